@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <errno.h>
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -21,6 +22,7 @@
 #include <string.h>
 
 #include <hardware/nvram.h>
+#include <nvram/hal/nvram_provisioning.h>
 
 #define countof(array) (sizeof(array) / sizeof((array)[0]))
 
@@ -98,6 +100,36 @@ static int StringToControl(const char* name, nvram_control_t* control) {
   return 1;
 }
 
+// Parses the comma-separated control names in |names| into a newly allocated
+// array stored in |controls_list|, and its size in |list_size|. |names| is
+// modified in the process. Returns 0 if successful, a status code otherwise.
+static int ParseControls(char* names,
+                         nvram_control_t** controls_list,
+                         uint32_t* list_size) {
+  *controls_list = NULL;
+  *list_size = 0;
+  char* tail = names;
+  while (tail) {
+    nvram_control_t* new_controls_list =
+        realloc(*controls_list, sizeof(nvram_control_t) * (*list_size + 1));
+    if (!new_controls_list) {
+      free(*controls_list);
+      *controls_list = NULL;
+      return kStatusAllocationFailure;
+    }
+    *controls_list = new_controls_list;
+
+    if (StringToControl(strsep(&tail, ","), &(*controls_list)[*list_size])) {
+      free(*controls_list);
+      *controls_list = NULL;
+      return kStatusInvalidArg;
+    }
+    ++*list_size;
+  }
+
+  return 0;
+}
+
 static int HandleGetTotalSize(nvram_device_t* device, char* args[]) {
   (void)args;
   uint64_t total_size = 0;
@@ -263,26 +295,16 @@ static int HandleCreateSpace(nvram_device_t* device, char* args[]) {
   uint64_t size = strtoull(args[1], NULL, 0);
   uint32_t list_size = 0;
   nvram_control_t* controls_list = NULL;
-  char* tail = args[2];
-  while (tail) {
-    ++list_size;
-    nvram_control_t* new_controls_list =
-        realloc(controls_list, sizeof(nvram_control_t) * list_size);
-    if (new_controls_list) {
-      controls_list = new_controls_list;
-    } else {
-      free(controls_list);
-      return kStatusAllocationFailure;
-    }
-
-    if (StringToControl(strsep(&tail, ","), &(controls_list[list_size - 1]))) {
-      free(controls_list);
-      return kStatusInvalidArg;
-    }
+  int status = ParseControls(args[2], &controls_list, &list_size);
+  if (status != 0) {
+    return status;
   }
 
-  return device->create_space(device, index, size, controls_list, list_size,
-                              (uint8_t*)args[3], strlen(args[3]));
+  nvram_result_t result =
+      device->create_space(device, index, size, controls_list, list_size,
+                           (uint8_t*)args[3], strlen(args[3]));
+  free(controls_list);
+  return result;
 }
 
 static int HandleDeleteSpace(nvram_device_t* device, char* args[]) {
@@ -340,6 +362,289 @@ static int HandleEnableReadLock(nvram_device_t* device, char* args[]) {
                                   strlen(args[1]));
 }
 
+// Returns |field| with "-" standing for an empty value.
+static const char* ManifestValue(const char* field) {
+  return strcmp(field, "-") == 0 ? "" : field;
+}
+
+// Reads the provisioning manifest at |path|. Each non-empty line that doesn't
+// start with '#' describes one space as
+//
+//   <index> <size> <controls> <auth> <contents>
+//
+// where <controls> is a comma-separated list of control names and <auth> and
+// <contents> are used verbatim, like the create_space and write_space
+// parameters. A "-" stands for an empty <controls>, <auth> or <contents>
+// value.
+//
+// On success, |spaces| holds |num_spaces| entries that point into |*buffer|.
+// The caller must release the controls lists, |*spaces| and |*buffer|.
+static int ReadManifest(const char* path,
+                        char** buffer,
+                        nvram_provisioning_space_t** spaces,
+                        uint32_t* num_spaces) {
+  *buffer = NULL;
+  *spaces = NULL;
+  *num_spaces = 0;
+
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return kStatusInvalidArg;
+  }
+
+  size_t size = 0;
+  char chunk[4096];
+  size_t bytes_read;
+  while ((bytes_read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    char* new_buffer = realloc(*buffer, size + bytes_read + 1);
+    if (!new_buffer) {
+      fclose(file);
+      return kStatusAllocationFailure;
+    }
+    *buffer = new_buffer;
+    memcpy(*buffer + size, chunk, bytes_read);
+    size += bytes_read;
+  }
+  int read_error = ferror(file);
+  fclose(file);
+  if (read_error || !*buffer) {
+    fprintf(stderr, "Failed to read %s.\n", path);
+    return kStatusInvalidArg;
+  }
+  (*buffer)[size] = '\0';
+
+  unsigned line_number = 0;
+  char* lines = *buffer;
+  char* line;
+  while ((line = strsep(&lines, "\n")) != NULL) {
+    ++line_number;
+    line += strspn(line, " \t\r");
+    if (*line == '\0' || *line == '#') {
+      continue;
+    }
+
+    char* fields[5];
+    size_t num_fields = 0;
+    char* field;
+    while (num_fields < countof(fields) &&
+           (field = strsep(&line, " \t\r")) != NULL) {
+      if (*field != '\0') {
+        fields[num_fields++] = field;
+      }
+    }
+    if (line) {
+      line += strspn(line, " \t\r");
+    }
+    if (num_fields != countof(fields) || (line && *line != '\0')) {
+      fprintf(stderr, "%s:%u: Expected 5 fields.\n", path, line_number);
+      return kStatusInvalidArg;
+    }
+
+    nvram_provisioning_space_t* new_spaces =
+        realloc(*spaces, sizeof(nvram_provisioning_space_t) * (*num_spaces + 1));
+    if (!new_spaces) {
+      return kStatusAllocationFailure;
+    }
+    *spaces = new_spaces;
+
+    nvram_provisioning_space_t* space = &(*spaces)[*num_spaces];
+    memset(space, 0, sizeof(*space));
+    char* end = NULL;
+    space->index = strtoul(fields[0], &end, 0);
+    if (*end != '\0') {
+      fprintf(stderr, "%s:%u: Bad index.\n", path, line_number);
+      return kStatusInvalidArg;
+    }
+    space->size = strtoull(fields[1], &end, 0);
+    if (*end != '\0') {
+      fprintf(stderr, "%s:%u: Bad size.\n", path, line_number);
+      return kStatusInvalidArg;
+    }
+    ++*num_spaces;
+
+    if (strcmp(fields[2], "-") != 0) {
+      nvram_control_t* controls = NULL;
+      int status = ParseControls(fields[2], &controls, &space->num_controls);
+      if (status != 0) {
+        fprintf(stderr, "%s:%u: Bad controls.\n", path, line_number);
+        return status;
+      }
+      space->controls = controls;
+    }
+
+    const char* auth = ManifestValue(fields[3]);
+    space->authorization_value = (const uint8_t*)auth;
+    space->authorization_value_size = strlen(auth);
+
+    const char* contents = ManifestValue(fields[4]);
+    space->contents = (const uint8_t*)contents;
+    space->contents_size = strlen(contents);
+    if (space->contents_size > space->size) {
+      fprintf(stderr, "%s:%u: Contents exceed the space size.\n", path,
+              line_number);
+      return kStatusInvalidArg;
+    }
+  }
+
+  return 0;
+}
+
+// Creates and initializes the spaces one by one via the regular HAL API. This
+// is used if the HAL module doesn't offer the provisioning device. Unlike bulk
+// provisioning, this may leave some of the spaces created on failure.
+static int ProvisionSpacesIndividually(nvram_device_t* device,
+                                       const nvram_provisioning_space_t* spaces,
+                                       uint32_t num_spaces) {
+  for (uint32_t i = 0; i < num_spaces; ++i) {
+    const nvram_provisioning_space_t* space = &spaces[i];
+    nvram_result_t result = device->create_space(
+        device, space->index, space->size, space->controls, space->num_controls,
+        space->authorization_value, space->authorization_value_size);
+    if (result == NV_RESULT_SUCCESS && space->contents_size > 0) {
+      result = device->write_space(
+          device, space->index, space->contents, space->contents_size,
+          space->authorization_value, space->authorization_value_size);
+    }
+    if (result != NV_RESULT_SUCCESS) {
+      fprintf(stderr, "Failed to provision space %" PRIu32 ".\n", space->index);
+      return result;
+    }
+  }
+
+  return 0;
+}
+
+// Opens the provisioning device of the HAL module |device| belongs to. Returns
+// NULL if the module doesn't offer the device, or only a version older than
+// |min_version|.
+static nvram_provisioning_device_t* OpenProvisioningDevice(
+    nvram_device_t* device,
+    uint32_t min_version) {
+  const hw_module_t* module = device->common.module;
+  nvram_provisioning_device_t* provisioning_device = NULL;
+  if (module->methods->open(module, NVRAM_PROVISIONING_DEVICE_ID,
+                            (hw_device_t**)&provisioning_device) != 0) {
+    return NULL;
+  }
+
+  if (provisioning_device->common.version < min_version) {
+    provisioning_device->common.close(&provisioning_device->common);
+    return NULL;
+  }
+
+  return provisioning_device;
+}
+
+static int HandleProvision(nvram_device_t* device, char* args[]) {
+  char* buffer = NULL;
+  nvram_provisioning_space_t* spaces = NULL;
+  uint32_t num_spaces = 0;
+  int ret = ReadManifest(args[0], &buffer, &spaces, &num_spaces);
+
+  if (ret == 0) {
+    nvram_provisioning_device_t* provisioning_device = OpenProvisioningDevice(
+        device, NVRAM_PROVISIONING_DEVICE_API_VERSION_0_1);
+    if (provisioning_device) {
+      ret = provisioning_device->provision_spaces(provisioning_device, spaces,
+                                                  num_spaces);
+      provisioning_device->common.close(&provisioning_device->common);
+    } else {
+      fprintf(stderr,
+              "Bulk provisioning unavailable, creating spaces one by one.\n");
+      ret = ProvisionSpacesIndividually(device, spaces, num_spaces);
+    }
+  }
+
+  for (uint32_t i = 0; i < num_spaces; ++i) {
+    free((nvram_control_t*)spaces[i].controls);
+  }
+  free(spaces);
+  free(buffer);
+  return ret;
+}
+
+// Parses a list of locks of the form <index>:<mode>[:<auth>], separated by
+// commas, where <mode> is "w", "r" or "rw". |list| is modified in the process.
+// On success, |locks| holds |num_locks| newly allocated entries that point into
+// |list|. The caller must free |*locks| in any case.
+static int ParseLocks(char* list, nvram_space_lock_t** locks,
+                      uint32_t* num_locks) {
+  *locks = NULL;
+  *num_locks = 0;
+  char* tail = list;
+  while (tail) {
+    char* entry = strsep(&tail, ",");
+    nvram_space_lock_t* new_locks =
+        realloc(*locks, sizeof(nvram_space_lock_t) * (*num_locks + 1));
+    if (!new_locks) {
+      return kStatusAllocationFailure;
+    }
+    *locks = new_locks;
+
+    nvram_space_lock_t* lock = &(*locks)[(*num_locks)++];
+    memset(lock, 0, sizeof(*lock));
+    char* index = strsep(&entry, ":");
+    char* end = NULL;
+    lock->index = strtoul(index, &end, 0);
+    if (*index == '\0' || *end != '\0' || !entry) {
+      return kStatusInvalidArg;
+    }
+
+    char* mode = strsep(&entry, ":");
+    lock->lock_write = strchr(mode, 'w') != NULL;
+    lock->lock_read = strchr(mode, 'r') != NULL;
+    if (strspn(mode, "rw") != strlen(mode) ||
+        (!lock->lock_write && !lock->lock_read)) {
+      return kStatusInvalidArg;
+    }
+
+    const char* auth = entry ? entry : "";
+    lock->authorization_value = (const uint8_t*)auth;
+    lock->authorization_value_size = strlen(auth);
+  }
+
+  return 0;
+}
+
+static int HandleLockSpaces(nvram_device_t* device, char* args[]) {
+  nvram_space_lock_t* locks = NULL;
+  uint32_t num_locks = 0;
+  int ret = ParseLocks(args[0], &locks, &num_locks);
+  if (ret != 0) {
+    free(locks);
+    return ret;
+  }
+
+  nvram_provisioning_device_t* provisioning_device = OpenProvisioningDevice(
+      device, NVRAM_PROVISIONING_DEVICE_API_VERSION_0_2);
+  if (provisioning_device) {
+    ret = provisioning_device->lock_spaces(provisioning_device, locks,
+                                           num_locks);
+    provisioning_device->common.close(&provisioning_device->common);
+    free(locks);
+    return ret;
+  }
+
+  // Fall back to locking the spaces one by one. Unlike bulk locking, this may
+  // leave some of the locks applied on failure.
+  for (uint32_t i = 0; i < num_locks && ret == 0; ++i) {
+    const nvram_space_lock_t* lock = &locks[i];
+    if (lock->lock_write) {
+      ret = device->enable_write_lock(device, lock->index,
+                                      lock->authorization_value,
+                                      lock->authorization_value_size);
+    }
+    if (ret == 0 && lock->lock_read) {
+      ret = device->enable_read_lock(device, lock->index,
+                                     lock->authorization_value,
+                                     lock->authorization_value_size);
+    }
+  }
+  free(locks);
+  return ret;
+}
+
 struct CommandHandler {
   const char* name;
   const char* params_desc;
@@ -364,6 +669,8 @@ struct CommandHandler kCommandHandlers[] = {
     {"read_space", "<index> <auth>", 2, &HandleReadSpace},
     {"enable_write_lock", "<index> <auth>", 2, &HandleEnableWriteLock},
     {"enable_read_lock", "<index> <auth>", 2, &HandleEnableReadLock},
+    {"provision", "<manifest>", 1, &HandleProvision},
+    {"lock_spaces", "<index>:<w|r|rw>[:<auth>],...", 1, &HandleLockSpaces},
 };
 
 int main(int argc, char* argv[]) {
@@ -20,6 +20,7 @@
 #include <nvram/messages/nvram_messages.h>
 
 #include <nvram/core/persistence.h>
+#include <nvram/core/stats.h>
 
 namespace nvram {
 
@@ -32,6 +33,14 @@ namespace nvram {
 // storage.
 class NvramManager {
  public:
+  // Creates a manager that keeps its data in the default storage backend, i.e.
+  // the link-time storage functions declared in storage.h.
+  NvramManager() : NvramManager(storage::GetDefaultStorageBackend()) {}
+
+  // Creates a manager that keeps its data in |storage|. |storage| must outlive
+  // the manager.
+  explicit NvramManager(storage::StorageBackend* storage) : storage_(storage) {}
+
   // Looks at |request| to determine the command to execute, extracts the
   // request parameters and invokes the correct handler function. Stores status
   // and output parameters in |response|.
@@ -83,14 +92,80 @@ class NvramManager {
   nvram_result_t DisableWipe(const DisableWipeRequest& request,
                              DisableWipeResponse* response);
 
+  // Creates all spaces listed in |request| and initializes their contents, as
+  // needed for factory provisioning. All spaces get validated up front, and the
+  // request fails without creating any space if one of them is invalid.
+  // Otherwise, the space data gets stored, followed by a single header update
+  // that adds all spaces.
+  nvram_result_t ProvisionSpaces(const ProvisionSpacesRequest& request,
+                                 ProvisionSpacesResponse* response);
+
+  // Performs the checks of |ProvisionSpaces()| without modifying any state.
+  nvram_result_t CheckProvisionSpaces(const ProvisionSpacesRequest& request);
+
+  // Applies the write and read locks listed in |request|, with the same
+  // semantics as |LockSpaceWrite()| and |LockSpaceRead()|. All locks get
+  // checked before any of them gets applied, so the request fails without
+  // effect if one of them isn't permitted. Persistent write locks get applied
+  // before any boot lock, so a storage failure while storing them leaves no
+  // boot lock applied. It may leave some persistent write locks applied,
+  // though.
+  nvram_result_t LockSpaces(const LockSpacesRequest& request,
+                            LockSpacesResponse* response);
+
+  // Performs the checks of |LockSpaces()| without modifying any state.
+  nvram_result_t CheckLockSpaces(const LockSpacesRequest& request);
+
+  // Retrieves the statistics collected by the recorder passed to
+  // |set_stats_recorder()| and clears them if |request.reset| is set. Fails
+  // with NV_RESULT_OPERATION_DISABLED if there is no recorder.
+  nvram_result_t GetStats(const GetStatsRequest& request,
+                          GetStatsResponse* response);
+
+  // Makes |Dispatch()| record per-command statistics in |stats|, which must
+  // outlive the manager. Pass nullptr to stop recording. Statistics collection
+  // is off by default.
+  void set_stats_recorder(StatsRecorder* stats) { stats_ = stats; }
+  StatsRecorder* stats_recorder() const { return stats_; }
+
+  // Performs initialization eagerly, i.e. loads the header and resolves any
+  // provisional space left behind by an interrupted create or delete, which
+  // otherwise happens on the first request. If |prefetch_spaces| is true, this
+  // also loads the data of all spaces once, which warms up caches in the
+  // storage layer, caches the spaces' access control metadata and detects
+  // unreadable spaces early. Returns NV_RESULT_SUCCESS if initialization
+  // succeeded and all spaces could be loaded. A failed space load doesn't
+  // affect operation on other spaces.
+  nvram_result_t Warmup(bool prefetch_spaces);
+
  private:
+  // Maximum number of NVRAM spaces we're willing to allocate.
+  static constexpr size_t kMaxSpaces = 32;
+
+  // Maximum size of the authorization values cached in |SpaceListEntry|. This
+  // covers all authorization values accepted at space creation.
+  static constexpr size_t kMaxCachedAuthSize = 32;
+
   // Holds transient state corresponding to an allocated NVRAM space, i.e. meta
   // data valid for a single boot. One instance of this struct is kept in memory
   // in the |spaces_| array for each of the spaces that are currently allocated.
+  //
+  // Once a space's data has been loaded, the entry also caches the space's
+  // controls and authorization value. These are fixed at creation, so boot
+  // locks can be checked and applied without loading the space data again.
   struct SpaceListEntry {
+    bool HasControl(uint32_t control) const {
+      return (controls & (1 << control)) != 0;
+    }
+
     uint32_t index;
     bool write_locked = false;
     bool read_locked = false;
+
+    bool has_metadata = false;
+    uint32_t controls = 0;
+    uint8_t authorization_value[kMaxCachedAuthSize];
+    size_t authorization_value_size = 0;
   };
 
   // |SpaceRecord| holds all information known about a space. It includes both
@@ -112,6 +187,10 @@ class NvramManager {
     // permitted and a suitable result code to return the client on failure.
     nvram_result_t CheckReadAccess(const Blob& authorization_value);
 
+    // Caches the controls and authorization value of |persistent| in
+    // |transient|, unless they're cached already.
+    void CacheMetadata();
+
     size_t array_index = 0;
     SpaceListEntry* transient = nullptr;
     NvramSpace persistent;
@@ -132,14 +211,43 @@ class NvramManager {
                        SpaceRecord* space_record,
                        nvram_result_t* result);
 
+  // Returns true if space |index| exists and has a persistent write lock.
+  bool HasPersistentWriteLock(uint32_t index);
+
+  // Performs the checks of |LockSpaces()|. |space_records| receives one record
+  // per lock in |request|, which holds the space data if the check loaded it.
+  nvram_result_t CheckLockSpaces(const LockSpacesRequest& request,
+                                 Vector<SpaceRecord>* space_records);
+
+  // Checks whether a write lock (if |write| is true) or read lock on space
+  // |index| is permitted with |authorization_value|. Boot locks get checked
+  // against the cached metadata, and the space data only gets loaded into
+  // |space_record| if the metadata isn't cached yet. Persistent write locks
+  // always need the space data, which is loaded into |space_record| unless it
+  // holds the data already.
+  nvram_result_t CheckLock(uint32_t index,
+                           bool write,
+                           const Blob& authorization_value,
+                           SpaceRecord* space_record);
+
+  // Applies a lock that passed |CheckLock()|. |space_record| is the one passed
+  // to |CheckLock()|, which holds the space data for persistent write locks.
+  // Only persistent write locks may fail, as they store the space data.
+  nvram_result_t ApplyLock(uint32_t index,
+                           bool write,
+                           SpaceRecord* space_record);
+
   // Writes the header to storage and returns a suitable status code.
   nvram_result_t WriteHeader(Optional<uint32_t> provisional_index);
 
   // Write |space| data for |index|.
   nvram_result_t WriteSpace(uint32_t index, const NvramSpace& space);
 
-  // Maximum number of NVRAM spaces we're willing to allocate.
-  static constexpr size_t kMaxSpaces = 32;
+  // The storage backend holding the persistent state.
+  storage::StorageBackend* const storage_;
+
+  // Records per-command statistics, if set.
+  StatsRecorder* stats_ = nullptr;
 
   bool initialized_ = false;
   bool disable_create_ = false;
@@ -29,6 +29,8 @@ extern "C" {
 
 namespace nvram {
 
+class StatsRecorder;
+
 // The NVRAM header data structure, which holds global information used by the
 // NVRAM service, such as version and a list of defined spaces.
 struct NvramHeader {
@@ -127,20 +129,58 @@ struct NvramSpace {
 
 namespace persistence {
 
-// Load NVRAM header from storage.
-storage::Status LoadHeader(NvramHeader* header);
-
-// Write the NVRAM header to storage.
-storage::Status StoreHeader(const NvramHeader& header);
-
-// Load NVRAM space data for a given index from storage.
-storage::Status LoadSpace(uint32_t index, NvramSpace* space);
-
-// Write the NVRAM space data for the given index to storage.
-storage::Status StoreSpace(uint32_t index, const NvramSpace& space);
-
-// Delete the stored NVRAM space data for the given index.
-storage::Status DeleteSpace(uint32_t index);
+// The functions below take an optional |stats| recorder, which gets the time
+// spent in the storage backend and in encoding or decoding attributed to the
+// corresponding |StatsPhase| of its current command.
+
+// Load NVRAM header from |storage|.
+storage::Status LoadHeader(storage::StorageBackend* storage,
+                           NvramHeader* header,
+                           StatsRecorder* stats = nullptr);
+
+// Write the NVRAM header to |storage|.
+storage::Status StoreHeader(storage::StorageBackend* storage,
+                            const NvramHeader& header,
+                            StatsRecorder* stats = nullptr);
+
+// Load NVRAM space data for a given index from |storage|.
+storage::Status LoadSpace(storage::StorageBackend* storage,
+                          uint32_t index,
+                          NvramSpace* space,
+                          StatsRecorder* stats = nullptr);
+
+// Write the NVRAM space data for the given index to |storage|.
+storage::Status StoreSpace(storage::StorageBackend* storage,
+                           uint32_t index,
+                           const NvramSpace& space,
+                           StatsRecorder* stats = nullptr);
+
+// Delete the stored NVRAM space data for the given index from |storage|.
+storage::Status DeleteSpace(storage::StorageBackend* storage,
+                            uint32_t index,
+                            StatsRecorder* stats = nullptr);
+
+// Variants of the above that operate on the default storage backend. These are
+// inline so only their users need to link the link-time storage functions.
+inline storage::Status LoadHeader(NvramHeader* header) {
+  return LoadHeader(storage::GetDefaultStorageBackend(), header);
+}
+
+inline storage::Status StoreHeader(const NvramHeader& header) {
+  return StoreHeader(storage::GetDefaultStorageBackend(), header);
+}
+
+inline storage::Status LoadSpace(uint32_t index, NvramSpace* space) {
+  return LoadSpace(storage::GetDefaultStorageBackend(), index, space);
+}
+
+inline storage::Status StoreSpace(uint32_t index, const NvramSpace& space) {
+  return StoreSpace(storage::GetDefaultStorageBackend(), index, space);
+}
+
+inline storage::Status DeleteSpace(uint32_t index) {
+  return DeleteSpace(storage::GetDefaultStorageBackend(), index);
+}
 
 }  // namespace persistence
 
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NVRAM_CORE_SHARDED_NVRAM_MANAGER_H_
+#define NVRAM_CORE_SHARDED_NVRAM_MANAGER_H_
+
+extern "C" {
+#include <stddef.h>
+#include <stdint.h>
+}  // extern "C"
+
+#include <nvram/messages/nvram_messages.h>
+
+#include <nvram/core/nvram_manager.h>
+#include <nvram/core/stats.h>
+#include <nvram/core/storage.h>
+
+namespace nvram {
+
+// |ShardedNvramManager| partitions the space index range across several
+// |NvramManager| instances, each of which keeps its own header in a separate
+// storage backend. Header writes on space creation and deletion thus only
+// cover the indices of a single shard, and the shards' capacities add up.
+//
+// Commands that refer to a space are routed to the shard owning the space's
+// index. GetInfo aggregates the information of all shards, GetStats their
+// statistics. The space count and size figures reported by GetInfo are the
+// totals across shards, which are upper bounds only: each shard enforces its
+// own limits, so creating a space fails once the shard owning its index is
+// full, even if other shards still have room. ProvisionSpaces and LockSpaces
+// split their spaces by shard and check all of them before applying the
+// request to any shard. DisableCreate, WipeStorage and DisableWipe get applied
+// to all shards, and report the first failure, if any. Note that a failure may
+// leave the operation applied to only some of the shards; retrying the command
+// is safe, except for ProvisionSpaces, where spaces already provisioned by a
+// shard then get reported as existing.
+//
+// The assignment of indices to shards depends on the number of shards only, so
+// the number of shards must remain the same across restarts for a given set of
+// storage backends.
+//
+// Like |NvramManager|, this class doesn't do any locking. As the shards are
+// independent, callers can serve them concurrently by locking per shard as
+// determined by |ShardForRequest()|, and taking all locks for requests that
+// span all shards.
+class ShardedNvramManager {
+ public:
+  // The maximum number of shards.
+  static constexpr size_t kMaxShards = 8;
+
+  // Returned by |ShardForRequest()| for requests that involve all shards.
+  static constexpr size_t kAllShards = kMaxShards;
+
+  // Creates a manager with |num_shards| shards, which must be between 1 and
+  // |kMaxShards|. |storage| points at |num_shards| storage backends, one per
+  // shard, which must outlive the manager.
+  ShardedNvramManager(storage::StorageBackend* const* storage,
+                      size_t num_shards);
+  ~ShardedNvramManager();
+
+  // Executes |request|, see |NvramManager::Dispatch()|.
+  void Dispatch(const Request& request, Response* response);
+
+  size_t num_shards() const { return num_shards_; }
+
+  // Returns the shard that owns space |index|.
+  size_t ShardForIndex(uint32_t index) const { return index % num_shards_; }
+
+  // Returns the shard that serves |request|, or |kAllShards| if it involves
+  // all shards.
+  size_t ShardForRequest(const Request& request) const;
+
+  // Returns the |NvramManager| for shard |shard|.
+  NvramManager* shard(size_t shard) { return &shards_[shard].manager; }
+
+  // Makes |Dispatch()| record statistics in |stats| for the requests that span
+  // all shards and get executed by this class rather than being passed to each
+  // shard, i.e. GetInfo, GetStats and ProvisionSpaces or LockSpaces across
+  // shards. Shards record the other requests if they have their own recorder,
+  // see |NvramManager::set_stats_recorder()|. GetStats merges all of them.
+  // The time shards spend on storage while executing a request that spans
+  // all shards counts towards that request's phases in |stats|. |stats| must
+  // outlive the manager.
+  void set_stats_recorder(StatsRecorder* stats) { stats_ = stats; }
+
+ private:
+  // Storage for an |NvramManager| that gets constructed in place, as
+  // |NvramManager| requires its storage backend at construction.
+  union ShardSlot {
+    ShardSlot() {}
+    ~ShardSlot() {}
+
+    NvramManager manager;
+  };
+
+  // Aggregates the GetInfo responses of all shards. |max_spaces|, |total_size|
+  // and |available_size| are the sums of the shards' figures, and
+  // |max_space_size| is the smallest one.
+  nvram_result_t GetInfo(const GetInfoRequest& request,
+                         GetInfoResponse* response);
+
+  // Provisions the spaces in |request| on their respective shards.
+  nvram_result_t ProvisionSpaces(const ProvisionSpacesRequest& request,
+                                 ProvisionSpacesResponse* response);
+
+  // Applies the locks in |request| on their respective shards.
+  nvram_result_t LockSpaces(const LockSpacesRequest& request,
+                            LockSpacesResponse* response);
+
+  // Merges the statistics of all shards and |stats_|.
+  nvram_result_t GetStats(const GetStatsRequest& request,
+                          GetStatsResponse* response);
+
+  // Executes |request| on all shards and returns the first failure.
+  void DispatchToAll(const Request& request, Response* response);
+
+  size_t num_shards_;
+  ShardSlot shards_[kMaxShards];
+  StatsRecorder* stats_ = nullptr;
+};
+
+}  // namespace nvram
+
+#endif  // NVRAM_CORE_SHARDED_NVRAM_MANAGER_H_
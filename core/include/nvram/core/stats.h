@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NVRAM_CORE_STATS_H_
+#define NVRAM_CORE_STATS_H_
+
+extern "C" {
+#include <stddef.h>
+#include <stdint.h>
+}  // extern "C"
+
+#include <nvram/messages/nvram_messages.h>
+
+namespace nvram {
+
+// A monotonic time source for |StatsRecorder|. Clocks are platform-specific, so
+// the embedding code provides the implementation.
+class Clock {
+ public:
+  virtual ~Clock() = default;
+
+  // Returns the current time in nanoseconds. Only differences between the
+  // returned values are meaningful.
+  virtual uint64_t NowNanoseconds() = 0;
+};
+
+// Collects per-command statistics for an |NvramManager|: call counts, result
+// code counts and latency histograms for the phases of command execution, see
+// |GetStatsResponse|. All counters live in fixed-size arrays, so recording
+// never allocates memory.
+//
+// Like |NvramManager|, this class doesn't do any locking. Managers that get
+// used concurrently need a recorder each.
+class StatsRecorder {
+ public:
+  // The number of buckets of each latency histogram.
+  static constexpr size_t kNumBuckets = 24;
+
+  // |clock| must outlive the recorder.
+  explicit StatsRecorder(Clock* clock) : clock_(clock) {}
+
+  uint64_t Now() { return clock_->NowNanoseconds(); }
+
+  // Starts timing a command.
+  void BeginCommand();
+
+  // Attributes |duration| nanoseconds of the current command to |phase|.
+  void AddPhaseTime(StatsPhase phase, uint64_t duration);
+
+  // Finishes the current command, which had type |command| and completed with
+  // |result|. The time since |BeginCommand()| that hasn't been attributed to
+  // other phases counts as |STATS_PHASE_LOGIC|.
+  void EndCommand(Command command, nvram_result_t result);
+
+  // Fills |response| with the statistics of all commands that have executed at
+  // least once. Returns false if memory allocation fails.
+  bool GetStats(GetStatsResponse* response) const;
+
+  // Clears all statistics.
+  void Reset();
+
+ private:
+  static constexpr size_t kNumCommands = COMMAND_GET_STATS + 1;
+  static constexpr size_t kNumPhases = STATS_PHASE_STORAGE_STORE + 1;
+  static constexpr size_t kNumResults = NV_RESULT_OPERATION_DISABLED + 1;
+
+  struct CommandCounters {
+    uint64_t calls;
+    uint64_t results[kNumResults];
+    uint32_t buckets[kNumPhases][kNumBuckets];
+  };
+
+  Clock* clock_;
+
+  // State of the command in progress.
+  uint64_t command_start_ = 0;
+  uint64_t phase_time_[kNumPhases] = {};
+  bool phase_used_[kNumPhases] = {};
+
+  CommandCounters counters_[kNumCommands] = {};
+};
+
+// Attributes the time between construction and destruction to |phase| of the
+// current command of |stats|. Does nothing if |stats| is nullptr.
+class ScopedPhaseTimer {
+ public:
+  ScopedPhaseTimer(StatsRecorder* stats, StatsPhase phase)
+      : stats_(stats), phase_(phase), start_(stats ? stats->Now() : 0) {}
+
+  ~ScopedPhaseTimer() {
+    if (stats_) {
+      stats_->AddPhaseTime(phase_, stats_->Now() - start_);
+    }
+  }
+
+ private:
+  StatsRecorder* const stats_;
+  const StatsPhase phase_;
+  const uint64_t start_;
+};
+
+}  // namespace nvram
+
+#endif  // NVRAM_CORE_STATS_H_
@@ -90,6 +90,29 @@ Status StoreSpace(uint32_t index, const Blob& blob);
 // returned for all other error conditions.
 Status DeleteSpace(uint32_t index);
 
+// A storage backend for |NvramManager|. The member functions have the same
+// semantics as the corresponding free functions above.
+//
+// The free functions get resolved at link time, so they provide exactly one
+// backend per process. Implement this interface instead to run several
+// |NvramManager| instances with separate storage in a single process, or to
+// swap backends at runtime.
+class StorageBackend {
+ public:
+  virtual ~StorageBackend() = default;
+
+  virtual Status LoadHeader(Blob* blob) = 0;
+  virtual Status StoreHeader(const Blob& blob) = 0;
+  virtual Status LoadSpace(uint32_t index, Blob* blob) = 0;
+  virtual Status StoreSpace(uint32_t index, const Blob& blob) = 0;
+  virtual Status DeleteSpace(uint32_t index) = 0;
+};
+
+// Returns a |StorageBackend| that forwards to the free functions above. Only
+// code that uses the default backend needs to link an implementation of the
+// free functions.
+StorageBackend* GetDefaultStorageBackend();
+
 }  // namespace storage
 }  // namespace nvram
 
@@ -62,8 +62,8 @@ nvram_result_t GetControlsVector(const NvramSpace& space,
 }
 
 // Constant time memory block comparison.
-bool ConstantTimeEquals(const Blob& a, const Blob& b) {
-  if (a.size() != b.size())
+bool ConstantTimeEquals(const uint8_t* a_data, size_t a_size, const Blob& b) {
+  if (a_size != b.size())
     return false;
 
   // The volatile qualifiers prevent the compiler from making assumptions that
@@ -72,22 +72,103 @@ bool ConstantTimeEquals(const Blob& a, const Blob& b) {
   //  * Marking |result| volatile ensures the subsequent loop iterations must
   //    still store to |result|, thus avoiding the loop to exit early.
   // This achieves the desired constant-time behavior.
-  volatile const uint8_t* data_a = a.data();
+  volatile const uint8_t* data_a = a_data;
   volatile const uint8_t* data_b = b.data();
   volatile uint8_t result = 0;
-  for (size_t i = 0; i < a.size(); ++i) {
+  for (size_t i = 0; i < a_size; ++i) {
     result |= data_a[i] ^ data_b[i];
   }
 
   return result == 0;
 }
 
+bool ConstantTimeEquals(const Blob& a, const Blob& b) {
+  return ConstantTimeEquals(a.data(), a.size(), b);
+}
+
 // A standard minimum function.
 template <typename Type>
 const Type& min(const Type& a, const Type& b) {
   return (a < b) ? a : b;
 }
 
+// Converts |control_list| to a bitmask of controls.
+uint32_t ControlsBitmask(const Vector<nvram_control_t>& control_list) {
+  uint32_t controls = 0;
+  for (uint32_t control : control_list) {
+    controls |= (1 << control);
+  }
+  return controls;
+}
+
+// Checks the parameters of a space to be created and computes its controls
+// bitmask in |controls|.
+nvram_result_t ValidateSpaceParameters(
+    uint64_t size,
+    const Vector<nvram_control_t>& control_list,
+    const Blob& authorization_value,
+    uint32_t* controls) {
+  if (size > kMaxSpaceSize) {
+    NVRAM_LOG_INFO("Create request exceeds max space size.");
+    return NV_RESULT_INVALID_PARAMETER;
+  }
+
+  if (authorization_value.size() > kMaxAuthSize) {
+    NVRAM_LOG_INFO("Authorization blob too large.");
+    return NV_RESULT_INVALID_PARAMETER;
+  }
+
+  *controls = ControlsBitmask(control_list);
+  if ((*controls & ~kSupportedControlsMask) != 0) {
+    NVRAM_LOG_INFO("Bad controls.");
+    return NV_RESULT_INVALID_PARAMETER;
+  }
+  if ((*controls & (1 << NV_CONTROL_PERSISTENT_WRITE_LOCK)) != 0 &&
+      (*controls & (1 << NV_CONTROL_BOOT_WRITE_LOCK)) != 0) {
+    NVRAM_LOG_INFO("Write lock controls are exclusive.");
+    return NV_RESULT_INVALID_PARAMETER;
+  }
+  if ((*controls & (1 << NV_CONTROL_WRITE_EXTEND)) != 0 &&
+      size != crypto::kSHA256DigestSize) {
+    NVRAM_LOG_INFO("Write-extended space size must be %zu.",
+                   crypto::kSHA256DigestSize);
+    return NV_RESULT_INVALID_PARAMETER;
+  }
+
+  return NV_RESULT_SUCCESS;
+}
+
+// Sets up the space record |space| for a new space of |size| bytes, which
+// starts out with |contents| followed by zeroes.
+nvram_result_t InitializeSpace(uint32_t controls,
+                               const Blob& authorization_value,
+                               uint64_t size,
+                               const Blob& contents,
+                               NvramSpace* space) {
+  space->flags = 0;
+  space->controls = controls;
+
+  // Copy the auth blob.
+  if (space->HasControl(NV_CONTROL_WRITE_AUTHORIZATION) ||
+      space->HasControl(NV_CONTROL_READ_AUTHORIZATION)) {
+    if (!space->authorization_value.Assign(authorization_value.data(),
+                                           authorization_value.size())) {
+      NVRAM_LOG_ERR("Allocation failure.");
+      return NV_RESULT_INTERNAL_ERROR;
+    }
+  }
+
+  // Initialize the space content.
+  if (!space->contents.Resize(size)) {
+    NVRAM_LOG_ERR("Allocation failure.");
+    return NV_RESULT_INTERNAL_ERROR;
+  }
+  memcpy(space->contents.data(), contents.data(), contents.size());
+  memset(space->contents.data() + contents.size(), 0, size - contents.size());
+
+  return NV_RESULT_SUCCESS;
+}
+
 // Filter status codes from the storage layer to only include known values.
 // Anything outside the range will be mapped to the generic |kStorageError|.
 storage::Status SanitizeStorageStatus(storage::Status status) {
@@ -113,6 +194,10 @@ void NvramManager::Dispatch(const nvram::Request& request,
   const nvram::RequestUnion& input = request.payload;
   nvram::ResponseUnion* output = &response->payload;
 
+  if (stats_) {
+    stats_->BeginCommand();
+  }
+
   switch (input.which()) {
     case nvram::COMMAND_GET_INFO:
       result = GetInfo(*input.get<COMMAND_GET_INFO>(),
@@ -158,9 +243,25 @@ void NvramManager::Dispatch(const nvram::Request& request,
       result = DisableWipe(*input.get<COMMAND_DISABLE_WIPE>(),
                            &output->Activate<COMMAND_DISABLE_WIPE>());
       break;
+    case nvram::COMMAND_PROVISION_SPACES:
+      result = ProvisionSpaces(*input.get<COMMAND_PROVISION_SPACES>(),
+                               &output->Activate<COMMAND_PROVISION_SPACES>());
+      break;
+    case nvram::COMMAND_LOCK_SPACES:
+      result = LockSpaces(*input.get<COMMAND_LOCK_SPACES>(),
+                          &output->Activate<COMMAND_LOCK_SPACES>());
+      break;
+    case nvram::COMMAND_GET_STATS:
+      result = GetStats(*input.get<COMMAND_GET_STATS>(),
+                        &output->Activate<COMMAND_GET_STATS>());
+      break;
   }
 
   response->result = result;
+
+  if (stats_) {
+    stats_->EndCommand(input.which(), result);
+  }
 }
 
 nvram_result_t NvramManager::GetInfo(const GetInfoRequest& /* request */,
@@ -212,73 +313,50 @@ nvram_result_t NvramManager::CreateSpace(const CreateSpaceRequest& request,
     return NV_RESULT_INVALID_PARAMETER;
   }
 
-  if (request.size > kMaxSpaceSize) {
-    NVRAM_LOG_INFO("Create request exceeds max space size.");
-    return NV_RESULT_INVALID_PARAMETER;
+  uint32_t controls = 0;
+  nvram_result_t result = ValidateSpaceParameters(
+      request.size, request.controls, request.authorization_value, &controls);
+  if (result != NV_RESULT_SUCCESS) {
+    return result;
   }
 
-  if (request.authorization_value.size() > kMaxAuthSize) {
-    NVRAM_LOG_INFO("Authorization blob too large.");
+  if (request.contents.size() > request.size) {
+    NVRAM_LOG_INFO("Initial contents exceed space size.");
     return NV_RESULT_INVALID_PARAMETER;
   }
 
-  uint32_t controls = 0;
-  for (uint32_t control : request.controls) {
-    controls |= (1 << control);
-  }
-  if ((controls & ~kSupportedControlsMask) != 0) {
-    NVRAM_LOG_INFO("Bad controls.");
-    return NV_RESULT_INVALID_PARAMETER;
-  }
-  if ((controls & (1 << NV_CONTROL_PERSISTENT_WRITE_LOCK)) != 0 &&
-      (controls & (1 << NV_CONTROL_BOOT_WRITE_LOCK)) != 0) {
-    NVRAM_LOG_INFO("Write lock controls are exclusive.");
-    return NV_RESULT_INVALID_PARAMETER;
+  // Create a space record.
+  NvramSpace space;
+  result = InitializeSpace(controls, request.authorization_value,
+                           request.size, request.contents, &space);
+  if (result != NV_RESULT_SUCCESS) {
+    return result;
   }
-  if ((controls & (1 << NV_CONTROL_WRITE_EXTEND)) != 0 &&
-      request.size != crypto::kSHA256DigestSize) {
-    NVRAM_LOG_INFO("Write-extended space size must be %zu.",
-                   crypto::kSHA256DigestSize);
-    return NV_RESULT_INVALID_PARAMETER;
+
+  // Remove any data left behind for |index|, e.g. by a ProvisionSpaces()
+  // command whose header write failed. The header written below marks |index|
+  // as provisional, and initialization only drops a provisional space if its
+  // data is missing. Stale data would thus turn into the new space's contents
+  // if there's a crash before the new data makes it to storage.
+  if (SanitizeStorageStatus(persistence::DeleteSpace(
+          storage_, index, stats_)) == storage::Status::kStorageError) {
+    NVRAM_LOG_ERR("Failed to delete stale space 0x%" PRIx32 " data.", index);
+    return NV_RESULT_INTERNAL_ERROR;
   }
 
   // Mark the index as allocated.
   spaces_[num_spaces_].index = index;
   spaces_[num_spaces_].write_locked = false;
   spaces_[num_spaces_].read_locked = false;
+  spaces_[num_spaces_].has_metadata = false;
   ++num_spaces_;
 
-  // Create a space record.
-  NvramSpace space;
-  space.flags = 0;
-  space.controls = controls;
-
-  // Copy the auth blob.
-  if (space.HasControl(NV_CONTROL_WRITE_AUTHORIZATION) ||
-      space.HasControl(NV_CONTROL_READ_AUTHORIZATION)) {
-    if (!space.authorization_value.Assign(request.authorization_value.data(),
-                                          request.authorization_value.size())) {
-      NVRAM_LOG_ERR("Allocation failure.");
-      return NV_RESULT_INTERNAL_ERROR;
-    }
-  }
-
-  // Initialize the space content.
-  if (!space.contents.Resize(request.size)) {
-    NVRAM_LOG_ERR("Allocation failure.");
-    return NV_RESULT_INTERNAL_ERROR;
-  }
-  memset(space.contents.data(), 0, request.size);
-
-  // Write the header before the space data. This ensures that all space
-  // definitions present in storage are also recorded in the header. Thus, the
-  // set of spaces present in the header is always a superset of the set of
-  // spaces that have state in storage. If there's a crash after writing the
-  // header but before writing the space information, the space data will be
-  // missing in storage. The initialization code handles this by checking the
-  // for the space data corresponding to the index marked as provisional in the
-  // header.
-  nvram_result_t result;
+  // Write the header before the space data. This ensures that the space
+  // definition about to be stored is recorded in the header first. If there's
+  // a crash after writing the header but before writing the space
+  // information, the space data will be missing in storage. The
+  // initialization code handles this by checking the for the space data
+  // corresponding to the index marked as provisional in the header.
   if ((result = WriteHeader(Optional<uint32_t>(index))) != NV_RESULT_SUCCESS ||
       (result = WriteSpace(index, space)) != NV_RESULT_SUCCESS) {
     --num_spaces_;
@@ -348,7 +426,8 @@ nvram_result_t NvramManager::DeleteSpace(const DeleteSpaceRequest& request,
   --num_spaces_;
   result = WriteHeader(Optional<uint32_t>(index));
   if (result == NV_RESULT_SUCCESS) {
-    switch (SanitizeStorageStatus(persistence::DeleteSpace(index))) {
+    switch (SanitizeStorageStatus(
+        persistence::DeleteSpace(storage_, index, stats_))) {
       case storage::Status::kStorageError:
         NVRAM_LOG_ERR("Failed to delete space 0x%" PRIx32 " data.", index);
         result = NV_RESULT_INTERNAL_ERROR;
@@ -474,26 +553,13 @@ nvram_result_t NvramManager::LockSpaceWrite(
     return NV_RESULT_INTERNAL_ERROR;
 
   SpaceRecord space_record;
-  nvram_result_t result;
-  if (!LoadSpaceRecord(index, &space_record, &result)) {
-    return result;
-  }
-
-  result = space_record.CheckWriteAccess(request.authorization_value);
+  nvram_result_t result =
+      CheckLock(index, true, request.authorization_value, &space_record);
   if (result != NV_RESULT_SUCCESS) {
     return result;
   }
 
-  if (space_record.persistent.HasControl(NV_CONTROL_PERSISTENT_WRITE_LOCK)) {
-    space_record.persistent.SetFlag(NvramSpace::kFlagWriteLocked);
-    return WriteSpace(index, space_record.persistent);
-  } else if (space_record.persistent.HasControl(NV_CONTROL_BOOT_WRITE_LOCK)) {
-    space_record.transient->write_locked = true;
-    return NV_RESULT_SUCCESS;
-  }
-
-  NVRAM_LOG_ERR("Space not configured for write locking.");
-  return NV_RESULT_INVALID_PARAMETER;
+  return ApplyLock(index, true, &space_record);
 }
 
 nvram_result_t NvramManager::LockSpaceRead(
@@ -506,23 +572,13 @@ nvram_result_t NvramManager::LockSpaceRead(
     return NV_RESULT_INTERNAL_ERROR;
 
   SpaceRecord space_record;
-  nvram_result_t result;
-  if (!LoadSpaceRecord(index, &space_record, &result)) {
-    return result;
-  }
-
-  result = space_record.CheckReadAccess(request.authorization_value);
+  nvram_result_t result =
+      CheckLock(index, false, request.authorization_value, &space_record);
   if (result != NV_RESULT_SUCCESS) {
     return result;
   }
 
-  if (space_record.persistent.HasControl(NV_CONTROL_BOOT_READ_LOCK)) {
-    space_record.transient->read_locked = true;
-    return NV_RESULT_SUCCESS;
-  }
-
-  NVRAM_LOG_ERR("Space not configured for read locking.");
-  return NV_RESULT_INVALID_PARAMETER;
+  return ApplyLock(index, false, &space_record);
 }
 
 nvram_result_t NvramManager::WipeStorage(
@@ -551,7 +607,8 @@ nvram_result_t NvramManager::WipeStorage(
   // support cross-object atomicity instead of per-object atomicity.
   for (size_t i = 0; i < num_spaces_; ++i) {
     const uint32_t index = spaces_[i].index;
-    switch (SanitizeStorageStatus(persistence::DeleteSpace(index))) {
+    switch (SanitizeStorageStatus(
+        persistence::DeleteSpace(storage_, index, stats_))) {
       case storage::Status::kStorageError:
         NVRAM_LOG_ERR("Failed to wipe space 0x%" PRIx32 " data.", index);
         return NV_RESULT_INTERNAL_ERROR;
@@ -595,6 +652,204 @@ nvram_result_t NvramManager::DisableWipe(
 #endif  // NVRAM_WIPE_STORAGE_SUPPORT
 }
 
+nvram_result_t NvramManager::ProvisionSpaces(
+    const ProvisionSpacesRequest& request,
+    ProvisionSpacesResponse* /* response */) {
+  NVRAM_LOG_INFO("ProvisionSpaces %zu", request.spaces.size());
+
+  nvram_result_t result = CheckProvisionSpaces(request);
+  if (result != NV_RESULT_SUCCESS || request.spaces.size() == 0) {
+    return result;
+  }
+
+  // Store all space data, then add all spaces to the header in one write.
+  // Unlike CreateSpace(), this doesn't go through a provisional index, so a
+  // crash or a failure before the header write leaves space data behind that
+  // the header doesn't refer to. That data is unreachable, and CreateSpace()
+  // deletes it before marking the index provisional, so it can't resurface as
+  // the contents of a later space. The request entries have been validated by
+  // CheckProvisionSpaces() already.
+  size_t num_stored = 0;
+  for (const ProvisionedSpace& entry : request.spaces) {
+    NvramSpace space;
+    if ((result = InitializeSpace(ControlsBitmask(entry.controls),
+                                  entry.authorization_value, entry.size,
+                                  entry.contents, &space)) !=
+            NV_RESULT_SUCCESS ||
+        (result = WriteSpace(entry.index, space)) != NV_RESULT_SUCCESS) {
+      break;
+    }
+    ++num_stored;
+  }
+
+  if (result != NV_RESULT_SUCCESS) {
+    // Remove the data stored so far. This is best effort, leftovers are
+    // harmless as explained above.
+    for (size_t i = 0; i < num_stored; ++i) {
+      const uint32_t index = request.spaces[i].index;
+      if (SanitizeStorageStatus(persistence::DeleteSpace(
+              storage_, index, stats_)) == storage::Status::kStorageError) {
+        NVRAM_LOG_ERR("Failed to delete space 0x%" PRIx32 " data.", index);
+      }
+    }
+    return result;
+  }
+
+  const size_t previous_num_spaces = num_spaces_;
+  for (const ProvisionedSpace& entry : request.spaces) {
+    spaces_[num_spaces_].index = entry.index;
+    spaces_[num_spaces_].write_locked = false;
+    spaces_[num_spaces_].read_locked = false;
+    spaces_[num_spaces_].has_metadata = false;
+    ++num_spaces_;
+  }
+
+  // Keep the space data if the header write fails. The new header may have
+  // been persisted regardless, in which case deleting the data would leave
+  // the header referring to spaces without data. If the header didn't make
+  // it, the data is left orphaned and gets cleared by CreateSpace() as
+  // explained above. Either way, the spaces are reported as absent until the
+  // header gets reloaded on the next start.
+  result = WriteHeader(Optional<uint32_t>());
+  if (result != NV_RESULT_SUCCESS) {
+    num_spaces_ = previous_num_spaces;
+  }
+  return result;
+}
+
+nvram_result_t NvramManager::CheckProvisionSpaces(
+    const ProvisionSpacesRequest& request) {
+  if (!Initialize())
+    return NV_RESULT_INTERNAL_ERROR;
+
+  if (disable_create_) {
+    NVRAM_LOG_INFO("Creation of further spaces is disabled.");
+    return NV_RESULT_OPERATION_DISABLED;
+  }
+
+  if (request.spaces.size() > kMaxSpaces - num_spaces_) {
+    NVRAM_LOG_INFO("Too many spaces.");
+    return NV_RESULT_INVALID_PARAMETER;
+  }
+
+  for (size_t i = 0; i < request.spaces.size(); ++i) {
+    const ProvisionedSpace& entry = request.spaces[i];
+    if (FindSpace(entry.index) != kMaxSpaces) {
+      NVRAM_LOG_INFO("Space 0x%" PRIx32 " already exists.", entry.index);
+      return NV_RESULT_SPACE_ALREADY_EXISTS;
+    }
+
+    for (size_t j = 0; j < i; ++j) {
+      if (request.spaces[j].index == entry.index) {
+        NVRAM_LOG_INFO("Duplicate space 0x%" PRIx32 ".", entry.index);
+        return NV_RESULT_INVALID_PARAMETER;
+      }
+    }
+
+    uint32_t controls = 0;
+    nvram_result_t result = ValidateSpaceParameters(
+        entry.size, entry.controls, entry.authorization_value, &controls);
+    if (result != NV_RESULT_SUCCESS) {
+      return result;
+    }
+
+    if (entry.contents.size() > entry.size) {
+      NVRAM_LOG_INFO("Initial contents exceed space 0x%" PRIx32 " size.",
+                     entry.index);
+      return NV_RESULT_INVALID_PARAMETER;
+    }
+  }
+
+  return NV_RESULT_SUCCESS;
+}
+
+nvram_result_t NvramManager::LockSpaces(const LockSpacesRequest& request,
+                                        LockSpacesResponse* /* response */) {
+  NVRAM_LOG_INFO("LockSpaces %zu", request.locks.size());
+
+  if (!Initialize())
+    return NV_RESULT_INTERNAL_ERROR;
+
+  Vector<SpaceRecord> space_records;
+  nvram_result_t result = CheckLockSpaces(request, &space_records);
+  if (result != NV_RESULT_SUCCESS) {
+    return result;
+  }
+
+  // Persistent write locks store the space data, so they are the only locks
+  // that may still fail. Apply them first, so a storage failure doesn't leave
+  // any boot locks applied.
+  for (size_t i = 0; i < request.locks.size(); ++i) {
+    const SpaceLock& lock = request.locks[i];
+    if (lock.lock_write && HasPersistentWriteLock(lock.index) &&
+        (result = ApplyLock(lock.index, true, &space_records[i])) !=
+            NV_RESULT_SUCCESS) {
+      return result;
+    }
+  }
+
+  for (size_t i = 0; i < request.locks.size(); ++i) {
+    const SpaceLock& lock = request.locks[i];
+    if (lock.lock_write && !HasPersistentWriteLock(lock.index)) {
+      ApplyLock(lock.index, true, &space_records[i]);
+    }
+    if (lock.lock_read) {
+      ApplyLock(lock.index, false, &space_records[i]);
+    }
+  }
+
+  return NV_RESULT_SUCCESS;
+}
+
+nvram_result_t NvramManager::CheckLockSpaces(const LockSpacesRequest& request) {
+  if (!Initialize())
+    return NV_RESULT_INTERNAL_ERROR;
+
+  Vector<SpaceRecord> space_records;
+  return CheckLockSpaces(request, &space_records);
+}
+
+nvram_result_t NvramManager::GetStats(const GetStatsRequest& request,
+                                      GetStatsResponse* response) {
+  NVRAM_LOG_INFO("GetStats");
+
+  if (!stats_) {
+    NVRAM_LOG_INFO("Stats collection disabled.");
+    return NV_RESULT_OPERATION_DISABLED;
+  }
+
+  if (!stats_->GetStats(response)) {
+    NVRAM_LOG_ERR("Allocation failure.");
+    return NV_RESULT_INTERNAL_ERROR;
+  }
+
+  if (request.reset) {
+    stats_->Reset();
+  }
+
+  return NV_RESULT_SUCCESS;
+}
+
+nvram_result_t NvramManager::Warmup(bool prefetch_spaces) {
+  if (!Initialize())
+    return NV_RESULT_INTERNAL_ERROR;
+
+  if (!prefetch_spaces) {
+    return NV_RESULT_SUCCESS;
+  }
+
+  nvram_result_t result = NV_RESULT_SUCCESS;
+  for (size_t i = 0; i < num_spaces_; ++i) {
+    SpaceRecord space_record;
+    nvram_result_t space_result;
+    if (!LoadSpaceRecord(spaces_[i].index, &space_record, &space_result)) {
+      result = space_result;
+    }
+  }
+
+  return result;
+}
+
 nvram_result_t NvramManager::SpaceRecord::CheckWriteAccess(
     const Blob& authorization_value) {
   if (persistent.HasControl(NV_CONTROL_PERSISTENT_WRITE_LOCK)) {
@@ -648,12 +903,29 @@ nvram_result_t NvramManager::SpaceRecord::CheckReadAccess(
   return NV_RESULT_SUCCESS;
 }
 
+void NvramManager::SpaceRecord::CacheMetadata() {
+  static_assert(kMaxCachedAuthSize == kMaxAuthSize,
+                "Cached authorization values must cover all valid ones.");
+
+  if (transient->has_metadata ||
+      persistent.authorization_value.size() > kMaxCachedAuthSize) {
+    return;
+  }
+
+  transient->controls = persistent.controls;
+  memcpy(transient->authorization_value, persistent.authorization_value.data(),
+         persistent.authorization_value.size());
+  transient->authorization_value_size = persistent.authorization_value.size();
+  transient->has_metadata = true;
+}
+
 bool NvramManager::Initialize() {
   if (initialized_)
     return true;
 
   NvramHeader header;
-  switch (SanitizeStorageStatus(persistence::LoadHeader(&header))) {
+  switch (SanitizeStorageStatus(
+      persistence::LoadHeader(storage_, &header, stats_))) {
     case storage::Status::kStorageError:
       NVRAM_LOG_ERR("Init failed to load header.");
       return false;
@@ -679,7 +951,8 @@ bool NvramManager::Initialize() {
   if (provisional_index.valid()) {
     NvramSpace space;
     switch (SanitizeStorageStatus(
-        persistence::LoadSpace(provisional_index.value(), &space))) {
+        persistence::LoadSpace(storage_, provisional_index.value(), &space,
+                               stats_))) {
       case storage::Status::kStorageError:
         // Log an error but leave the space marked as allocated. This will allow
         // initialization to complete, so other spaces can be accessed.
@@ -736,6 +1009,7 @@ bool NvramManager::Initialize() {
     spaces_[num_spaces_].index = index;
     spaces_[num_spaces_].write_locked = false;
     spaces_[num_spaces_].read_locked = false;
+    spaces_[num_spaces_].has_metadata = false;
     ++num_spaces_;
   }
 
@@ -744,7 +1018,8 @@ bool NvramManager::Initialize() {
   // space in that case.
   if (delete_provisional_space) {
     switch (SanitizeStorageStatus(
-        persistence::DeleteSpace(provisional_index.value()))) {
+        persistence::DeleteSpace(storage_, provisional_index.value(),
+                                 stats_))) {
       case storage::Status::kStorageError:
         NVRAM_LOG_ERR("Failed to delete provisional space 0x%" PRIx32 " data.",
                       provisional_index.value());
@@ -794,7 +1069,8 @@ bool NvramManager::LoadSpaceRecord(uint32_t index,
   space_record->transient = &spaces_[space_record->array_index];
 
   switch (SanitizeStorageStatus(
-      persistence::LoadSpace(index, &space_record->persistent))) {
+      persistence::LoadSpace(storage_, index, &space_record->persistent,
+                             stats_))) {
     case storage::Status::kStorageError:
       NVRAM_LOG_ERR("Failed to load space 0x%" PRIx32 " data.", index);
       *result = NV_RESULT_INTERNAL_ERROR;
@@ -807,6 +1083,7 @@ bool NvramManager::LoadSpaceRecord(uint32_t index,
       *result = NV_RESULT_INTERNAL_ERROR;
       return false;
     case storage::Status::kSuccess:
+      space_record->CacheMetadata();
       *result = NV_RESULT_SUCCESS;
       return true;
   }
@@ -815,6 +1092,117 @@ bool NvramManager::LoadSpaceRecord(uint32_t index,
   return false;
 }
 
+bool NvramManager::HasPersistentWriteLock(uint32_t index) {
+  const size_t array_index = FindSpace(index);
+  return array_index != kMaxSpaces &&
+         spaces_[array_index].HasControl(NV_CONTROL_PERSISTENT_WRITE_LOCK);
+}
+
+nvram_result_t NvramManager::CheckLockSpaces(
+    const LockSpacesRequest& request,
+    Vector<SpaceRecord>* space_records) {
+  if (!space_records->Resize(request.locks.size())) {
+    NVRAM_LOG_ERR("Allocation failure.");
+    return NV_RESULT_INTERNAL_ERROR;
+  }
+
+  for (size_t i = 0; i < request.locks.size(); ++i) {
+    const SpaceLock& lock = request.locks[i];
+    nvram_result_t result;
+    if (lock.lock_write &&
+        (result = CheckLock(lock.index, true, lock.authorization_value,
+                            &(*space_records)[i])) != NV_RESULT_SUCCESS) {
+      return result;
+    }
+    if (lock.lock_read &&
+        (result = CheckLock(lock.index, false, lock.authorization_value,
+                            &(*space_records)[i])) != NV_RESULT_SUCCESS) {
+      return result;
+    }
+  }
+
+  return NV_RESULT_SUCCESS;
+}
+
+nvram_result_t NvramManager::CheckLock(uint32_t index,
+                                       bool write,
+                                       const Blob& authorization_value,
+                                       SpaceRecord* space_record) {
+  const size_t array_index = FindSpace(index);
+  if (array_index == kMaxSpaces) {
+    return NV_RESULT_SPACE_DOES_NOT_EXIST;
+  }
+  const SpaceListEntry& entry = spaces_[array_index];
+
+  // Load the space data if the metadata isn't cached yet, which caches it, or
+  // if the lock is a persistent write lock, whose state is part of the space
+  // data. A |space_record| loaded by an earlier check gets reused.
+  nvram_result_t result;
+  const bool needs_space_data =
+      !entry.has_metadata ||
+      (write && entry.HasControl(NV_CONTROL_PERSISTENT_WRITE_LOCK));
+  if (needs_space_data && !space_record->transient &&
+      !LoadSpaceRecord(index, space_record, &result)) {
+    return result;
+  }
+  if (!entry.has_metadata) {
+    NVRAM_LOG_ERR("Space 0x%" PRIx32 " metadata not cacheable.", index);
+    return NV_RESULT_INTERNAL_ERROR;
+  }
+
+  if (write && entry.HasControl(NV_CONTROL_PERSISTENT_WRITE_LOCK)) {
+    return space_record->CheckWriteAccess(authorization_value);
+  }
+
+  // These checks match |SpaceRecord::CheckWriteAccess()| and
+  // |SpaceRecord::CheckReadAccess()|, based on the cached metadata.
+  const uint32_t lock_control =
+      write ? NV_CONTROL_BOOT_WRITE_LOCK : NV_CONTROL_BOOT_READ_LOCK;
+  const uint32_t authorization_control =
+      write ? NV_CONTROL_WRITE_AUTHORIZATION : NV_CONTROL_READ_AUTHORIZATION;
+  const bool locked = write ? entry.write_locked : entry.read_locked;
+  if (entry.HasControl(lock_control) && locked) {
+    NVRAM_LOG_INFO("Attempt to lock per-boot locked space 0x%" PRIx32 ".",
+                   index);
+    return NV_RESULT_OPERATION_DISABLED;
+  }
+
+  if (entry.HasControl(authorization_control) &&
+      !ConstantTimeEquals(entry.authorization_value,
+                          entry.authorization_value_size,
+                          authorization_value)) {
+    NVRAM_LOG_INFO("Authorization value mismatch for locking space 0x%" PRIx32
+                   ".",
+                   index);
+    return NV_RESULT_ACCESS_DENIED;
+  }
+
+  if (!entry.HasControl(lock_control)) {
+    NVRAM_LOG_ERR("Space not configured for %s locking.",
+                  write ? "write" : "read");
+    return NV_RESULT_INVALID_PARAMETER;
+  }
+
+  return NV_RESULT_SUCCESS;
+}
+
+nvram_result_t NvramManager::ApplyLock(uint32_t index,
+                                       bool write,
+                                       SpaceRecord* space_record) {
+  SpaceListEntry& entry = spaces_[FindSpace(index)];
+  if (write && entry.HasControl(NV_CONTROL_PERSISTENT_WRITE_LOCK)) {
+    space_record->persistent.SetFlag(NvramSpace::kFlagWriteLocked);
+    return WriteSpace(index, space_record->persistent);
+  }
+
+  if (write) {
+    entry.write_locked = true;
+  } else {
+    entry.read_locked = true;
+  }
+  return NV_RESULT_SUCCESS;
+}
+
 nvram_result_t NvramManager::WriteHeader(Optional<uint32_t> provisional_index) {
   NvramHeader header;
   header.version = NvramHeader::kVersion;
@@ -832,8 +1220,8 @@ nvram_result_t NvramManager::WriteHeader(Optional<uint32_t> provisional_index) {
 
   header.provisional_index = provisional_index;
 
-  if (SanitizeStorageStatus(persistence::StoreHeader(header)) !=
-      storage::Status::kSuccess) {
+  if (SanitizeStorageStatus(persistence::StoreHeader(
+          storage_, header, stats_)) != storage::Status::kSuccess) {
     NVRAM_LOG_ERR("Failed to store header.");
     return NV_RESULT_INTERNAL_ERROR;
   }
@@ -843,8 +1231,8 @@ nvram_result_t NvramManager::WriteHeader(Optional<uint32_t> provisional_index) {
 
 nvram_result_t NvramManager::WriteSpace(uint32_t index,
                                         const NvramSpace& space) {
-  if (SanitizeStorageStatus(persistence::StoreSpace(index, space)) !=
-      storage::Status::kSuccess) {
+  if (SanitizeStorageStatus(persistence::StoreSpace(
+          storage_, index, space, stats_)) != storage::Status::kSuccess) {
     NVRAM_LOG_ERR("Failed to store space 0x%" PRIx32 ".", index);
     return NV_RESULT_INTERNAL_ERROR;
   }
@@ -20,6 +20,7 @@
 #include <nvram/messages/proto.hpp>
 
 #include <nvram/core/logger.h>
+#include <nvram/core/stats.h>
 
 namespace nvram {
 
@@ -96,44 +97,77 @@ template <> struct DescriptorForType<NvramSpace> {
 
 namespace persistence {
 
-storage::Status LoadHeader(NvramHeader* header) {
+storage::Status LoadHeader(storage::StorageBackend* storage,
+                           NvramHeader* header,
+                           StatsRecorder* stats) {
   Blob blob;
-  storage::Status status = storage::LoadHeader(&blob);
+  storage::Status status;
+  {
+    ScopedPhaseTimer timer(stats, STATS_PHASE_STORAGE_LOAD);
+    status = storage->LoadHeader(&blob);
+  }
   if (status != storage::Status::kSuccess) {
     return status;
   }
+  ScopedPhaseTimer timer(stats, STATS_PHASE_DECODE);
   return DecodeObject<kHeaderMagic>(blob, header);
 }
 
-storage::Status StoreHeader(const NvramHeader& header) {
+storage::Status StoreHeader(storage::StorageBackend* storage,
+                            const NvramHeader& header,
+                            StatsRecorder* stats) {
   Blob blob;
-  storage::Status status = EncodeObject<kHeaderMagic>(header, &blob);
+  storage::Status status;
+  {
+    ScopedPhaseTimer timer(stats, STATS_PHASE_ENCODE);
+    status = EncodeObject<kHeaderMagic>(header, &blob);
+  }
   if (status != storage::Status::kSuccess) {
     return status;
   }
-  return storage::StoreHeader(blob);
+  ScopedPhaseTimer timer(stats, STATS_PHASE_STORAGE_STORE);
+  return storage->StoreHeader(blob);
 }
 
-storage::Status LoadSpace(uint32_t index, NvramSpace* space) {
+storage::Status LoadSpace(storage::StorageBackend* storage,
+                          uint32_t index,
+                          NvramSpace* space,
+                          StatsRecorder* stats) {
   Blob blob;
-  storage::Status status = storage::LoadSpace(index, &blob);
+  storage::Status status;
+  {
+    ScopedPhaseTimer timer(stats, STATS_PHASE_STORAGE_LOAD);
+    status = storage->LoadSpace(index, &blob);
+  }
   if (status != storage::Status::kSuccess) {
     return status;
   }
+  ScopedPhaseTimer timer(stats, STATS_PHASE_DECODE);
   return DecodeObject<kSpaceMagic>(blob, space);
 }
 
-storage::Status StoreSpace(uint32_t index, const NvramSpace& space) {
+storage::Status StoreSpace(storage::StorageBackend* storage,
+                           uint32_t index,
+                           const NvramSpace& space,
+                           StatsRecorder* stats) {
   Blob blob;
-  storage::Status status = EncodeObject<kSpaceMagic>(space, &blob);
+  storage::Status status;
+  {
+    ScopedPhaseTimer timer(stats, STATS_PHASE_ENCODE);
+    status = EncodeObject<kSpaceMagic>(space, &blob);
+  }
   if (status != storage::Status::kSuccess) {
     return status;
   }
-  return storage::StoreSpace(index, blob);
+  ScopedPhaseTimer timer(stats, STATS_PHASE_STORAGE_STORE);
+  return storage->StoreSpace(index, blob);
 }
 
-storage::Status DeleteSpace(uint32_t index) {
-  return storage::DeleteSpace(index);
+storage::Status DeleteSpace(storage::StorageBackend* storage,
+                            uint32_t index,
+                            StatsRecorder* stats) {
+  ScopedPhaseTimer timer(stats, STATS_PHASE_STORAGE_STORE);
+  return storage->DeleteSpace(index);
 }
 
 }  // namespace persistence
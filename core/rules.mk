@@ -24,7 +24,10 @@ MODULE := $(LOCAL_DIR)
 MODULE_SRCS += \
 	$(LOCAL_DIR)/crypto_boringssl.cpp \
 	$(LOCAL_DIR)/nvram_manager.cpp \
-	$(LOCAL_DIR)/persistence.cpp
+	$(LOCAL_DIR)/persistence.cpp \
+	$(LOCAL_DIR)/sharded_nvram_manager.cpp \
+	$(LOCAL_DIR)/stats.cpp \
+	$(LOCAL_DIR)/storage.cpp
 
 MODULE_CPPFLAGS := -Wall -Werror -Wextra
 
@@ -0,0 +1,465 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nvram/core/sharded_nvram_manager.h"
+
+#include <new>
+
+#include <nvram/messages/compiler.h>
+
+#include <nvram/core/logger.h>
+
+namespace nvram {
+
+namespace {
+
+// Extracts the space index from a request of type |command|.
+template <Command command>
+uint32_t GetIndex(const RequestUnion& input) {
+  return input.get<command>()->index;
+}
+
+// Determines the space index |request| refers to. Returns false if the
+// request doesn't refer to a single space.
+bool GetRequestIndex(const Request& request, uint32_t* index) {
+  const RequestUnion& input = request.payload;
+  switch (input.which()) {
+    case COMMAND_CREATE_SPACE:
+      *index = GetIndex<COMMAND_CREATE_SPACE>(input);
+      return true;
+    case COMMAND_GET_SPACE_INFO:
+      *index = GetIndex<COMMAND_GET_SPACE_INFO>(input);
+      return true;
+    case COMMAND_DELETE_SPACE:
+      *index = GetIndex<COMMAND_DELETE_SPACE>(input);
+      return true;
+    case COMMAND_WRITE_SPACE:
+      *index = GetIndex<COMMAND_WRITE_SPACE>(input);
+      return true;
+    case COMMAND_READ_SPACE:
+      *index = GetIndex<COMMAND_READ_SPACE>(input);
+      return true;
+    case COMMAND_LOCK_SPACE_WRITE:
+      *index = GetIndex<COMMAND_LOCK_SPACE_WRITE>(input);
+      return true;
+    case COMMAND_LOCK_SPACE_READ:
+      *index = GetIndex<COMMAND_LOCK_SPACE_READ>(input);
+      return true;
+    case COMMAND_GET_INFO:
+    case COMMAND_DISABLE_CREATE:
+    case COMMAND_WIPE_STORAGE:
+    case COMMAND_DISABLE_WIPE:
+    case COMMAND_PROVISION_SPACES:
+    case COMMAND_LOCK_SPACES:
+    case COMMAND_GET_STATS:
+      return false;
+  }
+
+  return false;
+}
+
+// Appends a copy of |space| to |request|. Returns false if memory allocation
+// fails.
+bool AppendProvisionedSpace(const ProvisionedSpace& space,
+                            ProvisionSpacesRequest* request) {
+  Vector<ProvisionedSpace>& spaces = request->spaces;
+  if (!spaces.Resize(spaces.size() + 1)) {
+    return false;
+  }
+
+  ProvisionedSpace& copy = spaces[spaces.size() - 1];
+  copy.index = space.index;
+  copy.size = space.size;
+  if (!copy.controls.Resize(space.controls.size())) {
+    return false;
+  }
+  for (size_t i = 0; i < space.controls.size(); ++i) {
+    copy.controls[i] = space.controls[i];
+  }
+  return copy.authorization_value.Assign(space.authorization_value.data(),
+                                         space.authorization_value.size()) &&
+         copy.contents.Assign(space.contents.data(), space.contents.size());
+}
+
+// Appends a copy of |lock| to |request|. Returns false if memory allocation
+// fails.
+bool AppendSpaceLock(const SpaceLock& lock, LockSpacesRequest* request) {
+  Vector<SpaceLock>& locks = request->locks;
+  if (!locks.Resize(locks.size() + 1)) {
+    return false;
+  }
+
+  SpaceLock& copy = locks[locks.size() - 1];
+  copy.index = lock.index;
+  copy.lock_write = lock.lock_write;
+  copy.lock_read = lock.lock_read;
+  return copy.authorization_value.Assign(lock.authorization_value.data(),
+                                         lock.authorization_value.size());
+}
+
+// Adds |counts| to |total| element-wise, growing |total| as needed. Returns
+// false if memory allocation fails.
+template <typename Count>
+bool AddCounts(const Vector<Count>& counts, Vector<Count>* total) {
+  if (total->size() < counts.size() && !total->Resize(counts.size())) {
+    return false;
+  }
+  for (size_t i = 0; i < counts.size(); ++i) {
+    (*total)[i] += counts[i];
+  }
+  return true;
+}
+
+// Adds the counters of |stats| to |total|, which refers to the same command.
+// Returns false if memory allocation fails.
+bool MergeCommandStats(const CommandStats& stats, CommandStats* total) {
+  total->calls += stats.calls;
+  if (!AddCounts(stats.result_counts, &total->result_counts)) {
+    return false;
+  }
+
+  for (const LatencyHistogram& histogram : stats.latencies) {
+    LatencyHistogram* total_histogram = nullptr;
+    for (LatencyHistogram& candidate : total->latencies) {
+      if (candidate.phase == histogram.phase) {
+        total_histogram = &candidate;
+        break;
+      }
+    }
+    if (!total_histogram) {
+      Vector<LatencyHistogram>& latencies = total->latencies;
+      if (!latencies.Resize(latencies.size() + 1)) {
+        return false;
+      }
+      total_histogram = &latencies[latencies.size() - 1];
+      total_histogram->phase = histogram.phase;
+    }
+    if (!AddCounts(histogram.buckets, &total_histogram->buckets)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Adds the statistics of all commands in |stats| to |total|. Returns false if
+// memory allocation fails.
+bool MergeStats(const GetStatsResponse& stats, GetStatsResponse* total) {
+  for (const CommandStats& command_stats : stats.commands) {
+    CommandStats* total_command_stats = nullptr;
+    for (CommandStats& candidate : total->commands) {
+      if (candidate.command == command_stats.command) {
+        total_command_stats = &candidate;
+        break;
+      }
+    }
+    if (!total_command_stats) {
+      Vector<CommandStats>& commands = total->commands;
+      if (!commands.Resize(commands.size() + 1)) {
+        return false;
+      }
+      total_command_stats = &commands[commands.size() - 1];
+      total_command_stats->command = command_stats.command;
+    }
+    if (!MergeCommandStats(command_stats, total_command_stats)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Makes all shards of |nvram| record their storage phase times in |stats|
+// while in scope, so they get attributed to the request |nvram| executes
+// itself rather than being discarded by the shards' own recorders.
+class ScopedShardStatsRecorder {
+ public:
+  ScopedShardStatsRecorder(ShardedNvramManager* nvram, StatsRecorder* stats)
+      : nvram_(nvram) {
+    for (size_t i = 0; i < nvram_->num_shards(); ++i) {
+      shard_stats_[i] = nvram_->shard(i)->stats_recorder();
+      nvram_->shard(i)->set_stats_recorder(stats);
+    }
+  }
+
+  ~ScopedShardStatsRecorder() {
+    for (size_t i = 0; i < nvram_->num_shards(); ++i) {
+      nvram_->shard(i)->set_stats_recorder(shard_stats_[i]);
+    }
+  }
+
+ private:
+  ShardedNvramManager* const nvram_;
+  StatsRecorder* shard_stats_[ShardedNvramManager::kMaxShards];
+};
+
+}  // namespace
+
+constexpr size_t ShardedNvramManager::kMaxShards;
+constexpr size_t ShardedNvramManager::kAllShards;
+
+ShardedNvramManager::ShardedNvramManager(
+    storage::StorageBackend* const* storage,
+    size_t num_shards)
+    : num_shards_(num_shards) {
+  NVRAM_CHECK(num_shards_ > 0 && num_shards_ <= kMaxShards);
+  for (size_t i = 0; i < num_shards_; ++i) {
+    new (&shards_[i].manager) NvramManager(storage[i]);
+  }
+}
+
+ShardedNvramManager::~ShardedNvramManager() {
+  for (size_t i = 0; i < num_shards_; ++i) {
+    shards_[i].manager.~NvramManager();
+  }
+}
+
+void ShardedNvramManager::Dispatch(const Request& request,
+                                   Response* response) {
+  size_t target = ShardForRequest(request);
+  if (target != kAllShards) {
+    shard(target)->Dispatch(request, response);
+    return;
+  }
+
+  // Requests executed on each shard in turn get recorded by the shards. The
+  // others are recorded here.
+  const Command command = request.payload.which();
+  if (stats_) {
+    stats_->BeginCommand();
+  }
+
+  switch (command) {
+    case COMMAND_GET_INFO:
+      response->result =
+          GetInfo(*request.payload.get<COMMAND_GET_INFO>(),
+                  &response->payload.Activate<COMMAND_GET_INFO>());
+      break;
+    case COMMAND_PROVISION_SPACES:
+      response->result = ProvisionSpaces(
+          *request.payload.get<COMMAND_PROVISION_SPACES>(),
+          &response->payload.Activate<COMMAND_PROVISION_SPACES>());
+      break;
+    case COMMAND_LOCK_SPACES:
+      response->result =
+          LockSpaces(*request.payload.get<COMMAND_LOCK_SPACES>(),
+                     &response->payload.Activate<COMMAND_LOCK_SPACES>());
+      break;
+    case COMMAND_GET_STATS:
+      response->result =
+          GetStats(*request.payload.get<COMMAND_GET_STATS>(),
+                   &response->payload.Activate<COMMAND_GET_STATS>());
+      break;
+    default:
+      DispatchToAll(request, response);
+      return;
+  }
+
+  if (stats_) {
+    stats_->EndCommand(command, response->result);
+  }
+}
+
+size_t ShardedNvramManager::ShardForRequest(const Request& request) const {
+  // LockSpaces only involves a single shard if all its spaces live there.
+  if (request.payload.which() == COMMAND_LOCK_SPACES) {
+    const Vector<SpaceLock>& locks =
+        request.payload.get<COMMAND_LOCK_SPACES>()->locks;
+    if (locks.size() == 0) {
+      return kAllShards;
+    }
+    size_t target = ShardForIndex(locks[0].index);
+    for (const SpaceLock& lock : locks) {
+      if (ShardForIndex(lock.index) != target) {
+        return kAllShards;
+      }
+    }
+    return target;
+  }
+
+  uint32_t index;
+  return GetRequestIndex(request, &index) ? ShardForIndex(index) : kAllShards;
+}
+
+nvram_result_t ShardedNvramManager::GetInfo(const GetInfoRequest& request,
+                                            GetInfoResponse* response) {
+  ScopedShardStatsRecorder shard_stats(this, stats_);
+  response->total_size = 0;
+  response->available_size = 0;
+  response->max_space_size = 0;
+  response->max_spaces = 0;
+  response->wipe_disabled = false;
+  if (!response->space_list.Resize(0)) {
+    return NV_RESULT_INTERNAL_ERROR;
+  }
+
+  for (size_t i = 0; i < num_shards_; ++i) {
+    GetInfoResponse shard_response;
+    nvram_result_t result = shard(i)->GetInfo(request, &shard_response);
+    if (result != NV_RESULT_SUCCESS) {
+      return result;
+    }
+
+    response->total_size += shard_response.total_size;
+    response->available_size += shard_response.available_size;
+    if (i == 0 || shard_response.max_space_size < response->max_space_size) {
+      response->max_space_size = shard_response.max_space_size;
+    }
+    response->max_spaces += shard_response.max_spaces;
+    response->wipe_disabled |= shard_response.wipe_disabled;
+
+    Vector<uint32_t>& space_list = response->space_list;
+    size_t offset = space_list.size();
+    if (!space_list.Resize(offset + shard_response.space_list.size())) {
+      NVRAM_LOG_ERR("Allocation failure.");
+      return NV_RESULT_INTERNAL_ERROR;
+    }
+    for (size_t j = 0; j < shard_response.space_list.size(); ++j) {
+      space_list[offset + j] = shard_response.space_list[j];
+    }
+  }
+
+  return NV_RESULT_SUCCESS;
+}
+
+nvram_result_t ShardedNvramManager::ProvisionSpaces(
+    const ProvisionSpacesRequest& request,
+    ProvisionSpacesResponse* response) {
+  ScopedShardStatsRecorder shard_stats(this, stats_);
+  ProvisionSpacesRequest shard_requests[kMaxShards];
+  for (const ProvisionedSpace& space : request.spaces) {
+    if (!AppendProvisionedSpace(space,
+                                &shard_requests[ShardForIndex(space.index)])) {
+      NVRAM_LOG_ERR("Allocation failure.");
+      return NV_RESULT_INTERNAL_ERROR;
+    }
+  }
+
+  // Validate the spaces of all shards first, so an invalid request doesn't get
+  // applied to any shard.
+  for (size_t i = 0; i < num_shards_; ++i) {
+    nvram_result_t result = shard(i)->CheckProvisionSpaces(shard_requests[i]);
+    if (result != NV_RESULT_SUCCESS) {
+      return result;
+    }
+  }
+
+  for (size_t i = 0; i < num_shards_; ++i) {
+    if (shard_requests[i].spaces.size() == 0) {
+      continue;
+    }
+
+    nvram_result_t result =
+        shard(i)->ProvisionSpaces(shard_requests[i], response);
+    if (result != NV_RESULT_SUCCESS) {
+      return result;
+    }
+  }
+
+  return NV_RESULT_SUCCESS;
+}
+
+nvram_result_t ShardedNvramManager::LockSpaces(const LockSpacesRequest& request,
+                                               LockSpacesResponse* response) {
+  ScopedShardStatsRecorder shard_stats(this, stats_);
+  LockSpacesRequest shard_requests[kMaxShards];
+  for (const SpaceLock& lock : request.locks) {
+    if (!AppendSpaceLock(lock, &shard_requests[ShardForIndex(lock.index)])) {
+      NVRAM_LOG_ERR("Allocation failure.");
+      return NV_RESULT_INTERNAL_ERROR;
+    }
+  }
+
+  // Check the locks of all shards first, so a lock that isn't permitted
+  // prevents the request from taking effect on any shard.
+  for (size_t i = 0; i < num_shards_; ++i) {
+    if (shard_requests[i].locks.size() == 0) {
+      continue;
+    }
+
+    nvram_result_t result = shard(i)->CheckLockSpaces(shard_requests[i]);
+    if (result != NV_RESULT_SUCCESS) {
+      return result;
+    }
+  }
+
+  for (size_t i = 0; i < num_shards_; ++i) {
+    if (shard_requests[i].locks.size() == 0) {
+      continue;
+    }
+
+    nvram_result_t result = shard(i)->LockSpaces(shard_requests[i], response);
+    if (result != NV_RESULT_SUCCESS) {
+      return result;
+    }
+  }
+
+  return NV_RESULT_SUCCESS;
+}
+
+nvram_result_t ShardedNvramManager::GetStats(const GetStatsRequest& request,
+                                             GetStatsResponse* response) {
+  if (!response->commands.Resize(0)) {
+    return NV_RESULT_INTERNAL_ERROR;
+  }
+
+  // Shards without a recorder don't contribute.
+  bool recording = false;
+  for (size_t i = 0; i < num_shards_; ++i) {
+    GetStatsResponse shard_response;
+    nvram_result_t result = shard(i)->GetStats(request, &shard_response);
+    if (result == NV_RESULT_OPERATION_DISABLED) {
+      continue;
+    }
+    if (result != NV_RESULT_SUCCESS) {
+      return result;
+    }
+    recording = true;
+    if (!MergeStats(shard_response, response)) {
+      NVRAM_LOG_ERR("Allocation failure.");
+      return NV_RESULT_INTERNAL_ERROR;
+    }
+  }
+
+  if (stats_) {
+    recording = true;
+    GetStatsResponse own_response;
+    if (!stats_->GetStats(&own_response) ||
+        !MergeStats(own_response, response)) {
+      NVRAM_LOG_ERR("Allocation failure.");
+      return NV_RESULT_INTERNAL_ERROR;
+    }
+    if (request.reset) {
+      stats_->Reset();
+    }
+  }
+
+  return recording ? NV_RESULT_SUCCESS : NV_RESULT_OPERATION_DISABLED;
+}
+
+void ShardedNvramManager::DispatchToAll(const Request& request,
+                                        Response* response) {
+  nvram_result_t result = NV_RESULT_SUCCESS;
+  for (size_t i = 0; i < num_shards_; ++i) {
+    shard(i)->Dispatch(request, response);
+    if (result == NV_RESULT_SUCCESS) {
+      result = response->result;
+    }
+  }
+  response->result = result;
+}
+
+}  // namespace nvram
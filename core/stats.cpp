@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nvram/core/stats.h"
+
+extern "C" {
+#include <string.h>
+}  // extern "C"
+
+namespace nvram {
+
+namespace {
+
+// Determines the histogram bucket for |duration| nanoseconds, see
+// |LatencyHistogram| for the bucket bounds.
+size_t BucketForDuration(uint64_t duration) {
+  uint64_t microseconds = duration / 1000;
+  size_t bucket = 0;
+  while (microseconds > 0 && bucket < StatsRecorder::kNumBuckets - 1) {
+    microseconds >>= 1;
+    ++bucket;
+  }
+  return bucket;
+}
+
+}  // namespace
+
+constexpr size_t StatsRecorder::kNumBuckets;
+
+void StatsRecorder::BeginCommand() {
+  memset(phase_time_, 0, sizeof(phase_time_));
+  memset(phase_used_, 0, sizeof(phase_used_));
+  command_start_ = Now();
+}
+
+void StatsRecorder::AddPhaseTime(StatsPhase phase, uint64_t duration) {
+  if (static_cast<size_t>(phase) >= kNumPhases) {
+    return;
+  }
+  phase_time_[phase] += duration;
+  phase_used_[phase] = true;
+}
+
+void StatsRecorder::EndCommand(Command command, nvram_result_t result) {
+  if (static_cast<size_t>(command) >= kNumCommands) {
+    return;
+  }
+
+  // Everything not covered by the other phases is command logic.
+  uint64_t total = Now() - command_start_;
+  uint64_t logic = total;
+  for (size_t phase = 0; phase < kNumPhases; ++phase) {
+    logic -= phase_time_[phase] < logic ? phase_time_[phase] : logic;
+  }
+  phase_time_[STATS_PHASE_LOGIC] = logic;
+  phase_used_[STATS_PHASE_LOGIC] = true;
+
+  CommandCounters& counters = counters_[command];
+  ++counters.calls;
+  if (static_cast<size_t>(result) < kNumResults) {
+    ++counters.results[result];
+  }
+  for (size_t phase = 0; phase < kNumPhases; ++phase) {
+    if (phase_used_[phase]) {
+      ++counters.buckets[phase][BucketForDuration(phase_time_[phase])];
+    }
+  }
+}
+
+bool StatsRecorder::GetStats(GetStatsResponse* response) const {
+  size_t num_commands = 0;
+  for (size_t command = 0; command < kNumCommands; ++command) {
+    if (counters_[command].calls > 0) {
+      ++num_commands;
+    }
+  }
+  if (!response->commands.Resize(num_commands)) {
+    return false;
+  }
+
+  size_t entry = 0;
+  for (size_t command = 0; command < kNumCommands; ++command) {
+    const CommandCounters& counters = counters_[command];
+    if (counters.calls == 0) {
+      continue;
+    }
+
+    CommandStats& command_stats = response->commands[entry++];
+    command_stats.command = command;
+    command_stats.calls = counters.calls;
+    if (!command_stats.result_counts.Resize(kNumResults)) {
+      return false;
+    }
+    for (size_t result = 0; result < kNumResults; ++result) {
+      command_stats.result_counts[result] = counters.results[result];
+    }
+
+    // Only report phases the command went through.
+    size_t num_phases = 0;
+    bool phase_used[kNumPhases] = {};
+    for (size_t phase = 0; phase < kNumPhases; ++phase) {
+      for (size_t bucket = 0; bucket < kNumBuckets; ++bucket) {
+        if (counters.buckets[phase][bucket] > 0) {
+          phase_used[phase] = true;
+          ++num_phases;
+          break;
+        }
+      }
+    }
+    if (!command_stats.latencies.Resize(num_phases)) {
+      return false;
+    }
+
+    size_t histogram_index = 0;
+    for (size_t phase = 0; phase < kNumPhases; ++phase) {
+      if (!phase_used[phase]) {
+        continue;
+      }
+      LatencyHistogram& histogram = command_stats.latencies[histogram_index++];
+      histogram.phase = phase;
+      if (!histogram.buckets.Resize(kNumBuckets)) {
+        return false;
+      }
+      for (size_t bucket = 0; bucket < kNumBuckets; ++bucket) {
+        histogram.buckets[bucket] = counters.buckets[phase][bucket];
+      }
+    }
+  }
+
+  return true;
+}
+
+void StatsRecorder::Reset() {
+  memset(counters_, 0, sizeof(counters_));
+}
+
+}  // namespace nvram
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nvram/core/storage.h"
+
+namespace nvram {
+namespace storage {
+
+namespace {
+
+// Adapts the link-time storage functions to the |StorageBackend| interface.
+class DefaultStorageBackend : public StorageBackend {
+ public:
+  Status LoadHeader(Blob* blob) override { return storage::LoadHeader(blob); }
+
+  Status StoreHeader(const Blob& blob) override {
+    return storage::StoreHeader(blob);
+  }
+
+  Status LoadSpace(uint32_t index, Blob* blob) override {
+    return storage::LoadSpace(index, blob);
+  }
+
+  Status StoreSpace(uint32_t index, const Blob& blob) override {
+    return storage::StoreSpace(index, blob);
+  }
+
+  Status DeleteSpace(uint32_t index) override {
+    return storage::DeleteSpace(index);
+  }
+};
+
+DefaultStorageBackend g_default_storage_backend;
+
+}  // namespace
+
+StorageBackend* GetDefaultStorageBackend() {
+  return &g_default_storage_backend;
+}
+
+}  // namespace storage
+}  // namespace nvram
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NVRAM_TEST_FAKE_CLOCK_H_
+#define NVRAM_TEST_FAKE_CLOCK_H_
+
+#include <nvram/core/stats.h>
+
+namespace nvram {
+
+// A |Clock| that advances by a fixed |step| on every reading, so each timed
+// interval without nested readings lasts exactly |step| nanoseconds.
+class FakeClock : public Clock {
+ public:
+  explicit FakeClock(uint64_t step) : step_(step) {}
+
+  // Clock:
+  uint64_t NowNanoseconds() override { return now_ += step_; }
+
+ private:
+  const uint64_t step_;
+  uint64_t now_ = 0;
+};
+
+}  // namespace nvram
+
+#endif  // NVRAM_TEST_FAKE_CLOCK_H_
@@ -26,154 +26,178 @@ namespace storage {
 
 namespace {
 
-class StorageSlot {
- public:
-  Status Load(Blob* blob) {
-    if (read_error_) {
-      return Status::kStorageError;
-    }
+// The instance backing the free storage functions.
+FakeStorageBackend g_storage;
 
-    if (!present_) {
-      return Status::kNotFound;
-    }
+}  // namespace
 
-    NVRAM_CHECK(blob->Assign(blob_.data(), blob_.size()));
-    return Status::kSuccess;
+Status FakeStorageBackend::StorageSlot::Load(Blob* blob) {
+  if (read_error_) {
+    return Status::kStorageError;
   }
 
-  Status Store(const Blob& blob) {
-    if (write_error_) {
-      return Status::kStorageError;
-    }
-
-    NVRAM_CHECK(blob_.Assign(blob.data(), blob.size()));
-    present_ = true;
-    return Status::kSuccess;
+  if (!present_) {
+    return Status::kNotFound;
   }
 
-  Status Delete() {
-    if (write_error_) {
-      return Status::kStorageError;
-    }
+  NVRAM_CHECK(blob->Assign(blob_.data(), blob_.size()));
+  return Status::kSuccess;
+}
 
-    NVRAM_CHECK(blob_.Resize(0));
-    present_ = false;
-    return Status::kSuccess;
+Status FakeStorageBackend::StorageSlot::Store(const Blob& blob) {
+  if (write_error_) {
+    return Status::kStorageError;
   }
 
-  void Clear() {
-    present_ = false;
-    read_error_ = false;
-    write_error_ = false;
-    NVRAM_CHECK(blob_.Resize(0));
+  NVRAM_CHECK(blob_.Assign(blob.data(), blob.size()));
+  present_ = true;
+  return error_after_store_ ? Status::kStorageError : Status::kSuccess;
+}
+
+Status FakeStorageBackend::StorageSlot::Delete() {
+  if (write_error_) {
+    return Status::kStorageError;
   }
 
-  bool present() const { return present_; }
-  void set_present(bool present) { present_ = present; }
-  void set_read_error(bool error) { read_error_ = error; }
-  void set_write_error(bool error) { write_error_ = error; }
-
- private:
-  bool present_ = false;
-  bool read_error_ = false;
-  bool write_error_ = false;
-  Blob blob_;
-};
-
-// Header storage.
-StorageSlot g_header;
-
-// Space blob storage.
-struct SpaceStorageSlot {
-  uint32_t index;
-  StorageSlot slot;
-};
-
-SpaceStorageSlot g_spaces[256];
-
-// Find the position in |g_spaces| corresponding to a given space |index|.
-// Returns the slot pointer or |nullptr| if not found.
-StorageSlot* FindSlotForIndex(uint32_t index) {
-  for (size_t i = 0; i < countof(g_spaces); ++i) {
-    if (g_spaces[i].slot.present() && g_spaces[i].index == index) {
-      return &g_spaces[i].slot;
+  NVRAM_CHECK(blob_.Resize(0));
+  present_ = false;
+  return Status::kSuccess;
+}
+
+void FakeStorageBackend::StorageSlot::Clear() {
+  present_ = false;
+  read_error_ = false;
+  write_error_ = false;
+  error_after_store_ = false;
+  NVRAM_CHECK(blob_.Resize(0));
+}
+
+FakeStorageBackend::StorageSlot* FakeStorageBackend::FindSlotForIndex(
+    uint32_t index) {
+  for (size_t i = 0; i < countof(spaces_); ++i) {
+    if (spaces_[i].slot.present() && spaces_[i].index == index) {
+      return &spaces_[i].slot;
     }
   }
 
   return nullptr;
 }
 
-// Finds or creates the slot for |index|. Returns the slot pointer or |nullptr|
-// if not found.
-StorageSlot* FindOrCreateSlotForIndex(uint32_t index) {
+FakeStorageBackend::StorageSlot* FakeStorageBackend::FindOrCreateSlotForIndex(
+    uint32_t index) {
   StorageSlot* slot = FindSlotForIndex(index);
   if (slot) {
     return slot;
   }
 
-
-  for (size_t i = 0; i < countof(g_spaces); ++i) {
-    if (!g_spaces[i].slot.present()) {
-      g_spaces[i].index = index;
-      return &g_spaces[i].slot;
+  for (size_t i = 0; i < countof(spaces_); ++i) {
+    if (!spaces_[i].slot.present()) {
+      spaces_[i].index = index;
+      return &spaces_[i].slot;
     }
   }
 
   return nullptr;
 }
 
-}  // namespace
+Status FakeStorageBackend::LoadHeader(Blob* blob) {
+  return header_.Load(blob);
+}
+
+Status FakeStorageBackend::StoreHeader(const Blob& blob) {
+  return header_.Store(blob);
+}
+
+Status FakeStorageBackend::LoadSpace(uint32_t index, Blob* blob) {
+  StorageSlot* slot = FindSlotForIndex(index);
+  return slot ? slot->Load(blob) : Status::kNotFound;
+}
+
+Status FakeStorageBackend::StoreSpace(uint32_t index, const Blob& blob) {
+  StorageSlot* slot = FindOrCreateSlotForIndex(index);
+  return slot ? slot->Store(blob) : Status::kStorageError;
+}
+
+Status FakeStorageBackend::DeleteSpace(uint32_t index) {
+  StorageSlot* slot = FindSlotForIndex(index);
+  return slot ? slot->Delete() : Status::kNotFound;
+}
+
+void FakeStorageBackend::SetHeaderReadError(bool error) {
+  header_.set_read_error(error);
+}
+
+void FakeStorageBackend::SetHeaderWriteError(bool error) {
+  header_.set_write_error(error);
+}
+
+void FakeStorageBackend::SetHeaderWriteErrorAfterStore(bool error) {
+  header_.set_error_after_store(error);
+}
+
+void FakeStorageBackend::SetSpaceReadError(uint32_t index, bool error) {
+  StorageSlot* slot = FindOrCreateSlotForIndex(index);
+  if (slot) {
+    slot->set_read_error(error);
+  }
+}
+
+void FakeStorageBackend::SetSpaceWriteError(uint32_t index, bool error) {
+  StorageSlot* slot = FindOrCreateSlotForIndex(index);
+  if (slot) {
+    slot->set_write_error(error);
+  }
+}
+
+void FakeStorageBackend::Clear() {
+  header_.Clear();
+  for (size_t i = 0; i < countof(spaces_); ++i) {
+    spaces_[i].slot.Clear();
+  }
+}
 
 Status LoadHeader(Blob* blob) {
-  return g_header.Load(blob);
+  return g_storage.LoadHeader(blob);
 }
 
 Status StoreHeader(const Blob& blob) {
-  return g_header.Store(blob);
+  return g_storage.StoreHeader(blob);
 }
 
 void SetHeaderReadError(bool error) {
-  g_header.set_read_error(error);
+  g_storage.SetHeaderReadError(error);
 }
 
 void SetHeaderWriteError(bool error) {
-  g_header.set_write_error(error);
+  g_storage.SetHeaderWriteError(error);
+}
+
+void SetHeaderWriteErrorAfterStore(bool error) {
+  g_storage.SetHeaderWriteErrorAfterStore(error);
 }
 
 Status LoadSpace(uint32_t index, Blob* blob) {
-  StorageSlot* slot = FindSlotForIndex(index);
-  return slot ? slot->Load(blob) : Status::kNotFound;
+  return g_storage.LoadSpace(index, blob);
 }
 
 Status StoreSpace(uint32_t index, const Blob& blob) {
-  StorageSlot* slot = FindOrCreateSlotForIndex(index);
-  return slot ? slot->Store(blob) : Status::kStorageError;
+  return g_storage.StoreSpace(index, blob);
 }
 
 Status DeleteSpace(uint32_t index) {
-  StorageSlot* slot = FindSlotForIndex(index);
-  return slot ? slot->Delete() : Status::kNotFound;
+  return g_storage.DeleteSpace(index);
 }
 
 void Clear() {
-  g_header.Clear();
-  for (size_t i = 0; i < countof(g_spaces); ++i) {
-    g_spaces[i].slot.Clear();
-  }
+  g_storage.Clear();
 }
 
 void SetSpaceReadError(uint32_t index, bool error) {
-  StorageSlot* slot = FindOrCreateSlotForIndex(index);
-  if (slot) {
-    slot->set_read_error(error);
-  }
+  g_storage.SetSpaceReadError(index, error);
 }
 
 void SetSpaceWriteError(uint32_t index, bool error) {
-  StorageSlot* slot = FindOrCreateSlotForIndex(index);
-  if (slot) {
-    slot->set_write_error(error);
-  }
+  g_storage.SetSpaceWriteError(index, error);
 }
 
 }  // namespace storage
@@ -22,12 +22,77 @@
 namespace nvram {
 namespace storage {
 
+// An in-memory |StorageBackend| with error injection. The free storage
+// functions operate on a global instance, which is manipulated through the
+// free functions below.
+class FakeStorageBackend : public StorageBackend {
+ public:
+  // StorageBackend:
+  Status LoadHeader(Blob* blob) override;
+  Status StoreHeader(const Blob& blob) override;
+  Status LoadSpace(uint32_t index, Blob* blob) override;
+  Status StoreSpace(uint32_t index, const Blob& blob) override;
+  Status DeleteSpace(uint32_t index) override;
+
+  // See the corresponding free functions below.
+  void SetHeaderReadError(bool error);
+  void SetHeaderWriteError(bool error);
+  void SetHeaderWriteErrorAfterStore(bool error);
+  void SetSpaceReadError(uint32_t index, bool error);
+  void SetSpaceWriteError(uint32_t index, bool error);
+  void Clear();
+
+ private:
+  class StorageSlot {
+   public:
+    Status Load(Blob* blob);
+    Status Store(const Blob& blob);
+    Status Delete();
+    void Clear();
+
+    bool present() const { return present_; }
+    void set_read_error(bool error) { read_error_ = error; }
+    void set_write_error(bool error) { write_error_ = error; }
+    void set_error_after_store(bool error) { error_after_store_ = error; }
+
+   private:
+    bool present_ = false;
+    bool read_error_ = false;
+    bool write_error_ = false;
+    bool error_after_store_ = false;
+    Blob blob_;
+  };
+
+  struct SpaceStorageSlot {
+    uint32_t index;
+    StorageSlot slot;
+  };
+
+  // Find the position in |spaces_| corresponding to a given space |index|.
+  // Returns the slot pointer or |nullptr| if not found.
+  StorageSlot* FindSlotForIndex(uint32_t index);
+
+  // Finds or creates the slot for |index|. Returns the slot pointer or
+  // |nullptr| if not found.
+  StorageSlot* FindOrCreateSlotForIndex(uint32_t index);
+
+  // Header storage.
+  StorageSlot header_;
+
+  // Space blob storage.
+  SpaceStorageSlot spaces_[256];
+};
+
 // Setup the header storage read functions to return Status::kStorageError.
 void SetHeaderReadError(bool error);
 
 // Setup the header storage write functions to return Status::kStorageError.
 void SetHeaderWriteError(bool error);
 
+// Setup the header storage write functions to store the header, but still
+// return Status::kStorageError, as for a failure after the data got persisted.
+void SetHeaderWriteErrorAfterStore(bool error);
+
 // Setup the storage read calls for space |index| to return
 // Status::kStorageError.
 void SetSpaceReadError(uint32_t index, bool error);
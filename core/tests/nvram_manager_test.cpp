@@ -25,6 +25,7 @@
 #include <nvram/core/nvram_manager.h>
 #include <nvram/core/persistence.h>
 
+#include "fake_clock.h"
 #include "fake_storage.h"
 
 namespace nvram {
@@ -199,6 +200,47 @@ TEST_F(NvramManagerTest, Init_BadSpacePresent) {
   EXPECT_EQ(10u, get_space_info_response.size);
 }
 
+TEST_F(NvramManagerTest, Warmup) {
+  // Set up a good space, a bad space and the data of a half-deleted
+  // provisional space.
+  NvramSpace space;
+  ASSERT_TRUE(space.contents.Resize(10));
+  ASSERT_EQ(storage::Status::kSuccess, persistence::StoreSpace(1, space));
+  ASSERT_EQ(storage::Status::kSuccess, persistence::StoreSpace(3, space));
+  const uint8_t kBadSpaceData[] = {0xba, 0xad};
+  Blob bad_space_blob;
+  ASSERT_TRUE(bad_space_blob.Assign(kBadSpaceData, sizeof(kBadSpaceData)));
+  ASSERT_EQ(storage::Status::kSuccess,
+            storage::StoreSpace(2, bad_space_blob));
+
+  NvramHeader header;
+  header.version = NvramHeader::kVersion;
+  ASSERT_TRUE(header.allocated_indices.Resize(2));
+  header.allocated_indices[0] = 1;
+  header.allocated_indices[1] = 2;
+  header.provisional_index.Activate() = 3;
+  ASSERT_EQ(storage::Status::kSuccess, persistence::StoreHeader(header));
+
+  // Warming up resolves the provisional space before any request.
+  NvramManager nvram;
+  EXPECT_EQ(NV_RESULT_SUCCESS, nvram.Warmup(false));
+  Blob blob;
+  EXPECT_EQ(storage::Status::kNotFound, storage::LoadSpace(3, &blob));
+
+  // Prefetching reports the bad space, but the good one remains usable.
+  EXPECT_EQ(NV_RESULT_INTERNAL_ERROR, nvram.Warmup(true));
+  GetSpaceInfoRequest get_space_info_request;
+  get_space_info_request.index = 1;
+  GetSpaceInfoResponse get_space_info_response;
+  EXPECT_EQ(NV_RESULT_SUCCESS, nvram.GetSpaceInfo(get_space_info_request,
+                                                  &get_space_info_response));
+
+  // Initialization failures get reported.
+  storage::SetHeaderReadError(true);
+  NvramManager nvram2;
+  EXPECT_EQ(NV_RESULT_INTERNAL_ERROR, nvram2.Warmup(false));
+}
+
 TEST_F(NvramManagerTest, Init_NewerStorageVersion) {
   // Set up an NVRAM space.
   NvramSpace space;
@@ -271,6 +313,36 @@ TEST_F(NvramManagerTest, CreateSpace_Success) {
   EXPECT_EQ(false, get_space_info_response.write_locked);
 }
 
+TEST_F(NvramManagerTest, CreateSpace_InitialContents) {
+  NvramManager nvram;
+
+  // Initial contents get stored along with the space, padded with zeroes.
+  CreateSpaceRequest create_space_request;
+  create_space_request.index = 1;
+  create_space_request.size = 8;
+  const uint8_t kContents[] = {1, 2, 3};
+  ASSERT_TRUE(create_space_request.contents.Assign(kContents,
+                                                   sizeof(kContents)));
+  CreateSpaceResponse create_space_response;
+  ASSERT_EQ(NV_RESULT_SUCCESS,
+            nvram.CreateSpace(create_space_request, &create_space_response));
+
+  const uint8_t kExpectedContents[] = {1, 2, 3, 0, 0, 0, 0, 0};
+  ReadAndCompareSpaceData(&nvram, 1, kExpectedContents,
+                          sizeof(kExpectedContents));
+
+  // The contents are persistent.
+  NvramManager nvram2;
+  ReadAndCompareSpaceData(&nvram2, 1, kExpectedContents,
+                          sizeof(kExpectedContents));
+
+  // Contents exceeding the space size are rejected.
+  create_space_request.index = 2;
+  create_space_request.size = 2;
+  EXPECT_EQ(NV_RESULT_INVALID_PARAMETER,
+            nvram2.CreateSpace(create_space_request, &create_space_response));
+}
+
 TEST_F(NvramManagerTest, CreateSpace_Existing) {
   // Set up an NVRAM space.
   NvramSpace space;
@@ -1106,6 +1178,220 @@ TEST_F(NvramManagerTest, LockSpaceRead_NotLockable) {
       nvram.LockSpaceRead(lock_space_read_request, &lock_space_read_response));
 }
 
+TEST_F(NvramManagerTest, LockSpace_CachedMetadata) {
+  // Set up an NVRAM space.
+  NvramSpace space;
+  space.controls = (1 << NV_CONTROL_BOOT_WRITE_LOCK) |
+                   (1 << NV_CONTROL_BOOT_READ_LOCK) |
+                   (1 << NV_CONTROL_WRITE_AUTHORIZATION);
+  ASSERT_TRUE(space.authorization_value.Assign("secret", 6));
+  ASSERT_TRUE(space.contents.Resize(10));
+  ASSERT_EQ(storage::Status::kSuccess, persistence::StoreSpace(17, space));
+  SetupHeader(NvramHeader::kVersion, 17);
+
+  NvramManager nvram;
+  ASSERT_EQ(NV_RESULT_SUCCESS, nvram.Warmup(true));
+
+  // Boot locks are served from the metadata loaded by the warm-up, so they
+  // don't touch storage.
+  storage::SetSpaceReadError(17, true);
+  LockSpaceWriteRequest lock_space_write_request;
+  lock_space_write_request.index = 17;
+  LockSpaceWriteResponse lock_space_write_response;
+  EXPECT_EQ(NV_RESULT_ACCESS_DENIED,
+            nvram.LockSpaceWrite(lock_space_write_request,
+                                 &lock_space_write_response));
+  ASSERT_TRUE(lock_space_write_request.authorization_value.Assign("secret", 6));
+  EXPECT_EQ(NV_RESULT_SUCCESS,
+            nvram.LockSpaceWrite(lock_space_write_request,
+                                 &lock_space_write_response));
+  EXPECT_EQ(NV_RESULT_OPERATION_DISABLED,
+            nvram.LockSpaceWrite(lock_space_write_request,
+                                 &lock_space_write_response));
+
+  LockSpaceReadRequest lock_space_read_request;
+  lock_space_read_request.index = 17;
+  LockSpaceReadResponse lock_space_read_response;
+  EXPECT_EQ(NV_RESULT_SUCCESS, nvram.LockSpaceRead(lock_space_read_request,
+                                                   &lock_space_read_response));
+}
+
+TEST_F(NvramManagerTest, LockSpaces) {
+  // Set up a boot write locked space with authorization, a boot read locked
+  // space, a persistently write locked space and a space without locks.
+  NvramSpace space;
+  ASSERT_TRUE(space.contents.Resize(10));
+  space.controls = (1 << NV_CONTROL_BOOT_WRITE_LOCK) |
+                   (1 << NV_CONTROL_WRITE_AUTHORIZATION);
+  ASSERT_TRUE(space.authorization_value.Assign("secret", 6));
+  ASSERT_EQ(storage::Status::kSuccess, persistence::StoreSpace(1, space));
+  space.controls = (1 << NV_CONTROL_BOOT_READ_LOCK);
+  ASSERT_TRUE(space.authorization_value.Resize(0));
+  ASSERT_EQ(storage::Status::kSuccess, persistence::StoreSpace(2, space));
+  space.controls = (1 << NV_CONTROL_PERSISTENT_WRITE_LOCK);
+  ASSERT_EQ(storage::Status::kSuccess, persistence::StoreSpace(3, space));
+  space.controls = 0;
+  ASSERT_EQ(storage::Status::kSuccess, persistence::StoreSpace(4, space));
+
+  NvramHeader header;
+  header.version = NvramHeader::kVersion;
+  ASSERT_TRUE(header.allocated_indices.Resize(4));
+  for (uint32_t i = 0; i < 4; ++i) {
+    header.allocated_indices[i] = i + 1;
+  }
+  ASSERT_EQ(storage::Status::kSuccess, persistence::StoreHeader(header));
+
+  NvramManager nvram;
+  LockSpacesRequest lock_spaces_request;
+  ASSERT_TRUE(lock_spaces_request.locks.Resize(4));
+  lock_spaces_request.locks[0].index = 1;
+  lock_spaces_request.locks[0].lock_write = true;
+  ASSERT_TRUE(
+      lock_spaces_request.locks[0].authorization_value.Assign("secret", 6));
+  lock_spaces_request.locks[1].index = 2;
+  lock_spaces_request.locks[1].lock_read = true;
+  lock_spaces_request.locks[2].index = 3;
+  lock_spaces_request.locks[2].lock_write = true;
+  lock_spaces_request.locks[3].index = 4;
+  lock_spaces_request.locks[3].lock_read = true;
+  LockSpacesResponse lock_spaces_response;
+
+  // Space 4 isn't lockable, so nothing gets locked.
+  EXPECT_EQ(NV_RESULT_INVALID_PARAMETER,
+            nvram.LockSpaces(lock_spaces_request, &lock_spaces_response));
+  GetSpaceInfoRequest get_space_info_request;
+  GetSpaceInfoResponse get_space_info_response;
+  for (uint32_t index = 1; index <= 3; ++index) {
+    get_space_info_request.index = index;
+    ASSERT_EQ(NV_RESULT_SUCCESS, nvram.GetSpaceInfo(get_space_info_request,
+                                                    &get_space_info_response));
+    EXPECT_FALSE(get_space_info_response.read_locked);
+    EXPECT_FALSE(get_space_info_response.write_locked);
+  }
+
+  // Lock the other spaces.
+  ASSERT_TRUE(lock_spaces_request.locks.Resize(3));
+  EXPECT_EQ(NV_RESULT_SUCCESS,
+            nvram.LockSpaces(lock_spaces_request, &lock_spaces_response));
+  get_space_info_request.index = 1;
+  ASSERT_EQ(NV_RESULT_SUCCESS, nvram.GetSpaceInfo(get_space_info_request,
+                                                  &get_space_info_response));
+  EXPECT_TRUE(get_space_info_response.write_locked);
+  get_space_info_request.index = 2;
+  ASSERT_EQ(NV_RESULT_SUCCESS, nvram.GetSpaceInfo(get_space_info_request,
+                                                  &get_space_info_response));
+  EXPECT_TRUE(get_space_info_response.read_locked);
+  get_space_info_request.index = 3;
+  ASSERT_EQ(NV_RESULT_SUCCESS, nvram.GetSpaceInfo(get_space_info_request,
+                                                  &get_space_info_response));
+  EXPECT_TRUE(get_space_info_response.write_locked);
+
+  // Locking again fails, as the spaces are locked already.
+  EXPECT_EQ(NV_RESULT_OPERATION_DISABLED,
+            nvram.LockSpaces(lock_spaces_request, &lock_spaces_response));
+
+  // Only the persistent lock survives a reboot.
+  NvramManager nvram2;
+  get_space_info_request.index = 1;
+  ASSERT_EQ(NV_RESULT_SUCCESS, nvram2.GetSpaceInfo(get_space_info_request,
+                                                   &get_space_info_response));
+  EXPECT_FALSE(get_space_info_response.write_locked);
+  get_space_info_request.index = 3;
+  ASSERT_EQ(NV_RESULT_SUCCESS, nvram2.GetSpaceInfo(get_space_info_request,
+                                                   &get_space_info_response));
+  EXPECT_TRUE(get_space_info_response.write_locked);
+}
+
+TEST_F(NvramManagerTest, LockSpaces_PersistentLockLoadsOnce) {
+  NvramSpace space;
+  ASSERT_TRUE(space.contents.Resize(10));
+  space.controls = (1 << NV_CONTROL_PERSISTENT_WRITE_LOCK) |
+                   (1 << NV_CONTROL_BOOT_READ_LOCK);
+  ASSERT_EQ(storage::Status::kSuccess, persistence::StoreSpace(1, space));
+  SetupHeader(NvramHeader::kVersion, 1);
+
+  // Each storage load takes 1 microsecond, so a single load per command ends
+  // up in bucket 1 of the storage load histogram.
+  NvramManager nvram;
+  FakeClock clock(1000);
+  StatsRecorder stats(&clock);
+  nvram.set_stats_recorder(&stats);
+  GetInfoRequest get_info_request;
+  GetInfoResponse get_info_response;
+  ASSERT_EQ(NV_RESULT_SUCCESS,
+            nvram.GetInfo(get_info_request, &get_info_response));
+
+  Request request;
+  LockSpacesRequest& lock_spaces_request =
+      request.payload.Activate<COMMAND_LOCK_SPACES>();
+  ASSERT_TRUE(lock_spaces_request.locks.Resize(1));
+  lock_spaces_request.locks[0].index = 1;
+  lock_spaces_request.locks[0].lock_write = true;
+  lock_spaces_request.locks[0].lock_read = true;
+  Response response;
+  nvram.Dispatch(request, &response);
+  ASSERT_EQ(NV_RESULT_SUCCESS, response.result);
+
+  GetStatsRequest get_stats_request;
+  GetStatsResponse get_stats_response;
+  ASSERT_EQ(NV_RESULT_SUCCESS,
+            nvram.GetStats(get_stats_request, &get_stats_response));
+  ASSERT_EQ(1U, get_stats_response.commands.size());
+  bool found_load_histogram = false;
+  for (const LatencyHistogram& histogram :
+       get_stats_response.commands[0].latencies) {
+    if (histogram.phase == STATS_PHASE_STORAGE_LOAD) {
+      found_load_histogram = true;
+      EXPECT_EQ(1U, histogram.buckets[1]);
+    }
+  }
+  EXPECT_TRUE(found_load_histogram);
+}
+
+TEST_F(NvramManagerTest, LockSpaces_PersistentLockFailure) {
+  NvramSpace space;
+  ASSERT_TRUE(space.contents.Resize(10));
+  space.controls = (1 << NV_CONTROL_BOOT_READ_LOCK);
+  ASSERT_EQ(storage::Status::kSuccess, persistence::StoreSpace(1, space));
+  space.controls = (1 << NV_CONTROL_PERSISTENT_WRITE_LOCK);
+  ASSERT_EQ(storage::Status::kSuccess, persistence::StoreSpace(2, space));
+
+  NvramHeader header;
+  header.version = NvramHeader::kVersion;
+  ASSERT_TRUE(header.allocated_indices.Resize(2));
+  header.allocated_indices[0] = 1;
+  header.allocated_indices[1] = 2;
+  ASSERT_EQ(storage::Status::kSuccess, persistence::StoreHeader(header));
+
+  // The boot lock comes first in the request, but doesn't get applied when
+  // storing the persistent lock fails.
+  NvramManager nvram;
+  LockSpacesRequest lock_spaces_request;
+  ASSERT_TRUE(lock_spaces_request.locks.Resize(2));
+  lock_spaces_request.locks[0].index = 1;
+  lock_spaces_request.locks[0].lock_read = true;
+  lock_spaces_request.locks[1].index = 2;
+  lock_spaces_request.locks[1].lock_write = true;
+  LockSpacesResponse lock_spaces_response;
+  storage::SetSpaceWriteError(2, true);
+  EXPECT_EQ(NV_RESULT_INTERNAL_ERROR,
+            nvram.LockSpaces(lock_spaces_request, &lock_spaces_response));
+
+  GetSpaceInfoRequest get_space_info_request;
+  get_space_info_request.index = 1;
+  GetSpaceInfoResponse get_space_info_response;
+  ASSERT_EQ(NV_RESULT_SUCCESS, nvram.GetSpaceInfo(get_space_info_request,
+                                                  &get_space_info_response));
+  EXPECT_FALSE(get_space_info_response.read_locked);
+
+  storage::SetSpaceWriteError(2, false);
+  EXPECT_EQ(NV_RESULT_SUCCESS,
+            nvram.LockSpaces(lock_spaces_request, &lock_spaces_response));
+  ASSERT_EQ(NV_RESULT_SUCCESS, nvram.GetSpaceInfo(get_space_info_request,
+                                                  &get_space_info_response));
+  EXPECT_TRUE(get_space_info_response.read_locked);
+}
+
 TEST_F(NvramManagerTest, WipeStorage_Success) {
   // Set up an NVRAM space.
   NvramSpace space;
@@ -1227,5 +1513,366 @@ TEST_F(NvramManagerTest, WipeStorage_Disable) {
   EXPECT_EQ(10U, get_space_info_response.size);
 }
 
+TEST_F(NvramManagerTest, ProvisionSpaces_Success) {
+  ProvisionSpacesRequest provision_spaces_request;
+  ASSERT_TRUE(provision_spaces_request.spaces.Resize(2));
+  ProvisionedSpace& first = provision_spaces_request.spaces[0];
+  first.index = 1;
+  first.size = 10;
+  ASSERT_TRUE(first.controls.Append(NV_CONTROL_WRITE_AUTHORIZATION));
+  ASSERT_TRUE(first.authorization_value.Assign("secret", 6));
+  ASSERT_TRUE(first.contents.Assign("init", 4));
+  ProvisionedSpace& second = provision_spaces_request.spaces[1];
+  second.index = 2;
+  second.size = 20;
+
+  NvramManager nvram;
+  ProvisionSpacesResponse provision_spaces_response;
+  ASSERT_EQ(NV_RESULT_SUCCESS,
+            nvram.ProvisionSpaces(provision_spaces_request,
+                                  &provision_spaces_response));
+
+  // The spaces are present after a restart, with the initial contents
+  // zero-padded to the space size.
+  NvramManager nvram2;
+  GetInfoRequest get_info_request;
+  GetInfoResponse get_info_response;
+  EXPECT_EQ(NV_RESULT_SUCCESS,
+            nvram2.GetInfo(get_info_request, &get_info_response));
+  EXPECT_EQ(2U, get_info_response.space_list.size());
+  ReadAndCompareSpaceData(&nvram2, 1, "init\0\0\0\0\0\0", 10);
+  const uint8_t kZeros[20] = {};
+  ReadAndCompareSpaceData(&nvram2, 2, kZeros, sizeof(kZeros));
+
+  // The controls and authorization value are in effect.
+  WriteSpaceRequest write_space_request;
+  write_space_request.index = 1;
+  ASSERT_TRUE(write_space_request.buffer.Assign("data", 4));
+  WriteSpaceResponse write_space_response;
+  EXPECT_EQ(NV_RESULT_ACCESS_DENIED,
+            nvram2.WriteSpace(write_space_request, &write_space_response));
+  ASSERT_TRUE(write_space_request.authorization_value.Assign("secret", 6));
+  EXPECT_EQ(NV_RESULT_SUCCESS,
+            nvram2.WriteSpace(write_space_request, &write_space_response));
+}
+
+TEST_F(NvramManagerTest, ProvisionSpaces_Invalid) {
+  NvramManager nvram;
+  CreateSpaceRequest create_space_request;
+  create_space_request.index = 3;
+  create_space_request.size = 10;
+  CreateSpaceResponse create_space_response;
+  ASSERT_EQ(NV_RESULT_SUCCESS,
+            nvram.CreateSpace(create_space_request, &create_space_response));
+
+  ProvisionSpacesRequest provision_spaces_request;
+  ASSERT_TRUE(provision_spaces_request.spaces.Resize(2));
+  provision_spaces_request.spaces[0].index = 1;
+  provision_spaces_request.spaces[0].size = 10;
+  provision_spaces_request.spaces[1].index = 2;
+  provision_spaces_request.spaces[1].size = 10;
+  ProvisionSpacesResponse provision_spaces_response;
+
+  // Initial contents larger than the space.
+  ASSERT_TRUE(provision_spaces_request.spaces[1].contents.Resize(11));
+  EXPECT_EQ(NV_RESULT_INVALID_PARAMETER,
+            nvram.ProvisionSpaces(provision_spaces_request,
+                                  &provision_spaces_response));
+  ASSERT_TRUE(provision_spaces_request.spaces[1].contents.Resize(0));
+
+  // Duplicate indices.
+  provision_spaces_request.spaces[1].index = 1;
+  EXPECT_EQ(NV_RESULT_INVALID_PARAMETER,
+            nvram.ProvisionSpaces(provision_spaces_request,
+                                  &provision_spaces_response));
+
+  // An existing space.
+  provision_spaces_request.spaces[1].index = 3;
+  EXPECT_EQ(NV_RESULT_SPACE_ALREADY_EXISTS,
+            nvram.ProvisionSpaces(provision_spaces_request,
+                                  &provision_spaces_response));
+
+  // None of the requests left anything behind.
+  GetInfoRequest get_info_request;
+  GetInfoResponse get_info_response;
+  EXPECT_EQ(NV_RESULT_SUCCESS,
+            nvram.GetInfo(get_info_request, &get_info_response));
+  ASSERT_EQ(1U, get_info_response.space_list.size());
+  EXPECT_EQ(3U, get_info_response.space_list[0]);
+  NvramSpace space;
+  EXPECT_EQ(storage::Status::kNotFound, persistence::LoadSpace(1, &space));
+}
+
+TEST_F(NvramManagerTest, ProvisionSpaces_StorageError) {
+  ProvisionSpacesRequest provision_spaces_request;
+  ASSERT_TRUE(provision_spaces_request.spaces.Resize(2));
+  provision_spaces_request.spaces[0].index = 1;
+  provision_spaces_request.spaces[0].size = 10;
+  provision_spaces_request.spaces[1].index = 2;
+  provision_spaces_request.spaces[1].size = 10;
+  ProvisionSpacesResponse provision_spaces_response;
+
+  // Failure to store the second space removes the first one's data again.
+  NvramManager nvram;
+  storage::SetSpaceWriteError(2, true);
+  EXPECT_EQ(NV_RESULT_INTERNAL_ERROR,
+            nvram.ProvisionSpaces(provision_spaces_request,
+                                  &provision_spaces_response));
+  NvramSpace space;
+  EXPECT_EQ(storage::Status::kNotFound, persistence::LoadSpace(1, &space));
+  storage::SetSpaceWriteError(2, false);
+
+  // A failure to store the header leaves the data in place, but the spaces
+  // don't get created.
+  storage::SetHeaderWriteError(true);
+  EXPECT_EQ(NV_RESULT_INTERNAL_ERROR,
+            nvram.ProvisionSpaces(provision_spaces_request,
+                                  &provision_spaces_response));
+  storage::SetHeaderWriteError(false);
+
+  GetInfoRequest get_info_request;
+  GetInfoResponse get_info_response;
+  EXPECT_EQ(NV_RESULT_SUCCESS,
+            nvram.GetInfo(get_info_request, &get_info_response));
+  EXPECT_EQ(0U, get_info_response.space_list.size());
+
+  // Retrying succeeds once storage works again.
+  EXPECT_EQ(NV_RESULT_SUCCESS,
+            nvram.ProvisionSpaces(provision_spaces_request,
+                                  &provision_spaces_response));
+}
+
+TEST_F(NvramManagerTest, ProvisionSpaces_HeaderErrorAfterStore) {
+  ProvisionSpacesRequest provision_spaces_request;
+  ASSERT_TRUE(provision_spaces_request.spaces.Resize(2));
+  provision_spaces_request.spaces[0].index = 1;
+  provision_spaces_request.spaces[0].size = 10;
+  provision_spaces_request.spaces[1].index = 2;
+  provision_spaces_request.spaces[1].size = 10;
+  ProvisionSpacesResponse provision_spaces_response;
+
+  // The header gets persisted, but the write still reports failure.
+  NvramManager nvram;
+  storage::SetHeaderWriteErrorAfterStore(true);
+  EXPECT_EQ(NV_RESULT_INTERNAL_ERROR,
+            nvram.ProvisionSpaces(provision_spaces_request,
+                                  &provision_spaces_response));
+  storage::SetHeaderWriteErrorAfterStore(false);
+
+  // After a restart, both spaces are present along with their data.
+  NvramManager nvram2;
+  GetInfoRequest get_info_request;
+  GetInfoResponse get_info_response;
+  EXPECT_EQ(NV_RESULT_SUCCESS,
+            nvram2.GetInfo(get_info_request, &get_info_response));
+  EXPECT_EQ(2U, get_info_response.space_list.size());
+
+  ReadSpaceRequest read_space_request;
+  read_space_request.index = 2;
+  ReadSpaceResponse read_space_response;
+  EXPECT_EQ(NV_RESULT_SUCCESS,
+            nvram2.ReadSpace(read_space_request, &read_space_response));
+  EXPECT_EQ(10U, read_space_response.buffer.size());
+}
+
+TEST_F(NvramManagerTest, ProvisionSpaces_StaleDataNotReused) {
+  ProvisionSpacesRequest provision_spaces_request;
+  ASSERT_TRUE(provision_spaces_request.spaces.Resize(1));
+  provision_spaces_request.spaces[0].index = 1;
+  provision_spaces_request.spaces[0].size = 10;
+  ProvisionSpacesResponse provision_spaces_response;
+
+  // A failed header write leaves the space data behind.
+  NvramManager nvram;
+  storage::SetHeaderWriteError(true);
+  EXPECT_EQ(NV_RESULT_INTERNAL_ERROR,
+            nvram.ProvisionSpaces(provision_spaces_request,
+                                  &provision_spaces_response));
+  storage::SetHeaderWriteError(false);
+
+  // Creating a space at the same index stores the header, but fails to write
+  // the space data, which is equivalent to crashing in between.
+  CreateSpaceRequest create_space_request;
+  create_space_request.index = 1;
+  create_space_request.size = 32;
+  CreateSpaceResponse create_space_response;
+  storage::SetSpaceWriteError(1, true);
+  EXPECT_EQ(NV_RESULT_INTERNAL_ERROR,
+            nvram.CreateSpace(create_space_request, &create_space_response));
+  storage::SetSpaceWriteError(1, false);
+
+  // After a restart, the stale data must not show up as the space.
+  NvramManager nvram2;
+  GetInfoRequest get_info_request;
+  GetInfoResponse get_info_response;
+  EXPECT_EQ(NV_RESULT_SUCCESS,
+            nvram2.GetInfo(get_info_request, &get_info_response));
+  EXPECT_EQ(0U, get_info_response.space_list.size());
+
+  GetSpaceInfoRequest get_space_info_request;
+  get_space_info_request.index = 1;
+  GetSpaceInfoResponse get_space_info_response;
+  EXPECT_EQ(NV_RESULT_SPACE_DOES_NOT_EXIST,
+            nvram2.GetSpaceInfo(get_space_info_request,
+                                &get_space_info_response));
+}
+
+TEST_F(NvramManagerTest, StorageBackend_Independent) {
+  static storage::FakeStorageBackend storage_a;
+  static storage::FakeStorageBackend storage_b;
+  storage_a.Clear();
+  storage_b.Clear();
+
+  NvramManager nvram_a(&storage_a);
+  NvramManager nvram_b(&storage_b);
+
+  CreateSpaceRequest create_space_request;
+  create_space_request.index = 1;
+  create_space_request.size = 10;
+  CreateSpaceResponse create_space_response;
+  ASSERT_EQ(NV_RESULT_SUCCESS,
+            nvram_a.CreateSpace(create_space_request, &create_space_response));
+
+  // The space only exists in the first manager's storage.
+  GetSpaceInfoRequest get_space_info_request;
+  get_space_info_request.index = 1;
+  GetSpaceInfoResponse get_space_info_response;
+  EXPECT_EQ(NV_RESULT_SPACE_DOES_NOT_EXIST,
+            nvram_b.GetSpaceInfo(get_space_info_request,
+                                 &get_space_info_response));
+  NvramManager nvram_default;
+  EXPECT_EQ(NV_RESULT_SPACE_DOES_NOT_EXIST,
+            nvram_default.GetSpaceInfo(get_space_info_request,
+                                       &get_space_info_response));
+
+  // A fresh manager on the same storage picks up the space.
+  NvramManager nvram_a2(&storage_a);
+  EXPECT_EQ(NV_RESULT_SUCCESS, nvram_a2.GetSpaceInfo(get_space_info_request,
+                                                     &get_space_info_response));
+  EXPECT_EQ(10U, get_space_info_response.size);
+
+  // Storage errors are confined to the affected backend.
+  storage_b.SetHeaderReadError(true);
+  NvramManager nvram_b2(&storage_b);
+  GetInfoRequest get_info_request;
+  GetInfoResponse get_info_response;
+  EXPECT_EQ(NV_RESULT_INTERNAL_ERROR,
+            nvram_b2.GetInfo(get_info_request, &get_info_response));
+  EXPECT_EQ(NV_RESULT_SUCCESS,
+            nvram_a2.GetInfo(get_info_request, &get_info_response));
+}
+
+// Finds the statistics for |command| in |response|, or returns nullptr.
+const CommandStats* FindCommandStats(const GetStatsResponse& response,
+                                     Command command) {
+  for (const CommandStats& command_stats : response.commands) {
+    if (command_stats.command == command) {
+      return &command_stats;
+    }
+  }
+  return nullptr;
+}
+
+// Finds the histogram for |phase| in |command_stats|, or returns nullptr.
+const LatencyHistogram* FindHistogram(const CommandStats& command_stats,
+                                      StatsPhase phase) {
+  for (const LatencyHistogram& histogram : command_stats.latencies) {
+    if (histogram.phase == phase) {
+      return &histogram;
+    }
+  }
+  return nullptr;
+}
+
+TEST_F(NvramManagerTest, GetStats) {
+  NvramManager nvram;
+  Request request;
+  Response response;
+  request.payload.Activate<COMMAND_GET_STATS>();
+  nvram.Dispatch(request, &response);
+  EXPECT_EQ(NV_RESULT_OPERATION_DISABLED, response.result);
+
+  // Every timed interval lasts 3 microseconds, i.e. falls into bucket 2.
+  FakeClock clock(3000);
+  StatsRecorder stats(&clock);
+  nvram.set_stats_recorder(&stats);
+
+  CreateSpaceRequest& create_space_request =
+      request.payload.Activate<COMMAND_CREATE_SPACE>();
+  create_space_request.index = 1;
+  create_space_request.size = 10;
+  nvram.Dispatch(request, &response);
+  ASSERT_EQ(NV_RESULT_SUCCESS, response.result);
+
+  request.payload.Activate<COMMAND_READ_SPACE>().index = 1;
+  nvram.Dispatch(request, &response);
+  ASSERT_EQ(NV_RESULT_SUCCESS, response.result);
+  request.payload.Activate<COMMAND_READ_SPACE>().index = 2;
+  nvram.Dispatch(request, &response);
+  ASSERT_EQ(NV_RESULT_SPACE_DOES_NOT_EXIST, response.result);
+
+  request.payload.Activate<COMMAND_GET_STATS>().reset = true;
+  nvram.Dispatch(request, &response);
+  ASSERT_EQ(NV_RESULT_SUCCESS, response.result);
+  const GetStatsResponse* get_stats_response =
+      response.payload.get<COMMAND_GET_STATS>();
+  ASSERT_TRUE(get_stats_response);
+  EXPECT_EQ(2U, get_stats_response->commands.size());
+
+  // Creation deletes stale space data, then stores the header and the space.
+  // That adds up to 9 microseconds of storage time and 6 microseconds for
+  // encoding.
+  const CommandStats* create_stats =
+      FindCommandStats(*get_stats_response, COMMAND_CREATE_SPACE);
+  ASSERT_TRUE(create_stats);
+  EXPECT_EQ(1U, create_stats->calls);
+  EXPECT_EQ(1U, create_stats->result_counts[NV_RESULT_SUCCESS]);
+  const LatencyHistogram* store_histogram =
+      FindHistogram(*create_stats, STATS_PHASE_STORAGE_STORE);
+  ASSERT_TRUE(store_histogram);
+  ASSERT_EQ(StatsRecorder::kNumBuckets, store_histogram->buckets.size());
+  EXPECT_EQ(1U, store_histogram->buckets[4]);
+  const LatencyHistogram* encode_histogram =
+      FindHistogram(*create_stats, STATS_PHASE_ENCODE);
+  ASSERT_TRUE(encode_histogram);
+  EXPECT_EQ(1U, encode_histogram->buckets[3]);
+
+  // Only the successful read loads and decodes space data.
+  const CommandStats* read_stats =
+      FindCommandStats(*get_stats_response, COMMAND_READ_SPACE);
+  ASSERT_TRUE(read_stats);
+  EXPECT_EQ(2U, read_stats->calls);
+  EXPECT_EQ(1U, read_stats->result_counts[NV_RESULT_SUCCESS]);
+  EXPECT_EQ(1U, read_stats->result_counts[NV_RESULT_SPACE_DOES_NOT_EXIST]);
+  EXPECT_EQ(3U, read_stats->latencies.size());
+  const LatencyHistogram* load_histogram =
+      FindHistogram(*read_stats, STATS_PHASE_STORAGE_LOAD);
+  ASSERT_TRUE(load_histogram);
+  EXPECT_EQ(1U, load_histogram->buckets[2]);
+  const LatencyHistogram* decode_histogram =
+      FindHistogram(*read_stats, STATS_PHASE_DECODE);
+  ASSERT_TRUE(decode_histogram);
+  EXPECT_EQ(1U, decode_histogram->buckets[2]);
+  const LatencyHistogram* logic_histogram =
+      FindHistogram(*read_stats, STATS_PHASE_LOGIC);
+  ASSERT_TRUE(logic_histogram);
+  uint32_t logic_count = 0;
+  for (uint32_t count : logic_histogram->buckets) {
+    logic_count += count;
+  }
+  EXPECT_EQ(2U, logic_count);
+
+  // The reset cleared everything recorded before the GetStats request.
+  request.payload.Activate<COMMAND_GET_STATS>().reset = false;
+  nvram.Dispatch(request, &response);
+  ASSERT_EQ(NV_RESULT_SUCCESS, response.result);
+  get_stats_response = response.payload.get<COMMAND_GET_STATS>();
+  ASSERT_TRUE(get_stats_response);
+  ASSERT_EQ(1U, get_stats_response->commands.size());
+  EXPECT_EQ(static_cast<uint32_t>(COMMAND_GET_STATS),
+            get_stats_response->commands[0].command);
+  EXPECT_EQ(1U, get_stats_response->commands[0].calls);
+}
+
 }  // namespace
 }  // namespace nvram
@@ -20,6 +20,7 @@ MODULE := $(LOCAL_DIR)
 
 MODULE_SRCS += \
 	$(LOCAL_DIR)/nvram_manager_test.cpp \
+	$(LOCAL_DIR)/sharded_nvram_manager_test.cpp \
 	$(LOCAL_DIR)/fake_storage.cpp \
 	$(LOCAL_DIR)/gtest_stubs.cpp \
 	$(LOCAL_DIR)/manifest.c
@@ -0,0 +1,349 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#if defined(HAS_GTEST)
+#include <gtest/gtest.h>
+#else
+#include "gtest_stubs.h"
+#endif
+
+#include <nvram/core/sharded_nvram_manager.h>
+
+#include "fake_clock.h"
+#include "fake_storage.h"
+
+namespace nvram {
+namespace {
+
+constexpr size_t kNumShards = 3;
+
+class ShardedNvramManagerTest : public testing::Test {
+ protected:
+  ShardedNvramManagerTest() {
+    for (size_t i = 0; i < kNumShards; ++i) {
+      storage_[i].Clear();
+      storage_pointers_[i] = &storage_[i];
+    }
+  }
+
+  static nvram_result_t CreateSpace(ShardedNvramManager* nvram,
+                                    uint32_t index) {
+    Request request;
+    CreateSpaceRequest& create_space_request =
+        request.payload.Activate<COMMAND_CREATE_SPACE>();
+    create_space_request.index = index;
+    create_space_request.size = 10;
+    Response response;
+    nvram->Dispatch(request, &response);
+    return response.result;
+  }
+
+  static nvram_result_t GetInfo(ShardedNvramManager* nvram,
+                                GetInfoResponse* get_info_response) {
+    Request request;
+    request.payload.Activate<COMMAND_GET_INFO>();
+    Response response;
+    nvram->Dispatch(request, &response);
+    if (response.result == NV_RESULT_SUCCESS) {
+      GetInfoResponse* payload = response.payload.get<COMMAND_GET_INFO>();
+      *get_info_response = static_cast<GetInfoResponse&&>(*payload);
+    }
+    return response.result;
+  }
+
+  // The backends are static to keep them off the stack.
+  static storage::FakeStorageBackend storage_[kNumShards];
+  storage::StorageBackend* storage_pointers_[kNumShards];
+};
+
+storage::FakeStorageBackend ShardedNvramManagerTest::storage_[kNumShards];
+
+TEST_F(ShardedNvramManagerTest, RoutesByIndex) {
+  ShardedNvramManager nvram(storage_pointers_, kNumShards);
+  for (uint32_t index = 1; index <= 6; ++index) {
+    ASSERT_EQ(NV_RESULT_SUCCESS, CreateSpace(&nvram, index));
+  }
+  EXPECT_EQ(NV_RESULT_SPACE_ALREADY_EXISTS, CreateSpace(&nvram, 4));
+
+  // Each shard only stores the spaces it owns.
+  for (size_t shard = 0; shard < kNumShards; ++shard) {
+    GetInfoRequest get_info_request;
+    GetInfoResponse get_info_response;
+    ASSERT_EQ(NV_RESULT_SUCCESS, nvram.shard(shard)->GetInfo(
+                                     get_info_request, &get_info_response));
+    ASSERT_EQ(2U, get_info_response.space_list.size());
+    for (uint32_t index : get_info_response.space_list) {
+      EXPECT_EQ(shard, nvram.ShardForIndex(index));
+    }
+  }
+
+  // The spaces are still there after a restart.
+  ShardedNvramManager nvram2(storage_pointers_, kNumShards);
+  Request request;
+  request.payload.Activate<COMMAND_GET_SPACE_INFO>().index = 5;
+  Response response;
+  nvram2.Dispatch(request, &response);
+  ASSERT_EQ(NV_RESULT_SUCCESS, response.result);
+  EXPECT_EQ(10U, response.payload.get<COMMAND_GET_SPACE_INFO>()->size);
+}
+
+TEST_F(ShardedNvramManagerTest, AggregatesInfo) {
+  ShardedNvramManager nvram(storage_pointers_, kNumShards);
+  GetInfoResponse empty_info;
+  ASSERT_EQ(NV_RESULT_SUCCESS, GetInfo(&nvram, &empty_info));
+  EXPECT_EQ(0U, empty_info.space_list.size());
+
+  ASSERT_EQ(NV_RESULT_SUCCESS, CreateSpace(&nvram, 7));
+  ASSERT_EQ(NV_RESULT_SUCCESS, CreateSpace(&nvram, 8));
+
+  GetInfoResponse info;
+  ASSERT_EQ(NV_RESULT_SUCCESS, GetInfo(&nvram, &info));
+  EXPECT_EQ(empty_info.total_size, info.total_size);
+  EXPECT_EQ(empty_info.max_spaces, info.max_spaces);
+  EXPECT_EQ(empty_info.available_size - 2 * info.max_space_size,
+            info.available_size);
+  ASSERT_EQ(2U, info.space_list.size());
+  EXPECT_EQ(15U, info.space_list[0] + info.space_list[1]);
+
+  GetInfoRequest get_info_request;
+  GetInfoResponse shard_info;
+  ASSERT_EQ(NV_RESULT_SUCCESS,
+            nvram.shard(0)->GetInfo(get_info_request, &shard_info));
+  EXPECT_EQ(kNumShards * shard_info.max_spaces, info.max_spaces);
+}
+
+TEST_F(ShardedNvramManagerTest, InfoIsUpperBoundForFullShard) {
+  ShardedNvramManager nvram(storage_pointers_, kNumShards);
+  GetInfoRequest get_info_request;
+  GetInfoResponse shard_info;
+  ASSERT_EQ(NV_RESULT_SUCCESS,
+            nvram.shard(0)->GetInfo(get_info_request, &shard_info));
+
+  // Fill up shard 0, which owns the multiples of |kNumShards|.
+  for (uint32_t i = 1; i <= shard_info.max_spaces; ++i) {
+    ASSERT_EQ(NV_RESULT_SUCCESS, CreateSpace(&nvram, i * kNumShards));
+  }
+
+  // The totals still report room, but only the other shards can use it.
+  GetInfoResponse info;
+  ASSERT_EQ(NV_RESULT_SUCCESS, GetInfo(&nvram, &info));
+  EXPECT_EQ(shard_info.max_spaces, info.space_list.size());
+  EXPECT_EQ(kNumShards * shard_info.max_spaces, info.max_spaces);
+  EXPECT_EQ((kNumShards - 1) * shard_info.available_size, info.available_size);
+  EXPECT_EQ(NV_RESULT_INVALID_PARAMETER,
+            CreateSpace(&nvram, (shard_info.max_spaces + 1) * kNumShards));
+  EXPECT_EQ(NV_RESULT_SUCCESS, CreateSpace(&nvram, 1));
+}
+
+TEST_F(ShardedNvramManagerTest, DisableCreateAppliesToAllShards) {
+  ShardedNvramManager nvram(storage_pointers_, kNumShards);
+  Request request;
+  request.payload.Activate<COMMAND_DISABLE_CREATE>();
+  EXPECT_EQ(ShardedNvramManager::kAllShards, nvram.ShardForRequest(request));
+  Response response;
+  nvram.Dispatch(request, &response);
+  ASSERT_EQ(NV_RESULT_SUCCESS, response.result);
+
+  for (uint32_t index = 1; index <= kNumShards; ++index) {
+    EXPECT_EQ(NV_RESULT_OPERATION_DISABLED, CreateSpace(&nvram, index));
+  }
+}
+
+TEST_F(ShardedNvramManagerTest, ProvisionSpacesAcrossShards) {
+  ShardedNvramManager nvram(storage_pointers_, kNumShards);
+  ASSERT_EQ(NV_RESULT_SUCCESS, CreateSpace(&nvram, 5));
+
+  Request request;
+  ProvisionSpacesRequest& provision_spaces_request =
+      request.payload.Activate<COMMAND_PROVISION_SPACES>();
+  ASSERT_TRUE(provision_spaces_request.spaces.Resize(4));
+  for (uint32_t i = 0; i < 4; ++i) {
+    provision_spaces_request.spaces[i].index = i + 1;
+    provision_spaces_request.spaces[i].size = 10;
+  }
+  EXPECT_EQ(ShardedNvramManager::kAllShards, nvram.ShardForRequest(request));
+
+  // Space 5 exists in the last shard, so nothing gets provisioned anywhere.
+  provision_spaces_request.spaces[3].index = 5;
+  Response response;
+  nvram.Dispatch(request, &response);
+  EXPECT_EQ(NV_RESULT_SPACE_ALREADY_EXISTS, response.result);
+  GetInfoResponse info;
+  ASSERT_EQ(NV_RESULT_SUCCESS, GetInfo(&nvram, &info));
+  EXPECT_EQ(1U, info.space_list.size());
+
+  provision_spaces_request.spaces[3].index = 4;
+  nvram.Dispatch(request, &response);
+  ASSERT_EQ(NV_RESULT_SUCCESS, response.result);
+  ASSERT_EQ(NV_RESULT_SUCCESS, GetInfo(&nvram, &info));
+  EXPECT_EQ(5U, info.space_list.size());
+  for (uint32_t index = 1; index <= 4; ++index) {
+    EXPECT_EQ(NV_RESULT_SPACE_ALREADY_EXISTS, CreateSpace(&nvram, index));
+  }
+}
+
+TEST_F(ShardedNvramManagerTest, LockSpacesAcrossShards) {
+  ShardedNvramManager nvram(storage_pointers_, kNumShards);
+  Request request;
+  ProvisionSpacesRequest& provision_spaces_request =
+      request.payload.Activate<COMMAND_PROVISION_SPACES>();
+  ASSERT_TRUE(provision_spaces_request.spaces.Resize(4));
+  for (uint32_t i = 0; i < 4; ++i) {
+    provision_spaces_request.spaces[i].index = i + 1;
+    provision_spaces_request.spaces[i].size = 10;
+    ASSERT_TRUE(provision_spaces_request.spaces[i].controls.Append(
+        NV_CONTROL_BOOT_READ_LOCK));
+  }
+  Response response;
+  nvram.Dispatch(request, &response);
+  ASSERT_EQ(NV_RESULT_SUCCESS, response.result);
+
+  // Requests for spaces of a single shard only involve that shard.
+  LockSpacesRequest& lock_spaces_request =
+      request.payload.Activate<COMMAND_LOCK_SPACES>();
+  ASSERT_TRUE(lock_spaces_request.locks.Resize(2));
+  lock_spaces_request.locks[0].index = 1;
+  lock_spaces_request.locks[0].lock_read = true;
+  lock_spaces_request.locks[1].index = 4;
+  lock_spaces_request.locks[1].lock_read = true;
+  EXPECT_EQ(nvram.ShardForIndex(1), nvram.ShardForRequest(request));
+
+  // Space 4 doesn't support write locks, so nothing gets locked.
+  ASSERT_TRUE(lock_spaces_request.locks.Resize(3));
+  lock_spaces_request.locks[2].index = 2;
+  lock_spaces_request.locks[2].lock_read = true;
+  lock_spaces_request.locks[1].lock_write = true;
+  EXPECT_EQ(ShardedNvramManager::kAllShards, nvram.ShardForRequest(request));
+  nvram.Dispatch(request, &response);
+  EXPECT_EQ(NV_RESULT_INVALID_PARAMETER, response.result);
+
+  lock_spaces_request.locks[1].lock_write = false;
+  nvram.Dispatch(request, &response);
+  ASSERT_EQ(NV_RESULT_SUCCESS, response.result);
+
+  GetSpaceInfoRequest get_space_info_request;
+  GetSpaceInfoResponse get_space_info_response;
+  for (uint32_t index = 1; index <= 4; ++index) {
+    get_space_info_request.index = index;
+    ASSERT_EQ(NV_RESULT_SUCCESS,
+              nvram.shard(nvram.ShardForIndex(index))
+                  ->GetSpaceInfo(get_space_info_request,
+                                 &get_space_info_response));
+    EXPECT_EQ(index != 3, get_space_info_response.read_locked);
+  }
+}
+
+TEST_F(ShardedNvramManagerTest, MergesStats) {
+  ShardedNvramManager nvram(storage_pointers_, kNumShards);
+  Request request;
+  request.payload.Activate<COMMAND_GET_STATS>();
+  EXPECT_EQ(ShardedNvramManager::kAllShards, nvram.ShardForRequest(request));
+  Response response;
+  nvram.Dispatch(request, &response);
+  EXPECT_EQ(NV_RESULT_OPERATION_DISABLED, response.result);
+
+  FakeClock clock(3000);
+  StatsRecorder stats(&clock);
+  StatsRecorder shard_stats[kNumShards] = {
+      StatsRecorder(&clock), StatsRecorder(&clock), StatsRecorder(&clock)};
+  nvram.set_stats_recorder(&stats);
+  for (size_t i = 0; i < kNumShards; ++i) {
+    nvram.shard(i)->set_stats_recorder(&shard_stats[i]);
+  }
+
+  for (uint32_t index = 1; index <= kNumShards; ++index) {
+    ASSERT_EQ(NV_RESULT_SUCCESS, CreateSpace(&nvram, index));
+  }
+  EXPECT_EQ(NV_RESULT_SPACE_ALREADY_EXISTS, CreateSpace(&nvram, 1));
+  GetInfoResponse info;
+  ASSERT_EQ(NV_RESULT_SUCCESS, GetInfo(&nvram, &info));
+
+  // Provision a space on each shard, which takes two stores per shard.
+  Request provision_request;
+  ProvisionSpacesRequest& provision_spaces_request =
+      provision_request.payload.Activate<COMMAND_PROVISION_SPACES>();
+  ASSERT_TRUE(provision_spaces_request.spaces.Resize(kNumShards));
+  for (size_t i = 0; i < kNumShards; ++i) {
+    provision_spaces_request.spaces[i].index = 10 + i;
+    provision_spaces_request.spaces[i].size = 10;
+  }
+  EXPECT_EQ(ShardedNvramManager::kAllShards,
+            nvram.ShardForRequest(provision_request));
+  nvram.Dispatch(provision_request, &response);
+  ASSERT_EQ(NV_RESULT_SUCCESS, response.result);
+
+  request.payload.Activate<COMMAND_GET_STATS>();
+  nvram.Dispatch(request, &response);
+  ASSERT_EQ(NV_RESULT_SUCCESS, response.result);
+  const GetStatsResponse* get_stats_response =
+      response.payload.get<COMMAND_GET_STATS>();
+  ASSERT_TRUE(get_stats_response);
+  ASSERT_EQ(3U, get_stats_response->commands.size());
+
+  // The shards' counts for CreateSpace add up. GetInfo and ProvisionSpaces
+  // span all shards and get recorded once, including the shards' storage
+  // time.
+  for (const CommandStats& command_stats : get_stats_response->commands) {
+    if (command_stats.command == COMMAND_CREATE_SPACE) {
+      EXPECT_EQ(4U, command_stats.calls);
+      EXPECT_EQ(3U, command_stats.result_counts[NV_RESULT_SUCCESS]);
+      EXPECT_EQ(1U,
+                command_stats.result_counts[NV_RESULT_SPACE_ALREADY_EXISTS]);
+      for (const LatencyHistogram& histogram : command_stats.latencies) {
+        if (histogram.phase == STATS_PHASE_STORAGE_STORE) {
+          ASSERT_EQ(StatsRecorder::kNumBuckets, histogram.buckets.size());
+          EXPECT_EQ(3U, histogram.buckets[4]);
+        }
+      }
+    } else if (command_stats.command == COMMAND_PROVISION_SPACES) {
+      EXPECT_EQ(1U, command_stats.calls);
+      bool has_store_phase = false;
+      for (const LatencyHistogram& histogram : command_stats.latencies) {
+        if (histogram.phase == STATS_PHASE_STORAGE_STORE) {
+          // Six stores of 3 microseconds each.
+          has_store_phase = true;
+          ASSERT_EQ(StatsRecorder::kNumBuckets, histogram.buckets.size());
+          EXPECT_EQ(1U, histogram.buckets[5]);
+        }
+      }
+      EXPECT_TRUE(has_store_phase);
+    } else {
+      EXPECT_EQ(static_cast<uint32_t>(COMMAND_GET_INFO),
+                command_stats.command);
+      EXPECT_EQ(1U, command_stats.calls);
+    }
+  }
+
+  // The shards' own recorders remain in place.
+  for (size_t i = 0; i < kNumShards; ++i) {
+    EXPECT_EQ(&shard_stats[i], nvram.shard(i)->stats_recorder());
+  }
+}
+
+TEST_F(ShardedNvramManagerTest, ShardFailure) {
+  storage_[1].SetHeaderReadError(true);
+  ShardedNvramManager nvram(storage_pointers_, kNumShards);
+
+  // Spaces in healthy shards remain usable.
+  EXPECT_EQ(NV_RESULT_SUCCESS, CreateSpace(&nvram, 3));
+  EXPECT_EQ(NV_RESULT_INTERNAL_ERROR, CreateSpace(&nvram, 4));
+
+  GetInfoResponse info;
+  EXPECT_EQ(NV_RESULT_INTERNAL_ERROR, GetInfo(&nvram, &info));
+}
+
+}  // namespace
+}  // namespace nvram
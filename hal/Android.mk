@@ -24,6 +24,16 @@ include $(CLEAR_VARS)
 LOCAL_MODULE := fake-nvram
 LOCAL_SRC_FILES := \
 	fake_nvram.cpp \
+	fake_nvram_block_storage.cpp \
+	fake_nvram_io_uring.cpp \
+	fake_nvram_log_storage.cpp \
+	fake_nvram_record.cpp \
+	fake_nvram_ring.cpp \
+	fake_nvram_rpmb.cpp \
+	fake_nvram_rpmb_storage.cpp \
+	fake_nvram_slab_storage.cpp \
+	fake_nvram_slot_storage.cpp \
+	fake_nvram_snapshot.cpp \
 	fake_nvram_storage.cpp
 LOCAL_CLANG := true
 LOCAL_CFLAGS := -Wall -Werror -Wextra
@@ -17,24 +17,58 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
-#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <android-base/logging.h>
+#include <android-base/macros.h>
+#include <android-base/unique_fd.h>
 #include <cutils/sockets.h>
 #include <libminijail.h>
 
 #include <nvram/core/nvram_manager.h>
+#include <nvram/core/sharded_nvram_manager.h>
+#include <nvram/core/stats.h>
+#include <nvram/messages/fd_io.h>
+#include <nvram/messages/framing.h>
 #include <nvram/messages/nvram_messages.h>
 
-// This is defined in fake_nvram_storage.h
+#include "fake_nvram_block_storage.h"
+#include "fake_nvram_io_uring.h"
+#include "fake_nvram_log_storage.h"
+#include "fake_nvram_ring.h"
+#include "fake_nvram_rpmb.h"
+#include "fake_nvram_rpmb_storage.h"
+#include "fake_nvram_slab_storage.h"
+#include "fake_nvram_snapshot.h"
+
+// These are defined in fake_nvram_storage.cpp
 void InitStorage(int data_dir_fd);
+bool InitStorageIoUring();
+void InitStorageGroupCommit();
+std::unique_ptr<nvram::storage::StorageBackend> CreateFileStorageBackend(
+    const char* name_prefix);
 
 namespace {
 
@@ -53,16 +87,51 @@ constexpr char kNvramDataDirectory[] = "/data/misc/fake-nvram/";
 // Connection backlog on control socket.
 constexpr int kControlSocketBacklog = 20;
 
-// Maximum number of client sockets supported.
-constexpr int kMaxClientSockets = 32;
+// Receive timeout for client sockets. Clients send the records of a frame back
+// to back, so a frame that stalls half-way for this long gets the client
+// dropped rather than blocking the serving thread.
+constexpr int kClientReceiveTimeoutMs = 1000;
+
+// Maximum number of ready sockets to retrieve per event loop iteration.
+constexpr int kMaxReadyEvents = 32;
+
+// Number of submission queue entries for the io_uring event loop.
+constexpr unsigned kIoUringEntries = 64;
+
+// Maximum number of records to receive per recvmmsg() call in batched mode.
+constexpr unsigned kMaxBatchSize = 16;
+
+// Upper bound for the --worker_threads flag.
+constexpr int kMaxWorkerThreads = 64;
+
+// Size of the emulated RPMB partition in half-sectors, i.e. 64 KiB.
+constexpr uint16_t kRpmbBlockCount = 256;
+
+// Pattern for the file name prefix of each shard's storage objects.
+constexpr char kShardFileNamePrefixPattern[] = "shard%zu_";
 
-// Size of the NVRAM message buffer for reading and writing serialized NVRAM
-// command messages from and to the control socket.
+// Size of the NVRAM message buffer for reading and writing unframed NVRAM
+// command messages from and to the control socket. This limits the message size
+// for legacy clients, framed messages aren't subject to this limit.
 constexpr int kNvramMessageBufferSize = 4096;
 
 // Variables holding command-line flags.
 const char* g_data_directory_path = kNvramDataDirectory;
 const char* g_control_socket_name = kNvramControlSocketName;
+int g_worker_threads = 0;
+bool g_use_io_uring = false;
+bool g_batch_commands = false;
+bool g_use_log_storage = false;
+bool g_use_slab_storage = false;
+const char* g_block_storage_path = nullptr;
+bool g_use_rpmb_storage = false;
+size_t g_num_shards = 1;
+bool g_group_commit = false;
+const char* g_snapshot_archive_path = nullptr;
+const char* g_import_archive_path = nullptr;
+bool g_warmup = false;
+bool g_prefetch_spaces = false;
+bool g_command_stats = false;
 
 // Parses the command line. Returns true if successful.
 bool ParseCommandLine(int argc, char** argv) {
@@ -70,6 +139,20 @@ bool ParseCommandLine(int argc, char** argv) {
     static const struct option options[] = {
         {"data_directory", required_argument, nullptr, 'd'},
         {"control_socket", required_argument, nullptr, 's'},
+        {"worker_threads", required_argument, nullptr, 'w'},
+        {"io_uring", no_argument, nullptr, 'u'},
+        {"batch", no_argument, nullptr, 'b'},
+        {"log_storage", no_argument, nullptr, 'l'},
+        {"slab_storage", no_argument, nullptr, 'm'},
+        {"block_storage", required_argument, nullptr, 'k'},
+        {"rpmb_storage", no_argument, nullptr, 'r'},
+        {"shards", required_argument, nullptr, 'n'},
+        {"group_commit", no_argument, nullptr, 'g'},
+        {"snapshot_archive", required_argument, nullptr, 'a'},
+        {"import_archive", required_argument, nullptr, 'i'},
+        {"warmup", no_argument, nullptr, 'W'},
+        {"prefetch_spaces", no_argument, nullptr, 'P'},
+        {"command_stats", no_argument, nullptr, 'c'},
     };
 
     int option_index = 0;
@@ -85,11 +168,85 @@ bool ParseCommandLine(int argc, char** argv) {
       case 's':
         g_control_socket_name = optarg;
         break;
+      case 'w': {
+        char* end = nullptr;
+        long value = strtol(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0' || value < 0 ||
+            value > kMaxWorkerThreads) {
+          LOG(ERROR) << "Invalid worker thread count: " << optarg;
+          return false;
+        }
+        g_worker_threads = static_cast<int>(value);
+        break;
+      }
+      case 'u':
+        g_use_io_uring = true;
+        break;
+      case 'b':
+        g_batch_commands = true;
+        break;
+      case 'l':
+        g_use_log_storage = true;
+        break;
+      case 'm':
+        g_use_slab_storage = true;
+        break;
+      case 'k':
+        g_block_storage_path = optarg;
+        break;
+      case 'r':
+        g_use_rpmb_storage = true;
+        break;
+      case 'n': {
+        char* end = nullptr;
+        long value = strtol(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0' || value < 1 ||
+            value > static_cast<long>(
+                        nvram::ShardedNvramManager::kMaxShards)) {
+          LOG(ERROR) << "Invalid shard count: " << optarg;
+          return false;
+        }
+        g_num_shards = static_cast<size_t>(value);
+        break;
+      }
+      case 'g':
+        g_group_commit = true;
+        break;
+      case 'a':
+        g_snapshot_archive_path = optarg;
+        break;
+      case 'i':
+        g_import_archive_path = optarg;
+        break;
+      case 'W':
+        g_warmup = true;
+        break;
+      case 'P':
+        g_warmup = true;
+        g_prefetch_spaces = true;
+        break;
+      case 'c':
+        g_command_stats = true;
+        break;
       default:
         return false;
     }
   }
 
+  int num_storage_flags = g_use_log_storage + g_use_slab_storage +
+                          (g_block_storage_path != nullptr) +
+                          g_use_rpmb_storage;
+  if (num_storage_flags > 1) {
+    LOG(ERROR) << "Log, slab, block and RPMB storage are mutually exclusive.";
+    return false;
+  }
+
+  if (num_storage_flags > 0 && g_num_shards > 1) {
+    LOG(ERROR) << "Log, slab, block and RPMB storage don't support multiple "
+                  "shards.";
+    return false;
+  }
+
   return true;
 }
 
@@ -108,11 +265,557 @@ bool InitMinijail() {
   return true;
 }
 
-// Reads a single command from |socket|, decodes the command, executes it on
-// |nvram_manager|, encodes the response, and writes the reply back to |socket|.
-// Returns true on success, false on errors (in which case the caller is
-// expected the close the |socket|).
-bool ProcessCommand(int socket, nvram::NvramManager* nvram_manager) {
+// Serializes command execution on a |ShardedNvramManager| shared by multiple
+// threads. Commands for different shards execute concurrently, commands that
+// involve all shards lock all of them in order. Only the |Dispatch()| call
+// itself is serialized, message decoding and encoding as well as socket I/O
+// happen outside of the lock.
+class CommandDispatcher {
+ public:
+  explicit CommandDispatcher(nvram::ShardedNvramManager* nvram_manager)
+      : nvram_manager_(nvram_manager) {}
+
+  void Dispatch(const nvram::Request& request, nvram::Response* response) {
+    size_t shard = nvram_manager_->ShardForRequest(request);
+    if (shard != nvram::ShardedNvramManager::kAllShards) {
+      std::lock_guard<std::mutex> lock(shard_mutexes_[shard]);
+      nvram_manager_->Dispatch(request, response);
+      return;
+    }
+
+    LockAllShards();
+    nvram_manager_->Dispatch(request, response);
+    UnlockAllShards();
+  }
+
+  // Excludes command execution on all shards until |UnlockAllShards()|, e.g.
+  // to observe a consistent state across shards.
+  void LockAllShards() {
+    size_t num_shards = nvram_manager_->num_shards();
+    for (size_t i = 0; i < num_shards; ++i) {
+      shard_mutexes_[i].lock();
+    }
+  }
+
+  void UnlockAllShards() {
+    for (size_t i = nvram_manager_->num_shards(); i > 0; --i) {
+      shard_mutexes_[i - 1].unlock();
+    }
+  }
+
+ private:
+  nvram::ShardedNvramManager* const nvram_manager_;
+  std::mutex shard_mutexes_[nvram::ShardedNvramManager::kMaxShards];
+};
+
+// Delivers readiness notifications for the control socket and client sockets.
+// Sockets are armed for a single notification at a time and need to be re-armed
+// once the notification has been handled. This guarantees that only a single
+// thread processes commands for a given connection at any time.
+class EventLoop {
+ public:
+  virtual ~EventLoop() = default;
+
+  // Arms |fd| for the next readiness notification. Returns true if successful.
+  virtual bool Arm(int fd) = 0;
+
+  // Waits for sockets to become ready and stores up to |max_fds| ready socket
+  // descriptors in |fds|. Returns the number of ready sockets, which may be 0
+  // if interrupted, or -1 on errors.
+  virtual int Wait(int* fds, int max_fds) = 0;
+};
+
+// An |EventLoop| implementation using epoll in one-shot mode.
+class EpollEventLoop : public EventLoop {
+ public:
+  ~EpollEventLoop() override {
+    if (epoll_fd_ != -1) {
+      close(epoll_fd_);
+    }
+  }
+
+  // Creates the epoll instance. Returns true if successful.
+  bool Init() {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ < 0) {
+      PLOG(ERROR) << "Failed to create epoll instance";
+      return false;
+    }
+    return true;
+  }
+
+  bool Arm(int fd) override {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &event) &&
+        (errno != ENOENT ||
+         epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event))) {
+      PLOG(ERROR) << "Failed to register socket with epoll";
+      return false;
+    }
+    return true;
+  }
+
+  int Wait(int* fds, int max_fds) override {
+    struct epoll_event events[kMaxReadyEvents];
+    int event_count = epoll_wait(epoll_fd_, events,
+                                 std::min(max_fds, kMaxReadyEvents), -1);
+    if (event_count < 0) {
+      return errno == EINTR ? 0 : -1;
+    }
+    for (int i = 0; i < event_count; ++i) {
+      fds[i] = events[i].data.fd;
+    }
+    return event_count;
+  }
+
+ private:
+  int epoll_fd_ = -1;
+};
+
+// An |EventLoop| implementation that uses io_uring poll requests. Re-arming
+// sockets only queues a request, which then gets submitted along with waiting
+// for the next notifications, so a loop iteration takes a single system call no
+// matter how many sockets were served.
+class IoUringEventLoop : public EventLoop {
+ public:
+  // Sockets that get re-armed by threads other than the one calling |Wait()|
+  // need to be submitted immediately, which is what |submit_eagerly| requests.
+  explicit IoUringEventLoop(bool submit_eagerly)
+      : submit_eagerly_(submit_eagerly) {}
+
+  // Sets up the io_uring. Returns true if successful.
+  bool Init() {
+    return io_uring_.Init(kIoUringEntries) &&
+           io_uring_.IsSupported(IORING_OP_POLL_ADD);
+  }
+
+  bool Arm(int fd) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    struct io_uring_sqe* sqe = io_uring_.GetSqe();
+    if (!sqe) {
+      // The submission queue is full, flush it to make room.
+      if (!io_uring_.Submit(0) || !(sqe = io_uring_.GetSqe())) {
+        return false;
+      }
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    // Poll requests take the same event mask as epoll.
+    sqe->poll32_events = EPOLLIN;
+    sqe->user_data = static_cast<uint64_t>(fd);
+    return !submit_eagerly_ || io_uring_.Submit(0);
+  }
+
+  int Wait(int* fds, int max_fds) override {
+    if (submit_eagerly_) {
+      if (!io_uring_.Wait(1)) {
+        return -1;
+      }
+    } else {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!io_uring_.Submit(1)) {
+        return -1;
+      }
+    }
+
+    int count = 0;
+    uint64_t user_data;
+    int32_t result;
+    while (count < max_fds && io_uring_.PopCompletion(&user_data, &result)) {
+      // Failed poll requests are reported as ready as well, the subsequent
+      // socket operation will then surface the error.
+      fds[count++] = static_cast<int>(user_data);
+    }
+    return count;
+  }
+
+ private:
+  const bool submit_eagerly_;
+  std::mutex mutex_;
+  nvram::IoUring io_uring_;
+};
+
+// Serves a shared memory ring attached to a client connection. See
+// fake_nvram_ring.h for the protocol.
+class RingConnection {
+ public:
+  RingConnection(android::base::unique_fd client_socket,
+                 android::base::unique_fd doorbell_fd,
+                 void* memory)
+      : client_socket_(std::move(client_socket)),
+        doorbell_fd_(std::move(doorbell_fd)),
+        memory_(memory),
+        control_(static_cast<nvram::RingControl*>(memory)),
+        requests_(&control_->requests,
+                  nvram::RequestRingData(memory),
+                  nvram::kRingCapacity),
+        responses_(&control_->responses,
+                   nvram::ResponseRingData(memory),
+                   nvram::kRingCapacity) {}
+
+  ~RingConnection() { munmap(memory_, nvram::kRingMemorySize); }
+
+  // Maps the shared memory region passed in |memory_fd| and validates it.
+  // Returns nullptr if the memory isn't suitable for a ring.
+  static std::shared_ptr<RingConnection> Create(
+      int client_socket,
+      const android::base::unique_fd& memory_fd,
+      android::base::unique_fd doorbell_fd) {
+    // The client must not be able to shrink the memory while it is mapped,
+    // since accessing the truncated pages would raise SIGBUS.
+    struct stat memory_stat;
+    int seals = fcntl(memory_fd.get(), F_GET_SEALS);
+    if (fstat(memory_fd.get(), &memory_stat) ||
+        memory_stat.st_size < static_cast<off_t>(nvram::kRingMemorySize) ||
+        seals < 0 || !(seals & F_SEAL_SHRINK)) {
+      LOG(WARNING) << "Ring memory isn't sealed against shrinking!";
+      return nullptr;
+    }
+
+    void* memory = mmap(nullptr, nvram::kRingMemorySize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, memory_fd.get(), 0);
+    if (memory == MAP_FAILED) {
+      PLOG(ERROR) << "Failed to map ring memory";
+      return nullptr;
+    }
+
+    // Keep a duplicate of the client socket for |Shutdown()|, so it remains
+    // valid even if the connection gets closed concurrently.
+    android::base::unique_fd socket_duplicate(
+        fcntl(client_socket, F_DUPFD_CLOEXEC, 0));
+    std::shared_ptr<RingConnection> ring(new RingConnection(
+        std::move(socket_duplicate), std::move(doorbell_fd), memory));
+    const nvram::RingControl* control = ring->control_;
+    if (ring->client_socket_.get() < 0) {
+      PLOG(ERROR) << "Failed to duplicate client socket";
+      return nullptr;
+    }
+    if (control->magic != nvram::kRingMagic ||
+        control->version != nvram::kRingVersion ||
+        control->capacity != nvram::kRingCapacity) {
+      LOG(WARNING) << "Unsupported ring layout!";
+      return nullptr;
+    }
+    return ring;
+  }
+
+  int doorbell_fd() const { return doorbell_fd_.get(); }
+
+  // Executes all requests queued in the ring and publishes the responses.
+  // Returns false if the ring state is inconsistent.
+  bool Serve(CommandDispatcher* dispatcher) {
+    // Reset the doorbell before looking at the ring, so requests queued after
+    // this point trigger another notification.
+    uint64_t doorbell;
+    if (TEMP_FAILURE_RETRY(read(doorbell_fd_.get(), &doorbell,
+                                sizeof(doorbell))) < 0 &&
+        errno != EAGAIN) {
+      PLOG(ERROR) << "Failed to read ring doorbell";
+      return false;
+    }
+
+    nvram::Request request;
+    nvram::SharedRing::ReadStatus status;
+    while ((status = requests_.Read(&request)) ==
+           nvram::SharedRing::ReadStatus::kSuccess) {
+      nvram::Response response;
+      dispatcher->Dispatch(request, &response);
+      if (!responses_.Write(response)) {
+        LOG(WARNING) << "Failed to place response in ring!";
+        return false;
+      }
+
+      control_->response_sequence.fetch_add(1);
+      if (control_->client_waiting.load()) {
+        nvram::FutexWake(&control_->response_sequence);
+      }
+    }
+
+    if (status == nvram::SharedRing::ReadStatus::kError) {
+      LOG(WARNING) << "Failed to read request from ring!";
+      return false;
+    }
+    return true;
+  }
+
+  // Shuts down the client connection, which prompts the client to detach and
+  // the connection to be closed via the regular socket path.
+  void Shutdown() { shutdown(client_socket_.get(), SHUT_RDWR); }
+
+  // Rings the doorbell from the daemon side.
+  void Notify() {
+    uint64_t doorbell = 1;
+    if (TEMP_FAILURE_RETRY(write(doorbell_fd_.get(), &doorbell,
+                                 sizeof(doorbell))) < 0) {
+      PLOG(ERROR) << "Failed to ring doorbell";
+    }
+  }
+
+ private:
+  android::base::unique_fd client_socket_;
+  android::base::unique_fd doorbell_fd_;
+  void* const memory_;
+  nvram::RingControl* const control_;
+  nvram::SharedRing requests_;
+  nvram::SharedRing responses_;
+};
+
+// Keeps track of the rings attached to client connections. Doorbell
+// descriptors are registered with the |EventLoop| alongside client sockets, so
+// ready descriptors need to be looked up here to tell them apart. Safe for
+// concurrent use.
+//
+// A doorbell may already be reported as ready by the time its connection gets
+// closed, so rings are only released while handling a doorbell notification.
+// Detaching a ring flags it and rings its doorbell to trigger the release.
+class RingRegistry {
+ public:
+  explicit RingRegistry(EventLoop* event_loop) : event_loop_(event_loop) {}
+
+  // Attaches the ring in |memory_fd| with doorbell |doorbell_fd| to
+  // |client_socket| and starts watching the doorbell. Returns true if
+  // successful.
+  bool Attach(int client_socket,
+              const android::base::unique_fd& memory_fd,
+              android::base::unique_fd doorbell_fd) {
+    std::shared_ptr<RingConnection> ring = RingConnection::Create(
+        client_socket, memory_fd, std::move(doorbell_fd));
+    if (!ring) {
+      return false;
+    }
+
+    int doorbell = ring->doorbell_fd();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (doorbells_.count(client_socket)) {
+        LOG(WARNING) << "Connection already has a ring attached!";
+        return false;
+      }
+      doorbells_[client_socket] = doorbell;
+      rings_[doorbell] = {ring, client_socket, false};
+    }
+
+    if (!event_loop_->Arm(doorbell)) {
+      Release(doorbell);
+      return false;
+    }
+    return true;
+  }
+
+  // Handles a readiness notification for |fd| if it is a ring doorbell, and
+  // re-arms the doorbell. Returns false if |fd| isn't a doorbell.
+  bool Serve(int fd, CommandDispatcher* dispatcher) {
+    std::shared_ptr<RingConnection> ring;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto entry = rings_.find(fd);
+      if (entry == rings_.end()) {
+        return false;
+      }
+      ring = entry->second.ring;
+    }
+
+    if (!ring->Serve(dispatcher)) {
+      ring->Shutdown();
+    }
+
+    // Check again, since serving the ring consumed any doorbell notification
+    // sent by |Detach()| in the meantime.
+    if (ReleaseIfDetached(fd)) {
+      return true;
+    }
+    if (!event_loop_->Arm(fd)) {
+      ring->Shutdown();
+      Release(fd);
+    }
+    return true;
+  }
+
+  // Detaches the ring attached to |client_socket|, if any. Must be called
+  // before closing a client socket.
+  void Detach(int client_socket) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto entry = doorbells_.find(client_socket);
+    if (entry != doorbells_.end()) {
+      RingEntry& ring_entry = rings_[entry->second];
+      ring_entry.detached = true;
+      ring_entry.ring->Notify();
+      doorbells_.erase(entry);
+    }
+  }
+
+ private:
+  struct RingEntry {
+    std::shared_ptr<RingConnection> ring;
+    int client_socket;
+    bool detached;
+  };
+
+  // Releases the ring with doorbell |fd| if it has been detached. Only safe if
+  // the doorbell isn't armed. Returns true if the ring was released.
+  bool ReleaseIfDetached(int fd) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto entry = rings_.find(fd);
+    if (entry == rings_.end() || !entry->second.detached) {
+      return false;
+    }
+    rings_.erase(entry);
+    return true;
+  }
+
+  // Releases the ring with doorbell |fd| right away. Only safe if the doorbell
+  // isn't armed.
+  void Release(int fd) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto entry = rings_.find(fd);
+    if (entry == rings_.end()) {
+      return;
+    }
+    auto doorbell = doorbells_.find(entry->second.client_socket);
+    if (doorbell != doorbells_.end() && doorbell->second == fd) {
+      doorbells_.erase(doorbell);
+    }
+    rings_.erase(entry);
+  }
+
+  EventLoop* const event_loop_;
+  std::mutex mutex_;
+  // Maps client sockets to the doorbells of their rings.
+  std::unordered_map<int, int> doorbells_;
+  // Maps doorbells to rings.
+  std::unordered_map<int, RingEntry> rings_;
+};
+
+// Ancillary data buffer large enough to receive the ring descriptors.
+union RingControlMessage {
+  struct cmsghdr align;
+  char buffer[CMSG_SPACE(2 * sizeof(int))];
+};
+
+// Takes ownership of the file descriptors passed as SCM_RIGHTS in |msg| and
+// appends them to |fds|. Clears the ancillary data in |msg| so descriptors
+// can't be taken twice.
+void TakeDescriptors(struct msghdr* msg,
+                     std::vector<android::base::unique_fd>* fds) {
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg;
+       cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t i = 0; i < count; ++i) {
+      int fd;
+      memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+      fds->emplace_back(fd);
+    }
+  }
+  msg->msg_controllen = 0;
+}
+
+// Checks whether the |size| bytes at |data| hold a ring attach frame header.
+bool IsAttachRingFrame(const uint8_t* data, size_t size) {
+  nvram::InputStreamBuffer input(data, size);
+  nvram::FrameHeader header;
+  return nvram::ReadFrameHeader(&input, &header) &&
+         (header.flags & nvram::kFrameFlagAttachRing) != 0;
+}
+
+// Handles a ring attach frame received on |client_socket| in |msg|. Writes the
+// acknowledgment to |output|. Returns true if successful, false if the request
+// is invalid or the ring can't be attached.
+bool HandleAttachRing(int client_socket,
+                      struct msghdr* msg,
+                      RingRegistry* rings,
+                      nvram::OutputStreamBuffer* output) {
+  std::vector<android::base::unique_fd> fds;
+  TakeDescriptors(msg, &fds);
+  if (fds.size() != 2 || (msg->msg_flags & MSG_CTRUNC)) {
+    LOG(WARNING) << "Invalid ring attach request!";
+    return false;
+  }
+
+  if (!rings->Attach(client_socket, fds[0], std::move(fds[1]))) {
+    return false;
+  }
+
+  nvram::FrameHeader reply;
+  reply.flags = nvram::kFrameFlagAttachRing;
+  return nvram::WriteFrameHeader(output, reply);
+}
+
+// Decodes the unframed command in the |size| bytes at |data|, executes it via
+// |dispatcher| and writes the encoded response to |output|. Returns true on
+// success, false on errors.
+bool HandleLegacyCommand(const uint8_t* data,
+                         size_t size,
+                         nvram::OutputStreamBuffer* output,
+                         CommandDispatcher* dispatcher) {
+  nvram::Request request;
+  if (!nvram::Decode(data, size, &request)) {
+    LOG(WARNING) << "Failed to decode command request!";
+    return false;
+  }
+
+  nvram::Response response;
+  dispatcher->Dispatch(request, &response);
+  if (nvram::GetEncodedSize(response) > kNvramMessageBufferSize ||
+      !nvram::Encode(response, output)) {
+    LOG(WARNING) << "Failed to encode command response!";
+    return false;
+  }
+
+  return true;
+}
+
+// Reads a framed command from |input|, executes it via |dispatcher| and writes
+// a framed response to |output|. Responses to tagged requests carry the request
+// ID of the request. Framing probes get acknowledged by echoing back a probe
+// header, which advertises tagged frame support if the client asks for it.
+// Returns true on success, false on errors.
+bool HandleFramedCommand(nvram::InputStreamBuffer* input,
+                         nvram::OutputStreamBuffer* output,
+                         CommandDispatcher* dispatcher) {
+  nvram::FrameHeader header;
+  if (!nvram::ReadFrameHeader(input, &header)) {
+    LOG(WARNING) << "Failed to read frame header!";
+    return false;
+  }
+
+  if (header.flags & nvram::kFrameFlagProbe) {
+    nvram::FrameHeader probe_reply;
+    probe_reply.flags = header.flags & (nvram::kFrameFlagProbe |
+                                        nvram::kFrameFlagRequestId);
+    return nvram::WriteFrameHeader(output, probe_reply);
+  }
+
+  nvram::Request request;
+  if (!nvram::ReadFramePayload(input, header, &request)) {
+    LOG(WARNING) << "Failed to decode framed command request!";
+    return false;
+  }
+
+  nvram::Response response;
+  dispatcher->Dispatch(request, &response);
+  bool written = (header.flags & nvram::kFrameFlagRequestId)
+                     ? nvram::WriteTaggedFrame(output, header.request_id,
+                                               response)
+                     : nvram::WriteFrame(output, response);
+  if (!written) {
+    LOG(WARNING) << "Failed to encode framed command response!";
+    return false;
+  }
+
+  return true;
+}
+
+// Reads a single unframed command from |socket|, decodes the command, executes
+// it via |dispatcher|, encodes the response, and writes the reply back to
+// |socket|. Returns true on success, false on errors (in which case the caller
+// is expected the close the |socket|).
+bool ProcessLegacyCommand(int socket, CommandDispatcher* dispatcher) {
   uint8_t command_buffer[kNvramMessageBufferSize];
   ssize_t bytes_read =
       TEMP_FAILURE_RETRY(read(socket, command_buffer, sizeof(command_buffer)));
@@ -125,21 +828,34 @@ bool ProcessCommand(int socket, nvram::NvramManager* nvram_manager) {
     return false;
   }
 
-  nvram::Request request;
-  if (!nvram::Decode(command_buffer, bytes_read, &request)) {
-    LOG(WARNING) << "Failed to decode command request!";
+  // Note that the request is fully decoded before the response gets encoded,
+  // so it's fine to reuse |command_buffer| for output.
+  nvram::ArrayOutputStreamBuffer output(command_buffer, sizeof(command_buffer));
+  if (!HandleLegacyCommand(command_buffer, bytes_read, &output, dispatcher)) {
     return false;
   }
 
-  nvram::Response response;
-  nvram_manager->Dispatch(request, &response);
-  size_t response_size = sizeof(command_buffer);
-  if (!nvram::Encode(response, command_buffer, &response_size)) {
-    LOG(WARNING) << "Failed to encode command response!";
+  if (TEMP_FAILURE_RETRY(
+          write(socket, command_buffer, output.bytes_written())) < 0) {
+    PLOG(ERROR) << "Failed to write response to client socket";
+    return false;
+  }
+
+  return true;
+}
+
+// Reads a single framed command from |socket|, executes it and writes a framed
+// response. Requests and responses are streamed through record-sized buffers,
+// so there's no upper bound on message size apart from the framing protocol
+// limit. Returns true on success, false on errors.
+bool ProcessFramedCommand(int socket, CommandDispatcher* dispatcher) {
+  nvram::FdInputStreamBuffer input_stream(socket, nvram::kFrameRecordSize);
+  nvram::FdOutputStreamBuffer output_stream(socket, nvram::kFrameRecordSize);
+  if (!HandleFramedCommand(&input_stream, &output_stream, dispatcher)) {
     return false;
   }
 
-  if (TEMP_FAILURE_RETRY(write(socket, command_buffer, response_size)) < 0) {
+  if (!output_stream.Flush()) {
     PLOG(ERROR) << "Failed to write response to client socket";
     return false;
   }
@@ -147,59 +863,737 @@ bool ProcessCommand(int socket, nvram::NvramManager* nvram_manager) {
   return true;
 }
 
-// Listens for incoming connections or data, accepts connections and processes
-// data as needed.
-int ProcessMessages(int control_socket_fd, nvram::NvramManager* nvram_manager) {
-  struct pollfd poll_fds[kMaxClientSockets];
-  memset(poll_fds, 0, sizeof(poll_fds));
-  poll_fds[0].fd = control_socket_fd;
-  poll_fds[0].events = POLLIN;
-  poll_fds[0].revents = 0;
-  nfds_t poll_fds_count = 1;
-  while (TEMP_FAILURE_RETRY(poll(poll_fds, poll_fds_count, -1)) >= 0) {
-    if (poll_fds[0].revents & POLLIN) {
-      // Accept a new connection.
-      int client_socket = accept(control_socket_fd, NULL, 0);
-      if (client_socket < 0) {
-        PLOG(ERROR) << "Error accepting connection";
-        return errno;
-      }
-
-      // Add |client_socket| to |poll_fds|.
-      if (poll_fds_count < kMaxClientSockets) {
-        poll_fds[poll_fds_count].fd = client_socket;
-        poll_fds[poll_fds_count].events = POLLIN;
-        poll_fds[poll_fds_count].revents = 0;
-        ++poll_fds_count;
+// Receives a ring attach frame along with the ring descriptors from |socket|
+// and attaches the ring. Returns true on success, false on errors.
+bool ProcessAttachRing(int socket, RingRegistry* rings) {
+  uint8_t header_buffer[nvram::kFrameHeaderSize];
+  struct iovec iov = {header_buffer, sizeof(header_buffer)};
+  RingControlMessage control;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof(control.buffer);
+  if (TEMP_FAILURE_RETRY(recvmsg(socket, &msg, MSG_CMSG_CLOEXEC)) < 0) {
+    PLOG(ERROR) << "Failed to read ring attach request from client socket";
+    return false;
+  }
+
+  nvram::ArrayOutputStreamBuffer output(header_buffer, sizeof(header_buffer));
+  if (!HandleAttachRing(socket, &msg, rings, &output)) {
+    return false;
+  }
+
+  if (TEMP_FAILURE_RETRY(write(socket, header_buffer, output.bytes_written())) <
+      0) {
+    PLOG(ERROR) << "Failed to write response to client socket";
+    return false;
+  }
+
+  return true;
+}
+
+// Processes the next command available on |socket|. Framed and unframed
+// commands are told apart by peeking at the first bytes of the next record.
+// Returns true on success, false on errors (in which case the caller is
+// expected the close the |socket|).
+bool ProcessCommand(int socket,
+                    CommandDispatcher* dispatcher,
+                    RingRegistry* rings) {
+  uint8_t header_buffer[nvram::kFrameHeaderSize];
+  ssize_t bytes_peeked = TEMP_FAILURE_RETRY(recv(
+      socket, header_buffer, sizeof(header_buffer), MSG_PEEK | MSG_DONTWAIT));
+  if (bytes_peeked == 0) {
+    return false;
+  }
+
+  if (bytes_peeked < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      // Spurious notification, e.g. after the client shut down a ring.
+      return true;
+    }
+    PLOG(ERROR) << "Failed to read command from client socket";
+    return false;
+  }
+
+  if (nvram::IsFrameHeader(header_buffer, bytes_peeked)) {
+    if (IsAttachRingFrame(header_buffer, bytes_peeked)) {
+      return ProcessAttachRing(socket, rings);
+    }
+    return ProcessFramedCommand(socket, dispatcher);
+  }
+
+  return ProcessLegacyCommand(socket, dispatcher);
+}
+
+// Counts how often batches of a given size occur. Safe for concurrent use.
+class BatchSizeHistogram {
+ public:
+  void Record(unsigned batch_size) {
+    buckets_[std::min(batch_size, kMaxBatchSize)].fetch_add(
+        1, std::memory_order_relaxed);
+  }
+
+  // Formats the non-empty buckets as "size:count" pairs.
+  std::string ToString() const {
+    std::string result;
+    for (unsigned i = 0; i <= kMaxBatchSize; ++i) {
+      uint64_t count = buckets_[i].load(std::memory_order_relaxed);
+      if (count) {
+        result += (result.empty() ? "" : " ") + std::to_string(i) + ":" +
+                  std::to_string(count);
+      }
+    }
+    return result.empty() ? "(none)" : result;
+  }
+
+ private:
+  std::atomic<uint64_t> buckets_[kMaxBatchSize + 1] = {};
+};
+
+// Daemon statistics, dumped to the log on SIGUSR1.
+struct DaemonStats {
+  // Number of records received per recvmmsg() call in batched mode.
+  BatchSizeHistogram receive_batch_sizes;
+
+  // Number of records sent per sendmmsg() call in batched mode.
+  BatchSizeHistogram send_batch_sizes;
+};
+
+DaemonStats g_stats;
+
+// Feeds |nvram::StatsRecorder|s from the monotonic system clock.
+class SteadyClock : public nvram::Clock {
+ public:
+  // nvram::Clock:
+  uint64_t NowNanoseconds() override {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+};
+
+// Log names of the |nvram::StatsPhase| values.
+const char* const kStatsPhaseNames[] = {
+    "storage_load", "decode", "logic", "encode", "storage_store",
+};
+
+// Formats |command_stats| for the log. Results are listed as "result:count"
+// pairs, and the latency histograms of each phase as "<bound:count" pairs,
+// where the bound is the bucket's upper bound in microseconds.
+std::string FormatCommandStats(const nvram::CommandStats& command_stats) {
+  std::string result = "command " + std::to_string(command_stats.command) +
+                       ": " + std::to_string(command_stats.calls) +
+                       " calls, results";
+  for (size_t i = 0; i < command_stats.result_counts.size(); ++i) {
+    if (command_stats.result_counts[i]) {
+      result += " " + std::to_string(i) + ":" +
+                std::to_string(command_stats.result_counts[i]);
+    }
+  }
+
+  for (const nvram::LatencyHistogram& histogram : command_stats.latencies) {
+    if (histogram.phase < arraysize(kStatsPhaseNames)) {
+      result += std::string(", ") + kStatsPhaseNames[histogram.phase];
+    } else {
+      result += ", phase " + std::to_string(histogram.phase);
+    }
+    for (size_t i = 0; i < histogram.buckets.size(); ++i) {
+      if (!histogram.buckets[i]) {
+        continue;
+      }
+      result += i + 1 < histogram.buckets.size()
+                    ? " <" + std::to_string(1ULL << i) + ":"
+                    : " >=" + std::to_string(1ULL << (i - 1)) + ":";
+      result += std::to_string(histogram.buckets[i]);
+    }
+  }
+  return result;
+}
+
+// The RPMB storage backend, if in use, which reports frame statistics.
+nvram::RpmbStorageBackend* g_rpmb_storage = nullptr;
+
+// Set by the SIGUSR1 handler to request a statistics dump.
+volatile sig_atomic_t g_dump_stats = 0;
+
+void HandleDumpStatsSignal(int /* signal */) {
+  g_dump_stats = 1;
+}
+
+// Set by the SIGUSR2 handler to request a snapshot export.
+volatile sig_atomic_t g_export_snapshot = 0;
+
+void HandleExportSnapshotSignal(int /* signal */) {
+  g_export_snapshot = 1;
+}
+
+// Logs the daemon statistics. With --command_stats, this includes the command
+// statistics collected by the NVRAM manager, which get retrieved through
+// |dispatcher| like any other request.
+void DumpStats(CommandDispatcher* dispatcher) {
+  LOG(INFO) << "recvmmsg batch sizes: "
+            << g_stats.receive_batch_sizes.ToString();
+  LOG(INFO) << "sendmmsg batch sizes: " << g_stats.send_batch_sizes.ToString();
+  if (g_rpmb_storage) {
+    LOG(INFO) << "RPMB " << g_rpmb_storage->FormatStats();
+  }
+
+  if (!g_command_stats) {
+    return;
+  }
+
+  nvram::Request request;
+  request.payload.Activate<nvram::COMMAND_GET_STATS>();
+  nvram::Response response;
+  dispatcher->Dispatch(request, &response);
+  const nvram::GetStatsResponse* get_stats_response =
+      response.payload.get<nvram::COMMAND_GET_STATS>();
+  if (response.result != NV_RESULT_SUCCESS || !get_stats_response) {
+    LOG(ERROR) << "Failed to retrieve command statistics: " << response.result;
+    return;
+  }
+  for (const nvram::CommandStats& command_stats :
+       get_stats_response->commands) {
+    LOG(INFO) << "NVRAM " << FormatCommandStats(command_stats);
+  }
+}
+
+// An |InputStreamBuffer| that reads a frame starting at a given record of a
+// batch of records received via recvmmsg(). Frames that extend beyond the end
+// of the batch continue to be read from |socket|.
+class BatchInputStreamBuffer : public nvram::InputStreamBuffer {
+ public:
+  BatchInputStreamBuffer(const struct mmsghdr* records,
+                         size_t record_count,
+                         size_t first_record,
+                         int socket,
+                         std::vector<uint8_t>* scratch_buffer)
+      : records_(records),
+        record_count_(record_count),
+        next_record_(first_record),
+        socket_(socket),
+        scratch_buffer_(scratch_buffer) {}
+
+  // Index of the first record in the batch that hasn't been consumed.
+  size_t next_record() const { return next_record_; }
+
+  // Whether all data in the records consumed so far has been read.
+  bool AtRecordBoundary() const { return pos_ == end_; }
+
+ protected:
+  // InputStreamBuffer:
+  bool Advance() override {
+    if (next_record_ < record_count_) {
+      const struct mmsghdr& record = records_[next_record_++];
+      pos_ = static_cast<const uint8_t*>(record.msg_hdr.msg_iov->iov_base);
+      end_ = pos_ + record.msg_len;
+      return record.msg_len > 0;
+    }
+
+    scratch_buffer_->resize(nvram::kFrameRecordSize);
+    ssize_t bytes_read = TEMP_FAILURE_RETRY(
+        read(socket_, scratch_buffer_->data(), scratch_buffer_->size()));
+    if (bytes_read <= 0) {
+      return false;
+    }
+    pos_ = scratch_buffer_->data();
+    end_ = pos_ + bytes_read;
+    return true;
+  }
+
+ private:
+  const struct mmsghdr* records_;
+  size_t record_count_;
+  size_t next_record_;
+  int socket_;
+  std::vector<uint8_t>* scratch_buffer_;
+};
+
+// An |OutputStreamBuffer| that collects output in a list of record-sized
+// buffers, which are then sent in one go via sendmmsg(). Buffers are kept
+// around for reuse.
+class RecordOutputStreamBuffer : public nvram::OutputStreamBuffer {
+ public:
+  // Finishes the current record, so subsequent output starts a new record.
+  void EndRecord() {
+    if (pos_ != record_start_) {
+      record_sizes_.push_back(pos_ - record_start_);
+    }
+    pos_ = end_ = record_start_ = nullptr;
+  }
+
+  // Sends all finished records to |socket| and clears the record list. Returns
+  // true if successful.
+  bool Send(int socket) {
+    EndRecord();
+    size_t record_count = record_sizes_.size();
+    iovecs_.resize(record_count);
+    headers_.resize(record_count);
+    for (size_t i = 0; i < record_count; ++i) {
+      iovecs_[i].iov_base = buffers_[i].get();
+      iovecs_[i].iov_len = record_sizes_[i];
+      memset(&headers_[i], 0, sizeof(headers_[i]));
+      headers_[i].msg_hdr.msg_iov = &iovecs_[i];
+      headers_[i].msg_hdr.msg_iovlen = 1;
+    }
+    record_sizes_.clear();
+
+    size_t sent = 0;
+    while (sent < record_count) {
+      int rc = TEMP_FAILURE_RETRY(
+          sendmmsg(socket, headers_.data() + sent, record_count - sent, 0));
+      if (rc < 0) {
+        PLOG(ERROR) << "Failed to write responses to client socket";
+        return false;
+      }
+      g_stats.send_batch_sizes.Record(rc);
+      sent += rc;
+    }
+    return true;
+  }
+
+ protected:
+  // OutputStreamBuffer:
+  bool Advance() override {
+    EndRecord();
+    size_t index = record_sizes_.size();
+    if (index == buffers_.size()) {
+      buffers_.emplace_back(new uint8_t[nvram::kFrameRecordSize]);
+    }
+    pos_ = record_start_ = buffers_[index].get();
+    end_ = pos_ + nvram::kFrameRecordSize;
+    return true;
+  }
+
+ private:
+  std::vector<std::unique_ptr<uint8_t[]>> buffers_;
+  std::vector<size_t> record_sizes_;
+  uint8_t* record_start_ = nullptr;
+  std::vector<struct iovec> iovecs_;
+  std::vector<struct mmsghdr> headers_;
+};
+
+// Processes commands in batched mode. All records queued on a client socket are
+// received with a single recvmmsg() call, the commands they contain get
+// executed and all responses are sent back with a single sendmmsg() call.
+// Each thread serving clients needs its own |CommandBatch|.
+class CommandBatch {
+ public:
+  CommandBatch()
+      : receive_buffer_(new uint8_t[kMaxBatchSize * nvram::kFrameRecordSize]) {
+    for (unsigned i = 0; i < kMaxBatchSize; ++i) {
+      receive_iovecs_[i].iov_base =
+          receive_buffer_.get() + i * nvram::kFrameRecordSize;
+      receive_iovecs_[i].iov_len = nvram::kFrameRecordSize;
+    }
+  }
+
+  // Processes the commands currently queued on |socket|. Returns false on
+  // errors or if the peer closed the connection.
+  bool Process(int socket, CommandDispatcher* dispatcher, RingRegistry* rings) {
+    for (unsigned i = 0; i < kMaxBatchSize; ++i) {
+      memset(&receive_headers_[i], 0, sizeof(receive_headers_[i]));
+      receive_headers_[i].msg_hdr.msg_iov = &receive_iovecs_[i];
+      receive_headers_[i].msg_hdr.msg_iovlen = 1;
+      receive_headers_[i].msg_hdr.msg_control = receive_controls_[i].buffer;
+      receive_headers_[i].msg_hdr.msg_controllen =
+          sizeof(receive_controls_[i].buffer);
+    }
+
+    int record_count = TEMP_FAILURE_RETRY(
+        recvmmsg(socket, receive_headers_, kMaxBatchSize,
+                 MSG_DONTWAIT | MSG_CMSG_CLOEXEC, nullptr));
+    if (record_count < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return true;
+      }
+      PLOG(ERROR) << "Failed to read commands from client socket";
+      return false;
+    }
+
+    // At the end of the stream, recvmmsg() reports empty records for all
+    // remaining slots. Don't count these in the statistics.
+    unsigned data_records = 0;
+    while (data_records < static_cast<unsigned>(record_count) &&
+           receive_headers_[data_records].msg_len > 0) {
+      ++data_records;
+    }
+    if (data_records > 0) {
+      g_stats.receive_batch_sizes.Record(data_records);
+    }
+
+    bool keep_open = record_count > 0;
+    size_t index = 0;
+    while (keep_open && index < static_cast<size_t>(record_count)) {
+      const struct mmsghdr& record = receive_headers_[index];
+      const uint8_t* data =
+          static_cast<const uint8_t*>(record.msg_hdr.msg_iov->iov_base);
+      if (record.msg_len == 0) {
+        // The peer closed the connection.
+        keep_open = false;
+      } else if (record.msg_hdr.msg_flags & MSG_TRUNC) {
+        LOG(WARNING) << "Oversized command record!";
+        keep_open = false;
+      } else if (IsAttachRingFrame(data, record.msg_len)) {
+        keep_open = HandleAttachRing(socket, &receive_headers_[index].msg_hdr,
+                                     rings, &output_);
+        ++index;
+      } else if (nvram::IsFrameHeader(data, record.msg_len)) {
+        BatchInputStreamBuffer input(receive_headers_, record_count, index,
+                                     socket, &scratch_buffer_);
+        keep_open = HandleFramedCommand(&input, &output_, dispatcher);
+        if (keep_open && !input.AtRecordBoundary()) {
+          LOG(WARNING) << "Frame doesn't end at record boundary!";
+          keep_open = false;
+        }
+        index = input.next_record();
       } else {
-        LOG(WARNING) << "Too many open client sockets, rejecting connection.";
-        // No need to handle EINTR specially here as bionic filters it out.
-        if (close(client_socket)) {
-          PLOG(ERROR) << "Failed to close connection socket after error";
+        keep_open =
+            HandleLegacyCommand(data, record.msg_len, &output_, dispatcher);
+        ++index;
+      }
+      output_.EndRecord();
+    }
+
+    // Release descriptors sent along with anything but ring attach requests.
+    std::vector<android::base::unique_fd> stray_fds;
+    for (int i = 0; i < record_count; ++i) {
+      if (receive_headers_[i].msg_hdr.msg_controllen > 0) {
+        TakeDescriptors(&receive_headers_[i].msg_hdr, &stray_fds);
+      }
+    }
+    stray_fds.clear();
+
+    // Send responses for the commands processed successfully, even if the
+    // connection is about to be closed.
+    return output_.Send(socket) && keep_open;
+  }
+
+ private:
+  std::unique_ptr<uint8_t[]> receive_buffer_;
+  struct iovec receive_iovecs_[kMaxBatchSize];
+  struct mmsghdr receive_headers_[kMaxBatchSize];
+  RingControlMessage receive_controls_[kMaxBatchSize];
+  std::vector<uint8_t> scratch_buffer_;
+  RecordOutputStreamBuffer output_;
+};
+
+// Configures a newly accepted |client_socket|. Command processing reads all
+// records of a frame once the first one arrives, so the socket gets a receive
+// timeout to bound the time spent waiting for the rest. Returns true if
+// successful.
+bool SetUpClientSocket(int client_socket) {
+  struct timeval timeout;
+  timeout.tv_sec = kClientReceiveTimeoutMs / 1000;
+  timeout.tv_usec = (kClientReceiveTimeoutMs % 1000) * 1000;
+  if (setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                 sizeof(timeout))) {
+    PLOG(ERROR) << "Failed to set client socket receive timeout";
+    return false;
+  }
+  return true;
+}
+
+// Closes a client connection socket.
+void CloseClientSocket(int client_socket) {
+  // No need to handle EINTR specially here as bionic filters it out.
+  if (close(client_socket)) {
+    PLOG(ERROR) << "Failed to close connection socket";
+  }
+}
+
+// Processes pending commands on the client socket or ring doorbell |fd| and
+// re-arms it for the next one. On socket errors, the connection gets closed,
+// ring errors shut down the connection the ring is attached to. Socket
+// commands are processed in batched mode if |batch| is non-null.
+void ServeClient(EventLoop* event_loop,
+                 int fd,
+                 CommandDispatcher* dispatcher,
+                 RingRegistry* rings,
+                 CommandBatch* batch) {
+  if (rings->Serve(fd, dispatcher)) {
+    return;
+  }
+
+  bool success = batch ? batch->Process(fd, dispatcher, rings)
+                       : ProcessCommand(fd, dispatcher, rings);
+  if (!success || !event_loop->Arm(fd)) {
+    rings->Detach(fd);
+    CloseClientSocket(fd);
+  }
+}
+
+// A pool of threads that serve client connections which have pending commands.
+class WorkerPool {
+ public:
+  WorkerPool(EventLoop* event_loop,
+             CommandDispatcher* dispatcher,
+             RingRegistry* rings,
+             bool batch_commands)
+      : event_loop_(event_loop),
+        dispatcher_(dispatcher),
+        rings_(rings),
+        batch_commands_(batch_commands) {}
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      shutdown_ = true;
+    }
+    condition_.notify_all();
+    for (std::thread& thread : threads_) {
+      thread.join();
+    }
+  }
+
+  // Starts |num_threads| worker threads.
+  void Start(int num_threads) {
+    for (int i = 0; i < num_threads; ++i) {
+      threads_.emplace_back(&WorkerPool::Run, this);
+    }
+  }
+
+  // Queues |client_socket| for processing by the next idle worker.
+  void Submit(int client_socket) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_.push_back(client_socket);
+    }
+    condition_.notify_one();
+  }
+
+ private:
+  void Run() {
+    std::unique_ptr<CommandBatch> batch;
+    if (batch_commands_) {
+      batch.reset(new CommandBatch);
+    }
+
+    while (true) {
+      int client_socket;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        condition_.wait(lock,
+                        [this] { return shutdown_ || !pending_.empty(); });
+        if (shutdown_) {
+          return;
         }
+        client_socket = pending_.front();
+        pending_.pop_front();
+      }
+      ServeClient(event_loop_, client_socket, dispatcher_, rings_, batch.get());
+    }
+  }
+
+  EventLoop* const event_loop_;
+  CommandDispatcher* const dispatcher_;
+  RingRegistry* const rings_;
+  const bool batch_commands_;
+
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  std::deque<int> pending_;
+  bool shutdown_ = false;
+  std::vector<std::thread> threads_;
+};
+
+// Initializes all shards before serving any request, so the first requests
+// don't pay for loading headers and resolving provisional spaces. With
+// --prefetch_spaces, the shards also load all their spaces once to warm up the
+// storage caches. Shards warm up in parallel, each on its own thread, as they
+// use separate storage backends. Failures only get logged, since the affected
+// shards retry initialization on the next request.
+void WarmupShards(nvram::ShardedNvramManager* nvram_manager) {
+  using Clock = std::chrono::steady_clock;
+  constexpr size_t kMaxShards = nvram::ShardedNvramManager::kMaxShards;
+  const size_t num_shards = nvram_manager->num_shards();
+  nvram_result_t results[kMaxShards];
+  Clock::duration durations[kMaxShards];
+
+  auto warmup_shard = [&](size_t shard) {
+    Clock::time_point start = Clock::now();
+    results[shard] = nvram_manager->shard(shard)->Warmup(g_prefetch_spaces);
+    durations[shard] = Clock::now() - start;
+  };
+
+  Clock::time_point start = Clock::now();
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_shards; ++i) {
+    threads.emplace_back(warmup_shard, i);
+  }
+  warmup_shard(0);
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  Clock::duration total_duration = Clock::now() - start;
+
+  for (size_t i = 0; i < num_shards; ++i) {
+    auto duration_us =
+        std::chrono::duration_cast<std::chrono::microseconds>(durations[i]);
+    if (results[i] != NV_RESULT_SUCCESS) {
+      LOG(WARNING) << "Shard " << i << " warm-up failed with result "
+                   << results[i] << " after " << duration_us.count() << " us.";
+    } else {
+      LOG(INFO) << "Shard " << i << " warmed up in " << duration_us.count()
+                << " us.";
+    }
+  }
+  LOG(INFO) << "Warm-up of " << num_shards << " shard(s) "
+            << (g_prefetch_spaces ? "with" : "without")
+            << " space prefetch took "
+            << std::chrono::duration_cast<std::chrono::microseconds>(
+                   total_duration)
+                   .count()
+            << " us.";
+}
+
+// Exports snapshots of all shards to the --snapshot_archive file. Command
+// execution only pauses while a snapshot gets taken, which doesn't involve any
+// I/O. The archive gets written on a background thread, so the event loop keeps
+// serving commands meanwhile. At most one export runs at a time.
+class SnapshotExporter {
+ public:
+  // |snapshot_storage| holds the snapshot backends of the |num_shards| shards.
+  SnapshotExporter(CommandDispatcher* dispatcher,
+                   nvram::SnapshotStorageBackend* const* snapshot_storage,
+                   size_t num_shards,
+                   int data_dir_fd)
+      : dispatcher_(dispatcher),
+        snapshot_storage_(snapshot_storage),
+        num_shards_(num_shards),
+        data_dir_fd_(data_dir_fd) {}
+
+  ~SnapshotExporter() {
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+  // Takes a snapshot and starts writing it to the archive, unless an export is
+  // still in progress.
+  void Export() {
+    if (busy_) {
+      LOG(WARNING) << "Snapshot export already in progress, request ignored.";
+      return;
+    }
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+
+    std::unique_ptr<nvram::StorageSnapshot[]> snapshots(
+        new nvram::StorageSnapshot[num_shards_]);
+    dispatcher_->LockAllShards();
+    for (size_t i = 0; i < num_shards_; ++i) {
+      snapshot_storage_[i]->TakeSnapshot(&snapshots[i]);
+    }
+    dispatcher_->UnlockAllShards();
+
+    busy_ = true;
+    thread_ = std::thread(&SnapshotExporter::WriteArchive, this,
+                          std::move(snapshots));
+  }
+
+ private:
+  void WriteArchive(std::unique_ptr<nvram::StorageSnapshot[]> snapshots) {
+    if (nvram::ExportSnapshotArchive(data_dir_fd_, g_snapshot_archive_path,
+                                     snapshots.get(), num_shards_)) {
+      LOG(INFO) << "Exported snapshot to " << g_snapshot_archive_path << ".";
+    } else {
+      LOG(ERROR) << "Failed to export snapshot.";
+    }
+    busy_ = false;
+  }
+
+  CommandDispatcher* const dispatcher_;
+  nvram::SnapshotStorageBackend* const* const snapshot_storage_;
+  const size_t num_shards_;
+  const int data_dir_fd_;
+
+  std::atomic<bool> busy_{false};
+  std::thread thread_;
+};
+
+// Listens for incoming connections or data, accepts connections and processes
+// data as needed. Commands are processed on the calling thread, unless
+// |worker_threads| is positive, in which case a pool of worker threads of that
+// size processes commands concurrently. |batch_commands| selects batched
+// command processing. |snapshot_storage| holds the snapshot backends of the
+// shards if snapshots are enabled and is nullptr otherwise.
+int ProcessMessages(int control_socket_fd,
+                    EventLoop* event_loop,
+                    nvram::ShardedNvramManager* nvram_manager,
+                    int worker_threads,
+                    bool batch_commands,
+                    nvram::SnapshotStorageBackend* const* snapshot_storage,
+                    int data_dir_fd) {
+  if (!event_loop->Arm(control_socket_fd)) {
+    return errno;
+  }
+
+  CommandDispatcher dispatcher(nvram_manager);
+  RingRegistry rings(event_loop);
+  std::unique_ptr<WorkerPool> worker_pool;
+  std::unique_ptr<CommandBatch> batch;
+  if (worker_threads > 0) {
+    worker_pool.reset(
+        new WorkerPool(event_loop, &dispatcher, &rings, batch_commands));
+    worker_pool->Start(worker_threads);
+  } else if (batch_commands) {
+    batch.reset(new CommandBatch);
+  }
+  std::unique_ptr<SnapshotExporter> snapshot_exporter;
+  if (snapshot_storage) {
+    snapshot_exporter.reset(new SnapshotExporter(
+        &dispatcher, snapshot_storage, nvram_manager->num_shards(),
+        data_dir_fd));
+  }
+
+  int ready_fds[kMaxReadyEvents];
+  int ready_count;
+  while ((ready_count = event_loop->Wait(ready_fds, kMaxReadyEvents)) >= 0) {
+    if (g_dump_stats) {
+      g_dump_stats = 0;
+      DumpStats(&dispatcher);
+    }
+
+    if (g_export_snapshot) {
+      g_export_snapshot = 0;
+      if (snapshot_exporter) {
+        snapshot_exporter->Export();
+      } else {
+        LOG(WARNING) << "Snapshot export requested without --snapshot_archive.";
       }
     }
 
-    // Walk the connection fds backwards. This way, we can remove fds by
-    // replacing the slot with the last array element, which we have processed
-    // already.
-    for (int i = poll_fds_count - 1; i > 0; --i) {
-      if (poll_fds[i].revents & POLLIN) {
-        if (!ProcessCommand(poll_fds[i].fd, nvram_manager)) {
-          // No need to handle EINTR specially here as bionic filters it out.
-          if (close(poll_fds[i].fd)) {
-            PLOG(ERROR) << "Failed to close connection socket after error";
-          }
-          --poll_fds_count;
-          poll_fds[i] = poll_fds[poll_fds_count];
+    for (int i = 0; i < ready_count; ++i) {
+      int fd = ready_fds[i];
+      if (fd == control_socket_fd) {
+        // Accept a new connection.
+        int client_socket = accept4(control_socket_fd, NULL, 0, SOCK_CLOEXEC);
+        if (client_socket < 0) {
+          PLOG(ERROR) << "Error accepting connection";
+          return errno;
+        }
+
+        if (!SetUpClientSocket(client_socket) ||
+            !event_loop->Arm(client_socket)) {
+          CloseClientSocket(client_socket);
+        }
+        if (!event_loop->Arm(control_socket_fd)) {
+          return errno;
         }
+      } else if (worker_pool) {
+        worker_pool->Submit(fd);
+      } else {
+        ServeClient(event_loop, fd, &dispatcher, &rings, batch.get());
       }
-      poll_fds[i].revents = 0;
     }
   }
 
-  // poll error.
-  PLOG(ERROR) << "Failed to poll control socket";
+  // Event loop error.
+  PLOG(ERROR) << "Failed to wait for socket events";
   return errno;
 };
 
@@ -221,6 +1615,24 @@ int main(int argc, char** argv) {
     return errno;
   }
 
+  // Note that the handler is installed without SA_RESTART, so the signal
+  // interrupts the event loop's wait and the dump happens right away.
+  struct sigaction dump_stats_action;
+  memset(&dump_stats_action, 0, sizeof(dump_stats_action));
+  dump_stats_action.sa_handler = HandleDumpStatsSignal;
+  if (sigaction(SIGUSR1, &dump_stats_action, nullptr)) {
+    PLOG(ERROR) << "Failed to install SIGUSR1 handler";
+    return errno;
+  }
+
+  struct sigaction export_snapshot_action;
+  memset(&export_snapshot_action, 0, sizeof(export_snapshot_action));
+  export_snapshot_action.sa_handler = HandleExportSnapshotSignal;
+  if (sigaction(SIGUSR2, &export_snapshot_action, nullptr)) {
+    PLOG(ERROR) << "Failed to install SIGUSR2 handler";
+    return errno;
+  }
+
   if (!InitMinijail()) {
     LOG(ERROR) << "Failed to drop privileges.";
     return -1;
@@ -234,7 +1646,135 @@ int main(int argc, char** argv) {
   }
 
   InitStorage(data_dir_fd);
+  if (g_group_commit) {
+    InitStorageGroupCommit();
+  }
 
-  nvram::NvramManager nvram_manager;
-  return ProcessMessages(control_socket_fd, &nvram_manager);
+  std::unique_ptr<EventLoop> event_loop;
+  if (g_use_io_uring) {
+    if (!InitStorageIoUring()) {
+      LOG(WARNING) << "Falling back to synchronous storage I/O.";
+    }
+
+    std::unique_ptr<IoUringEventLoop> io_uring_event_loop(
+        new IoUringEventLoop(g_worker_threads > 0));
+    if (io_uring_event_loop->Init()) {
+      event_loop = std::move(io_uring_event_loop);
+    } else {
+      LOG(WARNING) << "Falling back to epoll for socket events.";
+    }
+  }
+
+  if (!event_loop) {
+    std::unique_ptr<EpollEventLoop> epoll_event_loop(new EpollEventLoop);
+    if (!epoll_event_loop->Init()) {
+      return errno;
+    }
+    event_loop = std::move(epoll_event_loop);
+  }
+
+  // By default, storage objects live in individual files. The log-structured
+  // backend keeps them in a single log instead, the slab backend in fixed slots
+  // of a memory-mapped file, the block backend in fixed blocks of a file or
+  // block device and the RPMB backend in an emulated RPMB partition. With
+  // multiple shards, each shard's files carry a per-shard name prefix.
+  constexpr size_t kMaxShards = nvram::ShardedNvramManager::kMaxShards;
+  nvram::storage::StorageBackend* storage[kMaxShards];
+  std::unique_ptr<nvram::storage::StorageBackend> shard_storage[kMaxShards];
+  std::unique_ptr<nvram::LogStorageBackend> log_storage;
+  std::unique_ptr<nvram::SlabStorageBackend> slab_storage;
+  std::unique_ptr<nvram::BlockStorageBackend> block_storage;
+  std::unique_ptr<nvram::RpmbEmulator> rpmb_device;
+  std::unique_ptr<nvram::RpmbStorageBackend> rpmb_storage;
+  if (g_use_log_storage) {
+    log_storage.reset(new nvram::LogStorageBackend(data_dir_fd));
+    if (!log_storage->Open()) {
+      LOG(ERROR) << "Failed to open log storage.";
+      return EIO;
+    }
+    storage[0] = log_storage.get();
+  } else if (g_use_slab_storage) {
+    slab_storage.reset(new nvram::SlabStorageBackend(data_dir_fd));
+    if (!slab_storage->Open()) {
+      LOG(ERROR) << "Failed to open slab storage.";
+      return EIO;
+    }
+    storage[0] = slab_storage.get();
+  } else if (g_block_storage_path) {
+    block_storage.reset(new nvram::BlockStorageBackend(g_block_storage_path));
+    if (!block_storage->Open()) {
+      LOG(ERROR) << "Failed to open block storage.";
+      return EIO;
+    }
+    storage[0] = block_storage.get();
+  } else if (g_use_rpmb_storage) {
+    rpmb_device.reset(new nvram::RpmbEmulator(data_dir_fd, kRpmbBlockCount));
+    rpmb_storage.reset(
+        new nvram::RpmbStorageBackend(rpmb_device.get(), data_dir_fd));
+    if (!rpmb_device->Open() || !rpmb_storage->Open()) {
+      LOG(ERROR) << "Failed to open RPMB storage.";
+      return EIO;
+    }
+    storage[0] = rpmb_storage.get();
+    g_rpmb_storage = rpmb_storage.get();
+  } else if (g_num_shards == 1) {
+    storage[0] = nvram::storage::GetDefaultStorageBackend();
+  } else {
+    for (size_t i = 0; i < g_num_shards; ++i) {
+      char name_prefix[16];
+      snprintf(name_prefix, sizeof(name_prefix), kShardFileNamePrefixPattern,
+               i);
+      shard_storage[i] = CreateFileStorageBackend(name_prefix);
+      storage[i] = shard_storage[i].get();
+    }
+  }
+
+  // Restoring an archive writes the archived objects to storage directly,
+  // before the manager loads anything.
+  if (g_import_archive_path &&
+      !nvram::ImportSnapshotArchive(data_dir_fd, g_import_archive_path, storage,
+                                    g_num_shards)) {
+    LOG(ERROR) << "Failed to import snapshot archive.";
+    return EIO;
+  }
+
+  // Snapshots need a copy-on-write mirror of each shard's objects.
+  std::unique_ptr<nvram::SnapshotStorageBackend> snapshot_storage[kMaxShards];
+  nvram::SnapshotStorageBackend* snapshot_shards[kMaxShards];
+  if (g_snapshot_archive_path) {
+    for (size_t i = 0; i < g_num_shards; ++i) {
+      snapshot_storage[i].reset(new nvram::SnapshotStorageBackend(storage[i]));
+      if (!snapshot_storage[i]->Open()) {
+        LOG(ERROR) << "Failed to load storage for snapshots.";
+        return EIO;
+      }
+      snapshot_shards[i] = snapshot_storage[i].get();
+      storage[i] = snapshot_shards[i];
+    }
+  }
+
+  nvram::ShardedNvramManager nvram_manager(storage, g_num_shards);
+
+  // Each shard records command statistics separately, as shards execute
+  // commands concurrently. The last recorder covers commands that span all
+  // shards.
+  SteadyClock clock;
+  std::unique_ptr<nvram::StatsRecorder> stats_recorders[kMaxShards + 1];
+  if (g_command_stats) {
+    for (size_t i = 0; i <= g_num_shards; ++i) {
+      stats_recorders[i].reset(new nvram::StatsRecorder(&clock));
+    }
+    for (size_t i = 0; i < g_num_shards; ++i) {
+      nvram_manager.shard(i)->set_stats_recorder(stats_recorders[i].get());
+    }
+    nvram_manager.set_stats_recorder(stats_recorders[g_num_shards].get());
+  }
+
+  if (g_warmup) {
+    WarmupShards(&nvram_manager);
+  }
+  return ProcessMessages(control_socket_fd, event_loop.get(), &nvram_manager,
+                         g_worker_threads, g_batch_commands,
+                         g_snapshot_archive_path ? snapshot_shards : nullptr,
+                         data_dir_fd);
 }
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fake_nvram_block_storage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+
+namespace nvram {
+
+BlockStorageBackend::BlockStorageBackend(const char* path)
+    : SlotStorageBackend(kBlockSize), path_(path) {}
+
+BlockStorageBackend::~BlockStorageBackend() {
+  free(buffer_);
+}
+
+bool BlockStorageBackend::Open() {
+  if (!buffer_ && posix_memalign(reinterpret_cast<void**>(&buffer_),
+                                 kBlockSize, kBlockSize)) {
+    LOG(ERROR) << "Failed to allocate I/O buffer";
+    return false;
+  }
+
+  block_device_fd_.reset(TEMP_FAILURE_RETRY(
+      open(path_.c_str(), O_RDWR | O_CREAT | O_DIRECT | O_DSYNC | O_CLOEXEC,
+           S_IRUSR | S_IWUSR)));
+  if (block_device_fd_.get() < 0) {
+    PLOG(ERROR) << "Failed to open " << path_;
+    return false;
+  }
+
+  struct stat block_device_stat;
+  if (TEMP_FAILURE_RETRY(fstat(block_device_fd_.get(), &block_device_stat))) {
+    PLOG(ERROR) << "Failed to stat " << path_;
+    return false;
+  }
+
+  if (S_ISBLK(block_device_stat.st_mode)) {
+    if (!CheckBlockDevice()) {
+      return false;
+    }
+  } else if (S_ISREG(block_device_stat.st_mode)) {
+    if (!PrepareFile(block_device_stat.st_size)) {
+      return false;
+    }
+  } else {
+    LOG(ERROR) << path_ << " is neither a file nor a block device";
+    return false;
+  }
+
+  return Scan();
+}
+
+bool BlockStorageBackend::CheckBlockDevice() {
+  int logical_block_size = 0;
+  if (ioctl(block_device_fd_.get(), BLKSSZGET, &logical_block_size)) {
+    PLOG(ERROR) << "Failed to get block size of " << path_;
+    return false;
+  }
+  if (logical_block_size <= 0 ||
+      kBlockSize % static_cast<size_t>(logical_block_size) != 0) {
+    LOG(ERROR) << "Unsupported block size " << logical_block_size << " of "
+               << path_;
+    return false;
+  }
+
+  uint64_t device_size = 0;
+  if (ioctl(block_device_fd_.get(), BLKGETSIZE64, &device_size)) {
+    PLOG(ERROR) << "Failed to get size of " << path_;
+    return false;
+  }
+  if (device_size < kRegionSize) {
+    LOG(ERROR) << path_ << " too small: " << device_size << " < "
+               << kRegionSize;
+    return false;
+  }
+
+  return true;
+}
+
+bool BlockStorageBackend::PrepareFile(off_t size) {
+  if (size >= static_cast<off_t>(kRegionSize)) {
+    return true;
+  }
+
+  // The added range reads as zeros, which leaves the copies it holds invalid.
+  // Make sure the size and the directory entry are durable before any copies
+  // get written.
+  if (TEMP_FAILURE_RETRY(
+          ftruncate(block_device_fd_.get(), static_cast<off_t>(kRegionSize))) ||
+      TEMP_FAILURE_RETRY(fsync(block_device_fd_.get()))) {
+    PLOG(ERROR) << "Failed to extend " << path_;
+    return false;
+  }
+
+  std::string dir_path = android::base::Dirname(path_);
+  android::base::unique_fd dir_fd(
+      TEMP_FAILURE_RETRY(open(dir_path.c_str(), O_RDONLY | O_DIRECTORY)));
+  if (dir_fd.get() < 0 || TEMP_FAILURE_RETRY(fsync(dir_fd.get()))) {
+    PLOG(ERROR) << "Failed to sync " << dir_path;
+    return false;
+  }
+
+  return true;
+}
+
+const uint8_t* BlockStorageBackend::FetchCopy(size_t slot, int copy) {
+  ssize_t bytes_read = TEMP_FAILURE_RETRY(pread(
+      block_device_fd_.get(), buffer_, kBlockSize, CopyOffset(slot, copy)));
+  if (bytes_read != static_cast<ssize_t>(kBlockSize)) {
+    if (bytes_read >= 0) {
+      errno = EIO;
+    }
+    PLOG(ERROR) << "Failed to read " << path_;
+    return nullptr;
+  }
+
+  return buffer_;
+}
+
+uint8_t* BlockStorageBackend::PrepareCopy(size_t /* slot */, int /* copy */) {
+  // Clear stale data, so the trailing bytes of the block are deterministic.
+  memset(buffer_, 0, kBlockSize);
+  return buffer_;
+}
+
+bool BlockStorageBackend::CommitCopy(size_t slot,
+                                     int copy,
+                                     size_t /* size */) {
+  // O_DIRECT requires writing entire blocks. O_DSYNC makes the write durable.
+  ssize_t written = TEMP_FAILURE_RETRY(pwrite(
+      block_device_fd_.get(), buffer_, kBlockSize, CopyOffset(slot, copy)));
+  if (written != static_cast<ssize_t>(kBlockSize)) {
+    if (written >= 0) {
+      errno = EIO;
+    }
+    PLOG(ERROR) << "Failed to write " << path_;
+    return false;
+  }
+
+  return true;
+}
+
+size_t BlockStorageBackend::LoadSize(uint32_t /* size */) const {
+  return kBlockSize - kCopyHeaderSize;
+}
+
+off_t BlockStorageBackend::CopyOffset(size_t slot, int copy) {
+  return static_cast<off_t>((2 * slot + copy) * kBlockSize);
+}
+
+}  // namespace nvram
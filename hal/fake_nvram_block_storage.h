@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NVRAM_HAL_FAKE_NVRAM_BLOCK_STORAGE_H_
+#define NVRAM_HAL_FAKE_NVRAM_BLOCK_STORAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#include <android-base/unique_fd.h>
+
+#include "fake_nvram_slot_storage.h"
+
+namespace nvram {
+
+// A slot storage backend that keeps each copy in its own block of a file or a
+// block device, such as a raw partition or a loop device. All I/O bypasses the
+// page cache via O_DIRECT and happens at block granularity, i.e. loads return
+// the entire block, including trailing bytes beyond the stored object. Writes
+// use O_DSYNC, so each block write is durable on return, which block devices
+// implement as a single FUA write where supported.
+//
+// This mirrors storage systems that only provide block-granular I/O. Like the
+// file-per-object storage, it does not meet the tamper evidence requirements
+// for access-controlled NVRAM. Calls must be serialized by the caller.
+class BlockStorageBackend : public SlotStorageBackend {
+ public:
+  // Keeps the slots at the start of the file or block device at |path|.
+  explicit BlockStorageBackend(const char* path);
+  ~BlockStorageBackend() override;
+
+  // Opens the file or block device, creating and sizing the file if necessary,
+  // and determines the current copy of each slot. Returns true if successful.
+  bool Open();
+
+ protected:
+  // SlotStorageBackend:
+  const uint8_t* FetchCopy(size_t slot, int copy) override;
+  uint8_t* PrepareCopy(size_t slot, int copy) override;
+  bool CommitCopy(size_t slot, int copy, size_t size) override;
+  size_t LoadSize(uint32_t size) const override;
+
+ private:
+  // Size of each copy, which is also the I/O size and alignment. This is a
+  // multiple of the logical block size of common devices.
+  static constexpr size_t kBlockSize = 4096;
+
+  // Size of the region holding the slots.
+  static constexpr size_t kRegionSize = 2 * kNumSlots * kBlockSize;
+
+  // Checks that the block device behind |block_device_fd_| is suitable.
+  bool CheckBlockDevice();
+
+  // Extends the file behind |block_device_fd_| to hold all slots.
+  bool PrepareFile(off_t size);
+
+  // Returns the offset of copy |copy| of slot |slot|.
+  static off_t CopyOffset(size_t slot, int copy);
+
+  const std::string path_;
+  android::base::unique_fd block_device_fd_;
+
+  // Block-aligned I/O buffer as required by O_DIRECT.
+  uint8_t* buffer_ = nullptr;
+};
+
+}  // namespace nvram
+
+#endif  // NVRAM_HAL_FAKE_NVRAM_BLOCK_STORAGE_H_
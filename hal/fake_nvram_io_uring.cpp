@@ -0,0 +1,216 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fake_nvram_io_uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <android-base/logging.h>
+
+namespace nvram {
+namespace {
+
+// Number of operation slots to query when probing for supported operations.
+constexpr unsigned kProbeOps = 256;
+
+int IoUringSetup(unsigned entries, struct io_uring_params* params) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int IoUringEnter(int ring_fd,
+                 unsigned to_submit,
+                 unsigned min_complete,
+                 unsigned flags) {
+  return static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                                  min_complete, flags, nullptr, 0));
+}
+
+int IoUringRegister(int ring_fd, unsigned opcode, void* arg, unsigned nr_args) {
+  return static_cast<int>(
+      syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args));
+}
+
+// Maps the ring region at |offset| of |ring_fd|. Returns nullptr on failure.
+void* MapRing(int ring_fd, size_t size, off_t offset) {
+  void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+  return ptr == MAP_FAILED ? nullptr : ptr;
+}
+
+template <typename T>
+T* RingField(void* ring, uint32_t offset) {
+  return reinterpret_cast<T*>(static_cast<uint8_t*>(ring) + offset);
+}
+
+}  // namespace
+
+IoUring::~IoUring() {
+  if (sqes_) {
+    munmap(sqes_, sqes_size_);
+  }
+  if (cq_ring_) {
+    munmap(cq_ring_, cq_ring_size_);
+  }
+  if (sq_ring_) {
+    munmap(sq_ring_, sq_ring_size_);
+  }
+  if (ring_fd_ != -1) {
+    close(ring_fd_);
+  }
+}
+
+bool IoUring::Init(unsigned entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring_fd_ = IoUringSetup(entries, &params);
+  if (ring_fd_ < 0) {
+    PLOG(WARNING) << "Failed to set up io_uring";
+    ring_fd_ = -1;
+    return false;
+  }
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  sq_ring_ = MapRing(ring_fd_, sq_ring_size_, IORING_OFF_SQ_RING);
+  cq_ring_ = MapRing(ring_fd_, cq_ring_size_, IORING_OFF_CQ_RING);
+  sqes_ = static_cast<struct io_uring_sqe*>(
+      MapRing(ring_fd_, sqes_size_, IORING_OFF_SQES));
+  if (!sq_ring_ || !cq_ring_ || !sqes_) {
+    PLOG(WARNING) << "Failed to map io_uring buffers";
+    return false;
+  }
+
+  sq_head_ = RingField<unsigned>(sq_ring_, params.sq_off.head);
+  sq_tail_ = RingField<unsigned>(sq_ring_, params.sq_off.tail);
+  sq_mask_ = *RingField<unsigned>(sq_ring_, params.sq_off.ring_mask);
+  sq_entries_ = *RingField<unsigned>(sq_ring_, params.sq_off.ring_entries);
+  sq_array_ = RingField<unsigned>(sq_ring_, params.sq_off.array);
+  cq_head_ = RingField<unsigned>(cq_ring_, params.cq_off.head);
+  cq_tail_ = RingField<unsigned>(cq_ring_, params.cq_off.tail);
+  cq_mask_ = *RingField<unsigned>(cq_ring_, params.cq_off.ring_mask);
+  cqes_ = RingField<struct io_uring_cqe>(cq_ring_, params.cq_off.cqes);
+
+  // Find out which operations the kernel supports. Kernels that predate
+  // probing only support the basic I/O operations, which is what the
+  // |supported_ops_| default reflects.
+  size_t probe_size =
+      sizeof(struct io_uring_probe) + kProbeOps * sizeof(io_uring_probe_op);
+  struct io_uring_probe* probe =
+      static_cast<struct io_uring_probe*>(calloc(1, probe_size));
+  if (probe &&
+      IoUringRegister(ring_fd_, IORING_REGISTER_PROBE, probe, kProbeOps) == 0) {
+    for (unsigned i = 0; i < probe->ops_len && i < kProbeOps; ++i) {
+      if (probe->ops[i].flags & IO_URING_OP_SUPPORTED) {
+        supported_ops_.set(probe->ops[i].op);
+      }
+    }
+  } else {
+    supported_ops_.set(IORING_OP_NOP);
+    supported_ops_.set(IORING_OP_READV);
+    supported_ops_.set(IORING_OP_WRITEV);
+    supported_ops_.set(IORING_OP_FSYNC);
+    supported_ops_.set(IORING_OP_POLL_ADD);
+  }
+  free(probe);
+
+  return true;
+}
+
+struct io_uring_sqe* IoUring::GetSqe() {
+  unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  unsigned tail = *sq_tail_ + pending_;
+  if (tail - head >= sq_entries_) {
+    return nullptr;
+  }
+
+  unsigned slot = tail & sq_mask_;
+  struct io_uring_sqe* sqe = &sqes_[slot];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array_[slot] = slot;
+  ++pending_;
+  return sqe;
+}
+
+bool IoUring::Submit(unsigned wait_count) {
+  unsigned to_submit = pending_;
+  if (to_submit) {
+    // Publish the new entries to the kernel.
+    __atomic_store_n(sq_tail_, *sq_tail_ + to_submit, __ATOMIC_RELEASE);
+    pending_ = 0;
+  }
+
+  if (to_submit == 0 && wait_count == 0) {
+    return true;
+  }
+
+  unsigned flags = wait_count ? IORING_ENTER_GETEVENTS : 0;
+  while (true) {
+    int rc = IoUringEnter(ring_fd_, to_submit, wait_count, flags);
+    if (rc >= 0) {
+      // Entries that the kernel didn't consume are still in the ring and will
+      // be picked up by the next call.
+      to_submit -= static_cast<unsigned>(rc);
+      if (to_submit == 0) {
+        return true;
+      }
+      continue;
+    }
+    if (errno == EINTR) {
+      if (to_submit == 0) {
+        return true;
+      }
+      continue;
+    }
+    PLOG(ERROR) << "Failed to submit io_uring entries";
+    return false;
+  }
+}
+
+bool IoUring::Wait(unsigned wait_count) {
+  if (IoUringEnter(ring_fd_, 0, wait_count, IORING_ENTER_GETEVENTS) < 0 &&
+      errno != EINTR) {
+    PLOG(ERROR) << "Failed to wait for io_uring completions";
+    return false;
+  }
+  return true;
+}
+
+unsigned IoUring::Unconsumed() const {
+  return *sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+}
+
+bool IoUring::PopCompletion(uint64_t* user_data, int32_t* result) {
+  unsigned head = *cq_head_;
+  if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+
+  const struct io_uring_cqe& cqe = cqes_[head & cq_mask_];
+  *user_data = cqe.user_data;
+  *result = cqe.res;
+  __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+}  // namespace nvram
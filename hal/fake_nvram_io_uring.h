@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NVRAM_HAL_FAKE_NVRAM_IO_URING_H_
+#define NVRAM_HAL_FAKE_NVRAM_IO_URING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/io_uring.h>
+
+#include <bitset>
+
+namespace nvram {
+
+// A minimal wrapper around the raw io_uring system call interface, providing
+// just what the fake NVRAM daemon needs: queueing submission queue entries,
+// submitting them and reaping completions.
+//
+// This class is not thread-safe. Callers that share an |IoUring| between
+// threads must serialize access to the submission queue. The completion queue
+// may only be consumed by a single thread.
+class IoUring {
+ public:
+  IoUring() = default;
+  ~IoUring();
+
+  IoUring(const IoUring&) = delete;
+  IoUring& operator=(const IoUring&) = delete;
+
+  // Sets up a ring with at least |entries| submission queue slots. Returns
+  // false if the kernel doesn't support io_uring or setup fails otherwise.
+  bool Init(unsigned entries);
+
+  // Whether the kernel supports operations of type |opcode|.
+  bool IsSupported(uint8_t opcode) const { return supported_ops_[opcode]; }
+
+  // Returns a cleared submission queue entry to be filled in by the caller, or
+  // nullptr if the submission queue is full. Entries become visible to the
+  // kernel on the next call to |Submit()|.
+  struct io_uring_sqe* GetSqe();
+
+  // Submits all queued entries to the kernel and waits for at least
+  // |wait_count| completions to become available. Returns true if successful.
+  bool Submit(unsigned wait_count);
+
+  // Waits for at least |wait_count| completions to become available, without
+  // submitting any queued entries. Unlike the other member functions, this may
+  // be called while another thread queues and submits entries. Returns true if
+  // successful or interrupted by a signal.
+  bool Wait(unsigned wait_count);
+
+  // Returns the number of submitted entries the kernel hasn't consumed yet.
+  // These stay in the submission queue until the next call to |Submit()|.
+  unsigned Unconsumed() const;
+
+  // Retrieves the next completion. Returns false if there are no completions
+  // available.
+  bool PopCompletion(uint64_t* user_data, int32_t* result);
+
+ private:
+  int ring_fd_ = -1;
+
+  // Memory mappings of the shared ring buffers.
+  void* sq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  void* cq_ring_ = nullptr;
+  size_t cq_ring_size_ = 0;
+  struct io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+
+  // Pointers to the ring header fields, which live in shared memory.
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned* sq_array_ = nullptr;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  struct io_uring_cqe* cqes_ = nullptr;
+
+  // Number of entries handed out by |GetSqe()| but not yet submitted.
+  unsigned pending_ = 0;
+
+  std::bitset<256> supported_ops_;
+};
+
+}  // namespace nvram
+
+#endif  // NVRAM_HAL_FAKE_NVRAM_IO_URING_H_
@@ -0,0 +1,418 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fake_nvram_log_storage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <utility>
+
+#include <android-base/logging.h>
+
+#include "fake_nvram_record.h"
+
+namespace nvram {
+namespace {
+
+// Name of the log file in the data directory.
+constexpr char kLogFileName[] = "log";
+
+// Name of the file a compacted log is written to before it replaces the log.
+constexpr char kCompactLogFileName[] = "log.compact";
+
+// Name under which the log is kept while a compacted log replaces it, so it can
+// be restored if the replacement doesn't become durable.
+constexpr char kPreviousLogFileName[] = "log.previous";
+
+// Marks the start of each record. "NVLG" in little-endian byte order.
+constexpr uint32_t kRecordMagic = 0x474c564e;
+
+// Record header layout. All fields are little-endian. The CRC covers the
+// header fields preceding it followed by the record data.
+constexpr size_t kRecordMagicOffset = 0;
+constexpr size_t kRecordTypeOffset = 4;
+constexpr size_t kRecordIndexOffset = 8;
+constexpr size_t kRecordSizeOffset = 12;
+constexpr size_t kRecordCrcOffset = 16;
+constexpr size_t kRecordHeaderSize = 20;
+
+// Maximum size of objects we're willing to read and write.
+constexpr uint32_t kMaxObjectSize = 2048;
+
+// The log doesn't get compacted before reaching this size.
+constexpr off_t kCompactionMinSize = 64 * 1024;
+
+// Compaction kicks in once the log exceeds the size of the live records by this
+// factor.
+constexpr off_t kCompactionRatio = 4;
+
+// Total size of a record holding |size| bytes of data.
+off_t RecordSize(uint32_t size) {
+  return static_cast<off_t>(kRecordHeaderSize + size);
+}
+
+}  // namespace
+
+LogStorageBackend::LogStorageBackend(int data_dir_fd)
+    : data_dir_fd_(data_dir_fd) {}
+
+bool LogStorageBackend::Open() {
+  // A compacted log that didn't make it into place is of no use.
+  if (TEMP_FAILURE_RETRY(unlinkat(data_dir_fd_, kCompactLogFileName, 0)) &&
+      errno != ENOENT) {
+    PLOG(WARNING) << "Failed to remove " << kCompactLogFileName;
+  }
+  if (TEMP_FAILURE_RETRY(unlinkat(data_dir_fd_, kPreviousLogFileName, 0)) &&
+      errno != ENOENT) {
+    PLOG(WARNING) << "Failed to remove " << kPreviousLogFileName;
+  }
+
+  log_fd_.reset(TEMP_FAILURE_RETRY(
+      openat(data_dir_fd_, kLogFileName, O_RDWR | O_CLOEXEC)));
+  if (log_fd_.get() < 0 && errno == ENOENT) {
+    log_fd_.reset(TEMP_FAILURE_RETRY(
+        openat(data_dir_fd_, kLogFileName,
+               O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR)));
+    // Make sure the new log's directory entry is durable. Later records only
+    // require syncing the log file itself.
+    if (log_fd_.get() >= 0 && TEMP_FAILURE_RETRY(fsync(data_dir_fd_))) {
+      PLOG(ERROR) << "Failed to sync data directory";
+      return false;
+    }
+  }
+  if (log_fd_.get() < 0) {
+    PLOG(ERROR) << "Failed to open " << kLogFileName;
+    return false;
+  }
+
+  return Replay();
+}
+
+storage::Status LogStorageBackend::LoadHeader(Blob* blob) {
+  if (!has_header_) {
+    return storage::Status::kNotFound;
+  }
+  return Load(header_, blob);
+}
+
+storage::Status LogStorageBackend::StoreHeader(const Blob& blob) {
+  return Append(RecordType::kStoreHeader, 0, &blob);
+}
+
+storage::Status LogStorageBackend::LoadSpace(uint32_t index, Blob* blob) {
+  auto entry = spaces_.find(index);
+  if (entry == spaces_.end()) {
+    return storage::Status::kNotFound;
+  }
+  return Load(entry->second, blob);
+}
+
+storage::Status LogStorageBackend::StoreSpace(uint32_t index,
+                                              const Blob& blob) {
+  return Append(RecordType::kStoreSpace, index, &blob);
+}
+
+storage::Status LogStorageBackend::DeleteSpace(uint32_t index) {
+  if (spaces_.find(index) == spaces_.end()) {
+    return storage::Status::kNotFound;
+  }
+  return Append(RecordType::kDeleteSpace, index, nullptr);
+}
+
+void LogStorageBackend::EncodeRecord(RecordType type,
+                                     uint32_t index,
+                                     const uint8_t* data,
+                                     uint32_t size) {
+  record_buffer_.resize(kRecordHeaderSize + size);
+  uint8_t* record = record_buffer_.data();
+  memset(record, 0, kRecordHeaderSize);
+  PutUint32(record + kRecordMagicOffset, kRecordMagic);
+  record[kRecordTypeOffset] = static_cast<uint8_t>(type);
+  PutUint32(record + kRecordIndexOffset, index);
+  PutUint32(record + kRecordSizeOffset, size);
+  if (size > 0) {
+    memcpy(record + kRecordHeaderSize, data, size);
+  }
+  uint32_t crc = Crc32(0, record, kRecordCrcOffset);
+  crc = Crc32(crc, record + kRecordHeaderSize, size);
+  PutUint32(record + kRecordCrcOffset, crc);
+}
+
+storage::Status LogStorageBackend::Append(RecordType type,
+                                          uint32_t index,
+                                          const Blob* blob) {
+  uint32_t size = blob ? static_cast<uint32_t>(blob->size()) : 0;
+  if (blob && blob->size() > kMaxObjectSize) {
+    LOG(ERROR) << "Object too large for log: " << blob->size();
+    return storage::Status::kStorageError;
+  }
+
+  EncodeRecord(type, index, blob ? blob->data() : nullptr, size);
+  ssize_t written = TEMP_FAILURE_RETRY(pwrite(
+      log_fd_.get(), record_buffer_.data(), record_buffer_.size(), log_size_));
+  if (written != static_cast<ssize_t>(record_buffer_.size())) {
+    if (written >= 0) {
+      errno = EIO;
+    }
+    PLOG(ERROR) << "Failed to append to " << kLogFileName;
+    // Drop the partial record, so it can't get in the way of later records.
+    TEMP_FAILURE_RETRY(ftruncate(log_fd_.get(), log_size_));
+    return storage::Status::kStorageError;
+  }
+
+  // This is the only sync per mutation. It also covers the file size change.
+  if (TEMP_FAILURE_RETRY(fdatasync(log_fd_.get()))) {
+    PLOG(ERROR) << "Failed to sync " << kLogFileName;
+    TEMP_FAILURE_RETRY(ftruncate(log_fd_.get(), log_size_));
+    return storage::Status::kStorageError;
+  }
+
+  Entry new_entry;
+  new_entry.offset = log_size_ + kRecordHeaderSize;
+  new_entry.size = size;
+  log_size_ += RecordSize(size);
+  ApplyRecord(type, index, new_entry);
+
+  MaybeCompact();
+  return storage::Status::kSuccess;
+}
+
+storage::Status LogStorageBackend::Load(const Entry& entry, Blob* blob) {
+  if (!blob->Resize(entry.size)) {
+    LOG(ERROR) << "Failed to allocate read buffer";
+    return storage::Status::kStorageError;
+  }
+
+  ssize_t bytes_read = TEMP_FAILURE_RETRY(
+      pread(log_fd_.get(), blob->data(), entry.size, entry.offset));
+  if (bytes_read != static_cast<ssize_t>(entry.size)) {
+    if (bytes_read >= 0) {
+      errno = EIO;
+    }
+    PLOG(ERROR) << "Failed to read " << kLogFileName;
+    return storage::Status::kStorageError;
+  }
+
+  return storage::Status::kSuccess;
+}
+
+bool LogStorageBackend::Replay() {
+  struct stat log_stat;
+  if (TEMP_FAILURE_RETRY(fstat(log_fd_.get(), &log_stat))) {
+    PLOG(ERROR) << "Failed to stat " << kLogFileName;
+    return false;
+  }
+
+  std::vector<uint8_t> contents(log_stat.st_size);
+  ssize_t bytes_read = TEMP_FAILURE_RETRY(
+      pread(log_fd_.get(), contents.data(), contents.size(), 0));
+  if (bytes_read != static_cast<ssize_t>(contents.size())) {
+    PLOG(ERROR) << "Failed to read " << kLogFileName;
+    return false;
+  }
+
+  has_header_ = false;
+  spaces_.clear();
+  live_size_ = 0;
+
+  size_t offset = 0;
+  while (contents.size() - offset >= kRecordHeaderSize) {
+    const uint8_t* record = contents.data() + offset;
+    uint32_t type = record[kRecordTypeOffset];
+    uint32_t size = GetUint32(record + kRecordSizeOffset);
+    if (GetUint32(record + kRecordMagicOffset) != kRecordMagic ||
+        type < static_cast<uint32_t>(RecordType::kStoreHeader) ||
+        type > static_cast<uint32_t>(RecordType::kDeleteSpace) ||
+        size > kMaxObjectSize ||
+        size > contents.size() - offset - kRecordHeaderSize) {
+      break;
+    }
+
+    uint32_t crc = Crc32(0, record, kRecordCrcOffset);
+    crc = Crc32(crc, record + kRecordHeaderSize, size);
+    if (crc != GetUint32(record + kRecordCrcOffset)) {
+      break;
+    }
+
+    Entry entry;
+    entry.offset = static_cast<off_t>(offset + kRecordHeaderSize);
+    entry.size = size;
+    ApplyRecord(static_cast<RecordType>(type),
+                GetUint32(record + kRecordIndexOffset), entry);
+    offset += kRecordHeaderSize + size;
+  }
+
+  log_size_ = static_cast<off_t>(offset);
+  if (offset < contents.size()) {
+    // The remainder is a record that got torn by a crash while it was being
+    // appended. Remove it, so new records directly follow the intact ones.
+    LOG(WARNING) << "Discarding " << contents.size() - offset
+                 << " bytes of incomplete records from " << kLogFileName;
+    if (TEMP_FAILURE_RETRY(ftruncate(log_fd_.get(), log_size_)) ||
+        TEMP_FAILURE_RETRY(fdatasync(log_fd_.get()))) {
+      PLOG(ERROR) << "Failed to truncate " << kLogFileName;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void LogStorageBackend::ApplyRecord(RecordType type,
+                                    uint32_t index,
+                                    const Entry& entry) {
+  switch (type) {
+    case RecordType::kStoreHeader:
+      if (has_header_) {
+        live_size_ -= RecordSize(header_.size);
+      }
+      has_header_ = true;
+      header_ = entry;
+      live_size_ += RecordSize(entry.size);
+      break;
+    case RecordType::kStoreSpace: {
+      auto result = spaces_.emplace(index, entry);
+      if (!result.second) {
+        live_size_ -= RecordSize(result.first->second.size);
+        result.first->second = entry;
+      }
+      live_size_ += RecordSize(entry.size);
+      break;
+    }
+    case RecordType::kDeleteSpace: {
+      auto existing = spaces_.find(index);
+      if (existing != spaces_.end()) {
+        live_size_ -= RecordSize(existing->second.size);
+        spaces_.erase(existing);
+      }
+      break;
+    }
+  }
+}
+
+void LogStorageBackend::MaybeCompact() {
+  if (log_size_ < kCompactionMinSize ||
+      log_size_ < kCompactionRatio * live_size_) {
+    return;
+  }
+
+  // The log remains valid if compaction fails, it just keeps growing until the
+  // next attempt.
+  if (!Compact()) {
+    LOG(WARNING) << "Failed to compact " << kLogFileName;
+  }
+}
+
+bool LogStorageBackend::Compact() {
+  android::base::unique_fd compact_fd(TEMP_FAILURE_RETRY(
+      openat(data_dir_fd_, kCompactLogFileName,
+             O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR)));
+  if (compact_fd.get() < 0) {
+    PLOG(ERROR) << "Failed to open " << kCompactLogFileName;
+    return false;
+  }
+
+  off_t compact_size = 0;
+  Blob data;
+  auto copy_record = [&](RecordType type, uint32_t index, Entry* entry) {
+    if (Load(*entry, &data) != storage::Status::kSuccess) {
+      return false;
+    }
+    EncodeRecord(type, index, data.data(), entry->size);
+    ssize_t written =
+        TEMP_FAILURE_RETRY(pwrite(compact_fd.get(), record_buffer_.data(),
+                                  record_buffer_.size(), compact_size));
+    if (written != static_cast<ssize_t>(record_buffer_.size())) {
+      PLOG(ERROR) << "Failed to write " << kCompactLogFileName;
+      return false;
+    }
+    entry->offset = compact_size + kRecordHeaderSize;
+    compact_size += RecordSize(entry->size);
+    return true;
+  };
+
+  // Copy the live records, tracking their new locations.
+  Entry header = header_;
+  std::unordered_map<uint32_t, Entry> spaces = spaces_;
+  bool success = !has_header_ ||
+                 copy_record(RecordType::kStoreHeader, 0, &header);
+  for (auto& space : spaces) {
+    if (!success) {
+      break;
+    }
+    success = copy_record(RecordType::kStoreSpace, space.first, &space.second);
+  }
+
+  if (!success || TEMP_FAILURE_RETRY(fdatasync(compact_fd.get()))) {
+    PLOG(ERROR) << "Failed to write compacted log";
+    TEMP_FAILURE_RETRY(unlinkat(data_dir_fd_, kCompactLogFileName, 0));
+    return false;
+  }
+
+  // Keep the current log reachable until the compacted log is durably in
+  // place, so appends can continue on it if that fails.
+  TEMP_FAILURE_RETRY(unlinkat(data_dir_fd_, kPreviousLogFileName, 0));
+  if (TEMP_FAILURE_RETRY(linkat(data_dir_fd_, kLogFileName, data_dir_fd_,
+                                kPreviousLogFileName, 0))) {
+    PLOG(ERROR) << "Failed to link " << kLogFileName << " to "
+                << kPreviousLogFileName;
+    TEMP_FAILURE_RETRY(unlinkat(data_dir_fd_, kCompactLogFileName, 0));
+    return false;
+  }
+
+  if (TEMP_FAILURE_RETRY(renameat(data_dir_fd_, kCompactLogFileName,
+                                  data_dir_fd_, kLogFileName))) {
+    PLOG(ERROR) << "Failed to move " << kCompactLogFileName << " to "
+                << kLogFileName;
+    TEMP_FAILURE_RETRY(unlinkat(data_dir_fd_, kCompactLogFileName, 0));
+    TEMP_FAILURE_RETRY(unlinkat(data_dir_fd_, kPreviousLogFileName, 0));
+    return false;
+  }
+
+  // Records may only be appended to the compacted log once its directory entry
+  // is durable, otherwise they might get lost along with the rename. The old
+  // and the compacted log hold the same objects, so either one is fine to
+  // recover from until then.
+  bool synced = TEMP_FAILURE_RETRY(fsync(data_dir_fd_)) == 0;
+  if (!synced) {
+    PLOG(ERROR) << "Failed to sync data directory";
+    if (TEMP_FAILURE_RETRY(renameat(data_dir_fd_, kPreviousLogFileName,
+                                    data_dir_fd_, kLogFileName)) == 0) {
+      return false;
+    }
+    // The log file name still refers to the compacted log, so that's the one
+    // to append to.
+    PLOG(ERROR) << "Failed to restore " << kLogFileName;
+  }
+
+  log_fd_ = std::move(compact_fd);
+  log_size_ = compact_size;
+  live_size_ = compact_size;
+  header_ = header;
+  spaces_ = std::move(spaces);
+
+  if (TEMP_FAILURE_RETRY(unlinkat(data_dir_fd_, kPreviousLogFileName, 0))) {
+    PLOG(WARNING) << "Failed to remove " << kPreviousLogFileName;
+  }
+
+  return synced;
+}
+
+}  // namespace nvram
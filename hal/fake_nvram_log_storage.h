@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NVRAM_HAL_FAKE_NVRAM_LOG_STORAGE_H_
+#define NVRAM_HAL_FAKE_NVRAM_LOG_STORAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+
+#include <nvram/core/storage.h>
+
+namespace nvram {
+
+// A storage backend that keeps all storage objects in a single append-only log
+// file in the data directory.
+//
+// Each store or delete appends one record to the log and makes it durable with
+// a single fdatasync(). Records carry a CRC32 over their contents, so a record
+// torn by a crash is detected when the log gets replayed on open, and the log
+// is truncated back to the last intact record. This provides the atomicity the
+// storage interface requires: the previous version of an object remains in the
+// log until a newer record for it is complete.
+//
+// An in-memory index maps each live object to its latest record. Once the log
+// has grown well beyond the size of the live data, it is compacted by writing
+// the live records to a new file which then replaces the log.
+//
+// Like the file-per-object storage, this does not meet the tamper evidence
+// requirements for access-controlled NVRAM. Calls must be serialized by the
+// caller.
+class LogStorageBackend : public storage::StorageBackend {
+ public:
+  // Keeps the log in the directory |data_dir_fd|, which must remain open for
+  // the lifetime of the backend.
+  explicit LogStorageBackend(int data_dir_fd);
+  ~LogStorageBackend() override = default;
+
+  // Opens the log, creating it if necessary, and rebuilds the index from it.
+  // Returns true if successful.
+  bool Open();
+
+  // StorageBackend:
+  storage::Status LoadHeader(Blob* blob) override;
+  storage::Status StoreHeader(const Blob& blob) override;
+  storage::Status LoadSpace(uint32_t index, Blob* blob) override;
+  storage::Status StoreSpace(uint32_t index, const Blob& blob) override;
+  storage::Status DeleteSpace(uint32_t index) override;
+
+ private:
+  enum class RecordType : uint8_t {
+    kStoreHeader = 1,
+    kStoreSpace = 2,
+    kDeleteSpace = 3,
+  };
+
+  // Location of an object's data within the log.
+  struct Entry {
+    off_t offset = 0;
+    uint32_t size = 0;
+  };
+
+  // Encodes a record into |record_buffer_|.
+  void EncodeRecord(RecordType type,
+                    uint32_t index,
+                    const uint8_t* data,
+                    uint32_t size);
+
+  // Appends a record holding |blob|, if present, to the log, syncs it and
+  // updates the index.
+  storage::Status Append(RecordType type, uint32_t index, const Blob* blob);
+
+  // Reads the data at |entry| into |blob|.
+  storage::Status Load(const Entry& entry, Blob* blob);
+
+  // Rebuilds the index from the log contents and truncates any torn records
+  // at the end. Returns true if successful.
+  bool Replay();
+
+  // Applies a replayed or appended record to the index.
+  void ApplyRecord(RecordType type, uint32_t index, const Entry& entry);
+
+  // Compacts the log if it mostly consists of stale records.
+  void MaybeCompact();
+
+  // Writes the live records to a new log and replaces the current log with it.
+  // Returns true if successful. Leaves the current log in place on failure,
+  // unless the replacement already happened but couldn't be made durable or
+  // undone, in which case appends continue on the new log.
+  bool Compact();
+
+  const int data_dir_fd_;
+  android::base::unique_fd log_fd_;
+
+  // Size of the intact log prefix, i.e. the offset for the next record.
+  off_t log_size_ = 0;
+
+  // Total size of the records referenced by the index.
+  off_t live_size_ = 0;
+
+  bool has_header_ = false;
+  Entry header_;
+  std::unordered_map<uint32_t, Entry> spaces_;
+
+  // Buffer for encoding records, kept around across writes.
+  std::vector<uint8_t> record_buffer_;
+};
+
+}  // namespace nvram
+
+#endif  // NVRAM_HAL_FAKE_NVRAM_LOG_STORAGE_H_
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fake_nvram_record.h"
+
+namespace nvram {
+namespace {
+
+// Lookup table for the reflected CRC-32 polynomial.
+class Crc32Table {
+ public:
+  Crc32Table() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t value = i;
+      for (int bit = 0; bit < 8; ++bit) {
+        value = (value & 1) ? (value >> 1) ^ 0xedb88320 : value >> 1;
+      }
+      table_[i] = value;
+    }
+  }
+
+  uint32_t operator[](size_t i) const { return table_[i]; }
+
+ private:
+  uint32_t table_[256];
+};
+
+}  // namespace
+
+uint32_t Crc32(uint32_t crc, const uint8_t* data, size_t size) {
+  static const Crc32Table table;
+  crc = ~crc;
+  for (size_t i = 0; i < size; ++i) {
+    crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+}  // namespace nvram
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NVRAM_HAL_FAKE_NVRAM_RECORD_H_
+#define NVRAM_HAL_FAKE_NVRAM_RECORD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Helpers for encoding the records of the fake NVRAM storage backends that
+// keep several storage objects in one file.
+
+namespace nvram {
+
+// Stores |value| at |buffer| in little-endian byte order.
+inline void PutUint32(uint8_t* buffer, uint32_t value) {
+  buffer[0] = static_cast<uint8_t>(value);
+  buffer[1] = static_cast<uint8_t>(value >> 8);
+  buffer[2] = static_cast<uint8_t>(value >> 16);
+  buffer[3] = static_cast<uint8_t>(value >> 24);
+}
+
+// Loads a little-endian value from |buffer|.
+inline uint32_t GetUint32(const uint8_t* buffer) {
+  return static_cast<uint32_t>(buffer[0]) |
+         (static_cast<uint32_t>(buffer[1]) << 8) |
+         (static_cast<uint32_t>(buffer[2]) << 16) |
+         (static_cast<uint32_t>(buffer[3]) << 24);
+}
+
+// Extends |crc| over |size| bytes at |data|, using the reflected CRC-32
+// polynomial used by zlib and others. Start with a |crc| of 0.
+uint32_t Crc32(uint32_t crc, const uint8_t* data, size_t size);
+
+}  // namespace nvram
+
+#endif  // NVRAM_HAL_FAKE_NVRAM_RECORD_H_
@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fake_nvram_ring.h"
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nvram/messages/io.h>
+#include <nvram/messages/nvram_messages.h>
+
+namespace nvram {
+namespace {
+
+// Size of the length field preceding each message.
+constexpr uint32_t kLengthSize = sizeof(uint32_t);
+
+// Returns the number of ring bytes occupied by a message of |size| bytes.
+uint32_t RecordSize(uint32_t size) {
+  return (kLengthSize + size + 3) & ~3U;
+}
+
+// An |InputStreamBuffer| reading a message from a ring buffer. The message
+// occupies at most two windows, the second one starting at the beginning of the
+// buffer if the message wraps around.
+class RingInputStreamBuffer : public InputStreamBuffer {
+ public:
+  RingInputStreamBuffer(const uint8_t* data,
+                        uint32_t capacity,
+                        uint32_t offset,
+                        uint32_t size)
+      : wrap_start_(data) {
+    uint32_t first = size < capacity - offset ? size : capacity - offset;
+    pos_ = data + offset;
+    end_ = pos_ + first;
+    wrap_size_ = size - first;
+  }
+
+ protected:
+  // InputStreamBuffer:
+  bool Advance() override {
+    if (wrap_size_ == 0) {
+      return false;
+    }
+    pos_ = wrap_start_;
+    end_ = wrap_start_ + wrap_size_;
+    wrap_size_ = 0;
+    return true;
+  }
+
+ private:
+  const uint8_t* wrap_start_;
+  uint32_t wrap_size_;
+};
+
+// The output counterpart to |RingInputStreamBuffer|.
+class RingOutputStreamBuffer : public OutputStreamBuffer {
+ public:
+  RingOutputStreamBuffer(uint8_t* data,
+                         uint32_t capacity,
+                         uint32_t offset,
+                         uint32_t size)
+      : wrap_start_(data) {
+    uint32_t first = size < capacity - offset ? size : capacity - offset;
+    pos_ = data + offset;
+    end_ = pos_ + first;
+    wrap_size_ = size - first;
+  }
+
+ protected:
+  // OutputStreamBuffer:
+  bool Advance() override {
+    if (wrap_size_ == 0) {
+      return false;
+    }
+    pos_ = wrap_start_;
+    end_ = wrap_start_ + wrap_size_;
+    wrap_size_ = 0;
+    return true;
+  }
+
+ private:
+  uint8_t* wrap_start_;
+  uint32_t wrap_size_;
+};
+
+}  // namespace
+
+bool SharedRing::Empty() const {
+  return indices_->head.load(std::memory_order_relaxed) ==
+         indices_->tail.load(std::memory_order_acquire);
+}
+
+template <typename Message>
+bool SharedRing::Write(const Message& msg) {
+  size_t size = GetEncodedSize(msg);
+  if (size > capacity_ - kLengthSize) {
+    return false;
+  }
+  uint32_t record_size = RecordSize(static_cast<uint32_t>(size));
+
+  uint32_t head = indices_->head.load(std::memory_order_acquire);
+  uint32_t tail = indices_->tail.load(std::memory_order_relaxed);
+  uint32_t used = tail - head;
+  if (used > capacity_ || record_size > capacity_ - used || (tail & 3) != 0) {
+    return false;
+  }
+
+  uint32_t offset = tail & (capacity_ - 1);
+  uint32_t length = static_cast<uint32_t>(size);
+  memcpy(data_ + offset, &length, kLengthSize);
+
+  RingOutputStreamBuffer stream(data_, capacity_,
+                                (offset + kLengthSize) & (capacity_ - 1),
+                                length);
+  if (!Encode(msg, &stream)) {
+    return false;
+  }
+
+  indices_->tail.store(tail + record_size, std::memory_order_release);
+  return true;
+}
+
+template <typename Message>
+SharedRing::ReadStatus SharedRing::Read(Message* msg) {
+  uint32_t head = indices_->head.load(std::memory_order_relaxed);
+  uint32_t tail = indices_->tail.load(std::memory_order_acquire);
+  if (head == tail) {
+    return ReadStatus::kEmpty;
+  }
+
+  uint32_t available = tail - head;
+  if (available > capacity_ || available < kLengthSize || (head & 3) != 0) {
+    return ReadStatus::kError;
+  }
+
+  uint32_t offset = head & (capacity_ - 1);
+  uint32_t length;
+  memcpy(&length, data_ + offset, kLengthSize);
+  if (length > capacity_ - kLengthSize || RecordSize(length) > available) {
+    return ReadStatus::kError;
+  }
+
+  RingInputStreamBuffer stream(data_, capacity_,
+                               (offset + kLengthSize) & (capacity_ - 1),
+                               length);
+  bool decoded = Decode(&stream, msg);
+
+  // Consume the message even if it fails to decode, so the ring stays in sync.
+  indices_->head.store(head + RecordSize(length), std::memory_order_release);
+  return decoded ? ReadStatus::kSuccess : ReadStatus::kError;
+}
+
+template bool SharedRing::Write<Request>(const Request&);
+template bool SharedRing::Write<Response>(const Response&);
+template SharedRing::ReadStatus SharedRing::Read<Request>(Request*);
+template SharedRing::ReadStatus SharedRing::Read<Response>(Response*);
+
+bool FutexWait(std::atomic<uint32_t>* word,
+               uint32_t expected,
+               int timeout_ms) {
+  struct timespec timeout;
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+  int rc = syscall(__NR_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT,
+                   expected, &timeout, nullptr, 0);
+  return rc == 0 || errno != ETIMEDOUT;
+}
+
+void FutexWake(std::atomic<uint32_t>* word) {
+  syscall(__NR_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT32_MAX,
+          nullptr, nullptr, 0);
+}
+
+}  // namespace nvram
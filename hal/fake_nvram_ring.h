@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NVRAM_HAL_FAKE_NVRAM_RING_H_
+#define NVRAM_HAL_FAKE_NVRAM_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+// Shared memory ring transport between the testing NVRAM HAL and the fake
+// NVRAM daemon.
+//
+// The client creates a sealed memfd holding a |RingControl| block followed by
+// two single-producer single-consumer rings, one for requests and one for
+// responses. It passes the memfd along with an eventfd to the daemon on a
+// regular control socket connection, in a frame with |kFrameFlagAttachRing|
+// set and the descriptors attached as SCM_RIGHTS ancillary data. The daemon
+// acknowledges by echoing the frame header. The ring stays attached for as long
+// as the control socket connection remains open.
+//
+// To issue a request, the client writes the encoded request to the request
+// ring and signals the eventfd. The daemon drains the request ring, places
+// responses in the response ring and bumps |RingControl::response_sequence|. If
+// the client has announced that it is about to sleep by setting
+// |RingControl::client_waiting|, the daemon also wakes it up via a futex wake
+// on |response_sequence|.
+//
+// Each ring message consists of a 32-bit length followed by the encoded
+// message, padded to a multiple of 4 bytes. Messages may wrap around the end of
+// the ring buffer, but the length field never does. Neither side trusts the
+// other to keep the shared state consistent, so all indices and lengths are
+// validated before use.
+
+namespace nvram {
+
+constexpr uint32_t kRingMagic = 0x4e565247;  // "NVRG"
+constexpr uint32_t kRingVersion = 1;
+
+// Size of each of the two rings. Must be a power of two.
+constexpr uint32_t kRingCapacity = 64 * 1024;
+
+// Offset of the ring buffers within the shared memory region.
+constexpr size_t kRingDataOffset = 4096;
+
+// Total size of the shared memory region.
+constexpr size_t kRingMemorySize = kRingDataOffset + 2 * kRingCapacity;
+
+// Producer and consumer positions of a ring. These increase monotonically and
+// wrap around at 2^32. The producer owns |tail|, the consumer owns |head|.
+struct RingIndices {
+  alignas(64) std::atomic<uint32_t> head;
+  alignas(64) std::atomic<uint32_t> tail;
+};
+
+// Control block at the start of the shared memory region.
+struct RingControl {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t capacity;
+
+  RingIndices requests;
+  RingIndices responses;
+
+  // Incremented by the daemon whenever it publishes responses. The client
+  // waits on this with a futex.
+  alignas(64) std::atomic<uint32_t> response_sequence;
+
+  // Set by the client before it goes to sleep waiting for a response.
+  std::atomic<uint32_t> client_waiting;
+};
+
+static_assert(sizeof(RingControl) <= kRingDataOffset,
+              "RingControl doesn't fit in the control area.");
+static_assert(ATOMIC_INT_LOCK_FREE == 2,
+              "Shared memory atomics must be lock-free.");
+
+// Returns the request ring buffer within the shared memory at |base|.
+inline uint8_t* RequestRingData(void* base) {
+  return static_cast<uint8_t*>(base) + kRingDataOffset;
+}
+
+// Returns the response ring buffer within the shared memory at |base|.
+inline uint8_t* ResponseRingData(void* base) {
+  return static_cast<uint8_t*>(base) + kRingDataOffset + kRingCapacity;
+}
+
+// One direction of the shared memory transport. Producer and consumer each
+// create a |SharedRing| for the same ring and only use the respective member
+// functions.
+class SharedRing {
+ public:
+  enum class ReadStatus {
+    kEmpty,
+    kSuccess,
+    kError,
+  };
+
+  SharedRing() = default;
+  SharedRing(RingIndices* indices, uint8_t* data, uint32_t capacity)
+      : indices_(indices), data_(data), capacity_(capacity) {}
+
+  // Whether the ring currently holds any messages.
+  bool Empty() const;
+
+  // Encodes |msg| into the ring and publishes it to the consumer. Returns false
+  // if the ring lacks space or the ring state is invalid.
+  template <typename Message>
+  bool Write(const Message& msg);
+
+  // Decodes the next message from the ring and consumes it.
+  template <typename Message>
+  ReadStatus Read(Message* msg);
+
+ private:
+  RingIndices* indices_ = nullptr;
+  uint8_t* data_ = nullptr;
+  uint32_t capacity_ = 0;
+};
+
+// Waits for |*word| to change from |expected|, for at most |timeout_ms|
+// milliseconds. The futex is process-shared, so this works across processes
+// that map the same memory. Returns false on timeout.
+bool FutexWait(std::atomic<uint32_t>* word,
+               uint32_t expected,
+               int timeout_ms);
+
+// Wakes all waiters on |word|.
+void FutexWake(std::atomic<uint32_t>* word);
+
+}  // namespace nvram
+
+#endif  // NVRAM_HAL_FAKE_NVRAM_RING_H_
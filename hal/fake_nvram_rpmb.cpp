@@ -0,0 +1,339 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fake_nvram_rpmb.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+#include <openssl/hmac.h>
+#include <openssl/mem.h>
+
+#include "fake_nvram_record.h"
+
+namespace nvram {
+namespace {
+
+// Name of the file holding the emulated device state.
+constexpr char kRpmbFileName[] = "rpmb";
+
+// Temporary file name used for atomically replacing the device state.
+constexpr char kRpmbTempFileName[] = "rpmb.tmp";
+
+// Marks the device state file. "NVRP" in little-endian byte order.
+constexpr uint32_t kRpmbFileMagic = 0x5052564e;
+
+// Device state file layout. Integers are little-endian.
+constexpr size_t kFileMagicOffset = 0;
+constexpr size_t kFileKeyProgrammedOffset = 4;
+constexpr size_t kFileWriteCounterOffset = 8;
+constexpr size_t kFileKeyOffset = 12;
+constexpr size_t kFileBlocksOffset = kFileKeyOffset + kRpmbKeySize;
+
+// Offset of the first field covered by frame MACs.
+constexpr size_t kMacCoverageOffset = offsetof(RpmbFrame, data);
+
+uint16_t RequestType(const RpmbFrame& frame) {
+  return GetRpmbUint16(frame.request);
+}
+
+void SetResponse(RpmbFrame* response,
+                 RpmbRequest request,
+                 RpmbResult result) {
+  PutRpmbUint16(response->request, RpmbResponseType(request));
+  PutRpmbUint16(response->result, static_cast<uint16_t>(result));
+}
+
+}  // namespace
+
+bool ComputeRpmbMac(const uint8_t* key,
+                    const RpmbFrame* frames,
+                    size_t frame_count,
+                    uint8_t* mac) {
+  const size_t covered_size = sizeof(RpmbFrame) - kMacCoverageOffset;
+  std::vector<uint8_t> message(frame_count * covered_size);
+  for (size_t i = 0; i < frame_count; ++i) {
+    const uint8_t* frame = reinterpret_cast<const uint8_t*>(&frames[i]);
+    memcpy(message.data() + i * covered_size, frame + kMacCoverageOffset,
+           covered_size);
+  }
+
+  unsigned int mac_size = 0;
+  return HMAC(EVP_sha256(), key, kRpmbKeySize, message.data(), message.size(),
+              mac, &mac_size) &&
+         mac_size == kRpmbKeySize;
+}
+
+RpmbEmulator::RpmbEmulator(int data_dir_fd, uint16_t block_count)
+    : data_dir_fd_(data_dir_fd),
+      block_count_(block_count),
+      blocks_(block_count * kRpmbBlockSize) {}
+
+bool RpmbEmulator::Open() {
+  // A temporary file that didn't make it into place is of no use.
+  if (TEMP_FAILURE_RETRY(unlinkat(data_dir_fd_, kRpmbTempFileName, 0)) &&
+      errno != ENOENT) {
+    PLOG(WARNING) << "Failed to remove " << kRpmbTempFileName;
+  }
+
+  android::base::unique_fd fd(TEMP_FAILURE_RETRY(
+      openat(data_dir_fd_, kRpmbFileName, O_RDONLY | O_CLOEXEC)));
+  if (fd.get() < 0) {
+    if (errno != ENOENT) {
+      PLOG(ERROR) << "Failed to open " << kRpmbFileName;
+      return false;
+    }
+
+    // Start out with a blank device, which has no key programmed.
+    return Persist();
+  }
+
+  std::vector<uint8_t> contents(kFileBlocksOffset + blocks_.size());
+  if (!android::base::ReadFully(fd.get(), contents.data(), contents.size())) {
+    PLOG(ERROR) << "Failed to read " << kRpmbFileName;
+    return false;
+  }
+
+  if (GetUint32(contents.data() + kFileMagicOffset) != kRpmbFileMagic) {
+    LOG(ERROR) << "Bad magic in " << kRpmbFileName;
+    return false;
+  }
+
+  key_programmed_ = contents[kFileKeyProgrammedOffset] != 0;
+  write_counter_ = GetUint32(contents.data() + kFileWriteCounterOffset);
+  memcpy(key_, contents.data() + kFileKeyOffset, kRpmbKeySize);
+  memcpy(blocks_.data(), contents.data() + kFileBlocksOffset, blocks_.size());
+  return true;
+}
+
+bool RpmbEmulator::Submit(const RpmbFrame* request,
+                          size_t request_count,
+                          std::vector<RpmbFrame>* response) {
+  if (request_count == 0) {
+    return false;
+  }
+
+  response->clear();
+  switch (static_cast<RpmbRequest>(RequestType(request[0]))) {
+    case RpmbRequest::kProgramKey:
+      if (request_count != 2 ||
+          RequestType(request[1]) !=
+              static_cast<uint16_t>(RpmbRequest::kReadResult)) {
+        return false;
+      }
+      response->resize(1);
+      ProgramKey(request[0], &(*response)[0]);
+      return true;
+    case RpmbRequest::kReadCounter:
+      if (request_count != 1) {
+        return false;
+      }
+      response->resize(1);
+      ReadCounter(request[0], &(*response)[0]);
+      return true;
+    case RpmbRequest::kWrite:
+      if (request_count < 2 ||
+          RequestType(request[request_count - 1]) !=
+              static_cast<uint16_t>(RpmbRequest::kReadResult)) {
+        return false;
+      }
+      for (size_t i = 1; i < request_count - 1; ++i) {
+        if (RequestType(request[i]) !=
+            static_cast<uint16_t>(RpmbRequest::kWrite)) {
+          return false;
+        }
+      }
+      response->resize(1);
+      Write(request, request_count - 1, &(*response)[0]);
+      return true;
+    case RpmbRequest::kRead:
+      if (request_count != 1) {
+        return false;
+      }
+      Read(request[0], response);
+      return true;
+    case RpmbRequest::kReadResult:
+      break;
+  }
+
+  return false;
+}
+
+void RpmbEmulator::ProgramKey(const RpmbFrame& request, RpmbFrame* response) {
+  memset(response, 0, sizeof(*response));
+  if (key_programmed_) {
+    SetResponse(response, RpmbRequest::kProgramKey,
+                RpmbResult::kGeneralFailure);
+    return;
+  }
+
+  key_programmed_ = true;
+  memcpy(key_, request.key_mac, kRpmbKeySize);
+  if (!Persist()) {
+    key_programmed_ = false;
+    SetResponse(response, RpmbRequest::kProgramKey, RpmbResult::kWriteFailure);
+    return;
+  }
+
+  // The key programming response isn't authenticated.
+  SetResponse(response, RpmbRequest::kProgramKey, RpmbResult::kOk);
+}
+
+void RpmbEmulator::ReadCounter(const RpmbFrame& request, RpmbFrame* response) {
+  memset(response, 0, sizeof(*response));
+  memcpy(response->nonce, request.nonce, kRpmbNonceSize);
+  if (!key_programmed_) {
+    SetResponse(response, RpmbRequest::kReadCounter,
+                RpmbResult::kKeyNotProgrammed);
+    return;
+  }
+
+  PutRpmbUint32(response->write_counter, write_counter_);
+  SetResponse(response, RpmbRequest::kReadCounter, RpmbResult::kOk);
+  SignResponse(response, 1);
+}
+
+void RpmbEmulator::Write(const RpmbFrame* request,
+                         size_t request_count,
+                         RpmbFrame* response) {
+  memset(response, 0, sizeof(*response));
+  uint16_t address = GetRpmbUint16(request[0].address);
+  memcpy(response->address, request[0].address, sizeof(response->address));
+
+  RpmbResult result = RpmbResult::kOk;
+  uint8_t mac[kRpmbKeySize];
+  if (!key_programmed_) {
+    result = RpmbResult::kKeyNotProgrammed;
+  } else if (!ComputeRpmbMac(key_, request, request_count, mac) ||
+             CRYPTO_memcmp(mac, request[request_count - 1].key_mac,
+                           kRpmbKeySize) != 0) {
+    result = RpmbResult::kAuthenticationFailure;
+  } else if (GetRpmbUint32(request[0].write_counter) != write_counter_ ||
+             write_counter_ == UINT32_MAX) {
+    result = RpmbResult::kCounterFailure;
+  } else if (GetRpmbUint16(request[0].block_count) != request_count ||
+             address + request_count > block_count_) {
+    result = RpmbResult::kAddressFailure;
+  }
+
+  if (result == RpmbResult::kOk) {
+    std::vector<uint8_t> previous_blocks(blocks_);
+    for (size_t i = 0; i < request_count; ++i) {
+      memcpy(blocks_.data() + (address + i) * kRpmbBlockSize, request[i].data,
+             kRpmbBlockSize);
+    }
+    ++write_counter_;
+    if (!Persist()) {
+      blocks_.swap(previous_blocks);
+      --write_counter_;
+      result = RpmbResult::kWriteFailure;
+    }
+  }
+
+  PutRpmbUint32(response->write_counter, write_counter_);
+  SetResponse(response, RpmbRequest::kWrite, result);
+  if (key_programmed_) {
+    SignResponse(response, 1);
+  }
+}
+
+void RpmbEmulator::Read(const RpmbFrame& request,
+                        std::vector<RpmbFrame>* response) {
+  uint16_t address = GetRpmbUint16(request.address);
+  uint16_t count = GetRpmbUint16(request.block_count);
+
+  RpmbResult result = RpmbResult::kOk;
+  if (!key_programmed_) {
+    result = RpmbResult::kKeyNotProgrammed;
+  } else if (count == 0 || address + count > block_count_) {
+    result = RpmbResult::kAddressFailure;
+  }
+
+  response->resize(result == RpmbResult::kOk ? count : 1);
+  for (size_t i = 0; i < response->size(); ++i) {
+    RpmbFrame* frame = &(*response)[i];
+    memset(frame, 0, sizeof(*frame));
+    if (result == RpmbResult::kOk) {
+      memcpy(frame->data, blocks_.data() + (address + i) * kRpmbBlockSize,
+             kRpmbBlockSize);
+    }
+    memcpy(frame->nonce, request.nonce, kRpmbNonceSize);
+    memcpy(frame->address, request.address, sizeof(frame->address));
+    PutRpmbUint16(frame->block_count, count);
+    SetResponse(frame, RpmbRequest::kRead, result);
+  }
+
+  if (key_programmed_) {
+    SignResponse(response->data(), response->size());
+  }
+}
+
+void RpmbEmulator::SignResponse(RpmbFrame* response, size_t response_count) {
+  if (!ComputeRpmbMac(key_, response, response_count,
+                      response[response_count - 1].key_mac)) {
+    // Leave the MAC blank, which fails verification on the client.
+    LOG(ERROR) << "Failed to sign RPMB response";
+    memset(response[response_count - 1].key_mac, 0, kRpmbKeySize);
+  }
+}
+
+bool RpmbEmulator::Persist() {
+  std::vector<uint8_t> contents(kFileBlocksOffset + blocks_.size());
+  PutUint32(contents.data() + kFileMagicOffset, kRpmbFileMagic);
+  contents[kFileKeyProgrammedOffset] = key_programmed_ ? 1 : 0;
+  PutUint32(contents.data() + kFileWriteCounterOffset, write_counter_);
+  memcpy(contents.data() + kFileKeyOffset, key_, kRpmbKeySize);
+  memcpy(contents.data() + kFileBlocksOffset, blocks_.data(), blocks_.size());
+
+  android::base::unique_fd fd(TEMP_FAILURE_RETRY(
+      openat(data_dir_fd_, kRpmbTempFileName,
+             O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR)));
+  if (fd.get() < 0) {
+    PLOG(ERROR) << "Failed to open " << kRpmbTempFileName;
+    return false;
+  }
+
+  if (!android::base::WriteFully(fd.get(), contents.data(), contents.size()) ||
+      TEMP_FAILURE_RETRY(fdatasync(fd.get()))) {
+    PLOG(ERROR) << "Failed to write " << kRpmbTempFileName;
+    TEMP_FAILURE_RETRY(unlinkat(data_dir_fd_, kRpmbTempFileName, 0));
+    return false;
+  }
+
+  if (TEMP_FAILURE_RETRY(renameat(data_dir_fd_, kRpmbTempFileName, data_dir_fd_,
+                                  kRpmbFileName))) {
+    PLOG(ERROR) << "Failed to move " << kRpmbTempFileName << " to "
+                << kRpmbFileName;
+    TEMP_FAILURE_RETRY(unlinkat(data_dir_fd_, kRpmbTempFileName, 0));
+    return false;
+  }
+
+  if (TEMP_FAILURE_RETRY(fsync(data_dir_fd_))) {
+    PLOG(ERROR) << "Failed to sync data directory";
+    return false;
+  }
+
+  return true;
+}
+
+}  // namespace nvram
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NVRAM_HAL_FAKE_NVRAM_RPMB_H_
+#define NVRAM_HAL_FAKE_NVRAM_RPMB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace nvram {
+
+// Size of the authentication key and of the HMAC-SHA256 frame MACs.
+constexpr size_t kRpmbKeySize = 32;
+
+// Size of the data field of a frame, i.e. of a half-sector, which is the unit
+// of RPMB addressing.
+constexpr size_t kRpmbBlockSize = 256;
+
+// Size of the nonce field of a frame.
+constexpr size_t kRpmbNonceSize = 16;
+
+// An RPMB data frame as defined by the eMMC standard. Multi-byte fields are
+// big-endian.
+struct RpmbFrame {
+  uint8_t stuff[196];
+  uint8_t key_mac[kRpmbKeySize];
+  uint8_t data[kRpmbBlockSize];
+  uint8_t nonce[kRpmbNonceSize];
+  uint8_t write_counter[4];
+  uint8_t address[2];
+  uint8_t block_count[2];
+  uint8_t result[2];
+  uint8_t request[2];
+};
+static_assert(sizeof(RpmbFrame) == 512, "Unexpected RPMB frame size");
+
+// Request types. Responses carry the request type shifted left by 8 bits.
+enum class RpmbRequest : uint16_t {
+  kProgramKey = 0x0001,
+  kReadCounter = 0x0002,
+  kWrite = 0x0003,
+  kRead = 0x0004,
+  kReadResult = 0x0005,
+};
+
+// Operation results.
+enum class RpmbResult : uint16_t {
+  kOk = 0x0000,
+  kGeneralFailure = 0x0001,
+  kAuthenticationFailure = 0x0002,
+  kCounterFailure = 0x0003,
+  kAddressFailure = 0x0004,
+  kWriteFailure = 0x0005,
+  kReadFailure = 0x0006,
+  kKeyNotProgrammed = 0x0007,
+};
+
+// Returns the response type for requests of type |request|.
+inline uint16_t RpmbResponseType(RpmbRequest request) {
+  return static_cast<uint16_t>(static_cast<uint16_t>(request) << 8);
+}
+
+inline uint16_t GetRpmbUint16(const uint8_t* field) {
+  return static_cast<uint16_t>((field[0] << 8) | field[1]);
+}
+
+inline void PutRpmbUint16(uint8_t* field, uint16_t value) {
+  field[0] = static_cast<uint8_t>(value >> 8);
+  field[1] = static_cast<uint8_t>(value);
+}
+
+inline uint32_t GetRpmbUint32(const uint8_t* field) {
+  return (static_cast<uint32_t>(field[0]) << 24) |
+         (static_cast<uint32_t>(field[1]) << 16) |
+         (static_cast<uint32_t>(field[2]) << 8) | field[3];
+}
+
+inline void PutRpmbUint32(uint8_t* field, uint32_t value) {
+  field[0] = static_cast<uint8_t>(value >> 24);
+  field[1] = static_cast<uint8_t>(value >> 16);
+  field[2] = static_cast<uint8_t>(value >> 8);
+  field[3] = static_cast<uint8_t>(value);
+}
+
+// Computes the HMAC-SHA256 of |frame_count| frames at |frames| with |key|, as
+// used for authenticating RPMB requests and responses. The MAC covers the
+// frames' fields from |data| onwards. Returns true if successful.
+bool ComputeRpmbMac(const uint8_t* key,
+                    const RpmbFrame* frames,
+                    size_t frame_count,
+                    uint8_t* mac);
+
+// Emulates an RPMB partition, backed by a file in the data directory.
+//
+// The emulator implements the request and response sequences of the eMMC
+// standard: programming the key once, reading the write counter, authenticated
+// writes checked against the write counter, and reads authenticated with a
+// client-supplied nonce. Like reliable writes on real devices, each write
+// request is applied atomically. Unlike real devices, which limit reliable
+// writes to a few blocks, the emulator accepts writes of any number of blocks.
+//
+// The emulated device state, including the key, lives in a plain file, so this
+// doesn't provide any actual protection. It's meant for exercising and
+// measuring RPMB-based storage without hardware. Calls must be serialized by
+// the caller.
+class RpmbEmulator {
+ public:
+  // Keeps the device state in the directory |data_dir_fd|, which must remain
+  // open for the lifetime of the emulator. The partition holds |block_count|
+  // half-sectors.
+  RpmbEmulator(int data_dir_fd, uint16_t block_count);
+
+  // Loads the device state, creating a blank device if necessary. Returns true
+  // if successful.
+  bool Open();
+
+  uint16_t block_count() const { return block_count_; }
+
+  // Executes the request consisting of |request_count| frames at |request| and
+  // places the response frames in |response|. Write and key programming
+  // requests must be followed by a result read request frame, as on real
+  // devices. Returns false if the request sequence is malformed, otherwise the
+  // result of the operation is reported in the response frames.
+  bool Submit(const RpmbFrame* request,
+              size_t request_count,
+              std::vector<RpmbFrame>* response);
+
+ private:
+  // Handlers for the individual request types. Each fills in |response|.
+  void ProgramKey(const RpmbFrame& request, RpmbFrame* response);
+  void ReadCounter(const RpmbFrame& request, RpmbFrame* response);
+  void Write(const RpmbFrame* request,
+             size_t request_count,
+             RpmbFrame* response);
+  void Read(const RpmbFrame& request, std::vector<RpmbFrame>* response);
+
+  // Signs the |response_count| frames at |response|.
+  void SignResponse(RpmbFrame* response, size_t response_count);
+
+  // Atomically writes the device state to the backing file. Returns true if
+  // successful.
+  bool Persist();
+
+  const int data_dir_fd_;
+  const uint16_t block_count_;
+
+  bool key_programmed_ = false;
+  uint8_t key_[kRpmbKeySize] = {};
+  uint32_t write_counter_ = 0;
+  std::vector<uint8_t> blocks_;
+};
+
+}  // namespace nvram
+
+#endif  // NVRAM_HAL_FAKE_NVRAM_RPMB_H_
@@ -0,0 +1,532 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fake_nvram_rpmb_storage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+#include <openssl/mem.h>
+#include <openssl/rand.h>
+
+#include "fake_nvram_record.h"
+
+namespace nvram {
+namespace {
+
+// Name of the file holding the authentication key.
+constexpr char kKeyFileName[] = "rpmb_key";
+
+// Marks the start of the image. "NVRI" in little-endian byte order.
+constexpr uint32_t kImageMagic = 0x4952564e;
+
+// Size of the image magic preceding the records.
+constexpr size_t kImageHeaderSize = 4;
+
+// Record types in the image. The end record terminates the image.
+constexpr uint8_t kRecordTypeEnd = 0;
+constexpr uint8_t kRecordTypeSpace = 1;
+constexpr uint8_t kRecordTypeHeader = 2;
+
+// Record layout. Integers are little-endian.
+constexpr size_t kRecordTypeOffset = 0;
+constexpr size_t kRecordIndexOffset = 1;
+constexpr size_t kRecordSizeOffset = 5;
+constexpr size_t kRecordHeaderSize = 9;
+
+// Appends a record to |image|.
+void AppendRecord(uint8_t type,
+                  uint32_t index,
+                  const std::vector<uint8_t>& data,
+                  std::vector<uint8_t>* image) {
+  size_t offset = image->size();
+  image->resize(offset + kRecordHeaderSize + data.size());
+  uint8_t* record = image->data() + offset;
+  record[kRecordTypeOffset] = type;
+  PutUint32(record + kRecordIndexOffset, index);
+  PutUint32(record + kRecordSizeOffset, static_cast<uint32_t>(data.size()));
+  if (!data.empty()) {
+    memcpy(record + kRecordHeaderSize, data.data(), data.size());
+  }
+}
+
+// Checks the result of a response frame of the given |request| type.
+bool CheckResponse(const RpmbFrame& response, RpmbRequest request) {
+  if (GetRpmbUint16(response.request) != RpmbResponseType(request)) {
+    LOG(ERROR) << "Unexpected RPMB response type "
+               << GetRpmbUint16(response.request);
+    return false;
+  }
+
+  uint16_t result = GetRpmbUint16(response.result);
+  if (result != static_cast<uint16_t>(RpmbResult::kOk)) {
+    LOG(ERROR) << "RPMB request " << static_cast<uint16_t>(request)
+               << " failed with result " << result;
+    return false;
+  }
+
+  return true;
+}
+
+}  // namespace
+
+RpmbStorageBackend::RpmbStorageBackend(RpmbEmulator* device, int data_dir_fd)
+    : device_(device), data_dir_fd_(data_dir_fd) {}
+
+bool RpmbStorageBackend::Open() {
+  if (!LoadKey()) {
+    return false;
+  }
+
+  bool key_programmed = false;
+  if (!ReadCounter(&key_programmed)) {
+    return false;
+  }
+  if (!key_programmed &&
+      (!ProgramKey() || !ReadCounter(&key_programmed) || !key_programmed)) {
+    LOG(ERROR) << "Failed to program RPMB key";
+    return false;
+  }
+
+  return ReadImage();
+}
+
+std::string RpmbStorageBackend::FormatStats() const {
+  char buffer[128];
+  snprintf(buffer, sizeof(buffer),
+           "updates: %" PRIu64 ", frames: %" PRIu64 ", blocks written: %" PRIu64
+           ", frames per update: %.2f",
+           update_count_, update_frame_count_, update_block_count_,
+           update_count_ ? static_cast<double>(update_frame_count_) /
+                               static_cast<double>(update_count_)
+                         : 0.0);
+  return buffer;
+}
+
+storage::Status RpmbStorageBackend::LoadHeader(Blob* blob) {
+  if (!has_header_) {
+    return storage::Status::kNotFound;
+  }
+  if (!blob->Assign(header_.data(), header_.size())) {
+    LOG(ERROR) << "Failed to allocate read buffer";
+    return storage::Status::kStorageError;
+  }
+  return storage::Status::kSuccess;
+}
+
+storage::Status RpmbStorageBackend::StoreHeader(const Blob& blob) {
+  std::vector<uint8_t> data(blob.data(), blob.data() + blob.size());
+  bool had_header = has_header_;
+  header_.swap(data);
+  has_header_ = true;
+
+  storage::Status status = Commit();
+  if (status != storage::Status::kSuccess) {
+    header_.swap(data);
+    has_header_ = had_header;
+  }
+  return status;
+}
+
+storage::Status RpmbStorageBackend::LoadSpace(uint32_t index, Blob* blob) {
+  Space* space = FindSpace(index);
+  if (!space) {
+    return storage::Status::kNotFound;
+  }
+  if (!blob->Assign(space->second.data(), space->second.size())) {
+    LOG(ERROR) << "Failed to allocate read buffer";
+    return storage::Status::kStorageError;
+  }
+  return storage::Status::kSuccess;
+}
+
+storage::Status RpmbStorageBackend::StoreSpace(uint32_t index,
+                                               const Blob& blob) {
+  std::vector<uint8_t> data(blob.data(), blob.data() + blob.size());
+  Space* space = FindSpace(index);
+  if (space) {
+    space->second.swap(data);
+    storage::Status status = Commit();
+    if (status != storage::Status::kSuccess) {
+      FindSpace(index)->second.swap(data);
+    }
+    return status;
+  }
+
+  // New spaces go to the end, so the existing ones keep their blocks.
+  spaces_.emplace_back(index, std::move(data));
+  storage::Status status = Commit();
+  if (status != storage::Status::kSuccess) {
+    spaces_.pop_back();
+  }
+  return status;
+}
+
+storage::Status RpmbStorageBackend::DeleteSpace(uint32_t index) {
+  Space* space = FindSpace(index);
+  if (!space) {
+    return storage::Status::kNotFound;
+  }
+
+  size_t position = space - spaces_.data();
+  Space removed = std::move(*space);
+  spaces_.erase(spaces_.begin() + position);
+  storage::Status status = Commit();
+  if (status != storage::Status::kSuccess) {
+    spaces_.insert(spaces_.begin() + position, std::move(removed));
+  }
+  return status;
+}
+
+bool RpmbStorageBackend::LoadKey() {
+  android::base::unique_fd key_fd(TEMP_FAILURE_RETRY(
+      openat(data_dir_fd_, kKeyFileName, O_RDONLY | O_CLOEXEC)));
+  if (key_fd.get() >= 0) {
+    if (!android::base::ReadFully(key_fd.get(), key_, sizeof(key_))) {
+      PLOG(ERROR) << "Failed to read " << kKeyFileName;
+      return false;
+    }
+    return true;
+  }
+
+  if (errno != ENOENT) {
+    PLOG(ERROR) << "Failed to open " << kKeyFileName;
+    return false;
+  }
+
+  if (!RAND_bytes(key_, sizeof(key_))) {
+    LOG(ERROR) << "Failed to generate RPMB key";
+    return false;
+  }
+
+  key_fd.reset(TEMP_FAILURE_RETRY(
+      openat(data_dir_fd_, kKeyFileName,
+             O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR)));
+  if (key_fd.get() < 0 ||
+      !android::base::WriteFully(key_fd.get(), key_, sizeof(key_)) ||
+      TEMP_FAILURE_RETRY(fdatasync(key_fd.get())) ||
+      TEMP_FAILURE_RETRY(fsync(data_dir_fd_))) {
+    PLOG(ERROR) << "Failed to write " << kKeyFileName;
+    TEMP_FAILURE_RETRY(unlinkat(data_dir_fd_, kKeyFileName, 0));
+    return false;
+  }
+
+  return true;
+}
+
+bool RpmbStorageBackend::ProgramKey() {
+  std::vector<RpmbFrame> request(2);
+  memset(request.data(), 0, request.size() * sizeof(RpmbFrame));
+  memcpy(request[0].key_mac, key_, kRpmbKeySize);
+  PutRpmbUint16(request[0].request,
+                static_cast<uint16_t>(RpmbRequest::kProgramKey));
+  PutRpmbUint16(request[1].request,
+                static_cast<uint16_t>(RpmbRequest::kReadResult));
+
+  std::vector<RpmbFrame> response;
+  return Submit(request, &response) &&
+         CheckResponse(response[0], RpmbRequest::kProgramKey);
+}
+
+bool RpmbStorageBackend::ReadCounter(bool* key_programmed) {
+  std::vector<RpmbFrame> request(1);
+  memset(request.data(), 0, sizeof(RpmbFrame));
+  PutRpmbUint16(request[0].request,
+                static_cast<uint16_t>(RpmbRequest::kReadCounter));
+  if (!RAND_bytes(request[0].nonce, kRpmbNonceSize)) {
+    LOG(ERROR) << "Failed to generate nonce";
+    return false;
+  }
+
+  std::vector<RpmbFrame> response;
+  if (!Submit(request, &response)) {
+    return false;
+  }
+
+  *key_programmed = GetRpmbUint16(response[0].result) !=
+                    static_cast<uint16_t>(RpmbResult::kKeyNotProgrammed);
+  if (!*key_programmed) {
+    return true;
+  }
+
+  uint8_t mac[kRpmbKeySize];
+  if (!CheckResponse(response[0], RpmbRequest::kReadCounter) ||
+      !ComputeRpmbMac(key_, response.data(), 1, mac) ||
+      CRYPTO_memcmp(mac, response[0].key_mac, kRpmbKeySize) != 0 ||
+      memcmp(response[0].nonce, request[0].nonce, kRpmbNonceSize) != 0) {
+    LOG(ERROR) << "Failed to authenticate RPMB write counter";
+    return false;
+  }
+
+  write_counter_ = GetRpmbUint32(response[0].write_counter);
+  return true;
+}
+
+bool RpmbStorageBackend::ReadBlocks(uint16_t address,
+                                    uint16_t count,
+                                    uint8_t* data) {
+  std::vector<RpmbFrame> request(1);
+  memset(request.data(), 0, sizeof(RpmbFrame));
+  PutRpmbUint16(request[0].request, static_cast<uint16_t>(RpmbRequest::kRead));
+  PutRpmbUint16(request[0].address, address);
+  PutRpmbUint16(request[0].block_count, count);
+  if (!RAND_bytes(request[0].nonce, kRpmbNonceSize)) {
+    LOG(ERROR) << "Failed to generate nonce";
+    return false;
+  }
+
+  std::vector<RpmbFrame> response;
+  if (!Submit(request, &response) ||
+      !CheckResponse(response[0], RpmbRequest::kRead) ||
+      response.size() != count) {
+    return false;
+  }
+
+  uint8_t mac[kRpmbKeySize];
+  if (!ComputeRpmbMac(key_, response.data(), response.size(), mac) ||
+      CRYPTO_memcmp(mac, response.back().key_mac, kRpmbKeySize) != 0) {
+    LOG(ERROR) << "Failed to authenticate RPMB read";
+    return false;
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    if (memcmp(response[i].nonce, request[0].nonce, kRpmbNonceSize) != 0 ||
+        GetRpmbUint16(response[i].address) != address) {
+      LOG(ERROR) << "RPMB read response doesn't match request";
+      return false;
+    }
+    memcpy(data + i * kRpmbBlockSize, response[i].data, kRpmbBlockSize);
+  }
+
+  return true;
+}
+
+bool RpmbStorageBackend::WriteBlocks(uint16_t address,
+                                     uint16_t count,
+                                     const uint8_t* data) {
+  std::vector<RpmbFrame> request(count + 1);
+  memset(request.data(), 0, request.size() * sizeof(RpmbFrame));
+  for (size_t i = 0; i < count; ++i) {
+    RpmbFrame* frame = &request[i];
+    memcpy(frame->data, data + i * kRpmbBlockSize, kRpmbBlockSize);
+    PutRpmbUint32(frame->write_counter, write_counter_);
+    PutRpmbUint16(frame->address, address);
+    PutRpmbUint16(frame->block_count, count);
+    PutRpmbUint16(frame->request, static_cast<uint16_t>(RpmbRequest::kWrite));
+  }
+  if (!ComputeRpmbMac(key_, request.data(), count,
+                      request[count - 1].key_mac)) {
+    LOG(ERROR) << "Failed to sign RPMB write";
+    return false;
+  }
+  PutRpmbUint16(request[count].request,
+                static_cast<uint16_t>(RpmbRequest::kReadResult));
+
+  std::vector<RpmbFrame> response;
+  if (!Submit(request, &response)) {
+    return false;
+  }
+
+  uint8_t mac[kRpmbKeySize];
+  if (!ComputeRpmbMac(key_, response.data(), 1, mac) ||
+      CRYPTO_memcmp(mac, response[0].key_mac, kRpmbKeySize) != 0) {
+    LOG(ERROR) << "Failed to authenticate RPMB write result";
+    return false;
+  }
+
+  if (!CheckResponse(response[0], RpmbRequest::kWrite) ||
+      GetRpmbUint32(response[0].write_counter) != write_counter_ + 1) {
+    return false;
+  }
+
+  ++write_counter_;
+  return true;
+}
+
+bool RpmbStorageBackend::Submit(const std::vector<RpmbFrame>& request,
+                                std::vector<RpmbFrame>* response) {
+  if (!device_->Submit(request.data(), request.size(), response) ||
+      response->empty()) {
+    LOG(ERROR) << "Malformed RPMB request";
+    return false;
+  }
+
+  frame_count_ += request.size() + response->size();
+  return true;
+}
+
+bool RpmbStorageBackend::ReadImage() {
+  std::vector<uint8_t> image(device_->block_count() * kRpmbBlockSize);
+  if (!ReadBlocks(0, device_->block_count(), image.data())) {
+    return false;
+  }
+
+  spaces_.clear();
+  has_header_ = false;
+  header_.clear();
+  image_.clear();
+
+  // A blank device holds no objects.
+  uint32_t magic = GetUint32(image.data());
+  if (magic == 0) {
+    return true;
+  }
+  if (magic != kImageMagic) {
+    LOG(ERROR) << "Bad RPMB image magic";
+    return false;
+  }
+
+  size_t offset = kImageHeaderSize;
+  while (true) {
+    if (image.size() - offset < 1) {
+      LOG(ERROR) << "Unterminated RPMB image";
+      return false;
+    }
+
+    const uint8_t* record = image.data() + offset;
+    uint8_t type = record[kRecordTypeOffset];
+    if (type == kRecordTypeEnd) {
+      offset += 1;
+      break;
+    }
+
+    if (image.size() - offset < kRecordHeaderSize) {
+      LOG(ERROR) << "Truncated RPMB image record";
+      return false;
+    }
+    uint32_t index = GetUint32(record + kRecordIndexOffset);
+    uint32_t size = GetUint32(record + kRecordSizeOffset);
+    if (size > image.size() - offset - kRecordHeaderSize) {
+      LOG(ERROR) << "Truncated RPMB image record";
+      return false;
+    }
+
+    const uint8_t* data = record + kRecordHeaderSize;
+    if (type == kRecordTypeSpace) {
+      spaces_.emplace_back(index, std::vector<uint8_t>(data, data + size));
+    } else if (type == kRecordTypeHeader) {
+      has_header_ = true;
+      header_.assign(data, data + size);
+    } else {
+      LOG(ERROR) << "Bad RPMB image record type " << type;
+      return false;
+    }
+    offset += kRecordHeaderSize + size;
+  }
+
+  // Only keep the blocks that hold the image.
+  size_t block_count = (offset + kRpmbBlockSize - 1) / kRpmbBlockSize;
+  image.resize(block_count * kRpmbBlockSize);
+  image_.swap(image);
+  return true;
+}
+
+bool RpmbStorageBackend::EncodeImage(std::vector<uint8_t>* image) const {
+  image->clear();
+  image->resize(kImageHeaderSize);
+  PutUint32(image->data(), kImageMagic);
+  for (const Space& space : spaces_) {
+    AppendRecord(kRecordTypeSpace, space.first, space.second, image);
+  }
+  if (has_header_) {
+    AppendRecord(kRecordTypeHeader, 0, header_, image);
+  }
+  image->push_back(kRecordTypeEnd);
+
+  size_t block_count = (image->size() + kRpmbBlockSize - 1) / kRpmbBlockSize;
+  if (block_count > device_->block_count()) {
+    LOG(ERROR) << "RPMB image exceeds partition size: " << image->size();
+    return false;
+  }
+  image->resize(block_count * kRpmbBlockSize);
+  return true;
+}
+
+storage::Status RpmbStorageBackend::WriteImage(
+    const std::vector<uint8_t>& image) {
+  // Determine the range of blocks that differ from the device contents. Blocks
+  // beyond the end of the image are irrelevant, as the end record precedes
+  // them.
+  size_t block_count = image.size() / kRpmbBlockSize;
+  size_t first = block_count;
+  size_t last = 0;
+  for (size_t i = 0; i < block_count; ++i) {
+    size_t offset = i * kRpmbBlockSize;
+    if (offset >= image_.size() ||
+        memcmp(image.data() + offset, image_.data() + offset,
+               kRpmbBlockSize) != 0) {
+      first = std::min(first, i);
+      last = i;
+    }
+  }
+
+  if (first == block_count) {
+    return storage::Status::kSuccess;
+  }
+
+  uint16_t count = static_cast<uint16_t>(last - first + 1);
+  if (!WriteBlocks(static_cast<uint16_t>(first), count,
+                   image.data() + first * kRpmbBlockSize)) {
+    // The write may or may not have happened. Pick up the current write
+    // counter and rewrite the entire image next time.
+    bool key_programmed = false;
+    if (!ReadCounter(&key_programmed)) {
+      LOG(ERROR) << "Failed to resynchronize with RPMB device";
+    }
+    image_.clear();
+    return storage::Status::kStorageError;
+  }
+
+  if (image_.size() < image.size()) {
+    image_.resize(image.size());
+  }
+  memcpy(image_.data() + first * kRpmbBlockSize,
+         image.data() + first * kRpmbBlockSize, count * kRpmbBlockSize);
+  update_block_count_ += count;
+  return storage::Status::kSuccess;
+}
+
+storage::Status RpmbStorageBackend::Commit() {
+  frame_count_ = 0;
+  std::vector<uint8_t> image;
+  storage::Status status = EncodeImage(&image)
+                               ? WriteImage(image)
+                               : storage::Status::kStorageError;
+  ++update_count_;
+  update_frame_count_ += frame_count_;
+  return status;
+}
+
+RpmbStorageBackend::Space* RpmbStorageBackend::FindSpace(uint32_t index) {
+  for (Space& space : spaces_) {
+    if (space.first == index) {
+      return &space;
+    }
+  }
+  return nullptr;
+}
+
+}  // namespace nvram
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NVRAM_HAL_FAKE_NVRAM_RPMB_STORAGE_H_
+#define NVRAM_HAL_FAKE_NVRAM_RPMB_STORAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <nvram/core/storage.h>
+
+#include "fake_nvram_rpmb.h"
+
+namespace nvram {
+
+// A storage backend that keeps all storage objects in an RPMB partition, using
+// authenticated frames for all device accesses.
+//
+// To keep the number of frames per operation low, the backend coalesces all
+// objects into a single packed image at the start of the partition, instead of
+// giving each object its own block-aligned area. The header and small spaces
+// thus share half-sectors. Each update re-encodes the image in memory and
+// writes only the range of blocks that changed, as a single authenticated write
+// request, which the device applies atomically. Spaces are laid out in creation
+// order and the header comes last, so creating a space only touches the blocks
+// at the end of the image, and rewriting a space only touches its own blocks.
+//
+// The image is read and verified once on open. Loads are served from memory,
+// as the backend is the only writer and the write counter guards against
+// changes behind its back.
+//
+// The authentication key is kept in a plain file in the data directory, so
+// like the RPMB emulator, this doesn't provide any actual protection. Calls
+// must be serialized by the caller.
+class RpmbStorageBackend : public storage::StorageBackend {
+ public:
+  // Accesses |device|, which must outlive the backend. The key file lives in
+  // the directory |data_dir_fd|, which must remain open for the lifetime of the
+  // backend.
+  RpmbStorageBackend(RpmbEmulator* device, int data_dir_fd);
+  ~RpmbStorageBackend() override = default;
+
+  // Loads or creates the authentication key, programs it into the device if
+  // necessary, and reads the image. Returns true if successful.
+  bool Open();
+
+  // Returns a summary of the frames transferred for updates.
+  std::string FormatStats() const;
+
+  // StorageBackend:
+  storage::Status LoadHeader(Blob* blob) override;
+  storage::Status StoreHeader(const Blob& blob) override;
+  storage::Status LoadSpace(uint32_t index, Blob* blob) override;
+  storage::Status StoreSpace(uint32_t index, const Blob& blob) override;
+  storage::Status DeleteSpace(uint32_t index) override;
+
+ private:
+  using Space = std::pair<uint32_t, std::vector<uint8_t>>;
+
+  // Loads the key from its file, creating a random key if there is none.
+  bool LoadKey();
+
+  // Programs the key into the device.
+  bool ProgramKey();
+
+  // Reads the device's write counter into |write_counter_|. Sets
+  // |*key_programmed| to false if the device has no key, in which case the
+  // counter isn't available.
+  bool ReadCounter(bool* key_programmed);
+
+  // Reads |count| blocks starting at block |address| into |data|.
+  bool ReadBlocks(uint16_t address, uint16_t count, uint8_t* data);
+
+  // Writes |count| blocks from |data| starting at block |address| in a single
+  // authenticated write request.
+  bool WriteBlocks(uint16_t address, uint16_t count, const uint8_t* data);
+
+  // Submits |request| and counts the frames transferred.
+  bool Submit(const std::vector<RpmbFrame>& request,
+              std::vector<RpmbFrame>* response);
+
+  // Reads the image from the device and decodes it.
+  bool ReadImage();
+
+  // Encodes the objects into |image|, padded to whole blocks.
+  bool EncodeImage(std::vector<uint8_t>* image) const;
+
+  // Writes the blocks of |image| that differ from the device contents.
+  storage::Status WriteImage(const std::vector<uint8_t>& image);
+
+  // Encodes the objects and writes the resulting image.
+  storage::Status Commit();
+
+  // Returns the space with |index|, or nullptr if there is none.
+  Space* FindSpace(uint32_t index);
+
+  RpmbEmulator* const device_;
+  const int data_dir_fd_;
+
+  uint8_t key_[kRpmbKeySize] = {};
+  uint32_t write_counter_ = 0;
+
+  // The stored objects, in image order.
+  std::vector<Space> spaces_;
+  bool has_header_ = false;
+  std::vector<uint8_t> header_;
+
+  // The device contents of the image area, as far as it has been written.
+  std::vector<uint8_t> image_;
+
+  // Statistics for updates, i.e. stores and deletes.
+  uint64_t update_count_ = 0;
+  uint64_t update_frame_count_ = 0;
+  uint64_t update_block_count_ = 0;
+
+  // Frames transferred by the operation in progress.
+  uint64_t frame_count_ = 0;
+};
+
+}  // namespace nvram
+
+#endif  // NVRAM_HAL_FAKE_NVRAM_RPMB_STORAGE_H_
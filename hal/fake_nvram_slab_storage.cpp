@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fake_nvram_slab_storage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <android-base/logging.h>
+
+namespace nvram {
+namespace {
+
+// Name of the slab file in the data directory.
+constexpr char kSlabFileName[] = "slab";
+
+}  // namespace
+
+SlabStorageBackend::SlabStorageBackend(int data_dir_fd)
+    : SlotStorageBackend(kCopySize), data_dir_fd_(data_dir_fd) {}
+
+SlabStorageBackend::~SlabStorageBackend() {
+  if (mapping_) {
+    munmap(mapping_, kSlabSize);
+  }
+}
+
+bool SlabStorageBackend::Open() {
+  const off_t slab_size = static_cast<off_t>(kSlabSize);
+
+  slab_fd_.reset(TEMP_FAILURE_RETRY(
+      openat(data_dir_fd_, kSlabFileName, O_RDWR | O_CLOEXEC)));
+  if (slab_fd_.get() < 0 && errno == ENOENT) {
+    // The new file is all zeros, which leaves all copies invalid and thus all
+    // slots empty. Its blocks get allocated up front, as running out of space
+    // when writing through the mapping raises SIGBUS rather than failing the
+    // store. Make sure its size and directory entry are durable before any
+    // copies get written.
+    slab_fd_.reset(TEMP_FAILURE_RETRY(
+        openat(data_dir_fd_, kSlabFileName,
+               O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR)));
+    if (slab_fd_.get() >= 0 &&
+        (TEMP_FAILURE_RETRY(fallocate(slab_fd_.get(), 0, 0, slab_size)) ||
+         TEMP_FAILURE_RETRY(fdatasync(slab_fd_.get())) ||
+         TEMP_FAILURE_RETRY(fsync(data_dir_fd_)))) {
+      PLOG(ERROR) << "Failed to create " << kSlabFileName;
+      return false;
+    }
+  }
+  if (slab_fd_.get() < 0) {
+    PLOG(ERROR) << "Failed to open " << kSlabFileName;
+    return false;
+  }
+
+  struct stat slab_stat;
+  if (TEMP_FAILURE_RETRY(fstat(slab_fd_.get(), &slab_stat))) {
+    PLOG(ERROR) << "Failed to stat " << kSlabFileName;
+    return false;
+  }
+  if (slab_stat.st_size != slab_size) {
+    LOG(ERROR) << "Unexpected size of " << kSlabFileName << ": "
+               << slab_stat.st_size;
+    return false;
+  }
+
+  // Files with holes, e.g. from an interrupted creation, get their blocks
+  // allocated before use. |st_blocks| counts 512-byte units.
+  if (slab_stat.st_blocks * 512 < slab_size) {
+    LOG(WARNING) << kSlabFileName << " isn't fully allocated, allocating.";
+    if (TEMP_FAILURE_RETRY(fallocate(slab_fd_.get(), 0, 0, slab_size)) ||
+        TEMP_FAILURE_RETRY(fdatasync(slab_fd_.get()))) {
+      PLOG(ERROR) << "Failed to allocate " << kSlabFileName;
+      return false;
+    }
+  }
+
+  void* mapping = mmap(nullptr, kSlabSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, slab_fd_.get(), 0);
+  if (mapping == MAP_FAILED) {
+    PLOG(ERROR) << "Failed to map " << kSlabFileName;
+    return false;
+  }
+  mapping_ = static_cast<uint8_t*>(mapping);
+  page_size_ = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+
+  return Scan();
+}
+
+const uint8_t* SlabStorageBackend::FetchCopy(size_t slot, int copy) {
+  return CopyAddress(slot, copy);
+}
+
+uint8_t* SlabStorageBackend::PrepareCopy(size_t slot, int copy) {
+  return CopyAddress(slot, copy);
+}
+
+bool SlabStorageBackend::CommitCopy(size_t slot, int copy, size_t size) {
+  // Flush only the pages covering the copy that changed.
+  uint8_t* address = CopyAddress(slot, copy);
+  uintptr_t begin = reinterpret_cast<uintptr_t>(address) & ~(page_size_ - 1);
+  uintptr_t end = reinterpret_cast<uintptr_t>(address) + size;
+  if (msync(reinterpret_cast<void*>(begin), end - begin, MS_SYNC)) {
+    PLOG(ERROR) << "Failed to sync " << kSlabFileName;
+    // Make sure the copy can't become current if it reaches the disk later.
+    memset(address, 0, kCopyHeaderSize);
+    return false;
+  }
+
+  return true;
+}
+
+uint8_t* SlabStorageBackend::CopyAddress(size_t slot, int copy) const {
+  return mapping_ + (2 * slot + copy) * kCopySize;
+}
+
+}  // namespace nvram
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NVRAM_HAL_FAKE_NVRAM_SLAB_STORAGE_H_
+#define NVRAM_HAL_FAKE_NVRAM_SLAB_STORAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <android-base/unique_fd.h>
+
+#include "fake_nvram_slot_storage.h"
+
+namespace nvram {
+
+// A slot storage backend that keeps the slots in a preallocated file in the
+// data directory, which is mapped into memory. A store flushes just the pages
+// of the copy it wrote with msync(). Loads are plain memory copies out of the
+// mapping, so they don't require any system calls.
+//
+// Like the file-per-object storage, this does not meet the tamper evidence
+// requirements for access-controlled NVRAM. Calls must be serialized by the
+// caller.
+class SlabStorageBackend : public SlotStorageBackend {
+ public:
+  // Keeps the slab file in the directory |data_dir_fd|, which must remain open
+  // for the lifetime of the backend.
+  explicit SlabStorageBackend(int data_dir_fd);
+  ~SlabStorageBackend() override;
+
+  // Opens and maps the slab file, creating it if necessary, and determines the
+  // current copy of each slot. Returns true if successful.
+  bool Open();
+
+ protected:
+  // SlotStorageBackend:
+  const uint8_t* FetchCopy(size_t slot, int copy) override;
+  uint8_t* PrepareCopy(size_t slot, int copy) override;
+  bool CommitCopy(size_t slot, int copy, size_t size) override;
+
+ private:
+  // Size of each copy. This is a common page size, so each store usually
+  // flushes a single page.
+  static constexpr size_t kCopySize = 4096;
+
+  // Size of the slab file.
+  static constexpr size_t kSlabSize = 2 * kNumSlots * kCopySize;
+
+  // Returns the address of copy |copy| of slot |slot| in the mapping.
+  uint8_t* CopyAddress(size_t slot, int copy) const;
+
+  const int data_dir_fd_;
+  android::base::unique_fd slab_fd_;
+  uint8_t* mapping_ = nullptr;
+
+  // Granularity for msync(), which requires page-aligned addresses.
+  size_t page_size_ = 0;
+};
+
+}  // namespace nvram
+
+#endif  // NVRAM_HAL_FAKE_NVRAM_SLAB_STORAGE_H_
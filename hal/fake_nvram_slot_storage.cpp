@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fake_nvram_slot_storage.h"
+
+#include <string.h>
+
+#include <android-base/logging.h>
+
+#include "fake_nvram_record.h"
+
+namespace nvram {
+namespace {
+
+// Marks valid copies. "NVSB" in little-endian byte order.
+constexpr uint32_t kCopyMagic = 0x4253564e;
+
+// Copy header layout. All fields are little-endian. The CRC covers the header
+// fields preceding it followed by the copy's data.
+constexpr size_t kCopyMagicOffset = 0;
+constexpr size_t kCopyTypeOffset = 4;
+constexpr size_t kCopyIndexOffset = 8;
+constexpr size_t kCopySizeOffset = 12;
+constexpr size_t kCopySequenceLowOffset = 16;
+constexpr size_t kCopySequenceHighOffset = 20;
+constexpr size_t kCopyCrcOffset = 24;
+
+}  // namespace
+
+SlotStorageBackend::SlotStorageBackend(size_t copy_size)
+    : copy_size_(copy_size) {}
+
+storage::Status SlotStorageBackend::LoadHeader(Blob* blob) {
+  if (slots_[0].type != CopyType::kHeader) {
+    return storage::Status::kNotFound;
+  }
+  return Load(0, blob);
+}
+
+storage::Status SlotStorageBackend::StoreHeader(const Blob& blob) {
+  return Store(0, CopyType::kHeader, 0, blob.data(), blob.size());
+}
+
+storage::Status SlotStorageBackend::LoadSpace(uint32_t index, Blob* blob) {
+  auto entry = space_slots_.find(index);
+  if (entry == space_slots_.end()) {
+    return storage::Status::kNotFound;
+  }
+  return Load(entry->second, blob);
+}
+
+storage::Status SlotStorageBackend::StoreSpace(uint32_t index,
+                                               const Blob& blob) {
+  auto entry = space_slots_.find(index);
+  if (entry != space_slots_.end()) {
+    return Store(entry->second, CopyType::kSpace, index, blob.data(),
+                 blob.size());
+  }
+
+  for (size_t slot = 1; slot < kNumSlots; ++slot) {
+    if (slots_[slot].type == CopyType::kFree) {
+      return Store(slot, CopyType::kSpace, index, blob.data(), blob.size());
+    }
+  }
+
+  LOG(ERROR) << "No free slot for space " << index;
+  return storage::Status::kStorageError;
+}
+
+storage::Status SlotStorageBackend::DeleteSpace(uint32_t index) {
+  auto entry = space_slots_.find(index);
+  if (entry == space_slots_.end()) {
+    return storage::Status::kNotFound;
+  }
+  return Store(entry->second, CopyType::kFree, index, nullptr, 0);
+}
+
+bool SlotStorageBackend::DecodeCopy(size_t slot,
+                                    int copy,
+                                    const uint8_t* address,
+                                    Slot* state) const {
+  uint32_t type = address[kCopyTypeOffset];
+  uint32_t size = GetUint32(address + kCopySizeOffset);
+  if (GetUint32(address + kCopyMagicOffset) != kCopyMagic ||
+      type < static_cast<uint32_t>(CopyType::kHeader) ||
+      type > static_cast<uint32_t>(CopyType::kFree) ||
+      size > copy_size_ - kCopyHeaderSize) {
+    return false;
+  }
+
+  // The header slot only ever holds the header, and vice versa.
+  if ((slot == 0) != (type == static_cast<uint32_t>(CopyType::kHeader))) {
+    return false;
+  }
+
+  uint32_t crc = Crc32(0, address, kCopyCrcOffset);
+  crc = Crc32(crc, address + kCopyHeaderSize, size);
+  if (crc != GetUint32(address + kCopyCrcOffset)) {
+    return false;
+  }
+
+  state->current = copy;
+  state->type = static_cast<CopyType>(type);
+  state->index = GetUint32(address + kCopyIndexOffset);
+  state->size = size;
+  state->sequence =
+      static_cast<uint64_t>(GetUint32(address + kCopySequenceLowOffset)) |
+      (static_cast<uint64_t>(GetUint32(address + kCopySequenceHighOffset))
+       << 32);
+  return true;
+}
+
+bool SlotStorageBackend::Scan() {
+  space_slots_.clear();
+  next_sequence_ = 1;
+
+  for (size_t slot = 0; slot < kNumSlots; ++slot) {
+    Slot state;
+    for (int copy = 0; copy < 2; ++copy) {
+      const uint8_t* address = FetchCopy(slot, copy);
+      if (!address) {
+        return false;
+      }
+
+      Slot candidate;
+      if (DecodeCopy(slot, copy, address, &candidate) &&
+          (state.current < 0 || candidate.sequence > state.sequence)) {
+        state = candidate;
+      }
+    }
+    slots_[slot] = state;
+
+    if (state.current >= 0 && state.sequence >= next_sequence_) {
+      next_sequence_ = state.sequence + 1;
+    }
+  }
+
+  for (size_t slot = 1; slot < kNumSlots; ++slot) {
+    if (slots_[slot].type != CopyType::kSpace) {
+      continue;
+    }
+
+    // A space only lives in a single slot, as it only moves to a different
+    // slot after being deleted. Guard against duplicates regardless, keeping
+    // the more recent one.
+    auto result = space_slots_.emplace(slots_[slot].index, slot);
+    if (!result.second) {
+      size_t other = result.first->second;
+      LOG(WARNING) << "Space " << slots_[slot].index
+                   << " present in multiple slots";
+      if (slots_[slot].sequence > slots_[other].sequence) {
+        slots_[other].type = CopyType::kFree;
+        result.first->second = slot;
+      } else {
+        slots_[slot].type = CopyType::kFree;
+      }
+    }
+  }
+
+  return true;
+}
+
+storage::Status SlotStorageBackend::Load(size_t slot, Blob* blob) {
+  const Slot& state = slots_[slot];
+  const uint8_t* address = FetchCopy(slot, state.current);
+  if (!address) {
+    return storage::Status::kStorageError;
+  }
+
+  size_t size = LoadSize(state.size);
+  if (!blob->Resize(size)) {
+    LOG(ERROR) << "Failed to allocate read buffer";
+    return storage::Status::kStorageError;
+  }
+
+  memcpy(blob->data(), address + kCopyHeaderSize, size);
+  return storage::Status::kSuccess;
+}
+
+storage::Status SlotStorageBackend::Store(size_t slot,
+                                          CopyType type,
+                                          uint32_t index,
+                                          const uint8_t* data,
+                                          uint32_t size) {
+  if (size > copy_size_ - kCopyHeaderSize) {
+    LOG(ERROR) << "Object too large for slot: " << size;
+    return storage::Status::kStorageError;
+  }
+
+  Slot& state = slots_[slot];
+  int copy = state.current == 0 ? 1 : 0;
+  uint8_t* address = PrepareCopy(slot, copy);
+  if (!address) {
+    return storage::Status::kStorageError;
+  }
+  uint64_t sequence = next_sequence_;
+
+  memset(address, 0, kCopyHeaderSize);
+  PutUint32(address + kCopyMagicOffset, kCopyMagic);
+  address[kCopyTypeOffset] = static_cast<uint8_t>(type);
+  PutUint32(address + kCopyIndexOffset, index);
+  PutUint32(address + kCopySizeOffset, size);
+  PutUint32(address + kCopySequenceLowOffset, static_cast<uint32_t>(sequence));
+  PutUint32(address + kCopySequenceHighOffset,
+            static_cast<uint32_t>(sequence >> 32));
+  if (size > 0) {
+    memcpy(address + kCopyHeaderSize, data, size);
+  }
+  uint32_t crc = Crc32(0, address, kCopyCrcOffset);
+  crc = Crc32(crc, address + kCopyHeaderSize, size);
+  PutUint32(address + kCopyCrcOffset, crc);
+
+  if (!CommitCopy(slot, copy, kCopyHeaderSize + size)) {
+    return storage::Status::kStorageError;
+  }
+
+  ++next_sequence_;
+  if (state.type == CopyType::kSpace && type != CopyType::kSpace) {
+    space_slots_.erase(state.index);
+  } else if (type == CopyType::kSpace) {
+    space_slots_[index] = slot;
+  }
+  state.current = copy;
+  state.type = type;
+  state.index = index;
+  state.size = size;
+  state.sequence = sequence;
+  return storage::Status::kSuccess;
+}
+
+}  // namespace nvram
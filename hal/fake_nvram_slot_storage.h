@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NVRAM_HAL_FAKE_NVRAM_SLOT_STORAGE_H_
+#define NVRAM_HAL_FAKE_NVRAM_SLOT_STORAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <unordered_map>
+
+#include <nvram/core/storage.h>
+
+namespace nvram {
+
+// Base class for storage backends that keep all storage objects in fixed-size
+// slots of a single preallocated region, such as a file or a block device.
+//
+// The region holds one slot for the header and one slot per possible space.
+// Each slot consists of two copies, each of which carries a sequence number and
+// a CRC32 over its contents. A store writes the copy that isn't current and
+// makes just that copy durable, so the previous version of the object remains
+// intact until the new one has been written. When scanning the region, the
+// valid copy with the higher sequence number of each slot becomes current;
+// copies torn by a crash fail the CRC check and are ignored. Deleting a space
+// writes a copy that marks the slot as free.
+//
+// Subclasses provide access to the copies. Calls must be serialized by the
+// caller.
+class SlotStorageBackend : public storage::StorageBackend {
+ public:
+  ~SlotStorageBackend() override = default;
+
+  // StorageBackend:
+  storage::Status LoadHeader(Blob* blob) override;
+  storage::Status StoreHeader(const Blob& blob) override;
+  storage::Status LoadSpace(uint32_t index, Blob* blob) override;
+  storage::Status StoreSpace(uint32_t index, const Blob& blob) override;
+  storage::Status DeleteSpace(uint32_t index) override;
+
+ protected:
+  // Number of space slots, which matches the number of spaces |NvramManager|
+  // supports. Slot 0 holds the header, the space slots follow.
+  static constexpr size_t kNumSpaceSlots = 32;
+  static constexpr size_t kNumSlots = 1 + kNumSpaceSlots;
+
+  // Size of the header at the start of each copy, which precedes the data.
+  static constexpr size_t kCopyHeaderSize = 32;
+
+  // Creates a backend whose copies are |copy_size| bytes each.
+  explicit SlotStorageBackend(size_t copy_size);
+
+  // Returns the address of the contents of copy |copy| of slot |slot|, or
+  // nullptr on failure. The contents need to remain available until the next
+  // call to |FetchCopy()| or |PrepareCopy()|.
+  virtual const uint8_t* FetchCopy(size_t slot, int copy) = 0;
+
+  // Returns a buffer of |copy_size()| bytes to place the new contents of copy
+  // |copy| of slot |slot| in, or nullptr on failure.
+  virtual uint8_t* PrepareCopy(size_t slot, int copy) = 0;
+
+  // Makes the first |size| bytes of the prepared contents of copy |copy| of
+  // slot |slot| durable. Returns true if successful. On failure, the copy
+  // should be kept from becoming current if it reaches the underlying storage
+  // later, where possible.
+  virtual bool CommitCopy(size_t slot, int copy, size_t size) = 0;
+
+  // Returns the number of bytes to load for an object of |size| bytes.
+  // Subclasses performing I/O at copy granularity may load the entire copy.
+  virtual size_t LoadSize(uint32_t size) const { return size; }
+
+  // Determines the current copies of all slots and rebuilds the space index.
+  // Returns true if successful.
+  bool Scan();
+
+  size_t copy_size() const { return copy_size_; }
+
+ private:
+  enum class CopyType : uint8_t {
+    kHeader = 1,
+    kSpace = 2,
+    kFree = 3,
+  };
+
+  // In-memory state of a slot, reflecting its current copy.
+  struct Slot {
+    // The current copy, or -1 if neither copy is valid.
+    int current = -1;
+    CopyType type = CopyType::kFree;
+    uint32_t index = 0;
+    uint32_t size = 0;
+    uint64_t sequence = 0;
+  };
+
+  // Validates the contents of copy |copy| of slot |slot| at |address| and
+  // fills in |state| from them. Returns true if the copy is intact.
+  bool DecodeCopy(size_t slot,
+                  int copy,
+                  const uint8_t* address,
+                  Slot* state) const;
+
+  // Loads the current copy of |slot| into |blob|.
+  storage::Status Load(size_t slot, Blob* blob);
+
+  // Writes a copy of the given |type| to |slot|, replacing its current copy
+  // once it's durable.
+  storage::Status Store(size_t slot,
+                        CopyType type,
+                        uint32_t index,
+                        const uint8_t* data,
+                        uint32_t size);
+
+  const size_t copy_size_;
+
+  // Sequence number for the next copy written.
+  uint64_t next_sequence_ = 1;
+
+  Slot slots_[kNumSlots];
+  std::unordered_map<uint32_t, size_t> space_slots_;
+};
+
+}  // namespace nvram
+
+#endif  // NVRAM_HAL_FAKE_NVRAM_SLOT_STORAGE_H_
@@ -0,0 +1,464 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fake_nvram_snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+
+#include <nvram/core/persistence.h>
+
+#include "fake_nvram_record.h"
+
+namespace nvram {
+namespace {
+
+// Marks the start of an archive. "NVSA" in little-endian byte order.
+constexpr uint32_t kArchiveMagic = 0x4153564e;
+
+// Bump this upon making incompatible changes to the archive format.
+constexpr uint32_t kArchiveVersion = 1;
+
+// Archive header layout. All fields are little-endian.
+constexpr size_t kArchiveMagicOffset = 0;
+constexpr size_t kArchiveVersionOffset = 4;
+constexpr size_t kArchiveNumShardsOffset = 8;
+constexpr size_t kArchiveNumRecordsOffset = 12;
+constexpr size_t kArchiveHeaderSize = 16;
+
+// Record header layout. Each record header is directly followed by the object
+// data.
+constexpr size_t kRecordTypeOffset = 0;
+constexpr size_t kRecordShardOffset = 1;
+constexpr size_t kRecordIndexOffset = 4;
+constexpr size_t kRecordSizeOffset = 8;
+constexpr size_t kRecordHeaderSize = 12;
+
+// The archive ends in a CRC32 over all preceding bytes.
+constexpr size_t kArchiveTrailerSize = 4;
+
+// Upper bound for the size of archives we're willing to import.
+constexpr off_t kMaxArchiveSize = 16 * 1024 * 1024;
+
+// Suffix of the temporary file an archive is written to before it gets
+// renamed into place.
+constexpr char kTempFileSuffix[] = ".tmp";
+
+enum class RecordType : uint8_t {
+  kHeader = 1,
+  kSpace = 2,
+};
+
+// An object in an archive that's being imported.
+struct ArchiveObject {
+  uint32_t index = 0;
+  const uint8_t* data = nullptr;
+  uint32_t size = 0;
+};
+
+// The objects in an archive that belong to one shard.
+struct ArchiveShard {
+  bool has_header = false;
+  ArchiveObject header;
+  std::vector<ArchiveObject> spaces;
+};
+
+void AppendRecord(RecordType type,
+                  size_t shard,
+                  uint32_t index,
+                  const std::vector<uint8_t>& data,
+                  std::vector<uint8_t>* archive) {
+  size_t offset = archive->size();
+  archive->resize(offset + kRecordHeaderSize + data.size());
+  uint8_t* record = archive->data() + offset;
+  memset(record, 0, kRecordHeaderSize);
+  record[kRecordTypeOffset] = static_cast<uint8_t>(type);
+  record[kRecordShardOffset] = static_cast<uint8_t>(shard);
+  PutUint32(record + kRecordIndexOffset, index);
+  PutUint32(record + kRecordSizeOffset, static_cast<uint32_t>(data.size()));
+  if (!data.empty()) {
+    memcpy(record + kRecordHeaderSize, data.data(), data.size());
+  }
+}
+
+// Reads the archive at |path| into |contents| and verifies its framing and
+// checksum. Returns true if successful.
+bool ReadArchive(int dir_fd, const char* path, std::vector<uint8_t>* contents) {
+  android::base::unique_fd fd(
+      TEMP_FAILURE_RETRY(openat(dir_fd, path, O_RDONLY | O_CLOEXEC)));
+  if (fd.get() < 0) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return false;
+  }
+
+  struct stat archive_stat;
+  if (TEMP_FAILURE_RETRY(fstat(fd.get(), &archive_stat))) {
+    PLOG(ERROR) << "Failed to stat " << path;
+    return false;
+  }
+
+  if (archive_stat.st_size < static_cast<off_t>(kArchiveHeaderSize +
+                                                kArchiveTrailerSize) ||
+      archive_stat.st_size > kMaxArchiveSize) {
+    LOG(ERROR) << "Bad archive size: " << archive_stat.st_size;
+    return false;
+  }
+
+  contents->resize(archive_stat.st_size);
+  if (!android::base::ReadFully(fd.get(), contents->data(),
+                                contents->size())) {
+    PLOG(ERROR) << "Failed to read " << path;
+    return false;
+  }
+
+  size_t crc_offset = contents->size() - kArchiveTrailerSize;
+  if (GetUint32(contents->data() + kArchiveMagicOffset) != kArchiveMagic ||
+      GetUint32(contents->data() + kArchiveVersionOffset) != kArchiveVersion ||
+      Crc32(0, contents->data(), crc_offset) !=
+          GetUint32(contents->data() + crc_offset)) {
+    LOG(ERROR) << path << " is not a valid snapshot archive";
+    return false;
+  }
+
+  return true;
+}
+
+// Splits the records in |archive| by shard. Returns true if successful.
+bool ParseArchive(const std::vector<uint8_t>& archive,
+                  size_t num_shards,
+                  std::vector<ArchiveShard>* shards) {
+  uint32_t archive_shards = GetUint32(archive.data() + kArchiveNumShardsOffset);
+  if (archive_shards != num_shards) {
+    LOG(ERROR) << "Archive holds " << archive_shards << " shards, expected "
+               << num_shards;
+    return false;
+  }
+
+  shards->clear();
+  shards->resize(num_shards);
+  uint32_t num_records = GetUint32(archive.data() + kArchiveNumRecordsOffset);
+  size_t end = archive.size() - kArchiveTrailerSize;
+  size_t offset = kArchiveHeaderSize;
+  for (uint32_t i = 0; i < num_records; ++i) {
+    if (end - offset < kRecordHeaderSize) {
+      LOG(ERROR) << "Truncated archive record " << i;
+      return false;
+    }
+
+    const uint8_t* record = archive.data() + offset;
+    ArchiveObject object;
+    object.index = GetUint32(record + kRecordIndexOffset);
+    object.size = GetUint32(record + kRecordSizeOffset);
+    object.data = record + kRecordHeaderSize;
+    size_t shard = record[kRecordShardOffset];
+    uint8_t type = record[kRecordTypeOffset];
+    if (object.size > end - offset - kRecordHeaderSize || shard >= num_shards) {
+      LOG(ERROR) << "Bad archive record " << i;
+      return false;
+    }
+
+    ArchiveShard* archive_shard = &(*shards)[shard];
+    if (type == static_cast<uint8_t>(RecordType::kHeader) &&
+        !archive_shard->has_header) {
+      archive_shard->has_header = true;
+      archive_shard->header = object;
+    } else if (type == static_cast<uint8_t>(RecordType::kSpace)) {
+      archive_shard->spaces.push_back(object);
+    } else {
+      LOG(ERROR) << "Bad archive record " << i;
+      return false;
+    }
+
+    offset += kRecordHeaderSize + object.size;
+  }
+
+  if (offset != end) {
+    LOG(ERROR) << "Trailing data after archive records";
+    return false;
+  }
+
+  return true;
+}
+
+// Writes the objects in |shard| to |storage|. Returns true if successful.
+bool RestoreShard(const ArchiveShard& shard, storage::StorageBackend* storage) {
+  // Determine which spaces exist before the import, so the ones that aren't in
+  // the archive can be deleted afterwards.
+  NvramHeader old_header;
+  storage::Status status = persistence::LoadHeader(storage, &old_header);
+  bool has_old_header = status == storage::Status::kSuccess;
+  if (status != storage::Status::kSuccess &&
+      status != storage::Status::kNotFound) {
+    LOG(ERROR) << "Failed to load header";
+    return false;
+  }
+
+  // Store the spaces before the header that refers to them, as the manager
+  // does when creating spaces.
+  Blob blob;
+  for (const ArchiveObject& space : shard.spaces) {
+    if (!blob.Assign(space.data, space.size) ||
+        storage->StoreSpace(space.index, blob) != storage::Status::kSuccess) {
+      LOG(ERROR) << "Failed to store space " << space.index;
+      return false;
+    }
+  }
+
+  if (shard.has_header) {
+    if (!blob.Assign(shard.header.data, shard.header.size) ||
+        storage->StoreHeader(blob) != storage::Status::kSuccess) {
+      LOG(ERROR) << "Failed to store header";
+      return false;
+    }
+  } else if (has_old_header &&
+             persistence::StoreHeader(storage, NvramHeader()) !=
+                 storage::Status::kSuccess) {
+    // The archived shard was empty, so the existing header gets replaced with
+    // one that doesn't list any spaces.
+    LOG(ERROR) << "Failed to store header";
+    return false;
+  }
+
+  if (!has_old_header) {
+    return true;
+  }
+
+  auto delete_stale_space = [&](uint32_t index) {
+    for (const ArchiveObject& space : shard.spaces) {
+      if (space.index == index) {
+        return true;
+      }
+    }
+    status = storage->DeleteSpace(index);
+    if (status != storage::Status::kSuccess &&
+        status != storage::Status::kNotFound) {
+      LOG(ERROR) << "Failed to delete space " << index;
+      return false;
+    }
+    return true;
+  };
+
+  for (size_t i = 0; i < old_header.allocated_indices.size(); ++i) {
+    if (!delete_stale_space(old_header.allocated_indices[i])) {
+      return false;
+    }
+  }
+
+  return !old_header.provisional_index.valid() ||
+         delete_stale_space(old_header.provisional_index.value());
+}
+
+}  // namespace
+
+SnapshotStorageBackend::SnapshotStorageBackend(
+    storage::StorageBackend* backend)
+    : backend_(backend) {}
+
+bool SnapshotStorageBackend::Open() {
+  header_.reset();
+  spaces_.clear();
+
+  // The header tells which spaces there are.
+  NvramHeader header;
+  storage::Status status = persistence::LoadHeader(backend_, &header);
+  if (status == storage::Status::kNotFound) {
+    return true;
+  }
+
+  Blob blob;
+  if (status != storage::Status::kSuccess ||
+      backend_->LoadHeader(&blob) != storage::Status::kSuccess) {
+    LOG(ERROR) << "Failed to load header";
+    return false;
+  }
+  Update(blob, &header_);
+
+  // A provisional space may or may not be present, see |NvramHeader|.
+  auto load_space = [&](uint32_t index) {
+    status = backend_->LoadSpace(index, &blob);
+    if (status == storage::Status::kSuccess) {
+      Update(blob, &spaces_[index]);
+    } else if (status != storage::Status::kNotFound) {
+      LOG(ERROR) << "Failed to load space " << index;
+      return false;
+    }
+    return true;
+  };
+
+  for (size_t i = 0; i < header.allocated_indices.size(); ++i) {
+    if (!load_space(header.allocated_indices[i])) {
+      return false;
+    }
+  }
+
+  return !header.provisional_index.valid() ||
+         load_space(header.provisional_index.value());
+}
+
+void SnapshotStorageBackend::TakeSnapshot(StorageSnapshot* snapshot) const {
+  snapshot->header = header_;
+  snapshot->spaces.clear();
+  for (const auto& space : spaces_) {
+    snapshot->spaces.emplace_hint(snapshot->spaces.end(), space.first,
+                                  space.second);
+  }
+}
+
+storage::Status SnapshotStorageBackend::LoadHeader(Blob* blob) {
+  return backend_->LoadHeader(blob);
+}
+
+storage::Status SnapshotStorageBackend::StoreHeader(const Blob& blob) {
+  storage::Status status = backend_->StoreHeader(blob);
+  if (status == storage::Status::kSuccess) {
+    Update(blob, &header_);
+  }
+  return status;
+}
+
+storage::Status SnapshotStorageBackend::LoadSpace(uint32_t index, Blob* blob) {
+  return backend_->LoadSpace(index, blob);
+}
+
+storage::Status SnapshotStorageBackend::StoreSpace(uint32_t index,
+                                                   const Blob& blob) {
+  storage::Status status = backend_->StoreSpace(index, blob);
+  if (status == storage::Status::kSuccess) {
+    Update(blob, &spaces_[index]);
+  }
+  return status;
+}
+
+storage::Status SnapshotStorageBackend::DeleteSpace(uint32_t index) {
+  storage::Status status = backend_->DeleteSpace(index);
+  if (status == storage::Status::kSuccess ||
+      status == storage::Status::kNotFound) {
+    spaces_.erase(index);
+  }
+  return status;
+}
+
+// static
+void SnapshotStorageBackend::Update(const Blob& blob, MutableData* data) {
+  // Snapshots only ever get created by |TakeSnapshot()|, which the caller
+  // serializes with this call. So if there is no other reference right now,
+  // there won't be one while the buffer gets overwritten.
+  if (*data && data->use_count() == 1) {
+    (*data)->assign(blob.data(), blob.data() + blob.size());
+  } else {
+    data->reset(new std::vector<uint8_t>(blob.data(),
+                                         blob.data() + blob.size()));
+  }
+}
+
+bool ExportSnapshotArchive(int dir_fd,
+                           const char* path,
+                           const StorageSnapshot* snapshots,
+                           size_t num_shards) {
+  std::vector<uint8_t> archive(kArchiveHeaderSize);
+  uint32_t num_records = 0;
+  for (size_t i = 0; i < num_shards; ++i) {
+    if (snapshots[i].header) {
+      AppendRecord(RecordType::kHeader, i, 0, *snapshots[i].header, &archive);
+      ++num_records;
+    }
+    for (const auto& space : snapshots[i].spaces) {
+      AppendRecord(RecordType::kSpace, i, space.first, *space.second,
+                   &archive);
+      ++num_records;
+    }
+  }
+
+  PutUint32(archive.data() + kArchiveMagicOffset, kArchiveMagic);
+  PutUint32(archive.data() + kArchiveVersionOffset, kArchiveVersion);
+  PutUint32(archive.data() + kArchiveNumShardsOffset,
+            static_cast<uint32_t>(num_shards));
+  PutUint32(archive.data() + kArchiveNumRecordsOffset, num_records);
+  size_t crc_offset = archive.size();
+  archive.resize(crc_offset + kArchiveTrailerSize);
+  PutUint32(archive.data() + crc_offset,
+            Crc32(0, archive.data(), crc_offset));
+
+  std::string temp_path = std::string(path) + kTempFileSuffix;
+  android::base::unique_fd fd(TEMP_FAILURE_RETRY(
+      openat(dir_fd, temp_path.c_str(),
+             O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR)));
+  if (fd.get() < 0) {
+    PLOG(ERROR) << "Failed to open " << temp_path;
+    return false;
+  }
+
+  if (!android::base::WriteFully(fd.get(), archive.data(), archive.size()) ||
+      TEMP_FAILURE_RETRY(fdatasync(fd.get()))) {
+    PLOG(ERROR) << "Failed to write " << temp_path;
+    TEMP_FAILURE_RETRY(unlinkat(dir_fd, temp_path.c_str(), 0));
+    return false;
+  }
+
+  if (TEMP_FAILURE_RETRY(
+          renameat(dir_fd, temp_path.c_str(), dir_fd, path))) {
+    PLOG(ERROR) << "Failed to move " << temp_path << " to " << path;
+    TEMP_FAILURE_RETRY(unlinkat(dir_fd, temp_path.c_str(), 0));
+    return false;
+  }
+
+  // Make the rename durable.
+  android::base::unique_fd parent_fd(TEMP_FAILURE_RETRY(
+      openat(dir_fd, android::base::Dirname(path).c_str(),
+             O_RDONLY | O_DIRECTORY | O_CLOEXEC)));
+  if (parent_fd.get() < 0 || TEMP_FAILURE_RETRY(fsync(parent_fd.get()))) {
+    PLOG(WARNING) << "Failed to sync directory of " << path;
+  }
+
+  LOG(INFO) << "Exported " << num_records << " objects to " << path;
+  return true;
+}
+
+bool ImportSnapshotArchive(int dir_fd,
+                           const char* path,
+                           storage::StorageBackend* const* storage,
+                           size_t num_shards) {
+  // Validate the entire archive before touching storage.
+  std::vector<uint8_t> archive;
+  std::vector<ArchiveShard> shards;
+  if (!ReadArchive(dir_fd, path, &archive) ||
+      !ParseArchive(archive, num_shards, &shards)) {
+    return false;
+  }
+
+  for (size_t i = 0; i < num_shards; ++i) {
+    if (!RestoreShard(shards[i], storage[i])) {
+      LOG(ERROR) << "Failed to restore shard " << i << " from " << path;
+      return false;
+    }
+  }
+
+  LOG(INFO) << "Imported "
+            << GetUint32(archive.data() + kArchiveNumRecordsOffset)
+            << " objects from " << path;
+  return true;
+}
+
+}  // namespace nvram
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NVRAM_HAL_FAKE_NVRAM_SNAPSHOT_H_
+#define NVRAM_HAL_FAKE_NVRAM_SNAPSHOT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <nvram/core/storage.h>
+
+namespace nvram {
+
+// A point-in-time copy of the storage objects of one storage backend.
+//
+// The object data is shared with the |SnapshotStorageBackend| that produced the
+// snapshot and never modified, so taking a snapshot only copies references.
+struct StorageSnapshot {
+  using Data = std::shared_ptr<const std::vector<uint8_t>>;
+
+  // The header, or nullptr if there is none.
+  Data header;
+
+  // The space data, keyed by space index.
+  std::map<uint32_t, Data> spaces;
+};
+
+// A storage backend that forwards to another backend and keeps a copy-on-write
+// mirror of the stored objects in memory, so snapshots can be taken without
+// reading anything back from storage.
+//
+// A store only updates the mirror once the wrapped backend has succeeded. The
+// mirror replaces the data of objects referenced by a snapshot rather than
+// overwriting it, buffers that aren't referenced by any snapshot get reused.
+//
+// Calls, including |TakeSnapshot()|, must be serialized by the caller.
+// Snapshots themselves may be used and released on any thread.
+class SnapshotStorageBackend : public storage::StorageBackend {
+ public:
+  // Wraps |backend|, which must outlive this object.
+  explicit SnapshotStorageBackend(storage::StorageBackend* backend);
+  ~SnapshotStorageBackend() override = default;
+
+  // Populates the mirror with the header and the spaces it lists. Returns true
+  // if successful.
+  bool Open();
+
+  // Fills |snapshot| with the current objects.
+  void TakeSnapshot(StorageSnapshot* snapshot) const;
+
+  // StorageBackend:
+  storage::Status LoadHeader(Blob* blob) override;
+  storage::Status StoreHeader(const Blob& blob) override;
+  storage::Status LoadSpace(uint32_t index, Blob* blob) override;
+  storage::Status StoreSpace(uint32_t index, const Blob& blob) override;
+  storage::Status DeleteSpace(uint32_t index) override;
+
+ private:
+  using MutableData = std::shared_ptr<std::vector<uint8_t>>;
+
+  // Updates |data| to hold the contents of |blob|.
+  static void Update(const Blob& blob, MutableData* data);
+
+  storage::StorageBackend* const backend_;
+  MutableData header_;
+  std::map<uint32_t, MutableData> spaces_;
+};
+
+// Writes the |num_shards| snapshots in |snapshots| to an archive file at |path|,
+// relative to |dir_fd| unless absolute. The archive is written to a temporary
+// file first and then renamed, so |path| either holds the previous or the new
+// archive. Returns true if successful.
+bool ExportSnapshotArchive(int dir_fd,
+                           const char* path,
+                           const StorageSnapshot* snapshots,
+                           size_t num_shards);
+
+// Restores the objects in the archive file at |path| to the |num_shards|
+// backends in |storage|. The archive must have been exported with the same
+// number of shards. Objects are written to storage directly, spaces first and
+// the header last, after which spaces not in the archive are deleted. Returns
+// true if successful.
+bool ImportSnapshotArchive(int dir_fd,
+                           const char* path,
+                           storage::StorageBackend* const* storage,
+                           size_t num_shards);
+
+}  // namespace nvram
+
+#endif  // NVRAM_HAL_FAKE_NVRAM_SNAPSHOT_H_
@@ -23,12 +23,24 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/unique_fd.h>
 
 #include <nvram/core/logger.h>
 
+#include "fake_nvram_io_uring.h"
+
 // An NVRAM storage layer implementation backed by the file system.
 //
 // NOTE: This does not meet the tamper evidence requirements for
@@ -43,26 +55,110 @@ const char kHeaderFileName[] = "header";
 // Pattern for space data storage object names.
 const char kSpaceDataFileNamePattern[] = "space_%08x";
 
-// Temporary file name used in write-rename atomic write operations.
-const char kTempFileName[] = "temp";
+// Suffix appended to an object's name to form the name of the temporary file
+// used in write-rename atomic write operations. Each object has its own
+// temporary file, so stores of different objects may proceed concurrently.
+const char kTempFileNameSuffix[] = ".tmp";
 
 // Maximum size of objects we're willing to read and write.
 const off_t kMaxFileSize = 2048;
 
 // Buffer size for formatting names.
-using NameBuffer = char[16];
+using NameBuffer = char[64];
+
+// How long a group commit waits for stores that are still writing their data
+// to join the group.
+constexpr auto kGroupCommitWindow = std::chrono::microseconds(500);
+
+// Maximum number of stores committed as a group.
+constexpr size_t kGroupCommitMaxBatch = 16;
+
+// Maximum number of open file descriptors kept by the file descriptor cache.
+constexpr size_t kMaxCachedFiles = 64;
+
+// Number of submission queue entries for the storage io_uring. A file update
+// takes four entries.
+constexpr unsigned kStorageIoUringEntries = 8;
 
 // Global data directory descriptor.
 int g_data_dir_fd = -1;
 
-// Formats the storage object name for the given space index.
-bool FormatSpaceFileName(NameBuffer name, uint32_t index) {
-  int ret =
-      snprintf(name, sizeof(NameBuffer), kSpaceDataFileNamePattern, index);
-  return ret >= 0 && ret < static_cast<int>(sizeof(NameBuffer));
+// The io_uring used for file updates, if enabled. The ring is shared by all
+// storage backends, |g_io_uring_mutex| serializes its use.
+nvram::IoUring* g_io_uring = nullptr;
+std::mutex g_io_uring_mutex;
+
+// Whether temporary files get created via O_TMPFILE. Cleared if the file
+// system or kernel turn out not to support it.
+std::atomic<bool> g_use_tmpfile(true);
+
+// Keeps storage object files open across loads, so a load only needs a single
+// read. Stores put the descriptor of the new file in place of the replaced one.
+// Descriptors are shared, so they remain valid for loads in progress while
+// they get replaced or evicted.
+class FileCache {
+ public:
+  using FilePtr = std::shared_ptr<android::base::unique_fd>;
+
+  // Returns the cached descriptor for |name|, or nullptr if there is none.
+  FilePtr Get(const char* name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto entry = files_.find(name);
+    return entry != files_.end() ? entry->second : nullptr;
+  }
+
+  // Caches |file| as the descriptor for |name|.
+  void Put(const char* name, FilePtr file) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (files_.size() >= kMaxCachedFiles && files_.count(name) == 0) {
+      files_.erase(files_.begin());
+    }
+    files_[name] = std::move(file);
+  }
+
+  // Drops the cached descriptor for |name|, if any.
+  void Erase(const char* name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    files_.erase(name);
+  }
+
+ private:
+  std::mutex mutex_;
+  std::unordered_map<std::string, FilePtr> files_;
 };
 
+FileCache g_file_cache;
+
+// Checks the return value of snprintf() for errors and truncation.
+bool CheckFormatResult(int ret) {
+  return ret >= 0 && ret < static_cast<int>(sizeof(NameBuffer));
+}
+
+// Formats the storage object name for the header.
+bool FormatHeaderFileName(NameBuffer name, const std::string& prefix) {
+  return CheckFormatResult(snprintf(name, sizeof(NameBuffer), "%s%s",
+                                    prefix.c_str(), kHeaderFileName));
+}
+
+// Formats the storage object name for the given space index.
+bool FormatSpaceFileName(NameBuffer name,
+                         const std::string& prefix,
+                         uint32_t index) {
+  NameBuffer base_name;
+  return CheckFormatResult(snprintf(base_name, sizeof(NameBuffer),
+                                    kSpaceDataFileNamePattern, index)) &&
+         CheckFormatResult(snprintf(name, sizeof(NameBuffer), "%s%s",
+                                    prefix.c_str(), base_name));
+}
+
+// Formats the name of the temporary file for storage object |name|.
+bool FormatTempFileName(NameBuffer temp_name, const char* name) {
+  return CheckFormatResult(snprintf(temp_name, sizeof(NameBuffer), "%s%s",
+                                    name, kTempFileNameSuffix));
+}
+
 nvram::storage::Status DeleteFile(const char* name) {
+  g_file_cache.Erase(name);
   if (TEMP_FAILURE_RETRY(unlinkat(g_data_dir_fd, name, 0))) {
     if (errno == ENOENT) {
       return nvram::storage::Status::kNotFound;
@@ -76,75 +172,467 @@ nvram::storage::Status DeleteFile(const char* name) {
 
 // Loads the storage object identified by |name|.
 nvram::storage::Status LoadFile(const char* name, nvram::Blob* blob) {
-  android::base::unique_fd data_file_fd(
-      TEMP_FAILURE_RETRY(openat(g_data_dir_fd, name, O_RDONLY)));
-  if (data_file_fd.get() < 0) {
-    if (errno == ENOENT) {
-      return nvram::storage::Status::kNotFound;
+  FileCache::FilePtr data_file = g_file_cache.Get(name);
+  if (!data_file) {
+    data_file = std::make_shared<android::base::unique_fd>(
+        TEMP_FAILURE_RETRY(openat(g_data_dir_fd, name, O_RDONLY)));
+    if (data_file->get() < 0) {
+      if (errno == ENOENT) {
+        return nvram::storage::Status::kNotFound;
+      }
+      PLOG(ERROR) << "Failed to open " << name;
+      return nvram::storage::Status::kStorageError;
     }
-    PLOG(ERROR) << "Failed to open " << name;
+  }
+
+  // Read one byte more than permitted, so oversized files get detected without
+  // having to stat the file first.
+  if (!blob->Resize(kMaxFileSize + 1)) {
+    LOG(ERROR) << "Failed to allocate read buffer for " << name;
     return nvram::storage::Status::kStorageError;
   }
 
-  struct stat data_file_stat;
-  if (TEMP_FAILURE_RETRY(fstat(data_file_fd.get(), &data_file_stat))) {
-    PLOG(ERROR) << "Failed to stat " << name;
+  ssize_t bytes_read = TEMP_FAILURE_RETRY(
+      pread(data_file->get(), blob->data(), blob->size(), 0));
+  if (bytes_read < 0) {
+    PLOG(ERROR) << "Failed to read " << name;
     return nvram::storage::Status::kStorageError;
   }
 
-  if (data_file_stat.st_size > kMaxFileSize) {
-    LOG(ERROR) << "Bad size for " << name << ":" << data_file_stat.st_size;
+  if (bytes_read > kMaxFileSize) {
+    LOG(ERROR) << "Bad size for " << name << ":" << bytes_read;
     return nvram::storage::Status::kStorageError;
   }
 
-  if (!blob->Resize(data_file_stat.st_size)) {
+  if (!blob->Resize(bytes_read)) {
     LOG(ERROR) << "Failed to allocate read buffer for " << name;
     return nvram::storage::Status::kStorageError;
   }
 
-  if (!android::base::ReadFully(data_file_fd.get(), blob->data(),
-                                blob->size())) {
-    PLOG(ERROR) << "Failed to read " << name;
+  g_file_cache.Put(name, std::move(data_file));
+  return nvram::storage::Status::kSuccess;
+}
+
+// The steps of a file update, in order. Used to tag io_uring operations.
+enum class StoreStep : uint64_t {
+  kWrite,
+  kSyncFile,
+  kRename,
+  kSyncDirectory,
+  kCount,
+};
+
+constexpr unsigned kStoreStepCount = static_cast<unsigned>(StoreStep::kCount);
+
+// Waits for the operations of a file update that the kernel already picked up
+// when |g_io_uring| fails half-way, given that |completed| of them have been
+// reaped. The operations reference the caller's buffers and may still rename
+// the file, so they must finish before the update returns. Operations the
+// kernel didn't consume never run, as the ring gets disabled afterwards.
+void DrainStoreIoUring(unsigned completed) {
+  unsigned in_flight = kStoreStepCount - g_io_uring->Unconsumed() - completed;
+  while (in_flight > 0) {
+    uint64_t step;
+    int32_t result;
+    if (g_io_uring->PopCompletion(&step, &result)) {
+      if (step < kStoreStepCount) {
+        --in_flight;
+      }
+      continue;
+    }
+    if (!g_io_uring->Wait(in_flight)) {
+      LOG(FATAL) << "Failed to wait for outstanding io_uring operations.";
+    }
+  }
+}
+
+// Performs the write-rename sequence for |name| on |data_file_fd| as a chain of
+// linked io_uring operations, such that the whole update takes a single
+// submission. A failing operation cancels all operations after it.
+nvram::storage::Status StoreFileIoUring(const char* name,
+                                        const char* temp_name,
+                                        int data_file_fd,
+                                        const nvram::Blob& blob) {
+  std::lock_guard<std::mutex> lock(g_io_uring_mutex);
+  if (!g_io_uring) {
+    LOG(ERROR) << "io_uring storage got disabled.";
+    DeleteFile(temp_name);
+    return nvram::storage::Status::kStorageError;
+  }
+
+  struct io_uring_sqe* sqe = g_io_uring->GetSqe();
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = data_file_fd;
+  sqe->addr = reinterpret_cast<uintptr_t>(blob.data());
+  sqe->len = static_cast<uint32_t>(blob.size());
+  sqe->flags = IOSQE_IO_LINK;
+  sqe->user_data = static_cast<uint64_t>(StoreStep::kWrite);
+
+  sqe = g_io_uring->GetSqe();
+  sqe->opcode = IORING_OP_FSYNC;
+  sqe->fd = data_file_fd;
+  sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+  sqe->flags = IOSQE_IO_LINK;
+  sqe->user_data = static_cast<uint64_t>(StoreStep::kSyncFile);
+
+  sqe = g_io_uring->GetSqe();
+  sqe->opcode = IORING_OP_RENAMEAT;
+  sqe->fd = g_data_dir_fd;
+  sqe->addr = reinterpret_cast<uintptr_t>(temp_name);
+  sqe->len = static_cast<uint32_t>(g_data_dir_fd);
+  sqe->addr2 = reinterpret_cast<uintptr_t>(name);
+  sqe->flags = IOSQE_IO_LINK;
+  sqe->user_data = static_cast<uint64_t>(StoreStep::kRename);
+
+  sqe = g_io_uring->GetSqe();
+  sqe->opcode = IORING_OP_FSYNC;
+  sqe->fd = g_data_dir_fd;
+  sqe->user_data = static_cast<uint64_t>(StoreStep::kSyncDirectory);
+
+  if (!g_io_uring->Submit(kStoreStepCount)) {
+    // The state of the ring is unknown, so stop using it.
+    LOG(ERROR) << "Disabling io_uring storage after submission failure.";
+    DrainStoreIoUring(0);
+    g_io_uring = nullptr;
+    DeleteFile(temp_name);
+    return nvram::storage::Status::kStorageError;
+  }
+
+  int32_t results[kStoreStepCount];
+  unsigned completed = 0;
+  while (completed < kStoreStepCount) {
+    uint64_t step;
+    int32_t result;
+    if (!g_io_uring->PopCompletion(&step, &result)) {
+      if (!g_io_uring->Submit(kStoreStepCount - completed)) {
+        LOG(ERROR) << "Disabling io_uring storage after submission failure.";
+        DrainStoreIoUring(completed);
+        g_io_uring = nullptr;
+        DeleteFile(temp_name);
+        return nvram::storage::Status::kStorageError;
+      }
+      continue;
+    }
+    if (step < kStoreStepCount) {
+      results[step] = result;
+      ++completed;
+    }
+  }
+
+  const int32_t write_result =
+      results[static_cast<unsigned>(StoreStep::kWrite)];
+  if (write_result < 0 || static_cast<size_t>(write_result) != blob.size()) {
+    errno = write_result < 0 ? -write_result : EIO;
+    PLOG(ERROR) << "Failed to write " << temp_name;
+    DeleteFile(temp_name);
+    return nvram::storage::Status::kStorageError;
+  }
+
+  const int32_t sync_result =
+      results[static_cast<unsigned>(StoreStep::kSyncFile)];
+  if (sync_result < 0) {
+    errno = -sync_result;
+    PLOG(ERROR) << "Failed to sync " << temp_name;
+    DeleteFile(temp_name);
+    return nvram::storage::Status::kStorageError;
+  }
+
+  const int32_t rename_result =
+      results[static_cast<unsigned>(StoreStep::kRename)];
+  if (rename_result < 0) {
+    errno = -rename_result;
+    PLOG(ERROR) << "Failed to move " << temp_name << " to " << name;
+    DeleteFile(temp_name);
+    return nvram::storage::Status::kStorageError;
+  }
+
+  const int32_t dir_sync_result =
+      results[static_cast<unsigned>(StoreStep::kSyncDirectory)];
+  if (dir_sync_result < 0) {
+    errno = -dir_sync_result;
+    PLOG(ERROR) << "Failed to sync data directory";
     return nvram::storage::Status::kStorageError;
   }
 
   return nvram::storage::Status::kSuccess;
 }
 
-// Writes blob to the storage object indicated by |name|.
-nvram::storage::Status StoreFile(const char* name, const nvram::Blob& blob) {
-  android::base::unique_fd data_file_fd(TEMP_FAILURE_RETRY(
-      openat(g_data_dir_fd, kTempFileName, O_WRONLY | O_CREAT | O_TRUNC,
+// Writes |blob| to |data_file_fd| and syncs it. |temp_name| is only used for
+// logging.
+bool WriteAndSync(const char* temp_name,
+                  int data_file_fd,
+                  const nvram::Blob& blob) {
+  if (!android::base::WriteFully(data_file_fd, blob.data(), blob.size())) {
+    PLOG(ERROR) << "Failed to write " << temp_name;
+    return false;
+  }
+
+  // Force the file contents to be written to disk.
+  if (TEMP_FAILURE_RETRY(fdatasync(data_file_fd))) {
+    PLOG(ERROR) << "Failed to sync " << temp_name;
+    return false;
+  }
+
+  return true;
+}
+
+// Links the anonymous file at |proc_path| into the data directory as
+// |temp_name|. Returns false on errors, with |errno| set.
+bool LinkTempFile(const char* proc_path, const char* temp_name) {
+  return TEMP_FAILURE_RETRY(linkat(AT_FDCWD, proc_path, g_data_dir_fd,
+                                   temp_name, AT_SYMLINK_FOLLOW)) == 0;
+}
+
+// Writes |blob| to an anonymous O_TMPFILE file, which only gets linked into the
+// data directory as |temp_name| once its contents are durable. Thus, a crash
+// can't leave a partially written temporary file behind. Returns false if
+// O_TMPFILE isn't usable, in which case the caller should fall back to a named
+// temporary file.
+bool CreateAnonymousTempFile(const char* temp_name,
+                             const nvram::Blob& blob,
+                             android::base::unique_fd* data_file_fd) {
+  data_file_fd->reset(TEMP_FAILURE_RETRY(openat(
+      g_data_dir_fd, ".", O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR)));
+  if (data_file_fd->get() < 0) {
+    PLOG(WARNING) << "Failed to create anonymous temporary file";
+    return false;
+  }
+
+  if (!WriteAndSync(temp_name, data_file_fd->get(), blob)) {
+    return false;
+  }
+
+  // Linking via /proc doesn't require the privileges AT_EMPTY_PATH needs.
+  char proc_path[32];
+  snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d",
+           data_file_fd->get());
+  if (LinkTempFile(proc_path, temp_name)) {
+    return true;
+  }
+
+  // linkat() doesn't replace existing files, so remove a temporary file left
+  // behind by a crash, which is rare enough to not check on every store.
+  if (errno != EEXIST) {
+    PLOG(WARNING) << "Failed to link " << temp_name;
+    return false;
+  }
+  if (TEMP_FAILURE_RETRY(unlinkat(g_data_dir_fd, temp_name, 0)) &&
+      errno != ENOENT) {
+    PLOG(WARNING) << "Failed to remove " << temp_name;
+    return false;
+  }
+  if (!LinkTempFile(proc_path, temp_name)) {
+    PLOG(WARNING) << "Failed to link " << temp_name;
+    return false;
+  }
+
+  return true;
+}
+
+// Creates the temporary file |temp_name| holding |blob|, with its contents
+// synced to disk. The file stays open for reading and writing in
+// |data_file_fd|, so it can be cached once it replaces the storage object.
+nvram::storage::Status CreateTempFile(const char* temp_name,
+                                      const nvram::Blob& blob,
+                                      android::base::unique_fd* data_file_fd) {
+  if (g_use_tmpfile) {
+    if (CreateAnonymousTempFile(temp_name, blob, data_file_fd)) {
+      return nvram::storage::Status::kSuccess;
+    }
+    LOG(WARNING) << "Falling back to named temporary files.";
+    g_use_tmpfile = false;
+  }
+
+  data_file_fd->reset(TEMP_FAILURE_RETRY(
+      openat(g_data_dir_fd, temp_name, O_RDWR | O_CREAT | O_TRUNC,
              S_IRUSR | S_IWUSR)));
-  if (data_file_fd.get() < 0) {
+  if (data_file_fd->get() < 0) {
     if (errno == ENOENT) {
       return nvram::storage::Status::kNotFound;
     }
-    PLOG(ERROR) << "Failed to open " << kTempFileName;
+    PLOG(ERROR) << "Failed to open " << temp_name;
     return nvram::storage::Status::kStorageError;
   }
 
-  if (!android::base::WriteFully(data_file_fd.get(), blob.data(),
-                                 blob.size())) {
-    PLOG(ERROR) << "Failed to write " << kTempFileName;
-    DeleteFile(kTempFileName);
+  if (!WriteAndSync(temp_name, data_file_fd->get(), blob)) {
+    DeleteFile(temp_name);
     return nvram::storage::Status::kStorageError;
   }
 
-  // Force the file contents to be written to disk.
-  if (TEMP_FAILURE_RETRY(fdatasync(data_file_fd.get()))) {
-    PLOG(ERROR) << "Failed to sync " << kTempFileName;
-    DeleteFile(kTempFileName);
+  return nvram::storage::Status::kSuccess;
+}
+
+// Commits file stores in groups. Each store writes and syncs its temporary file
+// on its own, which allows the file system to merge concurrent data syncs. The
+// renames of all stores in a group then share a single directory sync, which
+// is the most expensive part of a store. Each store only completes once the
+// directory sync covering it has finished, so stores remain durable on return.
+//
+// Stores announce themselves via |BeginStore()| before writing their data. A
+// store that finds no group commit in progress becomes the group leader and
+// waits briefly for the other announced stores to join, so a single store
+// doesn't incur any delay.
+class GroupCommitter {
+ public:
+  // Announces a store that is about to write its temporary file. Must be
+  // followed by |Commit()| or |CancelStore()|.
+  void BeginStore() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++writers_;
+  }
+
+  // Withdraws an announced store that failed before committing.
+  void CancelStore() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    --writers_;
+    condition_.notify_all();
+  }
+
+  // Moves the synced temporary file |temp_name| into place as |name| and
+  // returns once the rename is durable.
+  nvram::storage::Status Commit(const char* temp_name, const char* name) {
+    PendingStore store;
+    store.temp_name = temp_name;
+    store.name = name;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    --writers_;
+    pending_.push_back(&store);
+    condition_.notify_all();
+
+    while (!store.done) {
+      if (leader_active_) {
+        condition_.wait(lock);
+        continue;
+      }
+
+      leader_active_ = true;
+      condition_.wait_for(lock, kGroupCommitWindow, [this]() {
+        return writers_ == 0 || pending_.size() >= kGroupCommitMaxBatch;
+      });
+
+      size_t batch_size = std::min(pending_.size(), kGroupCommitMaxBatch);
+      std::vector<PendingStore*> batch(pending_.begin(),
+                                       pending_.begin() + batch_size);
+      pending_.erase(pending_.begin(), pending_.begin() + batch_size);
+
+      lock.unlock();
+      CommitBatch(batch);
+      lock.lock();
+
+      leader_active_ = false;
+      condition_.notify_all();
+    }
+
+    return store.status;
+  }
+
+ private:
+  struct PendingStore {
+    const char* temp_name = nullptr;
+    const char* name = nullptr;
+    bool done = false;
+    nvram::storage::Status status = nvram::storage::Status::kStorageError;
+  };
+
+  // Renames the temporary files of |batch| and syncs the directory. Called
+  // without holding |mutex_|, marks the stores done under |mutex_|.
+  void CommitBatch(const std::vector<PendingStore*>& batch) {
+    std::vector<nvram::storage::Status> results(batch.size());
+    for (size_t i = 0; i < batch.size(); ++i) {
+      results[i] = nvram::storage::Status::kSuccess;
+      if (TEMP_FAILURE_RETRY(renameat(g_data_dir_fd, batch[i]->temp_name,
+                                      g_data_dir_fd, batch[i]->name))) {
+        PLOG(ERROR) << "Failed to move " << batch[i]->temp_name << " to "
+                    << batch[i]->name;
+        DeleteFile(batch[i]->temp_name);
+        results[i] = nvram::storage::Status::kStorageError;
+      }
+    }
+
+    // Force the directory meta data to be written to disk.
+    if (TEMP_FAILURE_RETRY(fsync(g_data_dir_fd))) {
+      PLOG(ERROR) << "Failed to sync data directory";
+      for (nvram::storage::Status& result : results) {
+        result = nvram::storage::Status::kStorageError;
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < batch.size(); ++i) {
+      batch[i]->status = results[i];
+      batch[i]->done = true;
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable condition_;
+
+  // Stores that have announced themselves but haven't reached |Commit()|.
+  size_t writers_ = 0;
+
+  // Stores waiting for the next group commit.
+  std::vector<PendingStore*> pending_;
+
+  // Whether a thread is currently committing a group.
+  bool leader_active_ = false;
+};
+
+// The group committer, if group commit is enabled.
+GroupCommitter* g_group_committer = nullptr;
+
+// Writes blob to the storage object indicated by |name| as part of a group
+// commit.
+nvram::storage::Status StoreFileGroupCommit(
+    const char* name,
+    const char* temp_name,
+    const nvram::Blob& blob,
+    android::base::unique_fd* data_file_fd) {
+  g_group_committer->BeginStore();
+
+  nvram::storage::Status status = CreateTempFile(temp_name, blob, data_file_fd);
+  if (status != nvram::storage::Status::kSuccess) {
+    g_group_committer->CancelStore();
+    return status;
+  }
+
+  return g_group_committer->Commit(temp_name, name);
+}
+
+// Writes blob to the storage object indicated by |name| using io_uring.
+nvram::storage::Status StoreFileViaIoUring(const char* name,
+                                           const char* temp_name,
+                                           const nvram::Blob& blob) {
+  android::base::unique_fd data_file_fd(TEMP_FAILURE_RETRY(
+      openat(g_data_dir_fd, temp_name, O_WRONLY | O_CREAT | O_TRUNC,
+             S_IRUSR | S_IWUSR)));
+  if (data_file_fd.get() < 0) {
+    if (errno == ENOENT) {
+      return nvram::storage::Status::kNotFound;
+    }
+    PLOG(ERROR) << "Failed to open " << temp_name;
     return nvram::storage::Status::kStorageError;
   }
 
-  data_file_fd.reset();
+  return StoreFileIoUring(name, temp_name, data_file_fd.get(), blob);
+}
+
+// Writes blob to the storage object indicated by |name| via the write-rename
+// sequence.
+nvram::storage::Status StoreFileSync(const char* name,
+                                     const char* temp_name,
+                                     const nvram::Blob& blob,
+                                     android::base::unique_fd* data_file_fd) {
+  nvram::storage::Status status = CreateTempFile(temp_name, blob, data_file_fd);
+  if (status != nvram::storage::Status::kSuccess) {
+    return status;
+  }
 
   // Move the file into place.
   if (TEMP_FAILURE_RETRY(
-          renameat(g_data_dir_fd, kTempFileName, g_data_dir_fd, name))) {
-    PLOG(ERROR) << "Failed to move " << kTempFileName << " to " << name;
-    DeleteFile(kTempFileName);
+          renameat(g_data_dir_fd, temp_name, g_data_dir_fd, name))) {
+    PLOG(ERROR) << "Failed to move " << temp_name << " to " << name;
+    DeleteFile(temp_name);
     return nvram::storage::Status::kStorageError;
   }
 
@@ -157,6 +645,89 @@ nvram::storage::Status StoreFile(const char* name, const nvram::Blob& blob) {
   return nvram::storage::Status::kSuccess;
 }
 
+// Writes blob to the storage object indicated by |name|.
+nvram::storage::Status StoreFile(const char* name, const nvram::Blob& blob) {
+  NameBuffer temp_name;
+  if (!FormatTempFileName(temp_name, name)) {
+    return nvram::storage::Status::kStorageError;
+  }
+
+  // Whatever the outcome, a cached descriptor may no longer refer to the
+  // current file.
+  g_file_cache.Erase(name);
+
+  if (!g_group_committer && g_io_uring) {
+    return StoreFileViaIoUring(name, temp_name, blob);
+  }
+
+  android::base::unique_fd data_file_fd;
+  nvram::storage::Status status =
+      g_group_committer
+          ? StoreFileGroupCommit(name, temp_name, blob, &data_file_fd)
+          : StoreFileSync(name, temp_name, blob, &data_file_fd);
+  if (status == nvram::storage::Status::kSuccess) {
+    g_file_cache.Put(name, std::make_shared<android::base::unique_fd>(
+                               std::move(data_file_fd)));
+  }
+  return status;
+}
+
+// A storage backend keeping each storage object in a file in the data
+// directory. The names of all files are prefixed with |name_prefix|, so
+// several backends can share the data directory.
+class FileStorageBackend : public nvram::storage::StorageBackend {
+ public:
+  explicit FileStorageBackend(const char* name_prefix)
+      : name_prefix_(name_prefix) {}
+
+  nvram::storage::Status LoadHeader(nvram::Blob* blob) override {
+    NameBuffer name;
+    if (!FormatHeaderFileName(name, name_prefix_)) {
+      return nvram::storage::Status::kStorageError;
+    }
+    return LoadFile(name, blob);
+  }
+
+  nvram::storage::Status StoreHeader(const nvram::Blob& blob) override {
+    NameBuffer name;
+    if (!FormatHeaderFileName(name, name_prefix_)) {
+      return nvram::storage::Status::kStorageError;
+    }
+    return StoreFile(name, blob);
+  }
+
+  nvram::storage::Status LoadSpace(uint32_t index, nvram::Blob* blob) override {
+    NameBuffer name;
+    if (!FormatSpaceFileName(name, name_prefix_, index)) {
+      return nvram::storage::Status::kStorageError;
+    }
+    return LoadFile(name, blob);
+  }
+
+  nvram::storage::Status StoreSpace(uint32_t index,
+                                    const nvram::Blob& blob) override {
+    NameBuffer name;
+    if (!FormatSpaceFileName(name, name_prefix_, index)) {
+      return nvram::storage::Status::kStorageError;
+    }
+    return StoreFile(name, blob);
+  }
+
+  nvram::storage::Status DeleteSpace(uint32_t index) override {
+    NameBuffer name;
+    if (!FormatSpaceFileName(name, name_prefix_, index)) {
+      return nvram::storage::Status::kStorageError;
+    }
+    return DeleteFile(name);
+  }
+
+ private:
+  const std::string name_prefix_;
+};
+
+// The backend behind the link-time storage functions.
+FileStorageBackend g_file_storage("");
+
 }  // namespace
 
 // Initializes the storage layer with the provided data directory descriptor.
@@ -164,40 +735,61 @@ void InitStorage(int data_dir_fd) {
   g_data_dir_fd = data_dir_fd;
 }
 
+// Switches file updates to io_uring. Returns false if io_uring isn't available
+// or lacks required operations, in which case storage keeps using synchronous
+// system calls.
+bool InitStorageIoUring() {
+  static nvram::IoUring io_uring;
+  if (!io_uring.Init(kStorageIoUringEntries)) {
+    return false;
+  }
+
+  if (!io_uring.IsSupported(IORING_OP_WRITE) ||
+      !io_uring.IsSupported(IORING_OP_FSYNC) ||
+      !io_uring.IsSupported(IORING_OP_RENAMEAT)) {
+    LOG(WARNING) << "io_uring lacks operations required for storage.";
+    return false;
+  }
+
+  g_io_uring = &io_uring;
+  return true;
+}
+
+// Enables group commit for file updates. This takes precedence over io_uring
+// file updates.
+void InitStorageGroupCommit() {
+  static GroupCommitter group_committer;
+  g_group_committer = &group_committer;
+}
+
+// Creates a file storage backend whose file names start with |name_prefix|.
+std::unique_ptr<nvram::storage::StorageBackend> CreateFileStorageBackend(
+    const char* name_prefix) {
+  return std::unique_ptr<nvram::storage::StorageBackend>(
+      new FileStorageBackend(name_prefix));
+}
+
 namespace nvram {
 namespace storage {
 
 Status LoadHeader(Blob* blob) {
-  return LoadFile(kHeaderFileName, blob);
+  return g_file_storage.LoadHeader(blob);
 }
 
 Status StoreHeader(const Blob& blob) {
-  return StoreFile(kHeaderFileName, blob);
+  return g_file_storage.StoreHeader(blob);
 }
 
 Status LoadSpace(uint32_t index, Blob* blob) {
-  NameBuffer name;
-  if (!FormatSpaceFileName(name, index)) {
-    return Status::kStorageError;
-  }
-  return LoadFile(name, blob);
+  return g_file_storage.LoadSpace(index, blob);
 }
 
 Status StoreSpace(uint32_t index, const Blob& blob) {
-  NameBuffer name;
-  if (!FormatSpaceFileName(name, index)) {
-    return Status::kStorageError;
-  }
-  return StoreFile(name, blob);
+  return g_file_storage.StoreSpace(index, blob);
 }
 
 Status DeleteSpace(uint32_t index) {
-  NameBuffer name;
-  if (!FormatSpaceFileName(name, index)) {
-    return Status::kStorageError;
-  }
-
-  return DeleteFile(name);
+  return g_file_storage.DeleteSpace(index);
 }
 
 }  // namespace storage
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <nvram/hal/in_process_nvram_implementation.h>
+
+namespace nvram {
+
+InProcessNvramImplementation::InProcessNvramImplementation(
+    storage::StorageBackend* storage,
+    bool encode_messages)
+    : encode_messages_(encode_messages), nvram_manager_(storage) {}
+
+void InProcessNvramImplementation::Execute(const nvram::Request& request,
+                                           nvram::Response* response) {
+  if (encode_messages_) {
+    ExecuteEncoded(request, response);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  nvram_manager_.Dispatch(request, response);
+}
+
+void InProcessNvramImplementation::ExecuteEncoded(
+    const nvram::Request& request,
+    nvram::Response* response) {
+  if (!DispatchEncoded(request, response)) {
+    response->result = NV_RESULT_INTERNAL_ERROR;
+  }
+}
+
+bool InProcessNvramImplementation::DispatchEncoded(
+    const nvram::Request& request,
+    nvram::Response* response) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  nvram::Request decoded_request;
+  if (!nvram::Encode(request, &message_buffer_) ||
+      !nvram::Decode(message_buffer_.data(), message_buffer_.size(),
+                     &decoded_request)) {
+    return false;
+  }
+
+  nvram::Response encoded_response;
+  nvram_manager_.Dispatch(decoded_request, &encoded_response);
+
+  return nvram::Encode(encoded_response, &message_buffer_) &&
+         nvram::Decode(message_buffer_.data(), message_buffer_.size(),
+                       response);
+}
+
+}  // namespace nvram
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NVRAM_HAL_IN_PROCESS_NVRAM_IMPLEMENTATION_H_
+#define NVRAM_HAL_IN_PROCESS_NVRAM_IMPLEMENTATION_H_
+
+#include <mutex>
+
+#include <nvram/core/nvram_manager.h>
+#include <nvram/core/storage.h>
+#include <nvram/hal/nvram_device_adapter.h>
+#include <nvram/messages/blob.h>
+
+namespace nvram {
+
+// An |NvramImplementation| that executes commands on an |NvramManager| in the
+// calling process, without any IPC. This is useful as a baseline for
+// benchmarks and as a fast backend for host-side tests.
+//
+// Each instance owns its |NvramManager|, which keeps its data in the storage
+// backend passed at construction. Commands are serialized per instance.
+// Instances sharing a backend share their spaces, but the managers don't
+// coordinate, so callers that want independent stores, e.g. tests that need a
+// fresh store, should give each instance its own backend.
+class InProcessNvramImplementation : public NvramImplementation {
+ public:
+  // The |NvramManager| keeps its data in |storage|, which must outlive the
+  // instance. The default backend forwards to the link-time storage functions
+  // declared in nvram/core/storage.h, e.g. those of libnvram-memory-storage.
+  //
+  // By default, requests and responses are passed to and from the
+  // |NvramManager| as is. If |encode_messages| is true, they're passed through
+  // their wire encoding instead, which accounts for message encoding cost
+  // without adding IPC cost.
+  explicit InProcessNvramImplementation(
+      storage::StorageBackend* storage = storage::GetDefaultStorageBackend(),
+      bool encode_messages = false);
+  ~InProcessNvramImplementation() override = default;
+
+  // NvramImplementation:
+  void Execute(const nvram::Request& request,
+               nvram::Response* response) override;
+  bool SupportsConcurrentRequests() const override { return true; }
+
+  // Executes |request| like Execute(), but passes |request| and |response|
+  // through their wire encoding regardless of |encode_messages|. This allows
+  // comparing both modes against the same |NvramManager|.
+  void ExecuteEncoded(const nvram::Request& request, nvram::Response* response);
+
+ private:
+  // Passes |request| and |response| through their wire encoding while
+  // executing |request|. Returns true if successful.
+  bool DispatchEncoded(const nvram::Request& request,
+                       nvram::Response* response);
+
+  const bool encode_messages_;
+
+  // Serializes access to |nvram_manager_| and |message_buffer_|.
+  std::mutex mutex_;
+
+  NvramManager nvram_manager_;
+
+  // Buffer for encoded messages, kept around across commands.
+  Blob message_buffer_;
+};
+
+}  // namespace nvram
+
+#endif  // NVRAM_HAL_IN_PROCESS_NVRAM_IMPLEMENTATION_H_
@@ -18,12 +18,16 @@
 #define NVRAM_HAL_NVRAM_DEVICE_ADAPTER_H_
 
 #include <memory>
+#include <mutex>
 
 #include <hardware/nvram.h>
+#include <nvram/hal/nvram_provisioning.h>
 #include <nvram/messages/nvram_messages.h>
 
 namespace nvram {
 
+class NvramResponseCache;
+
 // |NvramImplementation| subclasses provide an implementation of the NVRAM HAL
 // logic.
 class NvramImplementation {
@@ -35,6 +39,10 @@ class NvramImplementation {
   // the result and output parameters of the operation.
   virtual void Execute(const nvram::Request& request,
                        nvram::Response* response) = 0;
+
+  // Whether |Execute()| may be called concurrently from multiple threads. If
+  // not, |NvramDeviceAdapter| serializes all calls.
+  virtual bool SupportsConcurrentRequests() const { return false; }
 };
 
 // |NvramDeviceAdapater| provides glue to turn an |NvramImplementation| object
@@ -42,18 +50,36 @@ class NvramImplementation {
 // to be used in the HAL module's |open()| operation. To obtain the desired
 // |hw_device_t|, just create an |NvramDeviceAdapter| with a suitable
 // |NvramImplementation| and call |as_device()| to get the HAL device pointer.
+//
+// All device functions may be called concurrently from any thread. The adapter
+// serializes commands unless the implementation declares support for
+// concurrent requests.
 struct NvramDeviceAdapter {
  public:
   // Takes ownership of |implementation|.
   NvramDeviceAdapter(const hw_module_t* module,
                      NvramImplementation* implementation);
+  ~NvramDeviceAdapter();
 
   hw_device_t* as_device() { return &device_.common; }
   NvramImplementation* nvram_implementation() { return implementation_.get(); }
 
+  // Executes |request| on the implementation, honoring its threading
+  // requirements.
+  void Execute(const nvram::Request& request, nvram::Response* response);
+
+  // Recent GetInfo and GetSpaceInfo responses, which allow answering
+  // consecutive queries for the same information with a single command.
+  NvramResponseCache* response_cache() { return response_cache_.get(); }
+
  private:
   nvram_device_t device_;
   std::unique_ptr<NvramImplementation> implementation_;
+  std::unique_ptr<NvramResponseCache> response_cache_;
+
+  // Serializes commands for implementations that don't support concurrent
+  // requests.
+  std::mutex execute_mutex_;
 };
 
 // Make sure |NvramDeviceAdapter| is a standard layout type. This guarantees
@@ -62,6 +88,36 @@ struct NvramDeviceAdapter {
 static_assert(std::is_standard_layout<NvramDeviceAdapter>::value,
               "NvramDeviceAdapater must be a standard layout type.");
 
+// |NvramProvisioningDeviceAdapter| is the counterpart of |NvramDeviceAdapter|
+// for the optional provisioning device identified by
+// |NVRAM_PROVISIONING_DEVICE_ID|. It turns |provision_spaces()| and
+// |lock_spaces()| calls into COMMAND_PROVISION_SPACES and COMMAND_LOCK_SPACES
+// requests to |implementation|.
+struct NvramProvisioningDeviceAdapter {
+ public:
+  // Takes ownership of |implementation|.
+  NvramProvisioningDeviceAdapter(const hw_module_t* module,
+                                 NvramImplementation* implementation);
+  ~NvramProvisioningDeviceAdapter();
+
+  hw_device_t* as_device() { return &device_.common; }
+
+  // Executes |request| on the implementation, honoring its threading
+  // requirements.
+  void Execute(const nvram::Request& request, nvram::Response* response);
+
+ private:
+  nvram_provisioning_device_t device_;
+  std::unique_ptr<NvramImplementation> implementation_;
+
+  // Serializes commands for implementations that don't support concurrent
+  // requests.
+  std::mutex execute_mutex_;
+};
+
+static_assert(std::is_standard_layout<NvramProvisioningDeviceAdapter>::value,
+              "NvramProvisioningDeviceAdapter must be a standard layout type.");
+
 }  // namespace nvram
 
 #endif  // NVRAM_HAL_NVRAM_DEVICE_ADAPTER_H_
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NVRAM_HAL_NVRAM_PROVISIONING_H_
+#define NVRAM_HAL_NVRAM_PROVISIONING_H_
+
+#include <stdint.h>
+
+#include <hardware/hardware.h>
+#include <hardware/nvram.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// An optional device offered by NVRAM HAL modules in addition to
+// |NVRAM_HARDWARE_DEVICE_ID|. It exposes bulk operations on spaces, which are
+// intended for factory stations and bootloader handoff and not part of the
+// regular NVRAM HAL API.
+#define NVRAM_PROVISIONING_DEVICE_ID "nvram-provisioning"
+
+#define NVRAM_PROVISIONING_DEVICE_API_VERSION_0_1 HARDWARE_DEVICE_API_VERSION(0, 1)
+
+// Version 0.2 adds |lock_spaces()|.
+#define NVRAM_PROVISIONING_DEVICE_API_VERSION_0_2 HARDWARE_DEVICE_API_VERSION(0, 2)
+
+// Describes a space to be provisioned. Spaces are created with the given
+// |controls| and |authorization_value| just like |create_space()| does, and
+// the first |contents_size| bytes of the space are initialized to |contents|.
+// The remainder of the space is zero-filled.
+typedef struct nvram_provisioning_space {
+  uint32_t index;
+  uint64_t size;
+  const nvram_control_t* controls;
+  uint32_t num_controls;
+  const uint8_t* authorization_value;
+  uint32_t authorization_value_size;
+  const uint8_t* contents;
+  uint64_t contents_size;
+} nvram_provisioning_space_t;
+
+// Describes the locks to apply to a space. If |lock_write| is non-zero, the
+// space gets write locked as by |enable_write_lock()|. If |lock_read| is
+// non-zero, it gets read locked as by |enable_read_lock()|.
+typedef struct nvram_space_lock {
+  uint32_t index;
+  int lock_write;
+  int lock_read;
+  const uint8_t* authorization_value;
+  uint32_t authorization_value_size;
+} nvram_space_lock_t;
+
+typedef struct nvram_provisioning_device {
+  struct hw_device_t common;
+
+  // Creates |num_spaces| spaces as described by |spaces| in a single
+  // operation. All spaces are validated before any of them gets created. If
+  // the call fails, none of the spaces exist until the device restarts. In
+  // case of a storage error while recording the new spaces, they may all
+  // reappear after a restart, so callers should query the space list before
+  // retrying.
+  //
+  // Returns NV_RESULT_SUCCESS if all spaces have been created. Otherwise, the
+  // result code is the one |create_space()| would return for the first
+  // offending space, or NV_RESULT_INVALID_PARAMETER if |spaces| lists an index
+  // more than once or |contents_size| exceeds the space size.
+  nvram_result_t (*provision_spaces)(
+      const struct nvram_provisioning_device* device,
+      const nvram_provisioning_space_t* spaces,
+      uint32_t num_spaces);
+
+  // Applies the |num_locks| locks described by |locks| in a single operation.
+  // All locks are checked before any of them gets applied, so the call has no
+  // effect if one of them isn't permitted. Boot locks on spaces that have been
+  // accessed before are served from metadata held in memory, without loading
+  // space data from storage.
+  //
+  // Returns NV_RESULT_SUCCESS if all locks have been applied. Otherwise, the
+  // result code is the one |enable_write_lock()| or |enable_read_lock()| would
+  // return for the first offending lock.
+  nvram_result_t (*lock_spaces)(const struct nvram_provisioning_device* device,
+                                const nvram_space_lock_t* locks,
+                                uint32_t num_locks);
+} nvram_provisioning_device_t;
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  // NVRAM_HAL_NVRAM_PROVISIONING_H_
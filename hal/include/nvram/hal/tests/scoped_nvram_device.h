@@ -22,6 +22,7 @@
 
 #include <android-base/logging.h>
 #include <hardware/nvram.h>
+#include <nvram/hal/nvram_device_adapter.h>
 
 namespace nvram {
 
@@ -37,6 +38,11 @@ using ControlList = std::vector<nvram_control_t>;
 class ScopedNvramDevice {
  public:
   ScopedNvramDevice();
+
+  // Wraps a device that directly executes commands on |implementation| instead
+  // of going through the NVRAM HAL module. Takes ownership of
+  // |implementation|.
+  explicit ScopedNvramDevice(NvramImplementation* implementation);
   virtual ~ScopedNvramDevice();
 
   // Convenience methods which trivially wrap the device functions.
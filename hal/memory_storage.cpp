@@ -14,25 +14,41 @@
  * limitations under the License.
  */
 
+#include <string.h>
+
+#include <unordered_map>
+
 #include <nvram/core/storage.h>
 
 namespace nvram {
 namespace storage {
 namespace {
 
-// Maximum number of space blobs supported.
-const int kMaxSpaces = 32;
+// Copies |source| into |destination|. The buffer backing |destination| is
+// reused as is if the sizes match, which is the common case when a space gets
+// rewritten. Returns false if memory allocation fails, in which case
+// |destination| remains unchanged.
+bool CopyBlob(const Blob& source, Blob* destination) {
+  if (destination->size() != source.size() &&
+      !destination->Resize(source.size())) {
+    return false;
+  }
+
+  if (source.size() != 0) {
+    memcpy(destination->data(), source.data(), source.size());
+  }
+
+  return true;
+}
 
 class StorageSlot {
  public:
-  bool present() const { return blob_.size() != 0; }
-
   Status Load(Blob* blob) const {
-    if (blob_.size() == 0) {
+    if (!present_) {
       return Status::kNotFound;
     }
 
-    if (!blob->Assign(blob_.data(), blob_.size())) {
+    if (!CopyBlob(blob_, blob)) {
       return Status::kStorageError;
     }
 
@@ -40,41 +56,25 @@ class StorageSlot {
   }
 
   Status Store(const Blob& blob) {
-    if (!blob_.Assign(blob.data(), blob.size())) {
+    if (!CopyBlob(blob, &blob_)) {
       return Status::kStorageError;
     }
 
+    present_ = true;
     return Status::kSuccess;
   }
 
-  Status Delete() {
-    return blob_.Resize(0) ? Status::kSuccess : Status::kStorageError;
-  }
-
  private:
+  bool present_ = false;
   Blob blob_;
 };
 
 // Stores the header blob.
 StorageSlot g_header;
 
-// Stores the space blobs.
-struct {
-  uint32_t index;
-  StorageSlot slot;
-} g_spaces[kMaxSpaces];
-
-// Find the storage slot in |g_spaces| that corresponds to |index|. Returns
-// |nullptr| if no matching slot exists.
-StorageSlot* FindSpaceSlot(uint32_t index) {
-  for (size_t i = 0; i < kMaxSpaces; ++i) {
-    if (g_spaces[i].slot.present() && g_spaces[i].index == index) {
-      return &g_spaces[i].slot;
-    }
-  }
-
-  return nullptr;
-}
+// Stores the space blobs, keyed by space index. Deleting a space drops its
+// slot, so the map only ever holds the spaces that currently exist.
+std::unordered_map<uint32_t, StorageSlot> g_spaces;
 
 }  // namespace
 
@@ -87,33 +87,25 @@ Status StoreHeader(const Blob& blob) {
 }
 
 Status LoadSpace(uint32_t index, Blob* blob) {
-  StorageSlot* slot = FindSpaceSlot(index);
-  return slot ? slot->Load(blob) : Status::kNotFound;
+  auto entry = g_spaces.find(index);
+  return entry != g_spaces.end() ? entry->second.Load(blob)
+                                 : Status::kNotFound;
 }
 
 Status StoreSpace(uint32_t index, const Blob& blob) {
-  StorageSlot* slot = FindSpaceSlot(index);
-  if (slot) {
-    return slot->Store(blob);
+  // This creates an empty slot for new spaces. Drop it again if storing fails,
+  // so failed stores don't leave a space behind.
+  auto result = g_spaces.emplace(index, StorageSlot());
+  Status status = result.first->second.Store(blob);
+  if (status != Status::kSuccess && result.second) {
+    g_spaces.erase(result.first);
   }
 
-  // Allocate a new slot.
-  for (size_t i = 0; i < kMaxSpaces; ++i) {
-    if (!g_spaces[i].slot.present()) {
-      g_spaces[i].index = index;
-      return g_spaces[i].slot.Store(blob);
-    }
-  }
-
-  return Status::kStorageError;
+  return status;
 }
 
 Status DeleteSpace(uint32_t index) {
-  StorageSlot* slot = FindSpaceSlot(index);
-  if (slot) {
-    slot->Delete();
-  }
-
+  g_spaces.erase(index);
   return Status::kSuccess;
 }
 
@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "multiplexed_connection.h"
+
+#include <sys/socket.h>
+
+#include <utility>
+
+#include <android-base/logging.h>
+
+#include <nvram/messages/framing.h>
+
+namespace nvram {
+
+MultiplexedConnection::MultiplexedConnection(android::base::unique_fd socket)
+    : socket_(std::move(socket)),
+      output_stream_(socket_.get(), kFrameRecordSize),
+      input_stream_(socket_.get(), kFrameRecordSize) {}
+
+MultiplexedConnection::~MultiplexedConnection() = default;
+
+NegotiationResult MultiplexedConnection::Negotiate() {
+  FrameHeader probe;
+  probe.flags = kFrameFlagProbe | kFrameFlagRequestId;
+  if (!WriteFrameHeader(&output_stream_, probe) || !output_stream_.Flush()) {
+    return NegotiationResult::kError;
+  }
+
+  FrameHeader reply;
+  if (!ReadFrameHeader(&input_stream_, &reply)) {
+    return input_stream_.error() ? NegotiationResult::kError
+                                 : NegotiationResult::kUnsupported;
+  }
+
+  if ((reply.flags & kFrameFlagProbe) == 0 ||
+      (reply.flags & kFrameFlagRequestId) == 0) {
+    return NegotiationResult::kUnsupported;
+  }
+  return NegotiationResult::kSupported;
+}
+
+bool MultiplexedConnection::Execute(const Request& request,
+                                    Response* response) {
+  PendingRequest pending;
+  pending.response = response;
+  uint32_t request_id;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (broken_) {
+      return false;
+    }
+    request_id = next_request_id_++;
+    pending_[request_id] = &pending;
+  }
+
+  bool sent;
+  {
+    std::lock_guard<std::mutex> write_lock(write_mutex_);
+    sent = WriteTaggedFrame(&output_stream_, request_id, request) &&
+           output_stream_.Flush();
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!sent) {
+    PLOG(ERROR) << "Failed to send request on NVRAM control socket";
+    Fail();
+  }
+
+  while (!pending.done) {
+    if (reader_active_) {
+      condition_.wait(lock);
+      continue;
+    }
+
+    reader_active_ = true;
+    if (!ReadResponse(&lock)) {
+      Fail();
+    }
+    reader_active_ = false;
+    condition_.notify_all();
+  }
+
+  return pending.success;
+}
+
+bool MultiplexedConnection::broken() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return broken_;
+}
+
+size_t MultiplexedConnection::in_flight() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return pending_.size();
+}
+
+bool MultiplexedConnection::ReadResponse(std::unique_lock<std::mutex>* lock) {
+  // Don't block other threads from issuing requests while waiting for data.
+  lock->unlock();
+  FrameHeader header;
+  bool success = ReadFrameHeader(&input_stream_, &header) &&
+                 (header.flags & kFrameFlagRequestId) != 0;
+  lock->lock();
+
+  if (!success) {
+    LOG(ERROR) << "Failed to read NVRAM response header.";
+    return false;
+  }
+
+  auto entry = pending_.find(header.request_id);
+  if (entry == pending_.end()) {
+    LOG(ERROR) << "Received response for unknown request "
+               << header.request_id;
+    return false;
+  }
+
+  // Take the request out of |pending_|, so |Fail()| won't complete it while
+  // the response gets decoded into it.
+  PendingRequest* pending = entry->second;
+  pending_.erase(entry);
+
+  lock->unlock();
+  success = ReadFramePayload(&input_stream_, header, pending->response);
+  lock->lock();
+
+  pending->done = true;
+  pending->success = success;
+  if (!success) {
+    LOG(ERROR) << "Failed to decode NVRAM response.";
+  }
+  return success;
+}
+
+void MultiplexedConnection::Fail() {
+  if (!broken_) {
+    broken_ = true;
+    // Unblock the reader, if any.
+    shutdown(socket_.get(), SHUT_RDWR);
+  }
+
+  for (auto& entry : pending_) {
+    entry.second->done = true;
+    entry.second->success = false;
+  }
+  pending_.clear();
+  condition_.notify_all();
+}
+
+}  // namespace nvram
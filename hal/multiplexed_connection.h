@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NVRAM_HAL_MULTIPLEXED_CONNECTION_H_
+#define NVRAM_HAL_MULTIPLEXED_CONNECTION_H_
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <unordered_map>
+
+#include <android-base/unique_fd.h>
+
+#include <nvram/messages/fd_io.h>
+#include <nvram/messages/nvram_messages.h>
+
+namespace nvram {
+
+// Outcome of a protocol feature negotiation with the daemon.
+enum class NegotiationResult {
+  // The daemon supports the feature.
+  kSupported,
+  // The daemon answered, but doesn't support the feature.
+  kUnsupported,
+  // The negotiation failed due to an I/O error. It may succeed on retry.
+  kError,
+};
+
+// A framed connection to the fake NVRAM daemon that allows multiple threads to
+// have requests in flight at the same time. Requests are sent as tagged frames
+// and responses are routed back to the waiting threads by request ID.
+//
+// There's no dedicated receiver thread. Instead, one of the waiting threads
+// takes on the reader role at a time, reading responses and handing them to
+// their recipients until its own response arrives.
+class MultiplexedConnection {
+ public:
+  // Takes ownership of |socket|, which must be connected to the daemon.
+  explicit MultiplexedConnection(android::base::unique_fd socket);
+  ~MultiplexedConnection();
+
+  // Negotiates framed mode with tagged frames. Daemons that don't support
+  // framing drop the connection or reply with something other than a frame
+  // header, while daemons that support framing but not tagged frames
+  // acknowledge the probe without |kFrameFlagRequestId|. Both count as
+  // |NegotiationResult::kUnsupported|.
+  NegotiationResult Negotiate();
+
+  // Sends |request| and waits for the response. Safe to call concurrently.
+  // Returns false on errors, which break the connection and fail all requests
+  // in flight.
+  bool Execute(const Request& request, Response* response);
+
+  // Whether the connection has failed and should be discarded.
+  bool broken();
+
+  // Number of requests currently awaiting a response.
+  size_t in_flight();
+
+ private:
+  // State of a request awaiting its response.
+  struct PendingRequest {
+    Response* response;
+    bool done = false;
+    bool success = false;
+  };
+
+  // Reads the next response and hands it to the thread waiting for it. Must be
+  // called with |mutex_| held via |lock| and by the reader only. Returns false
+  // on errors.
+  bool ReadResponse(std::unique_lock<std::mutex>* lock);
+
+  // Marks the connection broken and fails all pending requests. Must be called
+  // with |mutex_| held.
+  void Fail();
+
+  android::base::unique_fd socket_;
+
+  // Serializes writing request frames.
+  std::mutex write_mutex_;
+  FdOutputStreamBuffer output_stream_;
+
+  // Only accessed by the thread holding the reader role.
+  FdInputStreamBuffer input_stream_;
+
+  // Guards the members below.
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  bool reader_active_ = false;
+  bool broken_ = false;
+  uint32_t next_request_id_ = 1;
+  std::unordered_map<uint32_t, PendingRequest*> pending_;
+};
+
+}  // namespace nvram
+
+#endif  // NVRAM_HAL_MULTIPLEXED_CONNECTION_H_
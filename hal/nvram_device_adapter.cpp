@@ -19,12 +19,120 @@
 #include <string.h>
 
 #include <algorithm>
+#include <chrono>
+#include <mutex>
 #include <type_traits>
 #include <utility>
 
 namespace nvram {
 namespace {
 
+// How long cached GetInfo and GetSpaceInfo responses remain valid. This bounds
+// how long changes made by other clients of the NVRAM implementation may go
+// unnoticed.
+constexpr auto kResponseCacheLifetime = std::chrono::milliseconds(100);
+
+// Number of GetSpaceInfo responses to cache.
+constexpr size_t kSpaceInfoCacheSize = 4;
+
+// Copies |from| to |to|. Returns false if memory allocation fails.
+template <typename ElementType>
+bool CopyVector(const Vector<ElementType>& from, Vector<ElementType>* to) {
+  if (!to->Resize(from.size())) {
+    return false;
+  }
+  for (size_t i = 0; i < from.size(); ++i) {
+    (*to)[i] = from[i];
+  }
+  return true;
+}
+
+// Copies cached responses, which aren't copyable as their vectors need
+// allocations that may fail. Returns false if memory allocation fails.
+bool CopyResponse(const GetInfoResponse& from, GetInfoResponse* to) {
+  to->total_size = from.total_size;
+  to->available_size = from.available_size;
+  to->max_space_size = from.max_space_size;
+  to->max_spaces = from.max_spaces;
+  to->wipe_disabled = from.wipe_disabled;
+  return CopyVector(from.space_list, &to->space_list);
+}
+
+bool CopyResponse(const GetSpaceInfoResponse& from, GetSpaceInfoResponse* to) {
+  to->size = from.size;
+  to->read_locked = from.read_locked;
+  to->write_locked = from.write_locked;
+  return CopyVector(from.controls, &to->controls);
+}
+
+}  // namespace
+
+// Caches GetInfo and GetSpaceInfo responses for a short time. HAL clients
+// usually issue several queries in a row which are all answered by the same
+// response, e.g. get_max_spaces() followed by two get_space_list() calls to
+// determine the list size and then fill the list, or get_space_size(),
+// get_space_controls() and is_space_locked() for the same space. Any command
+// issued through the adapter that may change the cached information
+// invalidates the cache.
+//
+// The cache may be used concurrently. Commands execute without holding the
+// cache lock, and responses that raced with an invalidation don't get cached.
+class NvramResponseCache {
+ public:
+  // Retrieves the GetInfo response for |device|, executing COMMAND_GET_INFO
+  // unless a recent response is cached.
+  nvram_result_t GetInfo(const nvram_device_t* device,
+                         GetInfoResponse* response);
+
+  // Retrieves the GetSpaceInfo response for space |index| on |device|,
+  // executing COMMAND_GET_SPACE_INFO unless a recent response is cached.
+  nvram_result_t GetSpaceInfo(const nvram_device_t* device,
+                              uint32_t index,
+                              GetSpaceInfoResponse* response);
+
+  // Drops all cached responses.
+  void Invalidate();
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  struct SpaceInfoEntry {
+    bool valid = false;
+    uint32_t index = 0;
+    Clock::time_point expiry;
+    GetSpaceInfoResponse response;
+  };
+
+  // Guards all members below.
+  std::mutex mutex_;
+
+  // Incremented on every invalidation.
+  uint64_t generation_ = 0;
+
+  bool info_valid_ = false;
+  Clock::time_point info_expiry_;
+  GetInfoResponse info_;
+
+  SpaceInfoEntry space_info_[kSpaceInfoCacheSize];
+  size_t next_space_info_ = 0;
+};
+
+namespace {
+
+// Whether |command| leaves the information reported by GetInfo and
+// GetSpaceInfo unchanged.
+bool PreservesCachedInfo(nvram::Command command) {
+  switch (command) {
+    case nvram::COMMAND_GET_INFO:
+    case nvram::COMMAND_GET_SPACE_INFO:
+    case nvram::COMMAND_READ_SPACE:
+    case nvram::COMMAND_WRITE_SPACE:
+      return true;
+    default:
+      return false;
+  }
+}
+
 // Executes an operation on the |NvramDeviceAdapter| corresponding to |device|.
 // |command| identifies the type of operation, |request_payload| provides the
 // input parameters. Output parameters are stored in |response_payload|, and the
@@ -41,7 +149,13 @@ nvram_result_t Execute(const nvram_device_t* device,
   nvram::Request request;
   request.payload.Activate<command>() = std::move(request_payload);
   nvram::Response response;
-  adapter->nvram_implementation()->Execute(request, &response);
+  adapter->Execute(request, &response);
+
+  // Invalidate after the command has executed, so concurrent queries can't
+  // cache information from before the change.
+  if (!PreservesCachedInfo(command)) {
+    adapter->response_cache()->Invalidate();
+  }
   if (response.result != NV_RESULT_SUCCESS) {
     return response.result;
   }
@@ -55,45 +169,137 @@ nvram_result_t Execute(const nvram_device_t* device,
   return NV_RESULT_SUCCESS;
 }
 
+}  // namespace
+
+nvram_result_t NvramResponseCache::GetInfo(const nvram_device_t* device,
+                                           GetInfoResponse* response) {
+  uint64_t generation;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (info_valid_ && Clock::now() < info_expiry_) {
+      return CopyResponse(info_, response) ? NV_RESULT_SUCCESS
+                                           : NV_RESULT_INTERNAL_ERROR;
+    }
+    generation = generation_;
+  }
+
+  Clock::time_point now = Clock::now();
+  nvram_result_t result =
+      Execute<COMMAND_GET_INFO>(device, GetInfoRequest(), response);
+  if (result != NV_RESULT_SUCCESS) {
+    return result;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (generation == generation_) {
+    info_valid_ = CopyResponse(*response, &info_);
+    info_expiry_ = now + kResponseCacheLifetime;
+  }
+  return result;
+}
+
+nvram_result_t NvramResponseCache::GetSpaceInfo(
+    const nvram_device_t* device,
+    uint32_t index,
+    GetSpaceInfoResponse* response) {
+  uint64_t generation;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const SpaceInfoEntry& entry : space_info_) {
+      if (entry.valid && entry.index == index && Clock::now() < entry.expiry) {
+        return CopyResponse(entry.response, response)
+                   ? NV_RESULT_SUCCESS
+                   : NV_RESULT_INTERNAL_ERROR;
+      }
+    }
+    generation = generation_;
+  }
+
+  Clock::time_point now = Clock::now();
+  GetSpaceInfoRequest request;
+  request.index = index;
+  nvram_result_t result = Execute<COMMAND_GET_SPACE_INFO>(
+      device, std::move(request), response);
+  if (result != NV_RESULT_SUCCESS) {
+    return result;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (generation != generation_) {
+    return result;
+  }
+
+  SpaceInfoEntry* entry = nullptr;
+  for (SpaceInfoEntry& candidate : space_info_) {
+    if (candidate.index == index) {
+      entry = &candidate;
+      break;
+    }
+  }
+  if (!entry) {
+    entry = &space_info_[next_space_info_];
+    next_space_info_ = (next_space_info_ + 1) % kSpaceInfoCacheSize;
+  }
+  entry->valid = CopyResponse(*response, &entry->response);
+  entry->index = index;
+  entry->expiry = now + kResponseCacheLifetime;
+  return result;
+}
+
+void NvramResponseCache::Invalidate() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++generation_;
+  info_valid_ = false;
+  for (SpaceInfoEntry& entry : space_info_) {
+    entry.valid = false;
+  }
+}
+
+namespace {
+
+// Returns the response cache of the |NvramDeviceAdapter| corresponding to
+// |device|.
+NvramResponseCache* GetResponseCache(const nvram_device_t* device) {
+  return reinterpret_cast<NvramDeviceAdapter*>(
+             const_cast<nvram_device_t*>(device))
+      ->response_cache();
+}
+
 // All the HAL methods need to be callable from C code.
 extern "C" {
 
 nvram_result_t device_get_total_size_in_bytes(const nvram_device_t* device,
                                               uint64_t* total_size) {
-  nvram::GetInfoRequest get_info_request;
   nvram::GetInfoResponse get_info_response;
-  nvram_result_t result = Execute<nvram::COMMAND_GET_INFO>(
-      device, std::move(get_info_request), &get_info_response);
+  nvram_result_t result = GetResponseCache(device)->GetInfo(
+      device, &get_info_response);
   *total_size = get_info_response.total_size;
   return result;
 }
 
 nvram_result_t device_get_available_size_in_bytes(const nvram_device_t* device,
                                                   uint64_t* available_size) {
-  nvram::GetInfoRequest get_info_request;
   nvram::GetInfoResponse get_info_response;
-  nvram_result_t result = Execute<nvram::COMMAND_GET_INFO>(
-      device, std::move(get_info_request), &get_info_response);
+  nvram_result_t result = GetResponseCache(device)->GetInfo(
+      device, &get_info_response);
   *available_size = get_info_response.available_size;
   return result;
 }
 
 nvram_result_t device_get_max_space_size_in_bytes(const nvram_device_t* device,
                                                   uint64_t* max_space_size) {
-  nvram::GetInfoRequest get_info_request;
   nvram::GetInfoResponse get_info_response;
-  nvram_result_t result = Execute<nvram::COMMAND_GET_INFO>(
-      device, std::move(get_info_request), &get_info_response);
+  nvram_result_t result = GetResponseCache(device)->GetInfo(
+      device, &get_info_response);
   *max_space_size = get_info_response.max_space_size;
   return result;
 }
 
 nvram_result_t device_get_max_spaces(const nvram_device_t* device,
                                      uint32_t* num_spaces) {
-  nvram::GetInfoRequest get_info_request;
   nvram::GetInfoResponse get_info_response;
-  nvram_result_t result = Execute<nvram::COMMAND_GET_INFO>(
-      device, std::move(get_info_request), &get_info_response);
+  nvram_result_t result = GetResponseCache(device)->GetInfo(
+      device, &get_info_response);
   *num_spaces = get_info_response.max_spaces;
   return result;
 }
@@ -102,10 +308,9 @@ nvram_result_t device_get_space_list(const nvram_device_t* device,
                                      uint32_t max_list_size,
                                      uint32_t* space_index_list,
                                      uint32_t* list_size) {
-  nvram::GetInfoRequest get_info_request;
   nvram::GetInfoResponse get_info_response;
-  nvram_result_t result = Execute<nvram::COMMAND_GET_INFO>(
-      device, std::move(get_info_request), &get_info_response);
+  nvram_result_t result = GetResponseCache(device)->GetInfo(
+      device, &get_info_response);
 
   if (space_index_list) {
     *list_size = std::min(get_info_response.space_list.size(),
@@ -123,11 +328,9 @@ nvram_result_t device_get_space_list(const nvram_device_t* device,
 nvram_result_t device_get_space_size(const nvram_device_t* device,
                                      uint32_t index,
                                      uint64_t* size) {
-  nvram::GetSpaceInfoRequest get_space_info_request;
-  get_space_info_request.index = index;
   nvram::GetSpaceInfoResponse get_space_info_response;
-  nvram_result_t result = Execute<nvram::COMMAND_GET_SPACE_INFO>(
-      device, std::move(get_space_info_request), &get_space_info_response);
+  nvram_result_t result = GetResponseCache(device)->GetSpaceInfo(
+      device, index, &get_space_info_response);
   *size = get_space_info_response.size;
   return result;
 }
@@ -137,11 +340,9 @@ nvram_result_t device_get_space_controls(const nvram_device_t* device,
                                          uint32_t max_list_size,
                                          nvram_control_t* control_list,
                                          uint32_t* list_size) {
-  nvram::GetSpaceInfoRequest get_space_info_request;
-  get_space_info_request.index = index;
   nvram::GetSpaceInfoResponse get_space_info_response;
-  nvram_result_t result = Execute<nvram::COMMAND_GET_SPACE_INFO>(
-      device, std::move(get_space_info_request), &get_space_info_response);
+  nvram_result_t result = GetResponseCache(device)->GetSpaceInfo(
+      device, index, &get_space_info_response);
 
   if (control_list) {
     *list_size = std::min(get_space_info_response.controls.size(),
@@ -160,11 +361,9 @@ nvram_result_t device_is_space_locked(const nvram_device_t* device,
                                       uint32_t index,
                                       int* write_lock_enabled,
                                       int* read_lock_enabled) {
-  nvram::GetSpaceInfoRequest get_space_info_request;
-  get_space_info_request.index = index;
   nvram::GetSpaceInfoResponse get_space_info_response;
-  nvram_result_t result = Execute<nvram::COMMAND_GET_SPACE_INFO>(
-      device, std::move(get_space_info_request), &get_space_info_response);
+  nvram_result_t result = GetResponseCache(device)->GetSpaceInfo(
+      device, index, &get_space_info_response);
   *write_lock_enabled = get_space_info_response.write_locked;
   *read_lock_enabled = get_space_info_response.read_locked;
   return result;
@@ -293,12 +492,84 @@ int device_nvram_device_close(struct hw_device_t* device) {
   return 0;
 }
 
+nvram_result_t device_provision_spaces(
+    const nvram_provisioning_device_t* device,
+    const nvram_provisioning_space_t* spaces,
+    uint32_t num_spaces) {
+  nvram::Request request;
+  nvram::ProvisionSpacesRequest& provision_spaces_request =
+      request.payload.Activate<nvram::COMMAND_PROVISION_SPACES>();
+  if (!provision_spaces_request.spaces.Resize(num_spaces)) {
+    return NV_RESULT_INTERNAL_ERROR;
+  }
+  for (uint32_t i = 0; i < num_spaces; ++i) {
+    const nvram_provisioning_space_t& space = spaces[i];
+    nvram::ProvisionedSpace& entry = provision_spaces_request.spaces[i];
+    entry.index = space.index;
+    entry.size = space.size;
+    if (!entry.controls.Resize(space.num_controls)) {
+      return NV_RESULT_INTERNAL_ERROR;
+    }
+    for (uint32_t j = 0; j < space.num_controls; ++j) {
+      entry.controls[j] = space.controls[j];
+    }
+    if (!entry.authorization_value.Assign(space.authorization_value,
+                                          space.authorization_value_size) ||
+        !entry.contents.Assign(space.contents, space.contents_size)) {
+      return NV_RESULT_INTERNAL_ERROR;
+    }
+  }
+
+  NvramProvisioningDeviceAdapter* adapter =
+      reinterpret_cast<NvramProvisioningDeviceAdapter*>(
+          const_cast<nvram_provisioning_device_t*>(device));
+  nvram::Response response;
+  adapter->Execute(request, &response);
+  return response.result;
+}
+
+nvram_result_t device_lock_spaces(const nvram_provisioning_device_t* device,
+                                  const nvram_space_lock_t* locks,
+                                  uint32_t num_locks) {
+  nvram::Request request;
+  nvram::LockSpacesRequest& lock_spaces_request =
+      request.payload.Activate<nvram::COMMAND_LOCK_SPACES>();
+  if (!lock_spaces_request.locks.Resize(num_locks)) {
+    return NV_RESULT_INTERNAL_ERROR;
+  }
+  for (uint32_t i = 0; i < num_locks; ++i) {
+    const nvram_space_lock_t& lock = locks[i];
+    nvram::SpaceLock& entry = lock_spaces_request.locks[i];
+    entry.index = lock.index;
+    entry.lock_write = lock.lock_write != 0;
+    entry.lock_read = lock.lock_read != 0;
+    if (!entry.authorization_value.Assign(lock.authorization_value,
+                                          lock.authorization_value_size)) {
+      return NV_RESULT_INTERNAL_ERROR;
+    }
+  }
+
+  NvramProvisioningDeviceAdapter* adapter =
+      reinterpret_cast<NvramProvisioningDeviceAdapter*>(
+          const_cast<nvram_provisioning_device_t*>(device));
+  nvram::Response response;
+  adapter->Execute(request, &response);
+  return response.result;
+}
+
+int device_nvram_provisioning_device_close(struct hw_device_t* device) {
+  delete reinterpret_cast<NvramProvisioningDeviceAdapter*>(
+      reinterpret_cast<nvram_provisioning_device_t*>(device));
+  return 0;
+}
+
 }  // extern "C"
 }  // namespace
 
 NvramDeviceAdapter::NvramDeviceAdapter(const hw_module_t* module,
                                        NvramImplementation* implementation)
-    : implementation_(implementation) {
+    : implementation_(implementation),
+      response_cache_(new NvramResponseCache) {
   memset(&device_, 0, sizeof(nvram_device_t));
 
   device_.common.tag = HARDWARE_DEVICE_TAG;
@@ -323,4 +594,45 @@ NvramDeviceAdapter::NvramDeviceAdapter(const hw_module_t* module,
   device_.enable_read_lock = device_enable_read_lock;
 }
 
+NvramDeviceAdapter::~NvramDeviceAdapter() = default;
+
+void NvramDeviceAdapter::Execute(const nvram::Request& request,
+                                 nvram::Response* response) {
+  if (implementation_->SupportsConcurrentRequests()) {
+    implementation_->Execute(request, response);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(execute_mutex_);
+  implementation_->Execute(request, response);
+}
+
+NvramProvisioningDeviceAdapter::NvramProvisioningDeviceAdapter(
+    const hw_module_t* module,
+    NvramImplementation* implementation)
+    : implementation_(implementation) {
+  memset(&device_, 0, sizeof(nvram_provisioning_device_t));
+
+  device_.common.tag = HARDWARE_DEVICE_TAG;
+  device_.common.version = NVRAM_PROVISIONING_DEVICE_API_VERSION_0_2;
+  device_.common.module = const_cast<hw_module_t *>(module);
+  device_.common.close = device_nvram_provisioning_device_close;
+
+  device_.provision_spaces = device_provision_spaces;
+  device_.lock_spaces = device_lock_spaces;
+}
+
+NvramProvisioningDeviceAdapter::~NvramProvisioningDeviceAdapter() = default;
+
+void NvramProvisioningDeviceAdapter::Execute(const nvram::Request& request,
+                                             nvram::Response* response) {
+  if (implementation_->SupportsConcurrentRequests()) {
+    implementation_->Execute(request, response);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(execute_mutex_);
+  implementation_->Execute(request, response);
+}
+
 }  // namespace nvram
@@ -0,0 +1,248 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "shared_memory_nvram_implementation.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/memfd.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <thread>
+
+#include <android-base/logging.h>
+#include <cutils/sockets.h>
+
+#include <nvram/messages/framing.h>
+
+namespace nvram {
+namespace {
+
+constexpr char kFakeNvramControlSocketName[] = "nvram";
+
+// How long to busy-wait for a response before going to sleep. Most commands
+// complete well within this time, which saves the cost of a futex sleep and
+// wake-up.
+constexpr auto kSpinDuration = std::chrono::microseconds(50);
+
+// Sleep interval while waiting for a response. After each interval, we check
+// whether the daemon is still alive.
+constexpr int kWaitTimeoutMs = 100;
+
+int CreateMemfd(const char* name) {
+  return static_cast<int>(
+      syscall(__NR_memfd_create, name, MFD_CLOEXEC | MFD_ALLOW_SEALING));
+}
+
+}  // namespace
+
+SharedMemoryNvramImplementation::~SharedMemoryNvramImplementation() {
+  Detach();
+}
+
+bool SharedMemoryNvramImplementation::Attach() {
+  Detach();
+
+  memory_fd_.reset(CreateMemfd("nvram-ring"));
+  if (memory_fd_.get() < 0) {
+    PLOG(ERROR) << "Failed to create shared memory";
+    return false;
+  }
+
+  // Seal the size, so the daemon can rely on the mapping to remain valid.
+  if (TEMP_FAILURE_RETRY(ftruncate(memory_fd_.get(), kRingMemorySize)) ||
+      fcntl(memory_fd_.get(), F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)) {
+    PLOG(ERROR) << "Failed to set up shared memory";
+    return false;
+  }
+
+  void* memory = mmap(nullptr, kRingMemorySize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, memory_fd_.get(), 0);
+  if (memory == MAP_FAILED) {
+    PLOG(ERROR) << "Failed to map shared memory";
+    return false;
+  }
+  memory_ = memory;
+
+  // The memory is zero-initialized, so only the header fields need setting.
+  control_ = static_cast<RingControl*>(memory_);
+  control_->magic = kRingMagic;
+  control_->version = kRingVersion;
+  control_->capacity = kRingCapacity;
+  requests_ =
+      SharedRing(&control_->requests, RequestRingData(memory_), kRingCapacity);
+  responses_ = SharedRing(&control_->responses, ResponseRingData(memory_),
+                          kRingCapacity);
+
+  doorbell_fd_.reset(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+  if (doorbell_fd_.get() < 0) {
+    PLOG(ERROR) << "Failed to create doorbell eventfd";
+    return false;
+  }
+
+  socket_.reset(socket_local_client(kFakeNvramControlSocketName,
+                                    ANDROID_SOCKET_NAMESPACE_RESERVED,
+                                    SOCK_SEQPACKET));
+  if (socket_.get() < 0) {
+    PLOG(ERROR) << "Failed to connect fake NVRAM control socket";
+    return false;
+  }
+
+  if (!SendAttachFrame()) {
+    LOG(WARNING) << "NVRAM daemon doesn't support shared memory transport.";
+    Detach();
+    return false;
+  }
+
+  return true;
+}
+
+void SharedMemoryNvramImplementation::Execute(const nvram::Request& request,
+                                              nvram::Response* response) {
+  if ((!control_ && !Attach()) || !SendRequest(request, response)) {
+    // Start over with a fresh ring next time.
+    Detach();
+    response->result = NV_RESULT_INTERNAL_ERROR;
+  }
+}
+
+void SharedMemoryNvramImplementation::Detach() {
+  socket_.reset();
+  doorbell_fd_.reset();
+  memory_fd_.reset();
+  if (memory_) {
+    munmap(memory_, kRingMemorySize);
+    memory_ = nullptr;
+  }
+  control_ = nullptr;
+}
+
+bool SharedMemoryNvramImplementation::SendAttachFrame() {
+  uint8_t header_buffer[kFrameHeaderSize];
+  ArrayOutputStreamBuffer header_stream(header_buffer, sizeof(header_buffer));
+  FrameHeader header;
+  header.flags = kFrameFlagAttachRing;
+  if (!WriteFrameHeader(&header_stream, header)) {
+    return false;
+  }
+
+  int fds[2] = {memory_fd_.get(), doorbell_fd_.get()};
+  union {
+    struct cmsghdr align;
+    char buffer[CMSG_SPACE(sizeof(fds))];
+  } control;
+  memset(&control, 0, sizeof(control));
+
+  struct iovec iov = {header_buffer, sizeof(header_buffer)};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof(control.buffer);
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  if (TEMP_FAILURE_RETRY(sendmsg(socket_.get(), &msg, 0)) < 0) {
+    PLOG(ERROR) << "Failed to send ring attach request";
+    return false;
+  }
+
+  ssize_t bytes_read = TEMP_FAILURE_RETRY(
+      read(socket_.get(), header_buffer, sizeof(header_buffer)));
+  if (bytes_read != static_cast<ssize_t>(sizeof(header_buffer))) {
+    return false;
+  }
+
+  InputStreamBuffer reply_stream(header_buffer, sizeof(header_buffer));
+  FrameHeader reply;
+  return ReadFrameHeader(&reply_stream, &reply) &&
+         (reply.flags & kFrameFlagAttachRing) != 0;
+}
+
+bool SharedMemoryNvramImplementation::WaitForResponse() {
+  // Spinning only pays off if the daemon can make progress on another CPU.
+  static const bool spin = std::thread::hardware_concurrency() > 1;
+  auto spin_deadline = std::chrono::steady_clock::now() + kSpinDuration;
+  while (spin && responses_.Empty()) {
+    if (std::chrono::steady_clock::now() > spin_deadline) {
+      break;
+    }
+  }
+
+  while (responses_.Empty()) {
+    // Announce that we're about to sleep, then check again before actually
+    // going to sleep, so we can't miss a wake-up.
+    uint32_t sequence = control_->response_sequence.load();
+    control_->client_waiting.store(1);
+    if (responses_.Empty() &&
+        !FutexWait(&control_->response_sequence, sequence, kWaitTimeoutMs)) {
+      // Check whether the daemon is still there. The daemon never sends data
+      // on the socket after attaching the ring, so any readable state means
+      // it closed the connection.
+      uint8_t byte;
+      ssize_t rc = recv(socket_.get(), &byte, sizeof(byte),
+                        MSG_PEEK | MSG_DONTWAIT);
+      if (rc >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        LOG(ERROR) << "NVRAM daemon closed the shared memory transport.";
+        control_->client_waiting.store(0);
+        return false;
+      }
+    }
+    control_->client_waiting.store(0);
+  }
+
+  return true;
+}
+
+bool SharedMemoryNvramImplementation::SendRequest(
+    const nvram::Request& request,
+    nvram::Response* response) {
+  if (!requests_.Write(request)) {
+    LOG(ERROR) << "Failed to place request in shared memory ring.";
+    return false;
+  }
+
+  uint64_t doorbell = 1;
+  if (TEMP_FAILURE_RETRY(write(doorbell_fd_.get(), &doorbell,
+                               sizeof(doorbell))) < 0) {
+    PLOG(ERROR) << "Failed to signal NVRAM daemon";
+    return false;
+  }
+
+  if (!WaitForResponse()) {
+    return false;
+  }
+
+  if (responses_.Read(response) != SharedRing::ReadStatus::kSuccess) {
+    LOG(ERROR) << "Failed to read response from shared memory ring.";
+    return false;
+  }
+
+  return true;
+}
+
+}  // namespace nvram
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NVRAM_HAL_SHARED_MEMORY_NVRAM_IMPLEMENTATION_H_
+#define NVRAM_HAL_SHARED_MEMORY_NVRAM_IMPLEMENTATION_H_
+
+#include <android-base/unique_fd.h>
+
+#include <nvram/hal/nvram_device_adapter.h>
+
+#include "fake_nvram_ring.h"
+
+namespace nvram {
+
+// An |NvramImplementation| that talks to the fake NVRAM daemon through a shared
+// memory ring instead of sending messages over the control socket. See
+// fake_nvram_ring.h for a description of the transport.
+class SharedMemoryNvramImplementation : public NvramImplementation {
+ public:
+  SharedMemoryNvramImplementation() = default;
+  ~SharedMemoryNvramImplementation() override;
+
+  // Sets up the shared memory ring and attaches it to a new daemon connection.
+  // Returns false if the daemon is unreachable or doesn't support the shared
+  // memory transport.
+  bool Attach();
+
+  // NvramImplementation:
+  void Execute(const nvram::Request& request,
+               nvram::Response* response) override;
+
+ private:
+  // Releases all transport resources.
+  void Detach();
+
+  // Sends the attach frame along with the ring descriptors and waits for the
+  // daemon's acknowledgment.
+  bool SendAttachFrame();
+
+  // Waits until the response ring has data. Returns false if the daemon went
+  // away.
+  bool WaitForResponse();
+
+  // Sends a request and receives the response. Returns true if successful.
+  bool SendRequest(const nvram::Request& request, nvram::Response* response);
+
+  android::base::unique_fd socket_;
+  android::base::unique_fd memory_fd_;
+  android::base::unique_fd doorbell_fd_;
+
+  void* memory_ = nullptr;
+  RingControl* control_ = nullptr;
+  SharedRing requests_;
+  SharedRing responses_;
+};
+
+}  // namespace nvram
+
+#endif  // NVRAM_HAL_SHARED_MEMORY_NVRAM_IMPLEMENTATION_H_
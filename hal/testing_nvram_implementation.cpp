@@ -20,65 +20,245 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
 #include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+#include <cutils/properties.h>
 #include <cutils/sockets.h>
 
 #include <nvram/hal/nvram_device_adapter.h>
+#include <nvram/hal/nvram_provisioning.h>
+#include <nvram/messages/fd_io.h>
+#include <nvram/messages/framing.h>
 #include <nvram/messages/nvram_messages.h>
 
+#include "multiplexed_connection.h"
+#include "shared_memory_nvram_implementation.h"
+
 namespace {
 
 constexpr char kFakeNvramControlSocketName[] = "nvram";
 
+// System property selecting the transport to the fake NVRAM daemon. Setting
+// this to |kSharedMemoryTransport| selects the shared memory ring transport,
+// any other value the control socket.
+constexpr char kTransportProperty[] = "nvram.testing.transport";
+constexpr char kSharedMemoryTransport[] = "shm";
+
+// Maximum number of multiplexed connections to the daemon. Additional
+// connections only get opened while all existing ones have requests in flight.
+constexpr size_t kMaxConnections = 4;
+
 // This instantiates an |NvramManager| with the storage interface wired up with
 // an in-memory implementation. This *DOES NOT* meet the persistence and tamper
 // evidence requirements of the HAL, but is useful for demonstration and running
 // tests against the |NvramManager| implementation.
+//
+// Requests may be issued concurrently. If the daemon supports tagged frames,
+// they're sent over a small pool of multiplexed connections, so concurrent
+// requests overlap. Otherwise, requests are serialized on a single connection.
 class TestingNvramImplementation : public nvram::NvramImplementation {
  public:
   ~TestingNvramImplementation() override;
 
   void Execute(const nvram::Request& request,
                nvram::Response* response) override;
+  bool SupportsConcurrentRequests() const override { return true; }
 
  private:
-  // Connects the fake NVRAM control socket it it is not open already. Returns
-  // true if the channel is open, false on errors.
+  // Returns the least busy multiplexed connection, opening a new one if all
+  // are busy and the pool isn't full. Returns nullptr if the daemon doesn't
+  // support multiplexing or is unreachable.
+  std::shared_ptr<nvram::MultiplexedConnection> GetConnection();
+
+  // Opens and negotiates a new multiplexed connection. Returns nullptr on
+  // failure. Only a negative answer from the daemon disables multiplexing,
+  // I/O errors leave it to the next request to try again.
+  std::shared_ptr<nvram::MultiplexedConnection> OpenMultiplexedConnection();
+
+  // The members below implement the fallback for daemons that don't support
+  // tagged frames and are guarded by |fallback_mutex_|.
+
+  // Connects the fake NVRAM control socket it it is not open already and
+  // negotiates framed mode. Returns true if the channel is open, false on
+  // errors.
   bool Connect();
 
+  // Opens a new connection to the control socket. Returns true if successful.
+  bool OpenSocket();
+
+  // Closes the connection to the fake NVRAM daemon, if any.
+  void Disconnect();
+
+  // Sends a framing probe and checks whether the daemon acknowledges it.
+  // Daemons that don't support framing drop the connection or reply with
+  // something other than a probe acknowledgement, which yields
+  // |NegotiationResult::kUnsupported|.
+  nvram::NegotiationResult NegotiateFraming();
+
   // Sends a request to the fake NVRAM daemon. Returns true if successful, false
   // on any I/O errors.
   bool SendRequest(const nvram::Request& request, nvram::Response* response);
 
+  // Request transmission implementations for framed and unframed mode,
+  // respectively.
+  bool SendFramedRequest(const nvram::Request& request,
+                         nvram::Response* response);
+  bool SendLegacyRequest(const nvram::Request& request,
+                         nvram::Response* response);
+
+  // Guards the multiplexed connection pool.
+  std::mutex pool_mutex_;
+  std::vector<std::shared_ptr<nvram::MultiplexedConnection>> connections_;
+
+  // Set once the daemon has been found to not support tagged frames.
+  std::atomic<bool> multiplexing_unsupported_{false};
+
+  // Serializes requests on the fallback connection.
+  std::mutex fallback_mutex_;
+
   // A file descriptor of the socket connected to the fake NVRAM daemon.
   int nvram_socket_fd_ = -1;
 
-  // The command buffer, used for encoding request and decoding responses.
+  // Set once the daemon has been found to not support framed mode. Subsequent
+  // connections skip the framing negotiation.
+  bool legacy_daemon_ = false;
+
+  // Stream buffers for framed mode. These are present only if framing has been
+  // negotiated for the current connection and keep their buffers allocated
+  // across requests.
+  std::unique_ptr<nvram::FdInputStreamBuffer> input_stream_;
+  std::unique_ptr<nvram::FdOutputStreamBuffer> output_stream_;
+
+  // The command buffer, used for encoding request and decoding responses in
+  // unframed mode.
   uint8_t command_buffer_[4096];
 };
 
 TestingNvramImplementation::~TestingNvramImplementation() {
-  if (nvram_socket_fd_ != -1) {
-    // No need to handle EINTR specially here as bionic filters it out.
-    if (close(nvram_socket_fd_)) {
-      PLOG(ERROR) << "Failed to close NVRAM command socket";
-    }
-    nvram_socket_fd_ = -1;
-  }
+  Disconnect();
 }
 
 void TestingNvramImplementation::Execute(const nvram::Request& request,
                                          nvram::Response* response) {
+  std::shared_ptr<nvram::MultiplexedConnection> connection = GetConnection();
+  if (connection) {
+    if (!connection->Execute(request, response)) {
+      response->result = NV_RESULT_INTERNAL_ERROR;
+    }
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(fallback_mutex_);
   if (!SendRequest(request, response)) {
     response->result = NV_RESULT_INTERNAL_ERROR;
   }
 }
 
+std::shared_ptr<nvram::MultiplexedConnection>
+TestingNvramImplementation::GetConnection() {
+  if (multiplexing_unsupported_) {
+    return nullptr;
+  }
+
+  std::lock_guard<std::mutex> lock(pool_mutex_);
+
+  // Threads still using broken connections hold on to their own references.
+  connections_.erase(
+      std::remove_if(connections_.begin(), connections_.end(),
+                     [](const std::shared_ptr<nvram::MultiplexedConnection>&
+                            connection) { return connection->broken(); }),
+      connections_.end());
+
+  std::shared_ptr<nvram::MultiplexedConnection> best;
+  size_t best_in_flight = 0;
+  for (const auto& connection : connections_) {
+    size_t in_flight = connection->in_flight();
+    if (!best || in_flight < best_in_flight) {
+      best = connection;
+      best_in_flight = in_flight;
+    }
+  }
+
+  if (best && (best_in_flight == 0 || connections_.size() >= kMaxConnections)) {
+    return best;
+  }
+
+  std::shared_ptr<nvram::MultiplexedConnection> connection =
+      OpenMultiplexedConnection();
+  if (!connection) {
+    return best;
+  }
+  connections_.push_back(connection);
+  return connection;
+}
+
+std::shared_ptr<nvram::MultiplexedConnection>
+TestingNvramImplementation::OpenMultiplexedConnection() {
+  android::base::unique_fd socket(
+      socket_local_client(kFakeNvramControlSocketName,
+                          ANDROID_SOCKET_NAMESPACE_RESERVED, SOCK_SEQPACKET));
+  if (socket.get() < 0) {
+    PLOG(ERROR) << "Failed to connect fake NVRAM control socket";
+    return nullptr;
+  }
+
+  std::shared_ptr<nvram::MultiplexedConnection> connection =
+      std::make_shared<nvram::MultiplexedConnection>(std::move(socket));
+  switch (connection->Negotiate()) {
+    case nvram::NegotiationResult::kSupported:
+      return connection;
+    case nvram::NegotiationResult::kUnsupported:
+      LOG(INFO) << "NVRAM daemon doesn't support request IDs, serializing "
+                   "requests.";
+      multiplexing_unsupported_ = true;
+      return nullptr;
+    case nvram::NegotiationResult::kError:
+      // Try again on the next request.
+      LOG(ERROR) << "Failed to negotiate multiplexed NVRAM connection.";
+      return nullptr;
+  }
+  return nullptr;
+}
+
 bool TestingNvramImplementation::Connect() {
   if (nvram_socket_fd_ != -1) {
     return true;
   }
 
+  if (!OpenSocket()) {
+    return false;
+  }
+
+  if (legacy_daemon_) {
+    return true;
+  }
+
+  switch (NegotiateFraming()) {
+    case nvram::NegotiationResult::kSupported:
+      return true;
+    case nvram::NegotiationResult::kUnsupported:
+      // Daemons that don't support framing drop the connection when receiving
+      // the probe, so reconnect and fall back to unframed mode.
+      LOG(INFO) << "NVRAM daemon doesn't support framing, using legacy mode.";
+      Disconnect();
+      legacy_daemon_ = true;
+      return OpenSocket();
+    case nvram::NegotiationResult::kError:
+      // Try again on the next request.
+      LOG(ERROR) << "Failed to negotiate framing with NVRAM daemon.";
+      Disconnect();
+      return false;
+  }
+  return false;
+}
+
+bool TestingNvramImplementation::OpenSocket() {
   int rc =
       socket_local_client(kFakeNvramControlSocketName,
                           ANDROID_SOCKET_NAMESPACE_RESERVED, SOCK_SEQPACKET);
@@ -91,12 +271,89 @@ bool TestingNvramImplementation::Connect() {
   return true;
 }
 
+void TestingNvramImplementation::Disconnect() {
+  input_stream_.reset();
+  output_stream_.reset();
+  if (nvram_socket_fd_ != -1) {
+    // No need to handle EINTR specially here as bionic filters it out.
+    if (close(nvram_socket_fd_)) {
+      PLOG(ERROR) << "Failed to close NVRAM command socket";
+    }
+    nvram_socket_fd_ = -1;
+  }
+}
+
+nvram::NegotiationResult TestingNvramImplementation::NegotiateFraming() {
+  std::unique_ptr<nvram::FdInputStreamBuffer> input_stream(
+      new nvram::FdInputStreamBuffer(nvram_socket_fd_,
+                                     nvram::kFrameRecordSize));
+  std::unique_ptr<nvram::FdOutputStreamBuffer> output_stream(
+      new nvram::FdOutputStreamBuffer(nvram_socket_fd_,
+                                      nvram::kFrameRecordSize));
+
+  nvram::FrameHeader probe;
+  probe.flags = nvram::kFrameFlagProbe;
+  if (!nvram::WriteFrameHeader(output_stream.get(), probe) ||
+      !output_stream->Flush()) {
+    return nvram::NegotiationResult::kError;
+  }
+
+  nvram::FrameHeader reply;
+  if (!nvram::ReadFrameHeader(input_stream.get(), &reply)) {
+    return input_stream->error() ? nvram::NegotiationResult::kError
+                                 : nvram::NegotiationResult::kUnsupported;
+  }
+
+  if ((reply.flags & nvram::kFrameFlagProbe) == 0) {
+    return nvram::NegotiationResult::kUnsupported;
+  }
+
+  input_stream_ = std::move(input_stream);
+  output_stream_ = std::move(output_stream);
+  return nvram::NegotiationResult::kSupported;
+}
+
 bool TestingNvramImplementation::SendRequest(const nvram::Request& request,
                                              nvram::Response* response) {
   if (!Connect()) {
     return false;
   }
 
+  if (input_stream_ && output_stream_) {
+    if (!SendFramedRequest(request, response)) {
+      // The connection state is unknown after errors, so start over with a
+      // fresh connection next time.
+      Disconnect();
+      return false;
+    }
+    return true;
+  }
+
+  return SendLegacyRequest(request, response);
+}
+
+bool TestingNvramImplementation::SendFramedRequest(
+    const nvram::Request& request,
+    nvram::Response* response) {
+  if (!nvram::WriteFrame(output_stream_.get(), request) ||
+      !output_stream_->Flush()) {
+    PLOG(ERROR) << "Failed to send request on NVRAM control socket";
+    return false;
+  }
+
+  nvram::FrameHeader header;
+  if (!nvram::ReadFrameHeader(input_stream_.get(), &header) ||
+      !nvram::ReadFramePayload(input_stream_.get(), header, response)) {
+    LOG(ERROR) << "Failed to read NVRAM response.";
+    return false;
+  }
+
+  return true;
+}
+
+bool TestingNvramImplementation::SendLegacyRequest(
+    const nvram::Request& request,
+    nvram::Response* response) {
   size_t request_size = sizeof(command_buffer_);
   if (!nvram::Encode(request, command_buffer_, &request_size)) {
     LOG(ERROR) << "Failed to encode NVRAM request.";
@@ -125,17 +382,42 @@ bool TestingNvramImplementation::SendRequest(const nvram::Request& request,
   return true;
 }
 
+// Creates the implementation for a new device, using the transport selected by
+// |kTransportProperty|.
+nvram::NvramImplementation* CreateImplementation() {
+  char transport[PROPERTY_VALUE_MAX];
+  property_get(kTransportProperty, transport, "");
+  if (strcmp(transport, kSharedMemoryTransport) == 0) {
+    std::unique_ptr<nvram::SharedMemoryNvramImplementation>
+        shared_memory_implementation(
+            new nvram::SharedMemoryNvramImplementation);
+    if (shared_memory_implementation->Attach()) {
+      return shared_memory_implementation.release();
+    }
+    LOG(WARNING) << "Falling back to socket transport.";
+  }
+  return new TestingNvramImplementation;
+}
+
 }  // namespace
 
 extern "C" int testing_nvram_open(const hw_module_t* module,
                                   const char* device_id,
                                   hw_device_t** device_ptr) {
-  if (strcmp(NVRAM_HARDWARE_DEVICE_ID, device_id) != 0) {
-    return -EINVAL;
+  if (strcmp(NVRAM_HARDWARE_DEVICE_ID, device_id) == 0) {
+    nvram::NvramDeviceAdapter* adapter =
+        new nvram::NvramDeviceAdapter(module, CreateImplementation());
+    *device_ptr = adapter->as_device();
+    return 0;
+  }
+
+  if (strcmp(NVRAM_PROVISIONING_DEVICE_ID, device_id) == 0) {
+    nvram::NvramProvisioningDeviceAdapter* adapter =
+        new nvram::NvramProvisioningDeviceAdapter(module,
+                                                  CreateImplementation());
+    *device_ptr = adapter->as_device();
+    return 0;
   }
 
-  nvram::NvramDeviceAdapter* adapter =
-      new nvram::NvramDeviceAdapter(module, new TestingNvramImplementation);
-  *device_ptr = adapter->as_device();
-  return 0;
+  return -EINVAL;
 }
@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Throughput benchmarks for the NVRAM HAL. Each benchmark thread opens its own
+// device, so with the testing HAL module every thread uses a separate
+// connection to the fake NVRAM daemon. Comparing results for different daemon
+// configurations (e.g. --io_uring, --worker_threads) shows how well the daemon
+// overlaps requests from concurrent clients.
+//
+// The in_process variants execute commands on an in-process |NvramManager|
+// backed by memory storage instead, which provides a baseline without any IPC
+// and storage I/O cost. All in-process devices share a single |NvramManager|.
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include <android-base/logging.h>
+#include <benchmark/benchmark.h>
+#include <hardware/nvram.h>
+#include <nvram/hal/in_process_nvram_implementation.h>
+
+#include "nvram/hal/tests/scoped_nvram_device.h"
+
+namespace {
+
+// Base index for spaces created by the benchmarks. Each benchmark thread uses a
+// separate space.
+constexpr uint32_t kBenchmarkIndexBase = 0xBE7C0000;
+
+// Size of the spaces created by the benchmarks.
+constexpr uint64_t kBenchmarkSpaceSize = 32;
+
+constexpr char kNoAuth[] = "";
+
+// Maximum number of concurrent benchmark threads.
+constexpr int kMaxThreads = 8;
+
+// Hands out space indices to benchmark threads.
+std::atomic<uint32_t> g_next_index(0);
+
+// Selects the NVRAM implementation a benchmark runs against.
+enum class Backend {
+  kModule,          // The NVRAM HAL module.
+  kInProcess,       // In-process, passing messages as is.
+  kInProcessCoded,  // In-process, passing messages through their encoding.
+};
+
+// Forwards commands to the process-wide |InProcessNvramImplementation|,
+// optionally passing them through their wire encoding. Both in-process
+// variants go through the same |NvramManager|, as separate managers on the
+// same process-wide storage would overwrite each other's header.
+class SharedInProcessNvramImplementation : public nvram::NvramImplementation {
+ public:
+  explicit SharedInProcessNvramImplementation(bool encode_messages)
+      : encode_messages_(encode_messages) {}
+
+  // NvramImplementation:
+  void Execute(const nvram::Request& request,
+               nvram::Response* response) override {
+    if (encode_messages_) {
+      Instance()->ExecuteEncoded(request, response);
+    } else {
+      Instance()->Execute(request, response);
+    }
+  }
+  bool SupportsConcurrentRequests() const override { return true; }
+
+ private:
+  static nvram::InProcessNvramImplementation* Instance() {
+    static nvram::InProcessNvramImplementation* instance =
+        new nvram::InProcessNvramImplementation();
+    return instance;
+  }
+
+  const bool encode_messages_;
+};
+
+// Opens a device for |backend|.
+std::shared_ptr<nvram::ScopedNvramDevice> OpenDevice(Backend backend) {
+  if (backend == Backend::kModule) {
+    return std::make_shared<nvram::ScopedNvramDevice>();
+  }
+  return std::make_shared<nvram::ScopedNvramDevice>(
+      new SharedInProcessNvramImplementation(backend ==
+                                             Backend::kInProcessCoded));
+}
+
+// Creates a fresh space for the calling benchmark thread and deletes it again
+// on destruction.
+class ScopedBenchmarkSpace {
+ public:
+  explicit ScopedBenchmarkSpace(nvram::ScopedNvramDevice* device)
+      : device_(device),
+        index_(kBenchmarkIndexBase + g_next_index++ % kMaxThreads) {
+    device_->DeleteSpace(index_, kNoAuth);
+    nvram_result_t result =
+        device_->CreateSpace(index_, kBenchmarkSpaceSize, {}, kNoAuth);
+    CHECK_EQ(NV_RESULT_SUCCESS, result) << "Failed to create benchmark space";
+  }
+
+  ~ScopedBenchmarkSpace() { device_->DeleteSpace(index_, kNoAuth); }
+
+  uint32_t index() const { return index_; }
+
+ private:
+  nvram::ScopedNvramDevice* device_;
+  uint32_t index_;
+};
+
+// The device adapter caches GetInfo responses for a short time, so this mostly
+// measures cache hits. BM_ReadSpace reflects the cost of a full round trip.
+void BM_GetTotalSize(benchmark::State& state, Backend backend) {
+  std::shared_ptr<nvram::ScopedNvramDevice> device = OpenDevice(backend);
+  uint64_t total_size = 0;
+  while (state.KeepRunning()) {
+    CHECK_EQ(NV_RESULT_SUCCESS, device->GetTotalSizeInBytes(&total_size));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_CAPTURE(BM_GetTotalSize, module, Backend::kModule)
+    ->ThreadRange(1, kMaxThreads)
+    ->UseRealTime();
+BENCHMARK_CAPTURE(BM_GetTotalSize, in_process, Backend::kInProcess)
+    ->ThreadRange(1, kMaxThreads)
+    ->UseRealTime();
+BENCHMARK_CAPTURE(BM_GetTotalSize, in_process_coded, Backend::kInProcessCoded)
+    ->ThreadRange(1, kMaxThreads)
+    ->UseRealTime();
+
+void BM_ReadSpace(benchmark::State& state, Backend backend) {
+  std::shared_ptr<nvram::ScopedNvramDevice> device = OpenDevice(backend);
+  ScopedBenchmarkSpace space(device.get());
+  std::string data;
+  while (state.KeepRunning()) {
+    CHECK_EQ(NV_RESULT_SUCCESS, device->ReadSpace(space.index(),
+                                                  kBenchmarkSpaceSize, kNoAuth,
+                                                  &data));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_CAPTURE(BM_ReadSpace, module, Backend::kModule)
+    ->ThreadRange(1, kMaxThreads)
+    ->UseRealTime();
+BENCHMARK_CAPTURE(BM_ReadSpace, in_process, Backend::kInProcess)
+    ->ThreadRange(1, kMaxThreads)
+    ->UseRealTime();
+BENCHMARK_CAPTURE(BM_ReadSpace, in_process_coded, Backend::kInProcessCoded)
+    ->ThreadRange(1, kMaxThreads)
+    ->UseRealTime();
+
+// Space writes hit persistent storage, so this measures the storage path of the
+// NVRAM implementation, including its durability barriers.
+void BM_WriteSpace(benchmark::State& state, Backend backend) {
+  std::shared_ptr<nvram::ScopedNvramDevice> device = OpenDevice(backend);
+  ScopedBenchmarkSpace space(device.get());
+  const std::string data(kBenchmarkSpaceSize, 'x');
+  while (state.KeepRunning()) {
+    CHECK_EQ(NV_RESULT_SUCCESS,
+             device->WriteSpace(space.index(), data, kNoAuth));
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * kBenchmarkSpaceSize);
+}
+BENCHMARK_CAPTURE(BM_WriteSpace, module, Backend::kModule)
+    ->ThreadRange(1, kMaxThreads)
+    ->UseRealTime();
+BENCHMARK_CAPTURE(BM_WriteSpace, in_process, Backend::kInProcess)
+    ->ThreadRange(1, kMaxThreads)
+    ->UseRealTime();
+BENCHMARK_CAPTURE(BM_WriteSpace, in_process_coded, Backend::kInProcessCoded)
+    ->ThreadRange(1, kMaxThreads)
+    ->UseRealTime();
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -15,7 +15,11 @@
 //
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/logging.h>
@@ -41,6 +45,9 @@ constexpr char kNoAuth[] = "";
 // If using authorization with an index returned by GetNextBurnSpace use this
 // as the value so the space can be cleaned up later.
 constexpr char kBurnSpaceAuth[] = "hal_test_burn";
+// Number of threads per role in the concurrency tests.
+constexpr int kConcurrentThreads = 4;
+constexpr int kConcurrentIterations = 50;
 
 // Returns true if |target| contains |value|.
 template <typename T>
@@ -190,6 +197,111 @@ bool GetNextBurnSpace(SafeScopedNvramDevice* device, uint32_t* index) {
   return true;
 }
 
+// An |NvramImplementation| that doesn't support concurrent requests and
+// records whether it ever got entered concurrently.
+class NonConcurrentNvramImplementation : public nvram::NvramImplementation {
+ public:
+  explicit NonConcurrentNvramImplementation(std::atomic<bool>* overlapped)
+      : overlapped_(overlapped) {}
+
+  void Execute(const nvram::Request& request,
+               nvram::Response* response) override {
+    if (active_.exchange(true)) {
+      overlapped_->store(true);
+    }
+    // Give other threads a chance to enter.
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+    response->result = NV_RESULT_SUCCESS;
+    if (request.payload.get<nvram::COMMAND_READ_SPACE>()) {
+      response->payload.Activate<nvram::COMMAND_READ_SPACE>();
+    } else {
+      response->result = NV_RESULT_INVALID_PARAMETER;
+    }
+    active_.store(false);
+  }
+
+ private:
+  std::atomic<bool> active_{false};
+  std::atomic<bool>* overlapped_;
+};
+
+// An |NvramImplementation| that counts the commands it executes. GetInfo
+// reports a single space of 32 bytes at |kTestIndex1|, all other commands
+// succeed without effect.
+class CountingNvramImplementation : public nvram::NvramImplementation {
+ public:
+  void Execute(const nvram::Request& request,
+               nvram::Response* response) override {
+    nvram::Command command = request.payload.which();
+    ++counts_[command];
+
+    response->result = NV_RESULT_SUCCESS;
+    switch (command) {
+      case nvram::COMMAND_GET_INFO: {
+        nvram::GetInfoResponse& get_info =
+            response->payload.Activate<nvram::COMMAND_GET_INFO>();
+        get_info.total_size = 1024;
+        get_info.available_size = 992;
+        get_info.max_space_size = 32;
+        get_info.max_spaces = 32;
+        CHECK(get_info.space_list.Resize(1));
+        get_info.space_list[0] = kTestIndex1;
+        break;
+      }
+      case nvram::COMMAND_GET_SPACE_INFO:
+        response->payload.Activate<nvram::COMMAND_GET_SPACE_INFO>().size = 32;
+        break;
+      case nvram::COMMAND_CREATE_SPACE:
+        response->payload.Activate<nvram::COMMAND_CREATE_SPACE>();
+        break;
+      case nvram::COMMAND_DELETE_SPACE:
+        response->payload.Activate<nvram::COMMAND_DELETE_SPACE>();
+        break;
+      case nvram::COMMAND_DISABLE_CREATE:
+        response->payload.Activate<nvram::COMMAND_DISABLE_CREATE>();
+        break;
+      case nvram::COMMAND_WRITE_SPACE:
+        response->payload.Activate<nvram::COMMAND_WRITE_SPACE>();
+        break;
+      case nvram::COMMAND_READ_SPACE:
+        response->payload.Activate<nvram::COMMAND_READ_SPACE>();
+        break;
+      case nvram::COMMAND_LOCK_SPACE_WRITE:
+        response->payload.Activate<nvram::COMMAND_LOCK_SPACE_WRITE>();
+        break;
+      case nvram::COMMAND_LOCK_SPACE_READ:
+        response->payload.Activate<nvram::COMMAND_LOCK_SPACE_READ>();
+        break;
+      default:
+        response->result = NV_RESULT_INVALID_PARAMETER;
+        break;
+    }
+
+    // Run the hook after preparing the response, as if it executed
+    // concurrently with the command. It only runs once.
+    std::function<void()> hook;
+    hook.swap(execute_hook_);
+    if (hook) {
+      hook();
+    }
+  }
+
+  // Nested calls from |execute_hook_| need to bypass the adapter's lock.
+  bool SupportsConcurrentRequests() const override { return true; }
+
+  // Returns the number of times |command| executed.
+  int count(nvram::Command command) const { return counts_[command]; }
+
+  // Makes the next command invoke |hook| while executing.
+  void set_execute_hook(std::function<void()> hook) {
+    execute_hook_ = std::move(hook);
+  }
+
+ private:
+  int counts_[nvram::COMMAND_GET_STATS + 1] = {};
+  std::function<void()> execute_hook_;
+};
+
 std::string SHA256HashString(const std::string& input) {
   uint8_t hash[SHA256_DIGEST_LENGTH];
   SHA256(reinterpret_cast<const uint8_t*>(input.data()), input.size(), hash);
@@ -550,4 +662,191 @@ TEST(NVRAMModuleTest, ReadWriteSpaceDoesNotExist) {
             device.EnableReadLock(index, kNoAuth));
 }
 
+TEST(NVRAMModuleTest, ConcurrentAccess) {
+  SafeScopedNvramDevice device;
+  const uint32_t indices[] = {kTestIndex1, kTestIndex2};
+  ScopedNvramSpace space1(&device, indices[0], 32, {});
+  ScopedNvramSpace space2(&device, indices[1], 32, {});
+
+  // Half of the threads write and read back their own data, the others keep
+  // querying information that must remain stable meanwhile.
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kConcurrentThreads; ++i) {
+    threads.emplace_back([&device, &indices, i]() {
+      uint32_t index = indices[i % arraysize(indices)];
+      for (int j = 0; j < kConcurrentIterations; ++j) {
+        if (i < static_cast<int>(arraysize(indices))) {
+          std::string written = std::to_string(i) + ":" + std::to_string(j);
+          EXPECT_EQ(NV_RESULT_SUCCESS,
+                    device.WriteSpace(index, written, kNoAuth));
+          std::string data;
+          EXPECT_EQ(NV_RESULT_SUCCESS,
+                    device.ReadSpace(index, written.size(), kNoAuth, &data));
+          EXPECT_EQ(written, data);
+        } else {
+          std::vector<uint32_t> space_index_list;
+          EXPECT_EQ(NV_RESULT_SUCCESS, device.GetSpaceList(&space_index_list));
+          EXPECT_TRUE(Contains(index, space_index_list));
+          uint64_t size = 0;
+          EXPECT_EQ(NV_RESULT_SUCCESS, device.GetSpaceSize(index, &size));
+          EXPECT_EQ(32u, size);
+          int write_lock = -1;
+          int read_lock = -1;
+          EXPECT_EQ(NV_RESULT_SUCCESS,
+                    device.IsSpaceLocked(index, &write_lock, &read_lock));
+          EXPECT_EQ(0, write_lock);
+          EXPECT_EQ(0, read_lock);
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
+TEST(NvramDeviceAdapterTest, SerializesNonConcurrentImplementation) {
+  std::atomic<bool> overlapped(false);
+  ScopedNvramDevice device(new NonConcurrentNvramImplementation(&overlapped));
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kConcurrentThreads; ++i) {
+    threads.emplace_back([&device]() {
+      for (int j = 0; j < kConcurrentIterations; ++j) {
+        std::string data;
+        EXPECT_EQ(NV_RESULT_SUCCESS,
+                  device.ReadSpace(kTestIndex1, 32, kNoAuth, &data));
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  EXPECT_FALSE(overlapped.load());
+}
+
+TEST(NvramDeviceAdapterTest, CachesGetInfo) {
+  CountingNvramImplementation* implementation = new CountingNvramImplementation;
+  ScopedNvramDevice device(implementation);
+
+  // All of these are answered by a single GetInfo response.
+  uint64_t size = 0;
+  EXPECT_EQ(NV_RESULT_SUCCESS, device.GetTotalSizeInBytes(&size));
+  EXPECT_EQ(1024u, size);
+  EXPECT_EQ(NV_RESULT_SUCCESS, device.GetAvailableSizeInBytes(&size));
+  EXPECT_EQ(992u, size);
+  EXPECT_EQ(NV_RESULT_SUCCESS, device.GetMaxSpaceSizeInBytes(&size));
+  EXPECT_EQ(32u, size);
+  uint32_t max_spaces = 0;
+  EXPECT_EQ(NV_RESULT_SUCCESS, device.GetMaxSpaces(&max_spaces));
+  EXPECT_EQ(32u, max_spaces);
+  std::vector<uint32_t> space_index_list;
+  EXPECT_EQ(NV_RESULT_SUCCESS, device.GetSpaceList(&space_index_list));
+  EXPECT_EQ(std::vector<uint32_t>{kTestIndex1}, space_index_list);
+  EXPECT_EQ(1, implementation->count(COMMAND_GET_INFO));
+}
+
+TEST(NvramDeviceAdapterTest, CachesGetSpaceInfo) {
+  CountingNvramImplementation* implementation = new CountingNvramImplementation;
+  ScopedNvramDevice device(implementation);
+
+  // Queries for the same space share a GetSpaceInfo response.
+  uint64_t size = 0;
+  EXPECT_EQ(NV_RESULT_SUCCESS, device.GetSpaceSize(kTestIndex1, &size));
+  EXPECT_EQ(32u, size);
+  std::vector<nvram_control_t> controls;
+  EXPECT_EQ(NV_RESULT_SUCCESS, device.GetSpaceControls(kTestIndex1, &controls));
+  int write_lock = -1;
+  int read_lock = -1;
+  EXPECT_EQ(NV_RESULT_SUCCESS,
+            device.IsSpaceLocked(kTestIndex1, &write_lock, &read_lock));
+  EXPECT_EQ(1, implementation->count(COMMAND_GET_SPACE_INFO));
+
+  // Other spaces need their own.
+  EXPECT_EQ(NV_RESULT_SUCCESS, device.GetSpaceSize(kTestIndex2, &size));
+  EXPECT_EQ(NV_RESULT_SUCCESS, device.GetSpaceSize(kTestIndex1, &size));
+  EXPECT_EQ(2, implementation->count(COMMAND_GET_SPACE_INFO));
+}
+
+TEST(NvramDeviceAdapterTest, CacheInvalidatedByChanges) {
+  CountingNvramImplementation* implementation = new CountingNvramImplementation;
+  ScopedNvramDevice device(implementation);
+
+  // Reading and writing space contents doesn't change the cached information.
+  uint64_t size = 0;
+  EXPECT_EQ(NV_RESULT_SUCCESS, device.GetTotalSizeInBytes(&size));
+  EXPECT_EQ(NV_RESULT_SUCCESS, device.GetSpaceSize(kTestIndex1, &size));
+  EXPECT_EQ(NV_RESULT_SUCCESS, device.WriteSpace(kTestIndex1, "data", kNoAuth));
+  std::string data;
+  EXPECT_EQ(NV_RESULT_SUCCESS, device.ReadSpace(kTestIndex1, 4, kNoAuth, &data));
+  EXPECT_EQ(NV_RESULT_SUCCESS, device.GetTotalSizeInBytes(&size));
+  EXPECT_EQ(NV_RESULT_SUCCESS, device.GetSpaceSize(kTestIndex1, &size));
+  EXPECT_EQ(1, implementation->count(COMMAND_GET_INFO));
+  EXPECT_EQ(1, implementation->count(COMMAND_GET_SPACE_INFO));
+
+  // Each of these drops the cached responses.
+  const std::vector<std::function<nvram_result_t()>> changes = {
+      [&device]() {
+        return device.CreateSpace(kTestIndex2, 32, {}, kNoAuth);
+      },
+      [&device]() { return device.DeleteSpace(kTestIndex2, kNoAuth); },
+      [&device]() { return device.EnableWriteLock(kTestIndex1, kNoAuth); },
+      [&device]() { return device.EnableReadLock(kTestIndex1, kNoAuth); },
+      [&device]() { return device.DisableCreate(); },
+  };
+  int expected_count = 1;
+  for (const std::function<nvram_result_t()>& change : changes) {
+    EXPECT_EQ(NV_RESULT_SUCCESS, change());
+    ++expected_count;
+    EXPECT_EQ(NV_RESULT_SUCCESS, device.GetTotalSizeInBytes(&size));
+    EXPECT_EQ(NV_RESULT_SUCCESS, device.GetSpaceSize(kTestIndex1, &size));
+    EXPECT_EQ(expected_count, implementation->count(COMMAND_GET_INFO));
+    EXPECT_EQ(expected_count, implementation->count(COMMAND_GET_SPACE_INFO));
+  }
+}
+
+TEST(NvramDeviceAdapterTest, CacheExpires) {
+  CountingNvramImplementation* implementation = new CountingNvramImplementation;
+  ScopedNvramDevice device(implementation);
+
+  uint64_t size = 0;
+  EXPECT_EQ(NV_RESULT_SUCCESS, device.GetTotalSizeInBytes(&size));
+  EXPECT_EQ(NV_RESULT_SUCCESS, device.GetSpaceSize(kTestIndex1, &size));
+
+  // Wait well past the adapter's cache lifetime of 100 milliseconds.
+  std::this_thread::sleep_for(std::chrono::milliseconds(250));
+  EXPECT_EQ(NV_RESULT_SUCCESS, device.GetTotalSizeInBytes(&size));
+  EXPECT_EQ(NV_RESULT_SUCCESS, device.GetSpaceSize(kTestIndex1, &size));
+  EXPECT_EQ(2, implementation->count(COMMAND_GET_INFO));
+  EXPECT_EQ(2, implementation->count(COMMAND_GET_SPACE_INFO));
+}
+
+TEST(NvramDeviceAdapterTest, CacheSkipsResponsesRacingInvalidation) {
+  CountingNvramImplementation* implementation = new CountingNvramImplementation;
+  ScopedNvramDevice device(implementation);
+
+  // A space gets deleted while GetInfo executes, so its response may be
+  // stale and must not be cached.
+  implementation->set_execute_hook([&device]() {
+    EXPECT_EQ(NV_RESULT_SUCCESS, device.DeleteSpace(kTestIndex2, kNoAuth));
+  });
+  uint64_t size = 0;
+  EXPECT_EQ(NV_RESULT_SUCCESS, device.GetTotalSizeInBytes(&size));
+  EXPECT_EQ(NV_RESULT_SUCCESS, device.GetTotalSizeInBytes(&size));
+  EXPECT_EQ(2, implementation->count(COMMAND_GET_INFO));
+
+  // The second response is cached again.
+  EXPECT_EQ(NV_RESULT_SUCCESS, device.GetTotalSizeInBytes(&size));
+  EXPECT_EQ(2, implementation->count(COMMAND_GET_INFO));
+
+  // Same for GetSpaceInfo.
+  implementation->set_execute_hook([&device]() {
+    EXPECT_EQ(NV_RESULT_SUCCESS, device.EnableReadLock(kTestIndex1, kNoAuth));
+  });
+  EXPECT_EQ(NV_RESULT_SUCCESS, device.GetSpaceSize(kTestIndex1, &size));
+  EXPECT_EQ(NV_RESULT_SUCCESS, device.GetSpaceSize(kTestIndex1, &size));
+  EXPECT_EQ(NV_RESULT_SUCCESS, device.GetSpaceSize(kTestIndex1, &size));
+  EXPECT_EQ(2, implementation->count(COMMAND_GET_SPACE_INFO));
+}
+
 }  // namespace nvram
@@ -55,6 +55,12 @@ ScopedNvramDevice::ScopedNvramDevice() {
   }
 }
 
+ScopedNvramDevice::ScopedNvramDevice(NvramImplementation* implementation) {
+  NvramDeviceAdapter* adapter =
+      new NvramDeviceAdapter(nullptr, implementation);
+  device_ = reinterpret_cast<nvram_device_t*>(adapter->as_device());
+}
+
 ScopedNvramDevice::~ScopedNvramDevice() {
   if (device_) {
     int result = nvram_close(device_);
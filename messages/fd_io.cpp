@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <nvram/messages/fd_io.h>
+
+extern "C" {
+#include <errno.h>
+#include <unistd.h>
+}
+
+namespace nvram {
+
+FdInputStreamBuffer::FdInputStreamBuffer(int fd, size_t buffer_size)
+    : fd_(fd), buffer_size_(buffer_size) {
+  NVRAM_CHECK(buffer_size_ > 0);
+}
+
+bool FdInputStreamBuffer::Advance() {
+  if (error_) {
+    return false;
+  }
+
+  // Note that resizing is fine here, since the current window is exhausted and
+  // hence there are no live pointers into |buffer_|.
+  if (buffer_.size() != buffer_size_ && !buffer_.Resize(buffer_size_)) {
+    error_ = true;
+    return false;
+  }
+
+  ssize_t bytes_read;
+  do {
+    bytes_read = read(fd_, buffer_.data(), buffer_.size());
+  } while (bytes_read < 0 && errno == EINTR);
+
+  if (bytes_read < 0) {
+    error_ = true;
+    return false;
+  }
+
+  if (bytes_read == 0) {
+    return false;
+  }
+
+  pos_ = buffer_.data();
+  end_ = buffer_.data() + bytes_read;
+  return true;
+}
+
+FdOutputStreamBuffer::FdOutputStreamBuffer(int fd, size_t buffer_size)
+    : fd_(fd), buffer_size_(buffer_size) {
+  NVRAM_CHECK(buffer_size_ > 0);
+}
+
+bool FdOutputStreamBuffer::Flush() {
+  if (error_) {
+    return false;
+  }
+
+  const uint8_t* data = buffer_.data();
+  while (data < pos_) {
+    ssize_t bytes_written = write(fd_, data, pos_ - data);
+    if (bytes_written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error_ = true;
+      return false;
+    }
+    data += bytes_written;
+  }
+
+  pos_ = buffer_.data();
+  return true;
+}
+
+bool FdOutputStreamBuffer::Advance() {
+  if (!Flush()) {
+    return false;
+  }
+
+  if (buffer_.size() != buffer_size_) {
+    if (!buffer_.Resize(buffer_size_)) {
+      error_ = true;
+      return false;
+    }
+  }
+
+  pos_ = buffer_.data();
+  end_ = buffer_.data() + buffer_.size();
+  return true;
+}
+
+}  // namespace nvram
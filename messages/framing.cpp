@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <nvram/messages/framing.h>
+
+#include <nvram/messages/nvram_messages.h>
+
+namespace nvram {
+namespace {
+
+// Frame header magic bytes. See framing.h for why these specific values.
+constexpr uint8_t kFrameMagic0 = 0x7a;
+constexpr uint8_t kFrameMagic1 = 0x7f;
+
+}  // namespace
+
+bool IsFrameHeader(const uint8_t* data, size_t size) {
+  return size >= 2 && data[0] == kFrameMagic0 && data[1] == kFrameMagic1;
+}
+
+bool WriteFrameHeader(OutputStreamBuffer* stream, const FrameHeader& header) {
+  const uint8_t encoded[kFrameHeaderSize] = {
+      kFrameMagic0,
+      kFrameMagic1,
+      header.version,
+      header.flags,
+      static_cast<uint8_t>(header.length),
+      static_cast<uint8_t>(header.length >> 8),
+      static_cast<uint8_t>(header.length >> 16),
+      static_cast<uint8_t>(header.length >> 24),
+  };
+  if (!stream->Write(encoded, sizeof(encoded))) {
+    return false;
+  }
+
+  if (header.flags & kFrameFlagRequestId) {
+    const uint8_t encoded_request_id[kFrameRequestIdSize] = {
+        static_cast<uint8_t>(header.request_id),
+        static_cast<uint8_t>(header.request_id >> 8),
+        static_cast<uint8_t>(header.request_id >> 16),
+        static_cast<uint8_t>(header.request_id >> 24),
+    };
+    return stream->Write(encoded_request_id, sizeof(encoded_request_id));
+  }
+
+  return true;
+}
+
+bool ReadFrameHeader(InputStreamBuffer* stream, FrameHeader* header) {
+  uint8_t encoded[kFrameHeaderSize];
+  if (!stream->Read(encoded, sizeof(encoded)) ||
+      !IsFrameHeader(encoded, sizeof(encoded))) {
+    return false;
+  }
+
+  header->version = encoded[2];
+  header->flags = encoded[3];
+  header->length = static_cast<uint32_t>(encoded[4]) |
+                   static_cast<uint32_t>(encoded[5]) << 8 |
+                   static_cast<uint32_t>(encoded[6]) << 16 |
+                   static_cast<uint32_t>(encoded[7]) << 24;
+
+  header->request_id = 0;
+  if (header->flags & kFrameFlagRequestId) {
+    uint8_t encoded_request_id[kFrameRequestIdSize];
+    if (!stream->Read(encoded_request_id, sizeof(encoded_request_id))) {
+      return false;
+    }
+    header->request_id = static_cast<uint32_t>(encoded_request_id[0]) |
+                         static_cast<uint32_t>(encoded_request_id[1]) << 8 |
+                         static_cast<uint32_t>(encoded_request_id[2]) << 16 |
+                         static_cast<uint32_t>(encoded_request_id[3]) << 24;
+  }
+
+  return header->version == kFrameVersion &&
+         header->length <= kMaxFrameLength;
+}
+
+namespace {
+
+// Writes |msg| as a frame, using |header| for all header fields apart from the
+// payload length.
+template <typename Message>
+bool WriteFrameWithHeader(OutputStreamBuffer* stream,
+                          FrameHeader header,
+                          const Message& msg) {
+  size_t size = GetEncodedSize(msg);
+  if (size > kMaxFrameLength) {
+    return false;
+  }
+  header.length = static_cast<uint32_t>(size);
+  return WriteFrameHeader(stream, header) && Encode(msg, stream);
+}
+
+}  // namespace
+
+template <typename Message>
+bool WriteFrame(OutputStreamBuffer* stream, const Message& msg) {
+  return WriteFrameWithHeader(stream, FrameHeader(), msg);
+}
+
+template <typename Message>
+bool WriteTaggedFrame(OutputStreamBuffer* stream,
+                      uint32_t request_id,
+                      const Message& msg) {
+  FrameHeader header;
+  header.flags = kFrameFlagRequestId;
+  header.request_id = request_id;
+  return WriteFrameWithHeader(stream, header, msg);
+}
+
+template <typename Message>
+bool ReadFramePayload(InputStreamBuffer* stream,
+                      const FrameHeader& header,
+                      Message* msg) {
+  if ((header.flags & (kFrameFlagProbe | kFrameFlagAttachRing)) != 0) {
+    return false;
+  }
+
+  NestedInputStreamBuffer payload_stream(stream, header.length);
+  return Decode(&payload_stream, msg);
+}
+
+// Instantiate the templates for the |Request| and |Response| message types.
+template NVRAM_EXPORT bool WriteFrame<Request>(OutputStreamBuffer*,
+                                               const Request&);
+template NVRAM_EXPORT bool WriteTaggedFrame<Request>(OutputStreamBuffer*,
+                                                     uint32_t,
+                                                     const Request&);
+template NVRAM_EXPORT bool ReadFramePayload<Request>(InputStreamBuffer*,
+                                                     const FrameHeader&,
+                                                     Request*);
+
+template NVRAM_EXPORT bool WriteFrame<Response>(OutputStreamBuffer*,
+                                                const Response&);
+template NVRAM_EXPORT bool WriteTaggedFrame<Response>(OutputStreamBuffer*,
+                                                      uint32_t,
+                                                      const Response&);
+template NVRAM_EXPORT bool ReadFramePayload<Response>(InputStreamBuffer*,
+                                                      const FrameHeader&,
+                                                      Response*);
+
+}  // namespace nvram
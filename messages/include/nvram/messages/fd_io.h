@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NVRAM_MESSAGES_FD_IO_H_
+#define NVRAM_MESSAGES_FD_IO_H_
+
+extern "C" {
+#include <stddef.h>
+#include <stdint.h>
+}
+
+#include <nvram/messages/blob.h>
+#include <nvram/messages/compiler.h>
+#include <nvram/messages/io.h>
+
+// Stream buffer implementations that perform I/O on POSIX file descriptors.
+// These are only meaningful in environments that provide |read()| and
+// |write()|, so they are kept separate from the core stream buffer classes in
+// io.h, which also need to build in restricted environments such as TEEs.
+
+namespace nvram {
+
+// An |InputStreamBuffer| that pulls its data from a file descriptor. Data is
+// read in chunks of up to |buffer_size| bytes, each |Advance()| call issuing a
+// single |read()|. This works for both files and stream sockets. When reading
+// from SOCK_SEQPACKET sockets, |buffer_size| must be at least as large as the
+// largest record the peer sends, since excess record bytes get discarded by the
+// kernel.
+class NVRAM_EXPORT FdInputStreamBuffer : public InputStreamBuffer {
+ public:
+  // The default buffer size. This matches the maximum record size used by the
+  // NVRAM control socket protocol.
+  static constexpr size_t kDefaultBufferSize = 4096;
+
+  // Initialize an |FdInputStreamBuffer| reading from |fd| using a buffer of
+  // |buffer_size| bytes. The buffer is allocated lazily on first use. |fd| is
+  // not owned and must remain open for the life time of this object.
+  explicit FdInputStreamBuffer(int fd,
+                               size_t buffer_size = kDefaultBufferSize);
+  ~FdInputStreamBuffer() override = default;
+
+  // Whether the stream hit an I/O or allocation error. This allows callers to
+  // distinguish errors from regular end of file conditions.
+  bool error() const { return error_; }
+
+ protected:
+  // InputStreamBuffer:
+  bool Advance() override;
+
+ private:
+  int fd_;
+  size_t buffer_size_;
+  Blob buffer_;
+  bool error_ = false;
+};
+
+// An |OutputStreamBuffer| that sends its data to a file descriptor. Output is
+// collected in a buffer of |buffer_size| bytes, which is written out via
+// |write()| whenever it fills up or |Flush()| gets called. On SOCK_SEQPACKET
+// sockets, each flush produces a separate record of at most |buffer_size|
+// bytes.
+//
+// Note that buffered data is *NOT* flushed on destruction, since there would be
+// no way to report errors. Call |Flush()| explicitly after writing the last
+// chunk of data.
+class NVRAM_EXPORT FdOutputStreamBuffer : public OutputStreamBuffer {
+ public:
+  // The default buffer size, see |FdInputStreamBuffer::kDefaultBufferSize|.
+  static constexpr size_t kDefaultBufferSize = 4096;
+
+  // Initialize an |FdOutputStreamBuffer| writing to |fd| using a buffer of
+  // |buffer_size| bytes. The buffer is allocated lazily on first use. |fd| is
+  // not owned and must remain open for the life time of this object.
+  explicit FdOutputStreamBuffer(int fd,
+                                size_t buffer_size = kDefaultBufferSize);
+  ~FdOutputStreamBuffer() override = default;
+
+  // Writes all buffered data to the file descriptor. Returns true if
+  // successful, false on I/O errors.
+  bool Flush();
+
+  // Whether the stream hit an I/O or allocation error.
+  bool error() const { return error_; }
+
+ protected:
+  // OutputStreamBuffer:
+  bool Advance() override;
+
+ private:
+  int fd_;
+  size_t buffer_size_;
+  Blob buffer_;
+  bool error_ = false;
+};
+
+}  // namespace nvram
+
+#endif  // NVRAM_MESSAGES_FD_IO_H_
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NVRAM_MESSAGES_FRAMING_H_
+#define NVRAM_MESSAGES_FRAMING_H_
+
+extern "C" {
+#include <stddef.h>
+#include <stdint.h>
+}
+
+#include <nvram/messages/compiler.h>
+#include <nvram/messages/io.h>
+
+// Length-prefixed message framing for NVRAM control sockets.
+//
+// The original control socket protocol sends each encoded message as a single
+// SOCK_SEQPACKET record, which limits messages to the size of the receive
+// buffer used by the peer (4096 bytes in practice). Framed mode lifts that
+// limit: each message is preceded by a |FrameHeader| indicating the encoded
+// message length, and the frame is transmitted as a sequence of records of at
+// most |kFrameRecordSize| bytes each. Frames always start at a record boundary,
+// so receivers can tell framed and unframed messages apart by looking at the
+// first bytes of a record.
+//
+// Framed mode is negotiated per connection. A client that supports framing
+// sends a probe frame (a bare header with |kFrameFlagProbe| set) right after
+// connecting. Servers that understand framing echo the probe header back,
+// after which both sides exchange framed messages. Servers that predate framing
+// fail to decode the probe and close the connection, which tells the client to
+// reconnect and fall back to unframed messages.
+//
+// Frames may carry a request ID, which allows clients to have multiple requests
+// in flight on a connection and match up responses. Servers tag each response
+// with the ID of the corresponding request. Clients request support for tagged
+// frames by setting |kFrameFlagRequestId| in the probe, and servers supporting
+// them set the flag in the probe reply.
+//
+// The header magic bytes are chosen such that they look like a protobuf
+// length-delimited field with an unknown field number that is longer than the
+// header. This guarantees that legacy decoders reject a bare frame header.
+
+namespace nvram {
+
+// Wire size of an encoded |FrameHeader|, not including the request ID.
+constexpr size_t kFrameHeaderSize = 8;
+
+// Wire size of the request ID field in tagged frame headers.
+constexpr size_t kFrameRequestIdSize = 4;
+
+// The current framing protocol version.
+constexpr uint8_t kFrameVersion = 1;
+
+// Maximum size of records that make up a frame on the wire.
+constexpr size_t kFrameRecordSize = 4096;
+
+// Upper bound on the payload length accepted in a frame. This bounds memory
+// allocations on behalf of peers.
+constexpr uint32_t kMaxFrameLength = 1024 * 1024;
+
+// Frame header flags.
+enum FrameFlags : uint8_t {
+  // The frame is a framing probe and doesn't carry a payload.
+  kFrameFlagProbe = 1 << 0,
+
+  // The frame requests attaching a shared memory transport to the connection.
+  // It doesn't carry a payload, the transport resources are passed as
+  // ancillary data along with the frame header.
+  kFrameFlagAttachRing = 1 << 1,
+
+  // The header is followed by a request ID.
+  kFrameFlagRequestId = 1 << 2,
+};
+
+// |FrameHeader| precedes each message in framed mode. Its wire encoding
+// consists of two magic bytes, followed by |version|, |flags| and |length|,
+// the latter encoded as a 32-bit little-endian integer. If |flags| has
+// |kFrameFlagRequestId| set, |request_id| follows as a 32-bit little-endian
+// integer.
+struct FrameHeader {
+  uint8_t version = kFrameVersion;
+  uint8_t flags = 0;
+  uint32_t length = 0;
+  uint32_t request_id = 0;
+};
+
+// Checks whether the |size| bytes at |data| start with the frame header magic.
+NVRAM_EXPORT bool IsFrameHeader(const uint8_t* data, size_t size);
+
+// Writes the wire encoding of |header| to |stream|. Returns true if successful.
+NVRAM_EXPORT bool WriteFrameHeader(OutputStreamBuffer* stream,
+                                   const FrameHeader& header);
+
+// Reads and validates a frame header from |stream|. Returns false on I/O
+// errors, bad magic bytes, unsupported versions and excess payload length.
+NVRAM_EXPORT bool ReadFrameHeader(InputStreamBuffer* stream,
+                                  FrameHeader* header);
+
+// Encodes |msg| as a frame and writes it to |stream|. Note that |stream| isn't
+// flushed, so callers writing to file descriptors need to flush |stream| after
+// this returns. Returns true if successful.
+template <typename Message>
+bool WriteFrame(OutputStreamBuffer* stream, const Message& msg);
+
+// Like |WriteFrame()|, but tags the frame with |request_id|.
+template <typename Message>
+bool WriteTaggedFrame(OutputStreamBuffer* stream,
+                      uint32_t request_id,
+                      const Message& msg);
+
+// Decodes the payload of a frame described by |header| from |stream| and
+// stores the result in |msg|. This consumes exactly |header.length| bytes.
+// Returns true if successful.
+template <typename Message>
+bool ReadFramePayload(InputStreamBuffer* stream,
+                      const FrameHeader& header,
+                      Message* msg);
+
+}  // namespace nvram
+
+#endif  // NVRAM_MESSAGES_FRAMING_H_
@@ -290,7 +290,8 @@ class NVRAM_EXPORT ProtoWriter {
   // Access to the underlying stream buffer.
   OutputStreamBuffer* stream_buffer() { return stream_buffer_; }
 
-  // Sets the field number to use when emitting a tag.
+  // The field number to use when emitting a tag.
+  uint64_t field_number() const { return field_number_; }
   void set_field_number(uint64_t field_number) { field_number_ = field_number; }
 
   // Whether the writer has exhausted the underlying |OutputStream|'s capacity.
@@ -21,6 +21,7 @@
 
 #include <nvram/messages/blob.h>
 #include <nvram/messages/compiler.h>
+#include <nvram/messages/io.h>
 #include <nvram/messages/struct.h>
 #include <nvram/messages/tagged_union.h>
 #include <nvram/messages/vector.h>
@@ -45,6 +46,18 @@ enum Command {
   // by implementations to implement NVRAM clearing on full device reset.
   COMMAND_WIPE_STORAGE = 10,
   COMMAND_DISABLE_WIPE = 11,
+
+  // Creates and initializes a batch of spaces at once, e.g. during factory
+  // provisioning. Not accessible via the HAL API.
+  COMMAND_PROVISION_SPACES = 12,
+
+  // Applies write and read locks to several spaces at once, e.g. when the
+  // bootloader hands off. Not accessible via the HAL API.
+  COMMAND_LOCK_SPACES = 13,
+
+  // Retrieves per-command execution statistics, if the implementation collects
+  // them. Not accessible via the HAL API.
+  COMMAND_GET_STATS = 14,
 };
 
 // COMMAND_GET_INFO request/response.
@@ -65,6 +78,10 @@ struct CreateSpaceRequest {
   uint64_t size = 0;
   Vector<nvram_control_t> controls;
   Blob authorization_value;
+  // Initial space contents, which may be shorter than |size|. The remainder is
+  // zero-filled. Implementations that predate this field ignore it and create
+  // an all-zero space.
+  Blob contents;
 };
 
 struct CreateSpaceResponse {};
@@ -137,6 +154,80 @@ struct WipeStorageResponse {};
 struct DisableWipeRequest {};
 struct DisableWipeResponse {};
 
+// COMMAND_PROVISION_SPACES request/response.
+struct ProvisionedSpace {
+  uint32_t index = 0;
+  uint64_t size = 0;
+  Vector<nvram_control_t> controls;
+  Blob authorization_value;
+  // Initial space contents, which may be shorter than |size|. The remainder is
+  // zero-filled.
+  Blob contents;
+};
+
+struct ProvisionSpacesRequest {
+  Vector<ProvisionedSpace> spaces;
+};
+
+struct ProvisionSpacesResponse {};
+
+// COMMAND_LOCK_SPACES request/response.
+struct SpaceLock {
+  uint32_t index = 0;
+  bool lock_write = false;
+  bool lock_read = false;
+  Blob authorization_value;
+};
+
+struct LockSpacesRequest {
+  Vector<SpaceLock> locks;
+};
+
+struct LockSpacesResponse {};
+
+// The phases of command execution that |LatencyHistogram|s cover. The storage
+// phases measure the storage backend, the encode and decode phases the
+// conversion of header and space data for storage, and the logic phase all the
+// remaining time spent in the command.
+enum StatsPhase {
+  STATS_PHASE_STORAGE_LOAD = 0,
+  STATS_PHASE_DECODE = 1,
+  STATS_PHASE_LOGIC = 2,
+  STATS_PHASE_ENCODE = 3,
+  STATS_PHASE_STORAGE_STORE = 4,
+};
+
+// COMMAND_GET_STATS request/response.
+struct GetStatsRequest {
+  // Whether to clear all statistics after retrieving them.
+  bool reset = false;
+};
+
+// Histogram of the time commands spent in a |StatsPhase|. Bucket 0 counts
+// durations below 1 microsecond, bucket i > 0 those from 2^(i-1) up to 2^i
+// microseconds. The last bucket also counts all longer durations. Commands
+// that don't go through the phase aren't counted.
+struct LatencyHistogram {
+  uint32_t phase = 0;
+  Vector<uint32_t> buckets;
+};
+
+struct CommandStats {
+  uint32_t command = 0;
+  uint64_t calls = 0;
+
+  // Number of calls per result code, indexed by |nvram_result_t| value.
+  Vector<uint64_t> result_counts;
+
+  // Histograms for the phases the command went through at least once.
+  Vector<LatencyHistogram> latencies;
+};
+
+struct GetStatsResponse {
+  // Statistics of the commands that executed at least once.
+  Vector<CommandStats> commands;
+};
+
 // Generic request message, carrying command-specific payload. The slot set in
 // the payload determines the requested command.
 using RequestUnion = TaggedUnion<
@@ -151,7 +242,10 @@ using RequestUnion = TaggedUnion<
     TaggedUnionMember<COMMAND_LOCK_SPACE_WRITE, LockSpaceWriteRequest>,
     TaggedUnionMember<COMMAND_LOCK_SPACE_READ, LockSpaceReadRequest>,
     TaggedUnionMember<COMMAND_WIPE_STORAGE, WipeStorageRequest>,
-    TaggedUnionMember<COMMAND_DISABLE_WIPE, DisableWipeRequest>>;
+    TaggedUnionMember<COMMAND_DISABLE_WIPE, DisableWipeRequest>,
+    TaggedUnionMember<COMMAND_PROVISION_SPACES, ProvisionSpacesRequest>,
+    TaggedUnionMember<COMMAND_LOCK_SPACES, LockSpacesRequest>,
+    TaggedUnionMember<COMMAND_GET_STATS, GetStatsRequest>>;
 struct Request {
   RequestUnion payload;
 };
@@ -170,7 +264,10 @@ using ResponseUnion = TaggedUnion<
     TaggedUnionMember<COMMAND_LOCK_SPACE_WRITE, LockSpaceWriteResponse>,
     TaggedUnionMember<COMMAND_LOCK_SPACE_READ, LockSpaceReadResponse>,
     TaggedUnionMember<COMMAND_WIPE_STORAGE, WipeStorageResponse>,
-    TaggedUnionMember<COMMAND_DISABLE_WIPE, DisableWipeResponse>>;
+    TaggedUnionMember<COMMAND_DISABLE_WIPE, DisableWipeResponse>,
+    TaggedUnionMember<COMMAND_PROVISION_SPACES, ProvisionSpacesResponse>,
+    TaggedUnionMember<COMMAND_LOCK_SPACES, LockSpacesResponse>,
+    TaggedUnionMember<COMMAND_GET_STATS, GetStatsResponse>>;
 struct Response {
   nvram_result_t result = NV_RESULT_SUCCESS;
   ResponseUnion payload;
@@ -193,6 +290,21 @@ bool Encode(const Message& msg, void* buffer, size_t* size);
 template <typename Message>
 bool Decode(const uint8_t* data, size_t size, Message* msg);
 
+// Encode |msg| to |stream|. This allows encoding to sinks that aren't backed by
+// a single memory buffer, such as sockets. Note that |stream| isn't flushed.
+// Returns true on success.
+template <typename Message>
+bool Encode(const Message& msg, OutputStreamBuffer* stream);
+
+// Decode |msg| from |stream|, consuming data until |stream| is exhausted.
+// Returns true if successful.
+template <typename Message>
+bool Decode(InputStreamBuffer* stream, Message* msg);
+
+// Returns the number of bytes required to encode |msg|.
+template <typename Message>
+size_t GetEncodedSize(const Message& msg);
+
 }  // namespace nvram
 
 #endif  // NVRAM_MESSAGES_NVRAM_MESSAGES_H_
@@ -64,7 +64,18 @@ bool MessageEncoderBase::Encode(ProtoWriter* writer) {
   //    some auxiliary data structure held in the encoder. This is probably the
   //    cleanest solution, but comes at the expense of having to thread the size
   //    cache data structure through the encoding logic.
-  return writer->WriteLengthHeader(GetSize()) && EncodeData(writer);
+  if (!writer->WriteLengthHeader(GetSize())) {
+    return false;
+  }
+
+  // Encoding the nested fields changes the field number. Restore it afterwards
+  // so the enclosing level can emit further elements of a repeated field.
+  const uint64_t field_number = writer->field_number();
+  if (!EncodeData(writer)) {
+    return false;
+  }
+  writer->set_field_number(field_number);
+  return true;
 }
 
 bool MessageEncoderBase::EncodeData(ProtoWriter* writer) {
@@ -46,7 +46,8 @@ template<> struct DescriptorForType<CreateSpaceRequest> {
       MakeFieldList(MakeField(1, &CreateSpaceRequest::index),
                     MakeField(2, &CreateSpaceRequest::size),
                     MakeField(3, &CreateSpaceRequest::controls),
-                    MakeField(4, &CreateSpaceRequest::authorization_value));
+                    MakeField(4, &CreateSpaceRequest::authorization_value),
+                    MakeField(5, &CreateSpaceRequest::contents));
 };
 
 template<> struct DescriptorForType<CreateSpaceResponse> {
@@ -142,6 +143,65 @@ template<> struct DescriptorForType<DisableWipeResponse> {
   static constexpr auto kFields = MakeFieldList();
 };
 
+template<> struct DescriptorForType<ProvisionedSpace> {
+  static constexpr auto kFields =
+      MakeFieldList(MakeField(1, &ProvisionedSpace::index),
+                    MakeField(2, &ProvisionedSpace::size),
+                    MakeField(3, &ProvisionedSpace::controls),
+                    MakeField(4, &ProvisionedSpace::authorization_value),
+                    MakeField(5, &ProvisionedSpace::contents));
+};
+
+template<> struct DescriptorForType<ProvisionSpacesRequest> {
+  static constexpr auto kFields =
+      MakeFieldList(MakeField(1, &ProvisionSpacesRequest::spaces));
+};
+
+template<> struct DescriptorForType<ProvisionSpacesResponse> {
+  static constexpr auto kFields = MakeFieldList();
+};
+
+template<> struct DescriptorForType<SpaceLock> {
+  static constexpr auto kFields =
+      MakeFieldList(MakeField(1, &SpaceLock::index),
+                    MakeField(2, &SpaceLock::lock_write),
+                    MakeField(3, &SpaceLock::lock_read),
+                    MakeField(4, &SpaceLock::authorization_value));
+};
+
+template<> struct DescriptorForType<LockSpacesRequest> {
+  static constexpr auto kFields =
+      MakeFieldList(MakeField(1, &LockSpacesRequest::locks));
+};
+
+template<> struct DescriptorForType<LockSpacesResponse> {
+  static constexpr auto kFields = MakeFieldList();
+};
+
+template<> struct DescriptorForType<GetStatsRequest> {
+  static constexpr auto kFields =
+      MakeFieldList(MakeField(1, &GetStatsRequest::reset));
+};
+
+template<> struct DescriptorForType<LatencyHistogram> {
+  static constexpr auto kFields =
+      MakeFieldList(MakeField(1, &LatencyHistogram::phase),
+                    MakeField(2, &LatencyHistogram::buckets));
+};
+
+template<> struct DescriptorForType<CommandStats> {
+  static constexpr auto kFields =
+      MakeFieldList(MakeField(1, &CommandStats::command),
+                    MakeField(2, &CommandStats::calls),
+                    MakeField(3, &CommandStats::result_counts),
+                    MakeField(4, &CommandStats::latencies));
+};
+
+template<> struct DescriptorForType<GetStatsResponse> {
+  static constexpr auto kFields =
+      MakeFieldList(MakeField(1, &GetStatsResponse::commands));
+};
+
 template<> struct DescriptorForType<Request> {
   static constexpr auto kFields = MakeFieldList(
       MakeOneOfField(1, &Request::payload, COMMAND_GET_INFO),
@@ -154,7 +214,10 @@ template<> struct DescriptorForType<Request> {
       MakeOneOfField(8, &Request::payload, COMMAND_LOCK_SPACE_WRITE),
       MakeOneOfField(9, &Request::payload, COMMAND_LOCK_SPACE_READ),
       MakeOneOfField(10, &Request::payload, COMMAND_WIPE_STORAGE),
-      MakeOneOfField(11, &Request::payload, COMMAND_DISABLE_WIPE));
+      MakeOneOfField(11, &Request::payload, COMMAND_DISABLE_WIPE),
+      MakeOneOfField(12, &Request::payload, COMMAND_PROVISION_SPACES),
+      MakeOneOfField(13, &Request::payload, COMMAND_LOCK_SPACES),
+      MakeOneOfField(14, &Request::payload, COMMAND_GET_STATS));
 };
 
 template<> struct DescriptorForType<Response> {
@@ -170,7 +233,10 @@ template<> struct DescriptorForType<Response> {
       MakeOneOfField(9, &Response::payload, COMMAND_LOCK_SPACE_WRITE),
       MakeOneOfField(10, &Response::payload, COMMAND_LOCK_SPACE_READ),
       MakeOneOfField(11, &Response::payload, COMMAND_WIPE_STORAGE),
-      MakeOneOfField(12, &Response::payload, COMMAND_DISABLE_WIPE));
+      MakeOneOfField(12, &Response::payload, COMMAND_DISABLE_WIPE),
+      MakeOneOfField(13, &Response::payload, COMMAND_PROVISION_SPACES),
+      MakeOneOfField(14, &Response::payload, COMMAND_LOCK_SPACES),
+      MakeOneOfField(15, &Response::payload, COMMAND_GET_STATS));
 };
 
 template <typename Message>
@@ -195,13 +261,36 @@ bool Decode(const uint8_t* data, size_t size, Message* msg) {
   return nvram::proto::Decode(msg, &stream) && stream.Done();
 }
 
+template <typename Message>
+bool Encode(const Message& msg, OutputStreamBuffer* stream) {
+  return nvram::proto::Encode(msg, stream);
+}
+
+template <typename Message>
+bool Decode(InputStreamBuffer* stream, Message* msg) {
+  return nvram::proto::Decode(msg, stream) && stream->Done();
+}
+
+template <typename Message>
+size_t GetEncodedSize(const Message& msg) {
+  return nvram::proto::GetSize(msg);
+}
+
 // Instantiate the templates for the |Request| and |Response| message types.
 template NVRAM_EXPORT bool Encode<Request>(const Request&, Blob*);
 template NVRAM_EXPORT bool Encode<Request>(const Request&, void*, size_t*);
 template NVRAM_EXPORT bool Decode<Request>(const uint8_t*, size_t, Request*);
+template NVRAM_EXPORT bool Encode<Request>(const Request&,
+                                           OutputStreamBuffer*);
+template NVRAM_EXPORT bool Decode<Request>(InputStreamBuffer*, Request*);
+template NVRAM_EXPORT size_t GetEncodedSize<Request>(const Request&);
 
 template NVRAM_EXPORT bool Encode<Response>(const Response&, Blob*);
 template NVRAM_EXPORT bool Encode<Response>(const Response&, void*, size_t*);
 template NVRAM_EXPORT bool Decode<Response>(const uint8_t*, size_t, Response*);
+template NVRAM_EXPORT bool Encode<Response>(const Response&,
+                                            OutputStreamBuffer*);
+template NVRAM_EXPORT bool Decode<Response>(InputStreamBuffer*, Response*);
+template NVRAM_EXPORT size_t GetEncodedSize<Response>(const Response&);
 
 }  // namespace nvram
@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include <nvram/messages/fd_io.h>
+#include <nvram/messages/nvram_messages.h>
+
+namespace nvram {
+
+namespace {
+
+// Holds a connected pair of file descriptors of the given socket |type|.
+class SocketPair {
+ public:
+  explicit SocketPair(int type) {
+    EXPECT_EQ(0, socketpair(AF_UNIX, type, 0, fds_));
+  }
+
+  ~SocketPair() {
+    CloseWriter();
+    close(fds_[0]);
+  }
+
+  int reader() const { return fds_[0]; }
+  int writer() const { return fds_[1]; }
+
+  void CloseWriter() {
+    if (fds_[1] != -1) {
+      close(fds_[1]);
+      fds_[1] = -1;
+    }
+  }
+
+ private:
+  int fds_[2] = {-1, -1};
+};
+
+// Fills |data| with consecutive byte values starting at |pos|.
+void FillBuf(uint8_t* data, size_t size, size_t pos) {
+  for (uint8_t* p = data; p < data + size; ++p) {
+    *p = pos++ % 256;
+  }
+}
+
+}  // namespace
+
+TEST(FdInputStreamBufferTest, Basic) {
+  SocketPair sockets(SOCK_STREAM);
+  uint8_t data[100];
+  FillBuf(data, sizeof(data), 0);
+  ASSERT_EQ(static_cast<ssize_t>(sizeof(data)),
+            write(sockets.writer(), data, sizeof(data)));
+  sockets.CloseWriter();
+
+  // Use a small buffer to force reads to span multiple windows.
+  FdInputStreamBuffer buf(sockets.reader(), 7);
+  EXPECT_FALSE(buf.Done());
+
+  uint8_t byte = 0;
+  EXPECT_TRUE(buf.ReadByte(&byte));
+  EXPECT_EQ(0, byte);
+
+  uint8_t read_data[50];
+  EXPECT_TRUE(buf.Read(read_data, sizeof(read_data)));
+  EXPECT_EQ(0, memcmp(data + 1, read_data, sizeof(read_data)));
+
+  EXPECT_TRUE(buf.Skip(40));
+  EXPECT_TRUE(buf.ReadByte(&byte));
+  EXPECT_EQ(91, byte);
+  EXPECT_TRUE(buf.Skip(8));
+  EXPECT_TRUE(buf.Done());
+  EXPECT_FALSE(buf.error());
+}
+
+TEST(FdInputStreamBufferTest, PrematureEnd) {
+  SocketPair sockets(SOCK_STREAM);
+  uint8_t data[10];
+  FillBuf(data, sizeof(data), 0);
+  ASSERT_EQ(static_cast<ssize_t>(sizeof(data)),
+            write(sockets.writer(), data, sizeof(data)));
+  sockets.CloseWriter();
+
+  FdInputStreamBuffer buf(sockets.reader());
+  uint8_t read_data[20];
+  EXPECT_FALSE(buf.Read(read_data, sizeof(read_data)));
+  EXPECT_FALSE(buf.error());
+}
+
+TEST(FdInputStreamBufferTest, ReadError) {
+  FdInputStreamBuffer buf(-1);
+  EXPECT_TRUE(buf.Done());
+  EXPECT_TRUE(buf.error());
+}
+
+TEST(FdOutputStreamBufferTest, Basic) {
+  SocketPair sockets(SOCK_STREAM);
+  uint8_t data[100];
+  FillBuf(data, sizeof(data), 0);
+
+  FdOutputStreamBuffer buf(sockets.writer(), 7);
+  EXPECT_FALSE(buf.Done());
+  EXPECT_TRUE(buf.WriteByte(data[0]));
+  EXPECT_TRUE(buf.Write(data + 1, sizeof(data) - 1));
+  EXPECT_TRUE(buf.Flush());
+  EXPECT_FALSE(buf.error());
+  sockets.CloseWriter();
+
+  uint8_t read_data[sizeof(data) + 1];
+  size_t total = 0;
+  ssize_t rc;
+  while ((rc = read(sockets.reader(), read_data + total,
+                    sizeof(read_data) - total)) > 0) {
+    total += rc;
+  }
+  ASSERT_EQ(sizeof(data), total);
+  EXPECT_EQ(0, memcmp(data, read_data, sizeof(data)));
+}
+
+TEST(FdOutputStreamBufferTest, SeqPacketRecords) {
+  SocketPair sockets(SOCK_SEQPACKET);
+  uint8_t data[40];
+  FillBuf(data, sizeof(data), 0);
+
+  FdOutputStreamBuffer buf(sockets.writer(), 16);
+  EXPECT_TRUE(buf.Write(data, sizeof(data)));
+  EXPECT_TRUE(buf.Flush());
+
+  // Each buffer window should have been emitted as a separate record.
+  uint8_t record[64];
+  EXPECT_EQ(16, read(sockets.reader(), record, sizeof(record)));
+  EXPECT_EQ(0, memcmp(data, record, 16));
+  EXPECT_EQ(16, read(sockets.reader(), record, sizeof(record)));
+  EXPECT_EQ(0, memcmp(data + 16, record, 16));
+  EXPECT_EQ(8, read(sockets.reader(), record, sizeof(record)));
+  EXPECT_EQ(0, memcmp(data + 32, record, 8));
+}
+
+TEST(FdOutputStreamBufferTest, WriteError) {
+  FdOutputStreamBuffer buf(-1, 4);
+  uint8_t data[8] = {};
+  EXPECT_FALSE(buf.Write(data, sizeof(data)));
+  EXPECT_TRUE(buf.error());
+}
+
+TEST(FdStreamBufferTest, MessageRoundTrip) {
+  SocketPair sockets(SOCK_STREAM);
+
+  // Use a space payload that's larger than the stream buffers so encoding and
+  // decoding need to go through several windows.
+  Request request;
+  WriteSpaceRequest& write_space_request =
+      request.payload.Activate<COMMAND_WRITE_SPACE>();
+  write_space_request.index = 0x1234;
+  ASSERT_TRUE(write_space_request.buffer.Resize(3000));
+  FillBuf(write_space_request.buffer.data(), 3000, 0);
+
+  FdOutputStreamBuffer output(sockets.writer(), 256);
+  ASSERT_TRUE(Encode(request, &output));
+  ASSERT_TRUE(output.Flush());
+  sockets.CloseWriter();
+
+  FdInputStreamBuffer input(sockets.reader(), 256);
+  Request decoded;
+  ASSERT_TRUE(Decode(&input, &decoded));
+  EXPECT_FALSE(input.error());
+
+  const WriteSpaceRequest* decoded_payload =
+      decoded.payload.get<COMMAND_WRITE_SPACE>();
+  ASSERT_TRUE(decoded_payload);
+  EXPECT_EQ(0x1234U, decoded_payload->index);
+  ASSERT_EQ(3000U, decoded_payload->buffer.size());
+  EXPECT_EQ(0, memcmp(write_space_request.buffer.data(),
+                      decoded_payload->buffer.data(), 3000));
+}
+
+}  // namespace nvram
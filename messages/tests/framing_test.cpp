@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include <nvram/messages/fd_io.h>
+#include <nvram/messages/framing.h>
+#include <nvram/messages/nvram_messages.h>
+
+namespace nvram {
+
+TEST(FramingTest, HeaderRoundTrip) {
+  uint8_t buffer[kFrameHeaderSize];
+  ArrayOutputStreamBuffer output(buffer, sizeof(buffer));
+  FrameHeader header;
+  header.flags = kFrameFlagProbe;
+  header.length = 0x12345;
+  ASSERT_TRUE(WriteFrameHeader(&output, header));
+  EXPECT_EQ(kFrameHeaderSize, output.bytes_written());
+  EXPECT_TRUE(IsFrameHeader(buffer, sizeof(buffer)));
+
+  InputStreamBuffer input(buffer, sizeof(buffer));
+  FrameHeader decoded;
+  ASSERT_TRUE(ReadFrameHeader(&input, &decoded));
+  EXPECT_EQ(kFrameVersion, decoded.version);
+  EXPECT_EQ(kFrameFlagProbe, decoded.flags);
+  EXPECT_EQ(0x12345U, decoded.length);
+}
+
+TEST(FramingTest, TaggedHeaderRoundTrip) {
+  uint8_t buffer[kFrameHeaderSize + kFrameRequestIdSize];
+  ArrayOutputStreamBuffer output(buffer, sizeof(buffer));
+  FrameHeader header;
+  header.flags = kFrameFlagRequestId;
+  header.length = 42;
+  header.request_id = 0xdeadbeef;
+  ASSERT_TRUE(WriteFrameHeader(&output, header));
+  EXPECT_EQ(sizeof(buffer), output.bytes_written());
+
+  InputStreamBuffer input(buffer, sizeof(buffer));
+  FrameHeader decoded;
+  ASSERT_TRUE(ReadFrameHeader(&input, &decoded));
+  EXPECT_EQ(kFrameFlagRequestId, decoded.flags);
+  EXPECT_EQ(42U, decoded.length);
+  EXPECT_EQ(0xdeadbeefU, decoded.request_id);
+  EXPECT_TRUE(input.Done());
+
+  // A truncated request ID must be rejected.
+  InputStreamBuffer truncated_input(buffer, sizeof(buffer) - 1);
+  EXPECT_FALSE(ReadFrameHeader(&truncated_input, &decoded));
+}
+
+TEST(FramingTest, TaggedFrameRoundTrip) {
+  uint8_t buffer[256];
+  ArrayOutputStreamBuffer output(buffer, sizeof(buffer));
+  Request request;
+  request.payload.Activate<COMMAND_GET_SPACE_INFO>().index = 0x1234;
+  ASSERT_TRUE(WriteTaggedFrame(&output, 7, request));
+
+  InputStreamBuffer input(buffer, output.bytes_written());
+  FrameHeader header;
+  ASSERT_TRUE(ReadFrameHeader(&input, &header));
+  EXPECT_EQ(7U, header.request_id);
+  EXPECT_EQ(GetEncodedSize(request), header.length);
+
+  Request decoded;
+  ASSERT_TRUE(ReadFramePayload(&input, header, &decoded));
+  const GetSpaceInfoRequest* payload =
+      decoded.payload.get<COMMAND_GET_SPACE_INFO>();
+  ASSERT_TRUE(payload);
+  EXPECT_EQ(0x1234U, payload->index);
+}
+
+TEST(FramingTest, HeaderBadMagic) {
+  const uint8_t kBadHeader[kFrameHeaderSize] = {0x0a, 0x7f, kFrameVersion};
+  EXPECT_FALSE(IsFrameHeader(kBadHeader, sizeof(kBadHeader)));
+  InputStreamBuffer input(kBadHeader, sizeof(kBadHeader));
+  FrameHeader header;
+  EXPECT_FALSE(ReadFrameHeader(&input, &header));
+}
+
+TEST(FramingTest, HeaderExcessLength) {
+  uint8_t buffer[kFrameHeaderSize];
+  ArrayOutputStreamBuffer output(buffer, sizeof(buffer));
+  FrameHeader header;
+  header.length = kMaxFrameLength + 1;
+  ASSERT_TRUE(WriteFrameHeader(&output, header));
+
+  InputStreamBuffer input(buffer, sizeof(buffer));
+  EXPECT_FALSE(ReadFrameHeader(&input, &header));
+}
+
+TEST(FramingTest, LegacyDecoderRejectsProbe) {
+  uint8_t buffer[kFrameHeaderSize];
+  ArrayOutputStreamBuffer output(buffer, sizeof(buffer));
+  FrameHeader header;
+  header.flags = kFrameFlagProbe;
+  ASSERT_TRUE(WriteFrameHeader(&output, header));
+
+  Request request;
+  EXPECT_FALSE(Decode(buffer, sizeof(buffer), &request));
+}
+
+TEST(FramingTest, LargeMessageOverSeqPacket) {
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds));
+
+  // Create a response that is way larger than a single record.
+  Response response;
+  response.result = NV_RESULT_SUCCESS;
+  ReadSpaceResponse& read_space_response =
+      response.payload.Activate<COMMAND_READ_SPACE>();
+  ASSERT_TRUE(read_space_response.buffer.Resize(5 * kFrameRecordSize));
+  for (size_t i = 0; i < read_space_response.buffer.size(); ++i) {
+    read_space_response.buffer.data()[i] = i % 251;
+  }
+
+  FdOutputStreamBuffer output(fds[1], kFrameRecordSize);
+  ASSERT_TRUE(WriteFrame(&output, response));
+  ASSERT_TRUE(output.Flush());
+
+  FdInputStreamBuffer input(fds[0], kFrameRecordSize);
+  FrameHeader header;
+  ASSERT_TRUE(ReadFrameHeader(&input, &header));
+  EXPECT_EQ(0, header.flags);
+  EXPECT_EQ(GetEncodedSize(response), header.length);
+
+  Response decoded;
+  ASSERT_TRUE(ReadFramePayload(&input, header, &decoded));
+  const ReadSpaceResponse* decoded_payload =
+      decoded.payload.get<COMMAND_READ_SPACE>();
+  ASSERT_TRUE(decoded_payload);
+  ASSERT_EQ(read_space_response.buffer.size(), decoded_payload->buffer.size());
+  EXPECT_EQ(0, memcmp(read_space_response.buffer.data(),
+                      decoded_payload->buffer.data(),
+                      decoded_payload->buffer.size()));
+
+  // A subsequent frame should be readable from a fresh stream buffer, since
+  // frames start at record boundaries.
+  Request request;
+  request.payload.Activate<COMMAND_GET_INFO>();
+  ASSERT_TRUE(WriteFrame(&output, request));
+  ASSERT_TRUE(output.Flush());
+
+  FdInputStreamBuffer next_input(fds[0], kFrameRecordSize);
+  ASSERT_TRUE(ReadFrameHeader(&next_input, &header));
+  Request decoded_request;
+  ASSERT_TRUE(ReadFramePayload(&next_input, header, &decoded_request));
+  EXPECT_EQ(COMMAND_GET_INFO, decoded_request.payload.which());
+
+  close(fds[0]);
+  close(fds[1]);
+}
+
+}  // namespace nvram
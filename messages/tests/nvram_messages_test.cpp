@@ -94,6 +94,8 @@ TEST(NvramMessagesTest, CreateSpaceRequest) {
   const uint8_t kAuthValue[] = {1, 2, 3, 4, 5};
   ASSERT_TRUE(request_payload.authorization_value.Assign(kAuthValue,
                                                          sizeof(kAuthValue)));
+  const uint8_t kContents[] = {9, 8, 7};
+  ASSERT_TRUE(request_payload.contents.Assign(kContents, sizeof(kContents)));
 
   Request decoded;
   EncodeAndDecode(request, &decoded);
@@ -112,6 +114,9 @@ TEST(NvramMessagesTest, CreateSpaceRequest) {
   ASSERT_EQ(sizeof(kAuthValue), decoded_auth_value.size());
   EXPECT_EQ(0,
             memcmp(kAuthValue, decoded_auth_value.data(), sizeof(kAuthValue)));
+  const Blob& decoded_contents = decoded_payload->contents;
+  ASSERT_EQ(sizeof(kContents), decoded_contents.size());
+  EXPECT_EQ(0, memcmp(kContents, decoded_contents.data(), sizeof(kContents)));
 }
 
 TEST(NvramMessagesTest, CreateSpaceResponse) {
@@ -396,6 +401,175 @@ TEST(NvramMessagesTest, LockSpaceReadResponse) {
   EXPECT_TRUE(decoded.payload.get<COMMAND_LOCK_SPACE_READ>());
 }
 
+TEST(NvramMessagesTest, ProvisionSpacesRequest) {
+  Request request;
+  ProvisionSpacesRequest& request_payload =
+      request.payload.Activate<COMMAND_PROVISION_SPACES>();
+  ASSERT_TRUE(request_payload.spaces.Resize(2));
+  request_payload.spaces[0].index = 0x12345678;
+  request_payload.spaces[0].size = 8;
+  ASSERT_TRUE(
+      request_payload.spaces[0].controls.Append(NV_CONTROL_BOOT_WRITE_LOCK));
+  const uint8_t kAuthValue[] = {1, 2, 3, 4, 5};
+  ASSERT_TRUE(request_payload.spaces[0].authorization_value.Assign(
+      kAuthValue, sizeof(kAuthValue)));
+  const uint8_t kContents[] = {6, 7, 8};
+  ASSERT_TRUE(
+      request_payload.spaces[0].contents.Assign(kContents, sizeof(kContents)));
+  request_payload.spaces[1].index = 0x42;
+  request_payload.spaces[1].size = 32;
+
+  Request decoded;
+  EncodeAndDecode(request, &decoded);
+
+  EXPECT_EQ(COMMAND_PROVISION_SPACES, decoded.payload.which());
+  const ProvisionSpacesRequest* decoded_payload =
+      decoded.payload.get<COMMAND_PROVISION_SPACES>();
+  ASSERT_TRUE(decoded_payload);
+
+  ASSERT_EQ(2UL, decoded_payload->spaces.size());
+  const ProvisionedSpace& first = decoded_payload->spaces[0];
+  EXPECT_EQ(0x12345678U, first.index);
+  EXPECT_EQ(8ULL, first.size);
+  ASSERT_EQ(1UL, first.controls.size());
+  EXPECT_EQ(NV_CONTROL_BOOT_WRITE_LOCK, first.controls[0]);
+  ASSERT_EQ(sizeof(kAuthValue), first.authorization_value.size());
+  EXPECT_EQ(0, memcmp(kAuthValue, first.authorization_value.data(),
+                      sizeof(kAuthValue)));
+  ASSERT_EQ(sizeof(kContents), first.contents.size());
+  EXPECT_EQ(0, memcmp(kContents, first.contents.data(), sizeof(kContents)));
+
+  const ProvisionedSpace& second = decoded_payload->spaces[1];
+  EXPECT_EQ(0x42U, second.index);
+  EXPECT_EQ(32ULL, second.size);
+  EXPECT_EQ(0UL, second.controls.size());
+  EXPECT_EQ(0UL, second.authorization_value.size());
+  EXPECT_EQ(0UL, second.contents.size());
+}
+
+TEST(NvramMessagesTest, ProvisionSpacesResponse) {
+  Response response;
+  response.result = NV_RESULT_SPACE_ALREADY_EXISTS;
+  response.payload.Activate<COMMAND_PROVISION_SPACES>();
+
+  Response decoded;
+  EncodeAndDecode(response, &decoded);
+
+  EXPECT_EQ(NV_RESULT_SPACE_ALREADY_EXISTS, decoded.result);
+  EXPECT_EQ(COMMAND_PROVISION_SPACES, decoded.payload.which());
+  EXPECT_TRUE(decoded.payload.get<COMMAND_PROVISION_SPACES>());
+}
+
+TEST(NvramMessagesTest, LockSpacesRequest) {
+  Request request;
+  LockSpacesRequest& request_payload =
+      request.payload.Activate<COMMAND_LOCK_SPACES>();
+  ASSERT_TRUE(request_payload.locks.Resize(2));
+  request_payload.locks[0].index = 0x1234;
+  request_payload.locks[0].lock_write = true;
+  const uint8_t kAuthValue[] = {1, 2, 3};
+  ASSERT_TRUE(request_payload.locks[0].authorization_value.Assign(
+      kAuthValue, sizeof(kAuthValue)));
+  request_payload.locks[1].index = 0x5678;
+  request_payload.locks[1].lock_read = true;
+
+  Request decoded;
+  EncodeAndDecode(request, &decoded);
+
+  EXPECT_EQ(COMMAND_LOCK_SPACES, decoded.payload.which());
+  const LockSpacesRequest* decoded_payload =
+      decoded.payload.get<COMMAND_LOCK_SPACES>();
+  ASSERT_TRUE(decoded_payload);
+
+  ASSERT_EQ(2UL, decoded_payload->locks.size());
+  EXPECT_EQ(0x1234U, decoded_payload->locks[0].index);
+  EXPECT_TRUE(decoded_payload->locks[0].lock_write);
+  EXPECT_FALSE(decoded_payload->locks[0].lock_read);
+  const Blob& decoded_auth_value =
+      decoded_payload->locks[0].authorization_value;
+  ASSERT_EQ(sizeof(kAuthValue), decoded_auth_value.size());
+  EXPECT_EQ(0,
+            memcmp(kAuthValue, decoded_auth_value.data(), sizeof(kAuthValue)));
+  EXPECT_EQ(0x5678U, decoded_payload->locks[1].index);
+  EXPECT_FALSE(decoded_payload->locks[1].lock_write);
+  EXPECT_TRUE(decoded_payload->locks[1].lock_read);
+  EXPECT_EQ(0UL, decoded_payload->locks[1].authorization_value.size());
+}
+
+TEST(NvramMessagesTest, LockSpacesResponse) {
+  Response response;
+  response.result = NV_RESULT_OPERATION_DISABLED;
+  response.payload.Activate<COMMAND_LOCK_SPACES>();
+
+  Response decoded;
+  EncodeAndDecode(response, &decoded);
+
+  EXPECT_EQ(NV_RESULT_OPERATION_DISABLED, decoded.result);
+  EXPECT_EQ(COMMAND_LOCK_SPACES, decoded.payload.which());
+  EXPECT_TRUE(decoded.payload.get<COMMAND_LOCK_SPACES>());
+}
+
+TEST(NvramMessagesTest, GetStatsRequest) {
+  Request request;
+  request.payload.Activate<COMMAND_GET_STATS>().reset = true;
+
+  Request decoded;
+  EncodeAndDecode(request, &decoded);
+
+  EXPECT_EQ(COMMAND_GET_STATS, decoded.payload.which());
+  const GetStatsRequest* decoded_payload =
+      decoded.payload.get<COMMAND_GET_STATS>();
+  ASSERT_TRUE(decoded_payload);
+  EXPECT_TRUE(decoded_payload->reset);
+}
+
+TEST(NvramMessagesTest, GetStatsResponse) {
+  Response response;
+  response.result = NV_RESULT_SUCCESS;
+  GetStatsResponse& response_payload =
+      response.payload.Activate<COMMAND_GET_STATS>();
+  ASSERT_TRUE(response_payload.commands.Resize(2));
+  for (size_t i = 0; i < 2; ++i) {
+    CommandStats& command_stats = response_payload.commands[i];
+    command_stats.command = COMMAND_READ_SPACE + i;
+    command_stats.calls = 0x100000000ULL + i;
+    ASSERT_TRUE(command_stats.result_counts.Resize(2));
+    command_stats.result_counts[NV_RESULT_INTERNAL_ERROR] = i + 1;
+    ASSERT_TRUE(command_stats.latencies.Resize(2));
+    for (size_t j = 0; j < 2; ++j) {
+      command_stats.latencies[j].phase = STATS_PHASE_STORAGE_LOAD + j;
+      ASSERT_TRUE(command_stats.latencies[j].buckets.Resize(3));
+      command_stats.latencies[j].buckets[2] = 10 * i + j;
+    }
+  }
+
+  Response decoded;
+  EncodeAndDecode(response, &decoded);
+
+  EXPECT_EQ(NV_RESULT_SUCCESS, decoded.result);
+  EXPECT_EQ(COMMAND_GET_STATS, decoded.payload.which());
+  const GetStatsResponse* decoded_payload =
+      decoded.payload.get<COMMAND_GET_STATS>();
+  ASSERT_TRUE(decoded_payload);
+
+  ASSERT_EQ(2UL, decoded_payload->commands.size());
+  for (size_t i = 0; i < 2; ++i) {
+    const CommandStats& command_stats = decoded_payload->commands[i];
+    EXPECT_EQ(COMMAND_READ_SPACE + i, command_stats.command);
+    EXPECT_EQ(0x100000000ULL + i, command_stats.calls);
+    ASSERT_EQ(2UL, command_stats.result_counts.size());
+    EXPECT_EQ(0U, command_stats.result_counts[NV_RESULT_SUCCESS]);
+    EXPECT_EQ(i + 1, command_stats.result_counts[NV_RESULT_INTERNAL_ERROR]);
+    ASSERT_EQ(2UL, command_stats.latencies.size());
+    for (size_t j = 0; j < 2; ++j) {
+      EXPECT_EQ(STATS_PHASE_STORAGE_LOAD + j, command_stats.latencies[j].phase);
+      ASSERT_EQ(3UL, command_stats.latencies[j].buckets.size());
+      EXPECT_EQ(0U, command_stats.latencies[j].buckets[0]);
+      EXPECT_EQ(10 * i + j, command_stats.latencies[j].buckets[2]);
+    }
+  }
+}
+
 TEST(NvramMessagesTest, GarbageDecode) {
   srand(0);
   uint8_t random_data[1024];